@@ -48,6 +48,7 @@ typedef struct pixel32_t
 int ExtractAndDescribeIconFamilyFile(char *filepath);
 int ExtractAndDescribeIconFamily(icns_family_t *iconFamily,char *description,char *outfileprefix);
 int WritePNGImage(FILE *outputfile,icns_image_t *image,icns_image_t *mask);
+int WritePNGData(FILE *outputfile,icns_size_t pngSize,const icns_byte_t *pngData);
 
 char 	*inputFileNames[MAX_INPUTFILES];
 int	fileCount = 0;
@@ -258,6 +259,9 @@ int main(int argc, char *argv[])
 	// display any exceptions thrown by libicns
 	icns_set_print_errors(PRINT_ICNS_ERRORS);
 
+	// Keep the jp2 codec set up across all the files, not per image
+	icns_jp2_codec_init();
+
 	for(count = 0; count < fileCount; count++)
 	{
         int convresult = ExtractAndDescribeIconFamilyFile(inputFileNames[count]);
@@ -268,6 +272,8 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	icns_jp2_codec_cleanup();
+
 	for(count = 0; count < fileCount; count++)
 		if(inputFileNames[count] != NULL)
 			free(inputFileNames[count]);
@@ -477,6 +483,7 @@ int ExtractAndDescribeIconFamily(icns_family_t *iconFamily,char *description,cha
 	int           elementCount = 0;
 	int           extractedCount = 0;
 	char           *outfilepath = NULL;
+	icns_family_index_t *familyIndex = NULL;
 
 	printf(" Extracting icons from %s...\n",description);
 
@@ -485,6 +492,10 @@ int ExtractAndDescribeIconFamily(icns_family_t *iconFamily,char *description,cha
 		outfilepath = (char *)malloc(strlen(outfileprefix)+25);
 		if(outfilepath == NULL)
 			return ICNS_STATUS_NO_MEMORY;
+
+		// Image + mask lookups for every element would otherwise rescan the family
+		if(icns_new_family_index(iconFamily,&familyIndex) != ICNS_STATUS_OK)
+			familyIndex = NULL;
 	}
 
 	// Start listing info:
@@ -660,10 +671,19 @@ int ExtractAndDescribeIconFamily(icns_family_t *iconFamily,char *description,cha
 					unsigned int	outfilepathlength = 0;
 					FILE 		*outfile = NULL;
 					icns_image_t	iconImage;
+					icns_size_t	pngSize = 0;
+					const icns_byte_t *pngData = NULL;
 
 					memset ( &iconImage, 0, sizeof(icns_image_t) );
 
-					error = icns_get_image32_with_mask_from_family(iconFamily,iconElement.elementType,&iconImage);
+					// Elements that already hold png data are written out as they are
+					error = icns_peek_png_data_in_indexed_family(iconFamily,familyIndex,iconElement.elementType,&pngSize,&pngData);
+
+					if(error != ICNS_STATUS_OK)
+					{
+						pngData = NULL;
+						error = icns_get_image32_with_mask_from_indexed_family(iconFamily,familyIndex,iconElement.elementType,&iconImage);
+					}
 
 					if(error == ICNS_STATUS_UNSUPPORTED)
 					{
@@ -686,7 +706,10 @@ int ExtractAndDescribeIconFamily(icns_family_t *iconFamily,char *description,cha
 						}
 						else
 						{
-							error = WritePNGImage(outfile,&iconImage,NULL);
+							if(pngData != NULL)
+								error = WritePNGData(outfile,pngSize,pngData);
+							else
+								error = WritePNGImage(outfile,&iconImage,NULL);
 
 							if(error) {
 								fprintf (stderr, "Error writing PNG image!\n");
@@ -744,9 +767,25 @@ int ExtractAndDescribeIconFamily(icns_family_t *iconFamily,char *description,cha
 		outfilepath = NULL;
 	}
 
+	if(familyIndex != NULL) {
+		icns_free_family_index(familyIndex);
+		familyIndex = NULL;
+	}
+
 	return error;
 }
 
+//***************************** WritePNGData **************************//
+// Writes png data taken straight from an icns element
+
+int	WritePNGData(FILE *outputfile,icns_size_t pngSize,const icns_byte_t *pngData)
+{
+	if(fwrite(pngData,1,pngSize,outputfile) != (size_t)pngSize)
+		return 1;
+
+	return 0;
+}
+
 //***************************** WritePNGImage **************************//
 // Relatively generic PNG file writing routine
 
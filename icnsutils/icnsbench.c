@@ -0,0 +1,728 @@
+/*
+ * icnsbench
+ *
+ * Copyright (C) 2001-2013 Mathew Eis <mathew@eisbox.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <getopt.h>
+
+#include <icns.h>
+
+#ifndef PACKAGE_VERSION
+ #define PACKAGE_VERSION "unknown"
+#endif
+
+#define BENCH_SUCCESS   0  // Return code on success
+#define BENCH_SHOWDOC   1  // Return code on --version/--help
+#define BENCH_INVALID   2  // Return code on invalid arguments
+#define BENCH_FAILURE   3  // Return code when a benchmark could not run
+
+#define	FALSE	0
+#define	TRUE	1
+
+#define	ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define	FORMAT_CSV	0
+#define	FORMAT_JSON	1
+
+/* One element type under test - every case gets a synthetic element of its own */
+typedef struct bench_case_t
+{
+	icns_type_t	iconType;
+	const char	*codec;		// "rle24", "png", "jp2", ...
+	icns_bool_t	isMask;
+	icns_bool_t	inFamily;	// part of the shared family, so lookups apply
+	icns_image_t	image;		// source image for encoding
+	icns_element_t	*element;	// encoded element for decoding
+} bench_case_t;
+
+// image and element start out empty and are filled in by setup_cases
+#define	BENCH_NO_IMAGE	{ 0, 0, 0, 0, 0, NULL }
+
+static bench_case_t benchCases[] = {
+	{ ICNS_128X128_32BIT_DATA,         "rle24", FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_48x48_32BIT_DATA,           "rle24", FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_32x32_32BIT_DATA,           "rle24", FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_16x16_32BIT_DATA,           "rle24", FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_128X128_8BIT_MASK,          "mask8", TRUE,  TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_48x48_8BIT_MASK,            "mask8", TRUE,  TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_32x32_8BIT_MASK,            "mask8", TRUE,  TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_16x16_8BIT_MASK,            "mask8", TRUE,  TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_48x48_8BIT_DATA,            "pal8",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_32x32_8BIT_DATA,            "pal8",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_16x16_8BIT_DATA,            "pal8",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_16x12_8BIT_DATA,            "pal8",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_48x48_4BIT_DATA,            "pal4",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_32x32_4BIT_DATA,            "pal4",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_16x16_4BIT_DATA,            "pal4",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_16x12_4BIT_DATA,            "pal4",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_48x48_1BIT_DATA,            "mono",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_32x32_1BIT_DATA,            "mono",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_16x16_1BIT_DATA,            "mono",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_16x12_1BIT_DATA,            "mono",  FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_16x16_2X_32BIT_ARGB_DATA,   "png",   FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_32x32_2X_32BIT_ARGB_DATA,   "png",   FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_128x128_2X_32BIT_ARGB_DATA, "png",   FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_256x256_32BIT_ARGB_DATA,    "png",   FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_256x256_2X_32BIT_ARGB_DATA, "png",   FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_512x512_32BIT_ARGB_DATA,    "png",   FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_512x512_2X_32BIT_ARGB_DATA, "png",   FALSE, TRUE, BENCH_NO_IMAGE, NULL },
+	// Same types again with jp2 data - skipped unless a jp2 codec is built in
+	{ ICNS_256x256_32BIT_ARGB_DATA,    "jp2",   FALSE, FALSE, BENCH_NO_IMAGE, NULL },
+	{ ICNS_512x512_32BIT_ARGB_DATA,    "jp2",   FALSE, FALSE, BENCH_NO_IMAGE, NULL },
+};
+
+static int		outputFormat = FORMAT_CSV;
+static double		minSeconds = 0.2;
+static const char	*onlyType = NULL;
+static const char	*outputPath = NULL;
+static FILE		*outputFile = NULL;
+static int		rowCount = 0;
+
+static icns_family_t	*benchFamily = NULL;
+static icns_size_t	benchFamilySize = 0;
+static icns_byte_t	*benchFamilyData = NULL;
+static icns_uint64_t	benchFamilyPixels = 0;
+static int		benchWriteFd = -1;	// /dev/null, so writes measure libicns and not the disk
+static icns_context_t	*quietContext = NULL;	// keeps expected setup failures (no jp2 codec) off stderr
+
+//***************************** Allocation counting ****************************//
+// With glibc, malloc and friends are wrapped to count the allocations made
+// by libicns (and libpng/zlib under it) while an operation is timed.
+// Elsewhere the counts are reported as -1.
+
+static icns_bool_t	countAllocs = FALSE;
+static icns_uint64_t	allocCount = 0;
+static icns_uint64_t	allocBytes = 0;
+
+#if defined(__GLIBC__)
+
+#define	HAVE_ALLOC_COUNTS	1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count,size_t size);
+extern void *__libc_realloc(void *ptr,size_t size);
+
+void *malloc(size_t size)
+{
+	if(countAllocs) {
+		allocCount++;
+		allocBytes += size;
+	}
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count,size_t size)
+{
+	if(countAllocs) {
+		allocCount++;
+		allocBytes += count * size;
+	}
+	return __libc_calloc(count,size);
+}
+
+void *realloc(void *ptr,size_t size)
+{
+	if(countAllocs) {
+		allocCount++;
+		allocBytes += size;
+	}
+	return __libc_realloc(ptr,size);
+}
+
+#else
+
+#define	HAVE_ALLOC_COUNTS	0
+
+#endif
+
+static double now_seconds(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+//***************************** Synthetic icons ****************************//
+// A round icon with a gradient, a little noise and an anti-aliased edge -
+// enough structure that RLE and png have real work to do, while staying the
+// same from one run (and release) to the next.
+
+static icns_uint32_t noise_state = 0x1234567;
+
+static icns_uint32_t next_noise(void)
+{
+	noise_state = noise_state * 1103515245 + 12345;
+	return (noise_state >> 16) & 0x7FFF;
+}
+
+static icns_byte_t icon_coverage(icns_uint32_t x,icns_uint32_t y,icns_uint32_t width,icns_uint32_t height)
+{
+	double	dx = (double)x + 0.5 - (double)width / 2.0;
+	double	dy = (double)y + 0.5 - (double)height / 2.0;
+	double	radius = (double)width * 0.45;
+	double	distance = 0;
+
+	distance = radius - sqrt(dx * dx + dy * dy);
+
+	if(distance >= 1.0)
+		return 255;
+	if(distance <= 0.0)
+		return 0;
+
+	return (icns_byte_t)(distance * 255.0);
+}
+
+static void fill_synthetic_image(icns_image_t *image,icns_bool_t isMask)
+{
+	icns_uint32_t	width = image->imageWidth;
+	icns_uint32_t	height = image->imageHeight;
+	icns_uint32_t	bitDepth = image->imagePixelDepth * image->imageChannels;
+	icns_uint32_t	rowBytes = (width * bitDepth + 7) / 8;
+	icns_uint32_t	x = 0;
+	icns_uint32_t	y = 0;
+
+	for(y = 0; y < height; y++)
+	{
+		icns_byte_t	*row = image->imageData + (size_t)y * rowBytes;
+
+		for(x = 0; x < width; x++)
+		{
+			icns_byte_t	coverage = icon_coverage(x,y,width,height);
+
+			if(bitDepth == 32)
+			{
+				row[x * 4 + 0] = (icns_byte_t)((x / 8) * 8 * 255 / width);
+				row[x * 4 + 1] = (icns_byte_t)((y / 8) * 8 * 255 / height);
+				row[x * 4 + 2] = (next_noise() & 7) ? 160 : (icns_byte_t)next_noise();
+				row[x * 4 + 3] = coverage;
+			}
+			else if(bitDepth == 8)
+			{
+				row[x] = isMask ? coverage : (coverage ? (icns_byte_t)((x / 4) + (y / 4) * 7) : 0);
+			}
+			else if(bitDepth == 4)
+			{
+				icns_byte_t	index = coverage ? (icns_byte_t)(((x / 4) + (y / 4)) & 0x0F) : 0;
+
+				if(x & 1)
+					row[x / 2] |= index;
+				else
+					row[x / 2] = (icns_byte_t)(index << 4);
+			}
+			else if(bitDepth == 1)
+			{
+				if(x % 8 == 0)
+					row[x / 8] = 0;
+				if(coverage > 127 && ((x ^ y) & 2))
+					row[x / 8] |= (icns_byte_t)(0x80 >> (x % 8));
+			}
+		}
+	}
+}
+
+// Wraps jp2 data in an element by hand - icns_new_element_from_image only
+// ever writes png for the argb types
+static icns_element_t *new_jp2_element(icns_type_t iconType,icns_image_t *image)
+{
+	icns_size_t	jp2Size = 0;
+	icns_byte_t	*jp2Data = NULL;
+	icns_element_t	*element = NULL;
+	icns_size_t	elementSize = 0;
+
+	if(icns_image_to_jp2(image,&jp2Size,&jp2Data) != ICNS_STATUS_OK)
+		return NULL;
+
+	elementSize = sizeof(icns_type_t) + sizeof(icns_size_t) + jp2Size;
+	element = (icns_element_t *)malloc(elementSize);
+	if(element != NULL)
+	{
+		element->elementType = iconType;
+		element->elementSize = elementSize;
+		memcpy(element->elementData,jp2Data,jp2Size);
+	}
+
+	free(jp2Data);
+
+	return element;
+}
+
+static icns_bool_t case_selected(bench_case_t *benchCase)
+{
+	char	typeStr[5];
+
+	if(onlyType == NULL)
+		return TRUE;
+
+	return (strcmp(icns_type_str(benchCase->iconType,typeStr),onlyType) == 0 || strcmp(benchCase->codec,onlyType) == 0);
+}
+
+static int setup_cases(void)
+{
+	unsigned int	i = 0;
+	int		error = 0;
+	char		typeStr[5];
+
+	// Keep the jp2 codec set up across all the images, not per image
+	icns_jp2_codec_init();
+
+	benchWriteFd = open("/dev/null",O_WRONLY);
+	if(benchWriteFd < 0)
+	{
+		fprintf(stderr,"Unable to open /dev/null for writing!\n");
+		return -1;
+	}
+
+	error = icns_new_context(&quietContext);
+	if(error)
+		return error;
+	icns_set_current_context(quietContext);
+
+	error = icns_create_family(&benchFamily);
+	if(error)
+	{
+		icns_set_current_context(NULL);
+		return error;
+	}
+
+	for(i = 0; i < ARRAY_SIZE(benchCases); i++)
+	{
+		bench_case_t	*benchCase = &benchCases[i];
+
+		error = icns_init_image_for_type(benchCase->iconType,&benchCase->image);
+		if(error)
+			break;
+
+		fill_synthetic_image(&benchCase->image,benchCase->isMask);
+
+		if(strcmp(benchCase->codec,"jp2") == 0)
+		{
+			benchCase->element = new_jp2_element(benchCase->iconType,&benchCase->image);
+			continue;
+		}
+
+		if(benchCase->isMask)
+			error = icns_new_element_from_mask(&benchCase->image,benchCase->iconType,&benchCase->element);
+		else
+			error = icns_new_element_from_image(&benchCase->image,benchCase->iconType,&benchCase->element);
+
+		if(error)
+		{
+			fprintf(stderr,"Unable to encode a '%s' element!\n",icns_type_str(benchCase->iconType,typeStr));
+			break;
+		}
+
+		error = icns_set_element_in_family(&benchFamily,benchCase->element);
+		if(error)
+			break;
+
+		benchFamilyPixels += (icns_uint64_t)benchCase->image.imageWidth * benchCase->image.imageHeight;
+	}
+
+	if(error == 0)
+		error = icns_export_family_data(benchFamily,&benchFamilySize,&benchFamilyData);
+
+	icns_set_current_context(NULL);
+
+	return error;
+}
+
+static void cleanup_cases(void)
+{
+	unsigned int	i = 0;
+
+	for(i = 0; i < ARRAY_SIZE(benchCases); i++)
+	{
+		icns_free_image(&benchCases[i].image);
+		free(benchCases[i].element);
+		benchCases[i].element = NULL;
+	}
+
+	free(benchFamily);
+	free(benchFamilyData);
+
+	if(benchWriteFd >= 0)
+		close(benchWriteFd);
+	if(quietContext != NULL)
+		icns_free_context(quietContext);
+
+	icns_jp2_codec_cleanup();
+}
+
+//***************************** Operations ****************************//
+// Each returns 0 on success, and frees whatever it made
+
+static int bench_parse(bench_case_t *benchCase)
+{
+	icns_family_t	*family = NULL;
+	int		error = icns_import_family_data(benchFamilySize,benchFamilyData,&family);
+
+	(void)benchCase;
+
+	free(family);
+
+	return error;
+}
+
+static int bench_write(bench_case_t *benchCase)
+{
+	(void)benchCase;
+
+	return icns_write_family_to_fd(benchWriteFd,benchFamily);
+}
+
+static int bench_export(bench_case_t *benchCase)
+{
+	icns_size_t	dataSize = 0;
+	icns_byte_t	*dataPtr = NULL;
+	int		error = icns_export_family_data(benchFamily,&dataSize,&dataPtr);
+
+	(void)benchCase;
+
+	free(dataPtr);
+
+	return error;
+}
+
+static int bench_lookup(bench_case_t *benchCase)
+{
+	icns_element_view_t	elementView;
+
+	return icns_peek_element_in_family(benchFamily,benchCase->iconType,&elementView);
+}
+
+static int bench_decode(bench_case_t *benchCase)
+{
+	icns_image_t	image;
+	int		error = 0;
+
+	memset(&image,0,sizeof(icns_image_t));
+
+	if(benchCase->isMask)
+		error = icns_get_mask_from_element(benchCase->element,&image);
+	else
+		error = icns_get_image_from_element(benchCase->element,&image);
+
+	icns_free_image(&image);
+
+	return error;
+}
+
+// The fused path the tools use: find the icon and its mask in the family
+// and decode both into one RGBA image
+static int bench_decode32(bench_case_t *benchCase)
+{
+	icns_image_t	image;
+	int		error = 0;
+
+	memset(&image,0,sizeof(icns_image_t));
+
+	error = icns_get_image32_with_mask_from_family(benchFamily,benchCase->iconType,&image);
+
+	icns_free_image(&image);
+
+	return error;
+}
+
+static int bench_encode(bench_case_t *benchCase)
+{
+	icns_element_t	*element = NULL;
+	int		error = 0;
+
+	if(strcmp(benchCase->codec,"jp2") == 0)
+	{
+		element = new_jp2_element(benchCase->iconType,&benchCase->image);
+		error = (element == NULL);
+	}
+	else if(benchCase->isMask)
+	{
+		error = icns_new_element_from_mask(&benchCase->image,benchCase->iconType,&element);
+	}
+	else
+	{
+		error = icns_new_element_from_image(&benchCase->image,benchCase->iconType,&element);
+	}
+
+	free(element);
+
+	return error;
+}
+
+//***************************** Timing and reporting ****************************//
+
+static void print_row(const char *typeStr,const char *codec,const char *op,icns_uint64_t iterations,double seconds,icns_uint64_t bytesPerOp,icns_uint64_t pixelsPerOp,long long allocsPerOp,long long allocBytesPerOp)
+{
+	double	nsPerOp = seconds * 1e9 / (double)iterations;
+	double	mbPerSecond = (double)bytesPerOp * (double)iterations / seconds / 1e6;
+	double	pixelsPerSecond = (double)pixelsPerOp * (double)iterations / seconds;
+
+	if(outputFormat == FORMAT_JSON)
+	{
+		fprintf(outputFile,"%s\n    { \"type\": \"%s\", \"codec\": \"%s\", \"op\": \"%s\", \"iterations\": %llu, \"seconds\": %.6f, "
+			"\"ns_per_op\": %.1f, \"mb_per_s\": %.3f, \"pixels_per_s\": %.0f, \"allocs_per_op\": %lld, \"alloc_bytes_per_op\": %lld }",
+			rowCount ? "," : "",typeStr,codec,op,(unsigned long long)iterations,seconds,
+			nsPerOp,mbPerSecond,pixelsPerSecond,allocsPerOp,allocBytesPerOp);
+	}
+	else
+	{
+		fprintf(outputFile,"%s,%s,%s,%llu,%.6f,%.1f,%.3f,%.0f,%lld,%lld\n",
+			typeStr,codec,op,(unsigned long long)iterations,seconds,
+			nsPerOp,mbPerSecond,pixelsPerSecond,allocsPerOp,allocBytesPerOp);
+	}
+
+	rowCount++;
+}
+
+// Runs op in doubling batches until minSeconds have passed. The first call
+// is a warm-up, and tells us whether the op works at all for this case.
+static int run_op(const char *op,int (*opFunc)(bench_case_t *),bench_case_t *benchCase,const char *typeStr,const char *codec,icns_uint64_t bytesPerOp,icns_uint64_t pixelsPerOp)
+{
+	icns_uint64_t	iterations = 0;
+	icns_uint64_t	batch = 1;
+	icns_uint64_t	i = 0;
+	double		startTime = 0;
+	double		seconds = 0;
+	int		error = 0;
+
+	if( (error = opFunc(benchCase)) )
+	{
+		fprintf(stderr,"%s %s: %s failed! (%d)\n",typeStr,codec,op,error);
+		return error;
+	}
+
+	allocCount = 0;
+	allocBytes = 0;
+	countAllocs = TRUE;
+	startTime = now_seconds();
+
+	do {
+		for(i = 0; i < batch; i++)
+			opFunc(benchCase);
+		iterations += batch;
+		if(batch < 65536)
+			batch *= 2;
+		seconds = now_seconds() - startTime;
+	} while(seconds < minSeconds);
+
+	countAllocs = FALSE;
+
+	if(HAVE_ALLOC_COUNTS)
+		print_row(typeStr,codec,op,iterations,seconds,bytesPerOp,pixelsPerOp,(long long)(allocCount / iterations),(long long)(allocBytes / iterations));
+	else
+		print_row(typeStr,codec,op,iterations,seconds,bytesPerOp,pixelsPerOp,-1,-1);
+
+	return 0;
+}
+
+static int run_benchmarks(void)
+{
+	unsigned int	i = 0;
+	int		failures = 0;
+	char		typeStr[5];
+
+	if(outputFormat == FORMAT_JSON)
+		fprintf(outputFile,"{\n  \"version\": \"%s\",\n  \"min_seconds\": %.3f,\n  \"results\": [",PACKAGE_VERSION,minSeconds);
+	else
+		fprintf(outputFile,"type,codec,op,iterations,seconds,ns_per_op,mb_per_s,pixels_per_s,allocs_per_op,alloc_bytes_per_op\n");
+
+	if(onlyType == NULL || strcmp(onlyType,"family") == 0)
+	{
+		failures += (run_op("parse",bench_parse,NULL,"family","all",benchFamilySize,benchFamilyPixels) != 0);
+		failures += (run_op("write",bench_write,NULL,"family","all",benchFamilySize,benchFamilyPixels) != 0);
+		failures += (run_op("export",bench_export,NULL,"family","all",benchFamilySize,benchFamilyPixels) != 0);
+	}
+
+	for(i = 0; i < ARRAY_SIZE(benchCases); i++)
+	{
+		bench_case_t	*benchCase = &benchCases[i];
+		icns_uint64_t	pixels = (icns_uint64_t)benchCase->image.imageWidth * benchCase->image.imageHeight;
+		icns_uint64_t	elementSize = 0;
+
+		if(!case_selected(benchCase) || benchCase->element == NULL)
+			continue;
+
+		icns_type_str(benchCase->iconType,typeStr);
+		elementSize = benchCase->element->elementSize;
+
+		// Throughput is per element byte for lookups, and per uncompressed
+		// image byte for decoding and encoding
+		if(benchCase->inFamily)
+			failures += (run_op("lookup",bench_lookup,benchCase,typeStr,benchCase->codec,elementSize,0) != 0);
+		failures += (run_op("decode",bench_decode,benchCase,typeStr,benchCase->codec,benchCase->image.imageDataSize,pixels) != 0);
+		if(benchCase->inFamily && !benchCase->isMask)
+			failures += (run_op("decode32",bench_decode32,benchCase,typeStr,benchCase->codec,(icns_uint64_t)pixels * 4,pixels) != 0);
+		failures += (run_op("encode",bench_encode,benchCase,typeStr,benchCase->codec,benchCase->image.imageDataSize,pixels) != 0);
+		fflush(outputFile);
+	}
+
+	if(outputFormat == FORMAT_JSON)
+		fprintf(outputFile,"\n  ]\n}\n");
+
+	return failures;
+}
+
+//***************************** Command line ****************************//
+
+static void PrintVersionInfo(void)
+{
+	printf("icnsbench %s\n",PACKAGE_VERSION);
+	printf("\n");
+	printf("Copyright (c) 2001-2013 Mathew Eis\n");
+	printf("This is free software; see the source for copying conditions.  There is NO\n");
+	printf("warranty; not even for MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.\n");
+}
+
+static void PrintUsage(void)
+{
+	printf("Usage: icnsbench [-f csv|json] [-t seconds] [-T type] [-o file]\n");
+}
+
+static void PrintHelp(void)
+{
+	printf("icnsbench times libicns on synthetic icons of every element type.\n");
+	printf("\n");
+	printf("The whole family is parsed, written to /dev/null with icns_write_family_to_fd\n");
+	printf("(write) and copied out with icns_export_family_data (export). Each element\n");
+	printf("type is looked up, decoded on its own (decode) and, for icons, together with\n");
+	printf("its mask through icns_get_image32_with_mask_from_family (decode32), and\n");
+	printf("encoded. mb_per_s counts element bytes for lookups, family bytes for\n");
+	printf("parse/write/export, and uncompressed image bytes otherwise. Allocation\n");
+	printf("counts are per operation, -1 where they can not be measured.\n");
+	printf("\n");
+	printf("Options:\n");
+	printf(" -f, --format  Output format, csv (default) or json\n");
+	printf(" -t, --time    Minimum seconds to run each operation (default 0.2)\n");
+	printf(" -T, --type    Only run one element type ('it32'), codec ('png') or 'family'\n");
+	printf(" -o, --output  Write the results to a file instead of stdout\n");
+	printf(" -h, --help    Displays this help message.\n");
+	printf(" -v, --version Displays the version information\n");
+}
+
+static char *short_opts = "f:t:T:o:hv";
+static struct option long_opts[] = {
+	{ "format",   required_argument,  NULL, 'f' },
+	{ "time",     required_argument,  NULL, 't' },
+	{ "type",     required_argument,  NULL, 'T' },
+	{ "output",   required_argument,  NULL, 'o' },
+	{ "help",     no_argument,        NULL, 'h' },
+	{ "version",  no_argument,        NULL, 'v' },
+	{ 0,          0,                  0,     0  }
+};
+
+static int ParseOptions(int argc, char** argv)
+{
+	int opt = 0;
+
+	while ((opt = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1)
+	{
+		switch (opt) {
+		case 'f':
+			if(strcmp(optarg,"csv") == 0) {
+				outputFormat = FORMAT_CSV;
+			} else if(strcmp(optarg,"json") == 0) {
+				outputFormat = FORMAT_JSON;
+			} else {
+				fprintf(stderr, "Invalid output format specified.\n");
+				return BENCH_INVALID;
+			}
+			break;
+		case 't':
+			minSeconds = atof(optarg);
+			if(minSeconds <= 0) {
+				fprintf(stderr, "Invalid time specified.\n");
+				return BENCH_INVALID;
+			}
+			break;
+		case 'T':
+			onlyType = optarg;
+			break;
+		case 'o':
+			outputPath = optarg;
+			break;
+		case 'v':
+			PrintVersionInfo();
+			return BENCH_SHOWDOC;
+		case 'h':
+			PrintUsage();
+			PrintHelp();
+			return BENCH_SHOWDOC;
+		case '?':
+		default:
+			PrintUsage();
+			return BENCH_INVALID;
+		}
+	}
+
+	return BENCH_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	int	result = 0;
+
+	result = ParseOptions(argc, argv);
+	if(result == BENCH_SHOWDOC)
+		return BENCH_SUCCESS;
+	if(result != BENCH_SUCCESS)
+		return result;
+
+	if(outputPath != NULL)
+	{
+		outputFile = fopen(outputPath,"w");
+		if(outputFile == NULL)
+		{
+			fprintf(stderr, "Unable to open %s for writing!\n", outputPath);
+			return BENCH_FAILURE;
+		}
+	}
+	else
+	{
+		outputFile = stdout;
+	}
+
+	if(setup_cases() != 0)
+	{
+		fprintf(stderr, "Unable to create the benchmark icons!\n");
+		result = BENCH_FAILURE;
+	}
+	else if(run_benchmarks() != 0)
+	{
+		result = BENCH_FAILURE;
+	}
+
+	cleanup_cases();
+
+	if(outputFile != stdout)
+		fclose(outputFile);
+
+	return result;
+}
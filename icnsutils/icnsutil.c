@@ -313,7 +313,42 @@ static int read_png(FILE *fp, png_bytepp buffer, int32_t *bpp, int32_t *width, i
 	return TRUE;
 }
 
-static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
+/* Reads a whole file into memory, leaving fp rewound */
+static int read_file_data(FILE *fp, icns_size_t *dataSize, icns_byte_t **dataPtr)
+{
+	long fileSize = 0;
+
+	*dataSize = 0;
+	*dataPtr = NULL;
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (fileSize = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET) != 0)
+	{
+		rewind(fp);
+		return FALSE;
+	}
+
+	*dataPtr = malloc(fileSize);
+	if (*dataPtr == NULL)
+	{
+		rewind(fp);
+		return FALSE;
+	}
+
+	if (fread(*dataPtr, 1, fileSize, fp) != (size_t)fileSize)
+	{
+		free(*dataPtr);
+		*dataPtr = NULL;
+		rewind(fp);
+		return FALSE;
+	}
+
+	*dataSize = (icns_size_t)fileSize;
+	rewind(fp);
+
+	return TRUE;
+}
+
+static int add_png_to_family(icns_family_builder_t *familyBuilder, char *pngname)
 {
 	FILE *pngfile;
 
@@ -325,6 +360,7 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 	icns_icon_info_t iconInfo;
 
 	icns_element_t *iconElement = NULL;
+	icns_element_view_t iconView;
 	icns_element_t *maskElement = NULL;
 	char iconStr[5] = {0,0,0,0,0};
 	char maskStr[5] = {0,0,0,0,0};
@@ -339,6 +375,14 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 	png_bytep buffer;
 	int width, height, bpp;
 
+	icns_size_t pngDataSize = 0;
+	icns_byte_t *pngDataPtr = NULL;
+	icns_uint32_t pngWidth = 0, pngHeight = 0;
+	icns_uint8_t pngBitDepth = 0, pngColorType = 0;
+	icns_context_t *probeContext = NULL;
+	icns_context_t *previousContext = NULL;
+	int isDuplicate = 0;
+
 	if(namea2xpng > 0) {
 			if(memcmp(&pngname[namea2xpng],"@2x.png",7) == 0) {
 					isHiDPI = 1;
@@ -355,6 +399,65 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 		return FALSE;
 	}
 
+	/* 8-bit RGBA PNGs at a png-capable icns size are stored as they are, */
+	/* skipping the decode and re-encode below */
+	if (read_file_data(pngfile, &pngDataSize, &pngDataPtr))
+	{
+		/* probe under a quiet context of our own: a png that doesn't fit */
+		/* just takes the decode path below, so its errors aren't news */
+		icnsErr = ICNS_STATUS_UNSUPPORTED;
+		if (icns_new_context(&probeContext) == ICNS_STATUS_OK)
+		{
+			previousContext = icns_set_current_context(probeContext);
+
+			if (icns_get_png_info(pngDataSize, pngDataPtr, &pngWidth, &pngHeight, &pngBitDepth, &pngColorType) == ICNS_STATUS_OK &&
+			    pngBitDepth == 8 && pngColorType == ICNS_PNG_COLOR_TYPE_RGBA)
+			{
+				iconInfo.isImage = 1;
+				iconInfo.iconWidth = pngWidth;
+				iconInfo.iconHeight = pngHeight;
+				iconInfo.iconBitDepth = 32;
+				iconInfo.iconChannels = 4;
+				iconInfo.iconPixelDepth = 8;
+
+				iconType = icns_get_type_from_image_info_advanced(iconInfo,isHiDPI);
+				maskType = icns_get_mask_type_for_icon_type(iconType);
+
+				if (iconType != ICNS_NULL_TYPE && maskType == ICNS_NULL_TYPE)
+					icnsErr = icns_new_element_from_png_data(iconType, pngDataSize, pngDataPtr, &iconElement);
+
+				if (icnsErr == ICNS_STATUS_OK && icns_peek_element_in_family_builder(familyBuilder, iconType, &iconView) == ICNS_STATUS_OK)
+					isDuplicate = 1;
+			}
+
+			icns_set_current_context(previousContext);
+			icns_free_context(probeContext);
+		}
+
+		if (icnsErr == ICNS_STATUS_OK)
+		{
+			free(pngDataPtr);
+			fclose(pngfile);
+
+			if (isDuplicate)
+			{
+				fprintf(stderr, "Duplicate icon element of type '%s' detected (%s)\n", icns_type_str(iconType,iconStr), pngname);
+				free(iconElement);
+
+				return FALSE;
+			}
+
+			/* the builder owns the element from here on */
+			icns_add_element_to_family_builder(familyBuilder, iconElement);
+
+			return TRUE;
+		}
+
+		free(pngDataPtr);
+		pngDataPtr = NULL;
+		icnsErr = ICNS_STATUS_OK;
+	}
+
 	if (!read_png(pngfile, &buffer, &bpp, &width, &height))
 	{
 		fprintf(stderr, "Failed to read PNG file\n");
@@ -403,7 +506,7 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 	}
 
 	icns_set_print_errors(0);
-	if (icns_get_element_from_family(*iconFamily, iconType, &iconElement) == ICNS_STATUS_OK)
+	if (icns_peek_element_in_family_builder(familyBuilder, iconType, &iconView) == ICNS_STATUS_OK)
 	{
 		icns_set_print_errors(1);
 
@@ -432,9 +535,13 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 	{
 		if (icnsErr == ICNS_STATUS_OK)
 		{
-			icns_set_element_in_family(iconFamily, iconElement);
+			/* the builder owns the element from here on */
+			icns_add_element_to_family_builder(familyBuilder, iconElement);
+		}
+		else
+		{
+			free(iconElement);
 		}
-		free(iconElement);
 	}
 
 	if(maskType != ICNS_NULL_TYPE)
@@ -457,9 +564,12 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 		{
 			if (icnsErr == ICNS_STATUS_OK)
 			{
-				icns_set_element_in_family(iconFamily, maskElement);
+				icns_add_element_to_family_builder(familyBuilder, maskElement);
+			}
+			else
+			{
+				free(maskElement);
 			}
-			free(maskElement);
 		}
 
 		icns_free_image(&icnsMask);
@@ -480,7 +590,8 @@ int usage(void)
 int iconset_to_icns(char *srcfile, char *dstfile)
 {
 	FILE *icnsfile;
-	icns_family_t	*iconFamily;
+	icns_family_t	*iconFamily = NULL;
+	icns_family_builder_t	*familyBuilder = NULL;
 	char *pngfile = NULL;
 	char *outfile = NULL;
 	int	srclen = strlen(srcfile);
@@ -512,17 +623,24 @@ int iconset_to_icns(char *srcfile, char *dstfile)
 		goto cleanup;
 	}
 
-	icns_create_family(&iconFamily);
+	icns_new_family_builder(&familyBuilder);
 
 	while(iconset_names[i] != NULL) {
 		strcpy(&pngfile[srclen],iconset_names[i]);
 		#if DEBUG_ICNSUTIL
 		printf("Adding %s\n",pngfile);
 		#endif
-		add_png_to_family(&iconFamily,pngfile);
+		add_png_to_family(familyBuilder,pngfile);
 		i++;
 	}
 
+	if (icns_build_family(familyBuilder, &iconFamily) != ICNS_STATUS_OK)
+	{
+		fprintf(stderr, "Failed to build icns family\n");
+		fclose(icnsfile);
+		goto cleanup;
+	}
+
 	if (icns_write_family_to_file(icnsfile, iconFamily) != ICNS_STATUS_OK)
 	{
 		fprintf(stderr, "Failed to write icns file\n");
@@ -538,6 +656,9 @@ int iconset_to_icns(char *srcfile, char *dstfile)
 
 cleanup:
 
+	if(familyBuilder != NULL)
+		icns_free_family_builder(familyBuilder);
+
 	if(iconFamily != NULL)
 		free(iconFamily);
 
@@ -550,16 +671,28 @@ cleanup:
 	return 0;
 }
 
+/* Writes png data taken straight from an icns element */
+static int write_png_data(FILE *outputfile, icns_size_t pngSize, const icns_byte_t *pngData)
+{
+	if (fwrite(pngData, 1, pngSize, outputfile) != (size_t)pngSize)
+		return 1;
+
+	return 0;
+}
+
 int icns_to_iconset(char *srcfile, char *dstpath)
 {
 	FILE *inFile = NULL;
 	char *outfile = NULL;
 	int	srclen = strlen(srcfile);
 	icns_family_t *iconFamily = NULL;
+	icns_family_index_t *familyIndex = NULL;
 	int	dstpathlen = 0;
 	int	dstfilelen = 0;
 	char *dstfile = NULL;
 	icns_image_t iconImage;
+	icns_size_t pngSize = 0;
+	const icns_byte_t *pngData = NULL;
 	int i = 0;
 	int error = 0;
 
@@ -601,6 +734,10 @@ int icns_to_iconset(char *srcfile, char *dstpath)
 	error = icns_read_family_from_file(inFile,&iconFamily);
 	fclose(inFile);
 
+	// Each image + mask pair is two lookups; index the family once up front
+	if(error == ICNS_STATUS_OK)
+		icns_new_family_index(iconFamily,&familyIndex);
+
 	// Create the .iconset directory
 	if (mkdir(dstpath,0777) == -1) {
 		if(errno == EEXIST) {
@@ -617,7 +754,12 @@ int icns_to_iconset(char *srcfile, char *dstpath)
 		int iconset_namelen = strlen(iconset_names[i]);
 		char typeStr[5];
 		icns_type_str(iconset_types[i],typeStr);
-		error = icns_get_image32_with_mask_from_family(iconFamily,iconset_types[i],&iconImage);
+		// Elements that already hold png data are written out as they are
+		error = icns_peek_png_data_in_indexed_family(iconFamily,familyIndex,iconset_types[i],&pngSize,&pngData);
+		if(error != ICNS_STATUS_OK) {
+			pngData = NULL;
+			error = icns_get_image32_with_mask_from_indexed_family(iconFamily,familyIndex,iconset_types[i],&iconImage);
+		}
 		if(error == ICNS_STATUS_OK) {
 			strncpy(&dstfile[dstpathlen],iconset_names[i],iconset_namelen+1);
 			FILE *outfile = fopen(&dstfile[0],"w");
@@ -627,7 +769,10 @@ int icns_to_iconset(char *srcfile, char *dstpath)
 			}
 			else
 			{
-				error = write_png(outfile,&iconImage,NULL);
+				if(pngData != NULL)
+					error = write_png_data(outfile,pngSize,pngData);
+				else
+					error = write_png(outfile,&iconImage,NULL);
 				if(error) {
 					fprintf (stderr, "Error writing PNG image!\n");
 				}
@@ -655,12 +800,18 @@ int icns_to_iconset(char *srcfile, char *dstpath)
 		outfile = NULL;
 	}
 
+	if(familyIndex) {
+		icns_free_family_index(familyIndex);
+		familyIndex = NULL;
+	}
+
 	return error;
 }
 
 int main(int argc, char **argv)
 {
 	int (*conv_fn)(char *,char *);
+	int result = 0;
 
 	if (argc < 4)
 		usage();
@@ -675,11 +826,16 @@ int main(int argc, char **argv)
 	else
 		usage();
 
+	// Keep the jp2 codec set up across all the images, not per image
+	icns_jp2_codec_init();
+
 	if (strcmp(argv[3],"-o") == 0) {
-		return (*conv_fn)(argv[5],argv[4]);
+		result = (*conv_fn)(argv[5],argv[4]);
 	} else {
-		return (*conv_fn)(argv[3],NULL);
+		result = (*conv_fn)(argv[3],NULL);
 	}
 
-	return 0;
+	icns_jp2_codec_cleanup();
+
+	return result;
 }
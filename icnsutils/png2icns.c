@@ -155,7 +155,42 @@ static int read_png(FILE *fp, png_bytepp buffer, int32_t *bpp, int32_t *width, i
 	return TRUE;
 }
 
-static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
+/* Reads a whole file into memory, leaving fp rewound */
+static int read_file_data(FILE *fp, icns_size_t *dataSize, icns_byte_t **dataPtr)
+{
+	long fileSize = 0;
+
+	*dataSize = 0;
+	*dataPtr = NULL;
+
+	if (fseek(fp, 0, SEEK_END) != 0 || (fileSize = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET) != 0)
+	{
+		rewind(fp);
+		return FALSE;
+	}
+
+	*dataPtr = malloc(fileSize);
+	if (*dataPtr == NULL)
+	{
+		rewind(fp);
+		return FALSE;
+	}
+
+	if (fread(*dataPtr, 1, fileSize, fp) != (size_t)fileSize)
+	{
+		free(*dataPtr);
+		*dataPtr = NULL;
+		rewind(fp);
+		return FALSE;
+	}
+
+	*dataSize = (icns_size_t)fileSize;
+	rewind(fp);
+
+	return TRUE;
+}
+
+static int add_png_to_family(icns_family_builder_t *familyBuilder, char *pngname)
 {
 	FILE *pngfile;
 
@@ -167,6 +202,7 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 	icns_icon_info_t iconInfo;
 
 	icns_element_t *iconElement = NULL;
+	icns_element_view_t iconView;
 	icns_element_t *maskElement = NULL;
 	char iconStr[5] = {0,0,0,0,0};
 	char maskStr[5] = {0,0,0,0,0};
@@ -176,6 +212,14 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 	png_bytep buffer;
 	int width, height, bpp;
 
+	icns_size_t pngDataSize = 0;
+	icns_byte_t *pngDataPtr = NULL;
+	icns_uint32_t pngWidth = 0, pngHeight = 0;
+	icns_uint8_t pngBitDepth = 0, pngColorType = 0;
+	icns_context_t *probeContext = NULL;
+	icns_context_t *previousContext = NULL;
+	int isDuplicate = 0;
+
 	pngfile = fopen(pngname, "rb");
 	if (pngfile == NULL)
 	{
@@ -183,6 +227,67 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 		return FALSE;
 	}
 
+	/* 8-bit RGBA PNGs at a png-capable icns size are stored as they are, */
+	/* skipping the decode and re-encode below */
+	if (read_file_data(pngfile, &pngDataSize, &pngDataPtr))
+	{
+		/* probe under a quiet context of our own: a png that doesn't fit */
+		/* just takes the decode path below, so its errors aren't news */
+		icnsErr = ICNS_STATUS_UNSUPPORTED;
+		if (icns_new_context(&probeContext) == ICNS_STATUS_OK)
+		{
+			previousContext = icns_set_current_context(probeContext);
+
+			if (icns_get_png_info(pngDataSize, pngDataPtr, &pngWidth, &pngHeight, &pngBitDepth, &pngColorType) == ICNS_STATUS_OK &&
+			    pngBitDepth == 8 && pngColorType == ICNS_PNG_COLOR_TYPE_RGBA)
+			{
+				iconInfo.isImage = 1;
+				iconInfo.iconWidth = pngWidth;
+				iconInfo.iconHeight = pngHeight;
+				iconInfo.iconBitDepth = 32;
+				iconInfo.iconChannels = 4;
+				iconInfo.iconPixelDepth = 8;
+
+				iconType = icns_get_type_from_image_info(iconInfo);
+				maskType = icns_get_mask_type_for_icon_type(iconType);
+
+				if (iconType != ICNS_NULL_TYPE && maskType == ICNS_NULL_TYPE)
+					icnsErr = icns_new_element_from_png_data(iconType, pngDataSize, pngDataPtr, &iconElement);
+
+				if (icnsErr == ICNS_STATUS_OK && icns_peek_element_in_family_builder(familyBuilder, iconType, &iconView) == ICNS_STATUS_OK)
+					isDuplicate = 1;
+			}
+
+			icns_set_current_context(previousContext);
+			icns_free_context(probeContext);
+		}
+
+		if (icnsErr == ICNS_STATUS_OK)
+		{
+			free(pngDataPtr);
+			fclose(pngfile);
+
+			if (isDuplicate)
+			{
+				fprintf(stderr, "Duplicate icon element of type '%s' detected (%s)\n", icns_type_str(iconType,iconStr), pngname);
+				free(iconElement);
+
+				return FALSE;
+			}
+
+			printf("Using icns type '%s' (ARGB, png data as is) for '%s'\n", icns_type_str(iconType,iconStr), pngname);
+
+			/* the builder owns the element from here on */
+			icns_add_element_to_family_builder(familyBuilder, iconElement);
+
+			return TRUE;
+		}
+
+		free(pngDataPtr);
+		pngDataPtr = NULL;
+		icnsErr = ICNS_STATUS_OK;
+	}
+
 	if (!read_png(pngfile, &buffer, &bpp, &width, &height))
 	{
 		fprintf(stderr, "Failed to read PNG file\n");
@@ -231,7 +336,7 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 	}
 
 	icns_set_print_errors(0);
-	if (icns_get_element_from_family(*iconFamily, iconType, &iconElement) == ICNS_STATUS_OK)
+	if (icns_peek_element_in_family_builder(familyBuilder, iconType, &iconView) == ICNS_STATUS_OK)
 	{
 		icns_set_print_errors(1);
 
@@ -258,9 +363,13 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 	{
 		if (icnsErr == ICNS_STATUS_OK)
 		{
-			icns_set_element_in_family(iconFamily, iconElement);
+			/* the builder owns the element from here on */
+			icns_add_element_to_family_builder(familyBuilder, iconElement);
+		}
+		else
+		{
+			free(iconElement);
 		}
-		free(iconElement);
 	}
 
 	if( (iconType != ICNS_1024x1024_32BIT_ARGB_DATA) && (iconType != ICNS_512x512_32BIT_ARGB_DATA) && (iconType != ICNS_256x256_32BIT_ARGB_DATA) )
@@ -283,9 +392,12 @@ static int add_png_to_family(icns_family_t **iconFamily, char *pngname)
 		{
 			if (icnsErr == ICNS_STATUS_OK)
 			{
-				icns_set_element_in_family(iconFamily, maskElement);
+				icns_add_element_to_family_builder(familyBuilder, maskElement);
+			}
+			else
+			{
+				free(maskElement);
 			}
-			free(maskElement);
 		}
 		
 		icns_free_image(&icnsMask);
@@ -300,7 +412,8 @@ int main(int argc, char **argv)
 {
 	FILE *icnsfile;
 
-	icns_family_t	*iconFamily;
+	icns_family_t	*iconFamily = NULL;
+	icns_family_builder_t	*familyBuilder = NULL;
 
 	int i;
 
@@ -318,11 +431,11 @@ int main(int argc, char **argv)
 	}
 
 	icns_set_print_errors(1);
-	icns_create_family(&iconFamily);
+	icns_new_family_builder(&familyBuilder);
 
 	for (i = 2; i < argc; i++)
 	{
-		if (!add_png_to_family(&iconFamily, argv[i]))
+		if (!add_png_to_family(familyBuilder, argv[i]))
 		{
 			fclose(icnsfile);
 			unlink(argv[1]);
@@ -331,6 +444,17 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (icns_build_family(familyBuilder, &iconFamily) != ICNS_STATUS_OK)
+	{
+		fprintf(stderr, "Failed to build icns family\n");
+		fclose(icnsfile);
+		unlink(argv[1]);
+
+		exit(1);
+	}
+
+	icns_free_family_builder(familyBuilder);
+
 	if (icns_write_family_to_file(icnsfile, iconFamily) != ICNS_STATUS_OK)
 	{
 		fprintf(stderr, "Failed to write icns file\n");
@@ -71,6 +71,73 @@ typedef struct icns_image_t
   icns_byte_t           *imageData;     // pointer to base address of uncompressed raw image data
 } icns_image_t;
 
+/* byte order of decoded 32-bit pixels */
+/* premultiplied formats have colour scaled by alpha */
+typedef enum icns_pixel_format_t
+{
+  ICNS_PIXEL_FORMAT_RGBA = 0,
+  ICNS_PIXEL_FORMAT_BGRA = 1,
+  ICNS_PIXEL_FORMAT_ARGB = 2,
+  ICNS_PIXEL_FORMAT_RGBA_PREMULTIPLIED = 3,
+  ICNS_PIXEL_FORMAT_BGRA_PREMULTIPLIED = 4,
+  ICNS_PIXEL_FORMAT_ARGB_PREMULTIPLIED = 5
+} icns_pixel_format_t;
+
+/* caller owned block to decode an image into */
+/* not part of the actual icns data format */
+typedef struct icns_pixel_buffer_t
+{
+  icns_uint32_t         bufferWidth;      // width in pixels, must match the decoded image
+  icns_uint32_t         bufferHeight;     // height in pixels, must match the decoded image
+  icns_size_t           bufferRowBytes;   // bytes from one row to the next, at least width * depth / bits-per-pixel
+  icns_byte_t           *bufferData;      // first row - NOT freed by libicns
+  icns_pixel_format_t   bufferFormat;     // layout of 32-bit pixels, ICNS_PIXEL_FORMAT_RGBA unless set
+} icns_pixel_buffer_t;
+
+/* decoded image cache counters - see icns_set_image_cache_limit */
+/* a hit still returns a private copy of the pixels, freed with icns_free_image */
+/* not part of the actual icns data format */
+typedef struct icns_image_cache_stats_t
+{
+  icns_uint64_t         hits;             // lookups answered from the cache
+  icns_uint64_t         misses;           // lookups that had to decode
+  icns_uint64_t         evictions;        // entries dropped to stay under the limit
+  icns_uint64_t         entryCount;       // images currently cached
+  icns_uint64_t         bytesUsed;        // bytes currently cached, element copies and entry overhead included
+  icns_uint64_t         bytesLimit;       // 0 while the cache is off
+} icns_image_cache_stats_t;
+
+/* stages counted by icns_get_stats - only collected when built with --enable-stats */
+/* times include any nested stage, e.g. decode image includes decode rle24 */
+#define ICNS_STATS_PARSE_FAMILY       0   // icns_parse_family_data
+#define ICNS_STATS_EXPORT_FAMILY      1   // icns_export_family_data
+#define ICNS_STATS_WRITE_FAMILY       2   // icns_write_family_to_file, icns_write_family_to_fd
+#define ICNS_STATS_SET_ELEMENT        3   // icns_set_element_in_family
+#define ICNS_STATS_DECODE_IMAGE       4   // icns_get_image_from_element, icns_get_image32_with_mask_from_family
+#define ICNS_STATS_DECODE_RLE24       5
+#define ICNS_STATS_ENCODE_RLE24       6
+#define ICNS_STATS_DECODE_PNG         7
+#define ICNS_STATS_ENCODE_PNG         8
+#define ICNS_STATS_DECODE_JP2         9
+#define ICNS_STATS_ENCODE_JP2         10
+#define ICNS_STATS_STAGE_COUNT        11
+
+#define ICNS_STATS_HISTOGRAM_BUCKETS  20
+
+typedef struct icns_stage_stats_t
+{
+  icns_uint64_t         calls;
+  icns_uint64_t         bytesProcessed;   // input bytes handed to the stage
+  icns_uint64_t         allocBytes;       // bytes allocated while the stage ran
+  icns_uint64_t         totalNanoseconds;
+  icns_uint64_t         latencyHistogram[ICNS_STATS_HISTOGRAM_BUCKETS]; // [0] under 1us, [n] under 2^n us, the last one all slower calls
+} icns_stage_stats_t;
+
+typedef struct icns_stats_t
+{
+  icns_stage_stats_t    stages[ICNS_STATS_STAGE_COUNT];
+} icns_stats_t;
+
 /* used for getting information about various types */
 /* not part of the actual icns data format */
 typedef struct icns_icon_info_t
@@ -86,6 +153,55 @@ typedef struct icns_icon_info_t
   icns_uint64_t         iconRawDataSize;  // uncompressed bytes = width * height * depth / bits-per-pixel
 } icns_icon_info_t;
 
+/* read-only view of an element's data, borrowed from its container */
+/* only valid while the container is left untouched - see icns_peek_element_in_family */
+/* not part of the actual icns data format */
+typedef struct icns_element_view_t
+{
+  icns_type_t           elementType;      // 'ICN#', 'icl8', etc...
+  icns_size_t           elementSize;      // total size of element (including 8 byte header)
+  icns_size_t           dataSize;         // size of the element data alone
+  const icns_byte_t     *elementData;     // element data - NOT a copy, do not free
+} icns_element_view_t;
+
+/* read-only icon family mapped directly from a file */
+/* opaque - see icns_map_family_from_path */
+typedef struct icns_family_map_t icns_family_map_t;
+
+/* element type -> location index over an icon family */
+/* opaque - see icns_new_family_index */
+typedef struct icns_family_index_t icns_family_index_t;
+
+/* collects elements to build a family with a single allocation */
+/* opaque - see icns_new_family_builder */
+typedef struct icns_family_builder_t icns_family_builder_t;
+
+/* error reporting state for one caller / thread */
+/* opaque - see icns_new_context */
+typedef struct icns_context_t icns_context_t;
+typedef void (*icns_error_callback_t)(icns_context_t *context,const char *message,void *userData);
+
+/* how png elements are compressed - see icns_init_png_options */
+typedef struct icns_png_options_t
+{
+  int                   compressionLevel; // zlib level 0-9, or ICNS_PNG_COMPRESSION_DEFAULT
+  int                   filterSet;        // ICNS_PNG_FILTER_* bits libpng may choose row filters from
+  int                   zlibStrategy;     // ICNS_PNG_STRATEGY_*
+} icns_png_options_t;
+
+/* replacement for malloc/realloc/free - see icns_set_allocator */
+typedef struct icns_allocator_t
+{
+  void                  *(*allocFunc)(size_t size,void *userData);
+  void                  *(*reallocFunc)(void *dataPtr,size_t oldSize,size_t newSize,void *userData); // optional
+  void                  (*freeFunc)(void *dataPtr,void *userData);
+  void                  *userData;
+} icns_allocator_t;
+
+/* bump allocator released all at once - see icns_new_arena */
+/* opaque - use icns_get_arena_allocator to allocate from it */
+typedef struct icns_arena_t icns_arena_t;
+
 /*  icns element type constants */
 
 #define ICNS_TABLE_OF_CONTENTS        0x544F4320  // "TOC "
@@ -143,6 +259,34 @@ typedef struct icns_icon_info_t
 #define ICNS_NULL_DATA                0x00000000
 #define ICNS_NULL_MASK                0x00000000
 
+/* png encoder constants - same values as libpng / zlib */
+
+#define ICNS_PNG_COMPRESSION_DEFAULT  -1
+
+#define ICNS_PNG_FILTER_NONE          0x08
+#define ICNS_PNG_FILTER_SUB           0x10
+#define ICNS_PNG_FILTER_UP            0x20
+#define ICNS_PNG_FILTER_AVG           0x40
+#define ICNS_PNG_FILTER_PAETH         0x80
+#define ICNS_PNG_FILTER_ALL           0xF8
+
+#define ICNS_PNG_STRATEGY_DEFAULT     0
+#define ICNS_PNG_STRATEGY_FILTERED    1
+#define ICNS_PNG_STRATEGY_HUFFMAN_ONLY 2
+#define ICNS_PNG_STRATEGY_RLE         3
+#define ICNS_PNG_STRATEGY_FIXED       4
+
+#define ICNS_PNG_COLOR_TYPE_GRAY      0
+#define ICNS_PNG_COLOR_TYPE_RGB       2
+#define ICNS_PNG_COLOR_TYPE_PALETTE   3
+#define ICNS_PNG_COLOR_TYPE_GRAY_ALPHA 4
+#define ICNS_PNG_COLOR_TYPE_RGBA      6
+
+/* icns_get_image_for_size flags */
+
+#define ICNS_SIZE_HIDPI               0x01  // width/height are in points, return 2x pixels
+#define ICNS_SIZE_NATIVE              0x02  // return the chosen element unscaled
+
 /* icns file / resource type constants */
 
 #define ICNS_FAMILY_TYPE              0x69636E73  // "icns"
@@ -167,31 +311,89 @@ typedef struct icns_icon_info_t
 /* icns function prototypes */
 /* NOTE: internal functions are found in icns_internals.h */
 
+// icns_context.c
+int icns_new_context(icns_context_t **contextOut);
+int icns_free_context(icns_context_t *context);
+int icns_context_set_print_errors(icns_context_t *context,icns_bool_t shouldPrint);
+int icns_context_set_error_callback(icns_context_t *context,icns_error_callback_t errorCallback,void *userData);
+int icns_context_get_last_error(icns_context_t *context,int *errorOut,const char **messageOut);
+int icns_context_set_png_options(icns_context_t *context,const icns_png_options_t *options);
+int icns_context_set_allocator(icns_context_t *context,const icns_allocator_t *allocator);
+icns_context_t *icns_set_current_context(icns_context_t *context);
+int icns_read_family_from_file_with_context(icns_context_t *context,FILE *dataFile,icns_family_t **iconFamilyOut);
+int icns_write_family_to_file_with_context(icns_context_t *context,FILE *dataFile,icns_family_t *iconFamilyIn);
+int icns_import_family_data_with_context(icns_context_t *context,icns_size_t dataSize,icns_byte_t *data,icns_family_t **iconFamilyOut);
+int icns_export_family_data_with_context(icns_context_t *context,icns_family_t *iconFamily,icns_size_t *dataSizeOut,icns_byte_t **dataPtrOut);
+int icns_read_element_from_fd_with_context(icns_context_t *context,int fd,icns_type_t iconType,icns_element_t **iconElementOut);
+int icns_get_element_from_family_with_context(icns_context_t *context,icns_family_t *iconFamily,icns_type_t iconType,icns_element_t **iconElementOut);
+int icns_peek_element_in_family_with_context(icns_context_t *context,icns_family_t *iconFamily,icns_type_t iconType,icns_element_view_t *elementViewOut);
+int icns_set_element_in_family_with_context(icns_context_t *context,icns_family_t **iconFamilyRef,icns_element_t *newIconElement);
+int icns_remove_element_in_family_with_context(icns_context_t *context,icns_family_t **iconFamilyRef,icns_type_t iconType);
+int icns_new_element_from_image_with_context(icns_context_t *context,icns_image_t *imageIn,icns_type_t iconType,icns_element_t **iconElementOut);
+int icns_new_element_from_mask_with_context(icns_context_t *context,icns_image_t *imageIn,icns_type_t iconType,icns_element_t **iconElementOut);
+int icns_get_image32_with_mask_from_family_with_context(icns_context_t *context,icns_family_t *iconFamily,icns_type_t iconType,icns_image_t *imageOut);
+int icns_get_image_from_element_with_context(icns_context_t *context,icns_element_t *iconElement,icns_image_t *imageOut);
+int icns_get_mask_from_element_with_context(icns_context_t *context,icns_element_t *iconElement,icns_image_t *imageOut);
+
 // icns_io.c
 int icns_write_family_to_file(FILE *dataFile,icns_family_t *iconFamilyIn);
+int icns_write_family_to_fd(int fd,icns_family_t *iconFamilyIn);
 int icns_read_family_from_file(FILE *dataFile,icns_family_t **iconFamilyOut);
 int icns_read_family_from_rsrc(FILE *rsrcFile,icns_family_t **iconFamilyOut);
 int icns_export_family_data(icns_family_t *iconFamily,icns_size_t *dataSizeOut,icns_byte_t **dataPtrOut);
 int icns_import_family_data(icns_size_t dataSize,icns_byte_t *data,icns_family_t **iconFamilyOut);
+int icns_map_family_from_path(const char *path,icns_family_map_t **familyMapOut);
+int icns_unmap_family(icns_family_map_t *familyMap);
+int icns_count_elements_in_map(icns_family_map_t *familyMap,icns_sint32_t *elementTotal);
+int icns_get_element_view_from_map(icns_family_map_t *familyMap,icns_type_t iconType,icns_element_view_t *elementViewOut);
+int icns_get_nth_element_view_from_map(icns_family_map_t *familyMap,icns_uint32_t elementIndex,icns_element_view_t *elementViewOut);
+int icns_read_element_from_file(FILE *dataFile,icns_type_t iconType,icns_element_t **iconElementOut);
+int icns_read_element_from_fd(int fd,icns_type_t iconType,icns_element_t **iconElementOut);
+int icns_get_element_size_from_file(FILE *dataFile,icns_type_t iconType,icns_size_t *elementSizeOut);
+int icns_get_element_size_from_fd(int fd,icns_type_t iconType,icns_size_t *elementSizeOut);
 
 // icns_family.c
 int icns_create_family(icns_family_t **iconFamilyOut);
 int icns_count_elements_in_family(icns_family_t *iconFamily, icns_sint32_t *elementTotal);
+int icns_new_family_index(icns_family_t *iconFamily,icns_family_index_t **familyIndexOut);
+int icns_free_family_index(icns_family_index_t *familyIndex);
+int icns_new_family_builder(icns_family_builder_t **familyBuilderOut);
+int icns_free_family_builder(icns_family_builder_t *familyBuilder);
+int icns_add_element_to_family_builder(icns_family_builder_t *familyBuilder,icns_element_t *iconElement);
+int icns_peek_element_in_family_builder(icns_family_builder_t *familyBuilder,icns_type_t iconType,icns_element_view_t *elementViewOut);
+int icns_build_family(icns_family_builder_t *familyBuilder,icns_family_t **iconFamilyOut);
 
 // icns_element.c
 int icns_get_element_from_family(icns_family_t *iconFamily,icns_type_t iconType,icns_element_t **iconElementOut);
 int icns_set_element_in_family(icns_family_t **iconFamilyRef,icns_element_t *newIconElement);
 int icns_add_element_in_family(icns_family_t **iconFamilyRef,icns_element_t *newIconElement);
 int icns_remove_element_in_family(icns_family_t **iconFamilyRef,icns_type_t iconType);
+int icns_get_element_from_indexed_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_element_t **iconElementOut);
+int icns_set_element_in_indexed_family(icns_family_t **iconFamilyRef,icns_family_index_t *familyIndex,icns_element_t *newIconElement);
+int icns_remove_element_in_indexed_family(icns_family_t **iconFamilyRef,icns_family_index_t *familyIndex,icns_type_t iconType);
+int icns_peek_element_in_family(icns_family_t *iconFamily,icns_type_t iconType,icns_element_view_t *elementViewOut);
+int icns_peek_element_in_indexed_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_element_view_t *elementViewOut);
+int icns_peek_png_data_in_family(icns_family_t *iconFamily,icns_type_t iconType,icns_size_t *pngSizeOut,const icns_byte_t **pngDataOut);
+int icns_peek_png_data_in_indexed_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_size_t *pngSizeOut,const icns_byte_t **pngDataOut);
 int icns_new_element_from_image(icns_image_t *imageIn,icns_type_t iconType,icns_element_t **iconElementOut);
 int icns_new_element_from_mask(icns_image_t *imageIn,icns_type_t iconType,icns_element_t **iconElementOut);
+int icns_new_element_from_png_data(icns_type_t iconType,icns_size_t dataSize,icns_byte_t *dataPtr,icns_element_t **iconElementOut);
 int icns_update_element_with_image(icns_image_t *imageIn,icns_element_t **iconElement);
 int icns_update_element_with_mask(icns_image_t *imageIn,icns_element_t **iconElement);
 
 // icns_image.c
 int icns_get_image32_with_mask_from_family(icns_family_t *iconFamily,icns_type_t sourceType,icns_image_t *imageOut);
+int icns_get_image32_with_mask_from_indexed_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_image_t *imageOut);
+int icns_get_image32_with_mask_from_map(icns_family_map_t *familyMap,icns_type_t iconType,icns_image_t *imageOut);
+int icns_get_image32_with_mask_from_family_in_format(icns_family_t *iconFamily,icns_type_t iconType,icns_pixel_format_t pixelFormat,icns_image_t *imageOut);
+int icns_get_image32_with_mask_from_family_into(icns_family_t *iconFamily,icns_type_t iconType,icns_pixel_buffer_t *bufferOut);
+int icns_get_image32_with_mask_from_indexed_family_into(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_pixel_buffer_t *bufferOut);
 int icns_get_image_from_element(icns_element_t *iconElement,icns_image_t *imageOut);
 int icns_get_mask_from_element(icns_element_t *iconElement,icns_image_t *imageOut);
+int icns_get_image_from_element_into(icns_element_t *iconElement,icns_pixel_buffer_t *bufferOut);
+int icns_get_mask_from_element_into(icns_element_t *maskElement,icns_pixel_buffer_t *bufferOut);
+int icns_get_image_from_element_view(const icns_element_view_t *elementView,icns_image_t *imageOut);
+int icns_get_mask_from_element_view(const icns_element_view_t *elementView,icns_image_t *imageOut);
 int icns_init_image_for_type(icns_type_t iconType,icns_image_t *imageOut);
 int icns_init_image(icns_uint32_t iconWidth,icns_uint32_t iconHeight,icns_uint32_t iconChannels,icns_uint32_t iconPixelDepth,icns_image_t *imageOut);
 int icns_free_image(icns_image_t *imageIn);
@@ -199,10 +401,41 @@ int icns_free_image(icns_image_t *imageIn);
 // icns_rle24.c
 int icns_decode_rle24_data(icns_size_t rawDataSize, icns_byte_t *rawDataPtr,icns_size_t expectedPixelCount, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut);
 int icns_encode_rle24_data(icns_size_t dataSizeIn, icns_byte_t *dataPtrIn,icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut);
+int icns_encode_rle24_data_into(icns_size_t dataSizeIn, icns_byte_t *dataPtrIn,icns_size_t bufferSize, icns_byte_t *bufferPtr,icns_size_t *dataSizeOut);
+icns_size_t icns_get_rle24_max_encoded_size(icns_size_t dataSizeIn);
+
+// icns_png.c
+int icns_init_png_options(icns_png_options_t *optionsOut);
+int icns_get_png_info(icns_size_t dataSize,icns_byte_t *dataPtr,icns_uint32_t *widthOut,icns_uint32_t *heightOut,icns_uint8_t *bitDepthOut,icns_uint8_t *colorTypeOut);
 
 // icns_jp2.c
 int icns_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *imageOut);
+int icns_jp2_to_image_at_size(icns_size_t dataSize, icns_byte_t *dataPtr, icns_uint32_t targetSize, icns_image_t *imageOut);
 int icns_image_to_jp2(icns_image_t *image, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut);
+int icns_jp2_codec_init(void);
+int icns_jp2_codec_cleanup(void);
+
+// icns_resample.c
+int icns_get_image_for_size(icns_family_t *iconFamily,icns_uint32_t width,icns_uint32_t height,icns_uint32_t flags,icns_image_t *imageOut);
+int icns_resample_image(icns_image_t *imageIn,icns_uint32_t width,icns_uint32_t height,icns_image_t *imageOut);
+
+// icns_alloc.c
+int icns_set_allocator(const icns_allocator_t *allocator);
+int icns_new_arena(size_t blockSize,icns_arena_t **arenaOut);
+int icns_get_arena_allocator(icns_arena_t *arena,icns_allocator_t *allocatorOut);
+int icns_reset_arena(icns_arena_t *arena);
+int icns_free_arena(icns_arena_t *arena);
+
+// icns_cache.c
+int icns_set_image_cache_limit(icns_uint64_t maxBytes);
+int icns_clear_image_cache(void);
+int icns_get_image_cache_stats(icns_image_cache_stats_t *statsOut);
+int icns_reset_image_cache_stats(void);
+
+// icns_stats.c
+int icns_get_stats(icns_stats_t *statsOut);
+int icns_get_thread_stats(icns_stats_t *statsOut);
+int icns_reset_stats(void);
 
 // icns_utils.c
 icns_icon_info_t icns_get_image_info_for_type(icns_type_t iconType);
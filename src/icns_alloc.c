@@ -0,0 +1,379 @@
+/*
+File:       icns_alloc.c
+Copyright (C) 2001-2013 Mathew Eis <mathew@eisbox.net>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the
+Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+Boston, MA 02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "icns.h"
+#include "icns_internals.h"
+
+/*
+Every allocation libicns makes goes through icns_malloc, icns_realloc and
+icns_free. They use the allocator of the current context (see
+icns_context_set_allocator), else the process-wide one set with
+icns_set_allocator, else the C library.
+
+Memory handed back to the caller - families, elements, image data - comes
+from whichever allocator was in effect, and has to be released through the
+same one: with the same context current for icns_free_image and friends,
+or all at once by resetting the arena it came from.
+*/
+
+/********* Process-wide allocator, set before any other libicns call *********/
+static icns_allocator_t	gDefaultAllocator;
+static icns_bool_t	gHasDefaultAllocator = 0;
+
+static const icns_allocator_t *icns_get_allocator(void)
+{
+	const icns_allocator_t	*allocator = icns_context_get_allocator();
+
+	if(allocator != NULL)
+		return allocator;
+
+	if(gHasDefaultAllocator)
+		return &gDefaultAllocator;
+
+	return NULL;
+}
+
+/***************************** icns_malloc **************************/
+
+void *icns_malloc(size_t dataSize)
+{
+	const icns_allocator_t	*allocator = icns_get_allocator();
+
+	ICNS_STATS_ALLOC(dataSize);
+
+	if(allocator == NULL)
+		return malloc(dataSize);
+
+	return allocator->allocFunc(dataSize,allocator->userData);
+}
+
+/***************************** icns_realloc **************************/
+// oldSize is the size dataPtr was last allocated with - allocators like the
+// arena need it to move the data, since they don't keep it themselves
+
+void *icns_realloc(void *dataPtr,size_t oldSize,size_t newSize)
+{
+	const icns_allocator_t	*allocator = icns_get_allocator();
+	void			*newPtr = NULL;
+
+	ICNS_STATS_ALLOC(newSize);
+
+	if(allocator == NULL)
+		return realloc(dataPtr,newSize);
+
+	if(allocator->reallocFunc != NULL)
+		return allocator->reallocFunc(dataPtr,oldSize,newSize,allocator->userData);
+
+	newPtr = allocator->allocFunc(newSize,allocator->userData);
+	if(newPtr != NULL && dataPtr != NULL)
+	{
+		memcpy(newPtr,dataPtr,(oldSize < newSize) ? oldSize : newSize);
+		allocator->freeFunc(dataPtr,allocator->userData);
+	}
+
+	return newPtr;
+}
+
+/***************************** icns_free **************************/
+
+void icns_free(void *dataPtr)
+{
+	const icns_allocator_t	*allocator = icns_get_allocator();
+
+	if(dataPtr == NULL)
+		return;
+
+	if(allocator == NULL)
+		free(dataPtr);
+	else
+		allocator->freeFunc(dataPtr,allocator->userData);
+}
+
+/***************************** icns_check_allocator **************************/
+// Shared by icns_set_allocator and icns_context_set_allocator
+
+int icns_check_allocator(const char *funcName,const icns_allocator_t *allocator)
+{
+	if(allocator->allocFunc == NULL || allocator->freeFunc == NULL)
+	{
+		icns_print_err("%s: allocator needs at least an alloc and a free function!\n",funcName);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_set_allocator **************************/
+// Replaces malloc/realloc/free for every call that has no context allocator
+// of its own. Pass NULL to go back to the C library. Only safe to change
+// while no other thread is inside libicns, and with nothing allocated by
+// the previous allocator left to free.
+
+int icns_set_allocator(const icns_allocator_t *allocator)
+{
+	int	error = ICNS_STATUS_OK;
+
+	if(allocator == NULL)
+	{
+		gHasDefaultAllocator = 0;
+		return ICNS_STATUS_OK;
+	}
+
+	error = icns_check_allocator("icns_set_allocator",allocator);
+	if(error)
+		return error;
+
+	gDefaultAllocator = *allocator;
+	gHasDefaultAllocator = 1;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** Arenas ****************************/
+// A bump allocator for one conversion at a time: allocations are carved out
+// of large blocks, free only gives back the most recent allocation, and
+// icns_reset_arena drops everything at once without touching the blocks,
+// which are reused by the next conversion. Like a context, an arena must
+// only be used by one thread at a time.
+
+#define	ICNS_ARENA_DEFAULT_BLOCK_SIZE	(256 * 1024)
+#define	ICNS_ARENA_ALIGN		16
+#define	ICNS_ARENA_ROUND(size)		(((size) + ICNS_ARENA_ALIGN - 1) & ~(size_t)(ICNS_ARENA_ALIGN - 1))
+
+typedef struct icns_arena_block_t
+{
+	struct icns_arena_block_t	*next;
+	size_t				capacity;	// usable bytes after the header
+} icns_arena_block_t;
+
+#define	ICNS_ARENA_HEADER_SIZE		ICNS_ARENA_ROUND(sizeof(icns_arena_block_t))
+#define	ICNS_ARENA_BLOCK_DATA(block)	((icns_byte_t *)(block) + ICNS_ARENA_HEADER_SIZE)
+
+struct icns_arena_t
+{
+	size_t			blockSize;
+	icns_arena_block_t	*firstBlock;
+	icns_arena_block_t	*currentBlock;	// blocks before it are full
+	size_t			usedBytes;	// used in currentBlock
+	icns_byte_t		*lastPtr;	// most recent allocation, for free and realloc in place
+};
+
+static icns_arena_block_t *icns_new_arena_block(size_t capacity)
+{
+	icns_arena_block_t	*block = (icns_arena_block_t *)malloc(ICNS_ARENA_HEADER_SIZE + capacity);
+
+	if(block == NULL)
+		return NULL;
+
+	block->next = NULL;
+	block->capacity = capacity;
+
+	return block;
+}
+
+static void *icns_arena_alloc(size_t dataSize,void *userData)
+{
+	icns_arena_t		*arena = (icns_arena_t *)userData;
+	icns_arena_block_t	*block = arena->currentBlock;
+	size_t			roundedSize = ICNS_ARENA_ROUND(dataSize ? dataSize : 1);
+	icns_byte_t		*dataPtr = NULL;
+
+	if(block == NULL || block->capacity - arena->usedBytes < roundedSize)
+	{
+		// Move on to the next block kept from an earlier conversion if it's
+		// big enough, otherwise put a new one in front of it
+		if(block != NULL && block->next != NULL && block->next->capacity >= roundedSize)
+		{
+			block = block->next;
+		}
+		else
+		{
+			icns_arena_block_t	*newBlock = icns_new_arena_block(roundedSize > arena->blockSize ? roundedSize : arena->blockSize);
+
+			if(newBlock == NULL)
+				return NULL;
+
+			if(block == NULL)
+			{
+				arena->firstBlock = newBlock;
+			}
+			else
+			{
+				newBlock->next = block->next;
+				block->next = newBlock;
+			}
+			block = newBlock;
+		}
+
+		arena->currentBlock = block;
+		arena->usedBytes = 0;
+	}
+
+	dataPtr = ICNS_ARENA_BLOCK_DATA(block) + arena->usedBytes;
+	arena->usedBytes += roundedSize;
+	arena->lastPtr = dataPtr;
+
+	return dataPtr;
+}
+
+static void *icns_arena_realloc(void *dataPtr,size_t oldSize,size_t newSize,void *userData)
+{
+	icns_arena_t		*arena = (icns_arena_t *)userData;
+	icns_byte_t		*newPtr = NULL;
+
+	// The most recent allocation can grow or shrink where it stands
+	if(dataPtr != NULL && dataPtr == arena->lastPtr)
+	{
+		icns_byte_t	*blockData = ICNS_ARENA_BLOCK_DATA(arena->currentBlock);
+		size_t		offset = (icns_byte_t *)dataPtr - blockData;
+		size_t		roundedSize = ICNS_ARENA_ROUND(newSize ? newSize : 1);
+
+		if(roundedSize <= arena->currentBlock->capacity - offset)
+		{
+			arena->usedBytes = offset + roundedSize;
+			return dataPtr;
+		}
+	}
+
+	newPtr = (icns_byte_t *)icns_arena_alloc(newSize,userData);
+	if(newPtr != NULL && dataPtr != NULL)
+		memcpy(newPtr,dataPtr,(oldSize < newSize) ? oldSize : newSize);
+
+	return newPtr;
+}
+
+static void icns_arena_free(void *dataPtr,void *userData)
+{
+	icns_arena_t	*arena = (icns_arena_t *)userData;
+
+	// Scratch buffers are usually freed right after use - hand the space back
+	if(dataPtr != NULL && dataPtr == arena->lastPtr)
+	{
+		arena->usedBytes = (icns_byte_t *)dataPtr - ICNS_ARENA_BLOCK_DATA(arena->currentBlock);
+		arena->lastPtr = NULL;
+	}
+}
+
+/***************************** icns_new_arena **************************/
+// blockSize is how much the arena grabs from malloc at a time; 0 picks a
+// default. Allocations larger than that get a block of their own.
+
+int icns_new_arena(size_t blockSize,icns_arena_t **arenaOut)
+{
+	icns_arena_t	*arena = NULL;
+
+	if(arenaOut == NULL)
+	{
+		icns_print_err("icns_new_arena: icns arena ref is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	*arenaOut = NULL;
+
+	arena = (icns_arena_t *)malloc(sizeof(icns_arena_t));
+	if(arena == NULL)
+	{
+		icns_print_err("icns_new_arena: Unable to allocate memory block of size: %d!\n",(int)sizeof(icns_arena_t));
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	memset(arena,0,sizeof(icns_arena_t));
+	arena->blockSize = ICNS_ARENA_ROUND(blockSize ? blockSize : ICNS_ARENA_DEFAULT_BLOCK_SIZE);
+
+	*arenaOut = arena;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_get_arena_allocator **************************/
+// Fills in an allocator drawing from arena, for icns_context_set_allocator
+
+int icns_get_arena_allocator(icns_arena_t *arena,icns_allocator_t *allocatorOut)
+{
+	if(arena == NULL)
+	{
+		icns_print_err("icns_get_arena_allocator: icns arena is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(allocatorOut == NULL)
+	{
+		icns_print_err("icns_get_arena_allocator: Allocator out is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	allocatorOut->allocFunc = icns_arena_alloc;
+	allocatorOut->reallocFunc = icns_arena_realloc;
+	allocatorOut->freeFunc = icns_arena_free;
+	allocatorOut->userData = arena;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_reset_arena **************************/
+// Releases everything allocated from arena at once. The blocks are kept
+// for the next conversion, so this costs the same however much was used.
+
+int icns_reset_arena(icns_arena_t *arena)
+{
+	if(arena == NULL)
+	{
+		icns_print_err("icns_reset_arena: icns arena is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	arena->currentBlock = arena->firstBlock;
+	arena->usedBytes = 0;
+	arena->lastPtr = NULL;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_free_arena **************************/
+// Gives all of the arena's blocks back to the C library
+
+int icns_free_arena(icns_arena_t *arena)
+{
+	icns_arena_block_t	*block = NULL;
+
+	if(arena == NULL)
+	{
+		icns_print_err("icns_free_arena: icns arena is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	block = arena->firstBlock;
+	while(block != NULL)
+	{
+		icns_arena_block_t	*nextBlock = block->next;
+
+		free(block);
+		block = nextBlock;
+	}
+
+	free(arena);
+
+	return ICNS_STATUS_OK;
+}
@@ -0,0 +1,436 @@
+/*
+File:       icns_cache.c
+Copyright (C) 2001-2013 Mathew Eis <mathew@eisbox.net>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the
+Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+Boston, MA 02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "icns.h"
+#include "icns_internals.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+//***************************** Decoded image cache ****************************//
+// A process-wide LRU cache of decoded images, bounded in bytes and off until
+// icns_set_image_cache_limit() gives it a size. Entries are keyed by the
+// element type and data (plus the mask's, if any) and the output pixel
+// format, so identical icons in different families share one entry. The
+// 64-bit hash only picks the candidate: each entry keeps a copy of the
+// element data, and a lookup is a hit only if that matches byte for byte.
+//
+// Entries are refcounted: a hit takes a reference under the lock, then
+// compares the element data and copies the pixels out after dropping it, so
+// neither blocks the cache and an entry evicted meanwhile stays alive until
+// both are done. Callers get their own copy of the pixels, freed with
+// icns_free_image like any decoded image - handing out shared read-only
+// images would need a new image type in the public API.
+
+#define ICNS_IMAGE_CACHE_BUCKETS	1024
+
+typedef struct icns_image_cache_entry_t
+{
+	icns_image_cache_key_t			key;
+	icns_image_t				image;
+	icns_byte_t				*elementData;	// icon then mask data, pointed to by key
+	icns_uint64_t				entryBytes;
+	icns_uint32_t				refCount;	// the cache itself holds one
+	struct icns_image_cache_entry_t		*hashNext;
+	struct icns_image_cache_entry_t		*lruPrev;	// towards most recently used
+	struct icns_image_cache_entry_t		*lruNext;
+} icns_image_cache_entry_t;
+
+static icns_image_cache_entry_t	*gImageCacheBuckets[ICNS_IMAGE_CACHE_BUCKETS];
+static icns_image_cache_entry_t	*gImageCacheNewest = NULL;
+static icns_image_cache_entry_t	*gImageCacheOldest = NULL;
+static icns_image_cache_stats_t	gImageCacheStats;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	gImageCacheLock = PTHREAD_MUTEX_INITIALIZER;
+ #define ICNS_IMAGE_CACHE_LOCK()	pthread_mutex_lock(&gImageCacheLock)
+ #define ICNS_IMAGE_CACHE_UNLOCK()	pthread_mutex_unlock(&gImageCacheLock)
+#else
+ #define ICNS_IMAGE_CACHE_LOCK()
+ #define ICNS_IMAGE_CACHE_UNLOCK()
+#endif
+
+// Word-at-a-time multiply/xorshift hash - fast enough to run over a 1MB
+// element for every lookup. Not collision resistant, so it only selects the
+// entry whose element data is then compared.
+static icns_uint64_t icns_hash_element_data(const icns_byte_t *dataPtr,icns_size_t dataSize)
+{
+	const icns_uint64_t	multiplier = 0x9E3779B97F4A7C15ULL;
+	icns_uint64_t		hash = 0xCBF29CE484222325ULL ^ (icns_uint64_t)dataSize;
+	icns_size_t		offset = 0;
+
+	if(dataPtr == NULL)
+		return 0;
+
+	for(offset = 0; offset + 8 <= dataSize; offset += 8)
+	{
+		icns_uint64_t	word;
+
+		memcpy(&word,dataPtr + offset,8);
+		hash = (hash ^ word) * multiplier;
+		hash ^= hash >> 32;
+	}
+
+	for(; offset < dataSize; offset++)
+		hash = (hash ^ dataPtr[offset]) * multiplier;
+
+	hash ^= hash >> 29;
+	hash *= multiplier;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+static icns_uint32_t icns_image_cache_bucket(const icns_image_cache_key_t *key)
+{
+	icns_uint64_t	hash = key->iconHash ^ (key->maskHash * 31) ^ ((icns_uint64_t)key->pixelFormat << 8) ^ key->kind;
+
+	return (icns_uint32_t)(hash ^ (hash >> 32)) & (ICNS_IMAGE_CACHE_BUCKETS - 1);
+}
+
+static icns_bool_t icns_image_cache_keys_equal(const icns_image_cache_key_t *a,const icns_image_cache_key_t *b)
+{
+	return (a->kind == b->kind &&
+		a->iconType == b->iconType && a->iconSize == b->iconSize && a->iconHash == b->iconHash &&
+		a->maskType == b->maskType && a->maskSize == b->maskSize && a->maskHash == b->maskHash &&
+		a->pixelFormat == b->pixelFormat);
+}
+
+static icns_bool_t icns_image_cache_data_equal(const icns_image_cache_key_t *a,const icns_image_cache_key_t *b)
+{
+	if(a->iconSize > 0 && memcmp(a->iconData,b->iconData,a->iconSize) != 0)
+		return 0;
+
+	if(a->maskSize > 0 && memcmp(a->maskData,b->maskData,a->maskSize) != 0)
+		return 0;
+
+	return 1;
+}
+
+// Both of these must be called with the lock held
+
+static void icns_release_image_cache_entry(icns_image_cache_entry_t *entry)
+{
+	if(--entry->refCount == 0)
+	{
+		free(entry->image.imageData);
+		free(entry->elementData);
+		free(entry);
+	}
+}
+
+static void icns_evict_image_cache_entry(icns_image_cache_entry_t *entry)
+{
+	icns_image_cache_entry_t	**link = &gImageCacheBuckets[icns_image_cache_bucket(&entry->key)];
+
+	while(*link != entry)
+		link = &(*link)->hashNext;
+	*link = entry->hashNext;
+
+	if(entry->lruPrev)
+		entry->lruPrev->lruNext = entry->lruNext;
+	else
+		gImageCacheNewest = entry->lruNext;
+
+	if(entry->lruNext)
+		entry->lruNext->lruPrev = entry->lruPrev;
+	else
+		gImageCacheOldest = entry->lruPrev;
+
+	gImageCacheStats.bytesUsed -= entry->entryBytes;
+	gImageCacheStats.entryCount--;
+
+	icns_release_image_cache_entry(entry);
+}
+
+//***************************** icns_image_cache_key_for **************************//
+// Fills in keyOut for an icon (and optional mask) element. Returns 0, and
+// skips the hashing, while the cache is off.
+
+icns_bool_t icns_image_cache_key_for(icns_uint32_t keyKind,const icns_element_view_t *iconView,const icns_element_view_t *maskView,icns_pixel_format_t pixelFormat,icns_image_cache_key_t *keyOut)
+{
+	icns_uint64_t	bytesLimit = 0;
+
+	ICNS_IMAGE_CACHE_LOCK();
+	bytesLimit = gImageCacheStats.bytesLimit;
+	ICNS_IMAGE_CACHE_UNLOCK();
+
+	if(bytesLimit == 0 || iconView == NULL || keyOut == NULL)
+		return 0;
+
+	memset(keyOut,0,sizeof(icns_image_cache_key_t));
+
+	keyOut->kind = keyKind;
+	keyOut->iconType = iconView->elementType;
+	keyOut->iconSize = iconView->dataSize;
+	keyOut->iconHash = icns_hash_element_data(iconView->elementData,iconView->dataSize);
+	keyOut->iconData = iconView->elementData;
+	keyOut->pixelFormat = pixelFormat;
+
+	if(maskView != NULL)
+	{
+		keyOut->maskType = maskView->elementType;
+		keyOut->maskSize = maskView->dataSize;
+		keyOut->maskHash = icns_hash_element_data(maskView->elementData,maskView->dataSize);
+		keyOut->maskData = maskView->elementData;
+	}
+
+	return 1;
+}
+
+//***************************** icns_image_cache_lookup **************************//
+// Copies a cached image into imageOut. Returns ICNS_STATUS_DATA_NOT_FOUND
+// on a miss. The key's element data has to stay valid during the call.
+
+int icns_image_cache_lookup(const icns_image_cache_key_t *key,icns_image_t *imageOut)
+{
+	icns_image_cache_entry_t	*entry = NULL;
+	icns_byte_t			*imageData = NULL;
+	icns_uint64_t			imageDataSize = 0;
+	icns_bool_t			isMatch = 0;
+
+	ICNS_IMAGE_CACHE_LOCK();
+
+	for(entry = gImageCacheBuckets[icns_image_cache_bucket(key)]; entry != NULL; entry = entry->hashNext)
+	{
+		if(icns_image_cache_keys_equal(&entry->key,key))
+			break;
+	}
+
+	if(entry == NULL)
+	{
+		gImageCacheStats.misses++;
+		ICNS_IMAGE_CACHE_UNLOCK();
+		return ICNS_STATUS_DATA_NOT_FOUND;
+	}
+
+	// Move to the front of the LRU list
+	if(entry != gImageCacheNewest)
+	{
+		entry->lruPrev->lruNext = entry->lruNext;
+		if(entry->lruNext)
+			entry->lruNext->lruPrev = entry->lruPrev;
+		else
+			gImageCacheOldest = entry->lruPrev;
+
+		entry->lruPrev = NULL;
+		entry->lruNext = gImageCacheNewest;
+		gImageCacheNewest->lruPrev = entry;
+		gImageCacheNewest = entry;
+	}
+
+	entry->refCount++;
+	ICNS_IMAGE_CACHE_UNLOCK();
+
+	// Same hash and size - make sure it really is the same element
+	isMatch = icns_image_cache_data_equal(&entry->key,key);
+	imageDataSize = entry->image.imageDataSize;
+
+	if(isMatch)
+	{
+		imageData = (icns_byte_t *)icns_malloc(imageDataSize);
+		if(imageData != NULL)
+		{
+			memcpy(imageData,entry->image.imageData,imageDataSize);
+			*imageOut = entry->image;
+			imageOut->imageData = imageData;
+		}
+	}
+
+	ICNS_IMAGE_CACHE_LOCK();
+	if(isMatch)
+		gImageCacheStats.hits++;
+	else
+		gImageCacheStats.misses++;
+	icns_release_image_cache_entry(entry);
+	ICNS_IMAGE_CACHE_UNLOCK();
+
+	if(!isMatch)
+		return ICNS_STATUS_DATA_NOT_FOUND;
+
+	if(imageData == NULL)
+	{
+		icns_print_err("icns_image_cache_lookup: Unable to allocate memory block of size: %d!\n",(int)imageDataSize);
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** icns_image_cache_insert **************************//
+// Stores a copy of a freshly decoded image and of the element data it came
+// from, evicting the least recently used entries to stay within the byte
+// limit. Images whose data size doesn't match their dimensions are skipped.
+
+void icns_image_cache_insert(const icns_image_cache_key_t *key,const icns_image_t *image)
+{
+	icns_image_cache_entry_t	*entry = NULL;
+	icns_image_cache_entry_t	*existing = NULL;
+	icns_uint32_t			bucket = icns_image_cache_bucket(key);
+
+	if(image == NULL || image->imageData == NULL || image->imageDataSize == 0)
+		return;
+
+	if(image->imageDataSize != (icns_uint64_t)image->imageWidth * image->imageHeight * image->imageChannels * image->imagePixelDepth / 8)
+		return;
+
+	entry = (icns_image_cache_entry_t *)malloc(sizeof(icns_image_cache_entry_t));
+	if(entry == NULL)
+		return;
+
+	memset(entry,0,sizeof(icns_image_cache_entry_t));
+	entry->key = *key;
+	entry->image = *image;
+	entry->entryBytes = image->imageDataSize + key->iconSize + key->maskSize + sizeof(icns_image_cache_entry_t);
+	entry->refCount = 1;
+	entry->image.imageData = (icns_byte_t *)malloc(image->imageDataSize);
+	entry->elementData = (icns_byte_t *)malloc(key->iconSize + key->maskSize + 1);
+
+	if(entry->image.imageData == NULL || entry->elementData == NULL)
+	{
+		free(entry->image.imageData);
+		free(entry->elementData);
+		free(entry);
+		return;
+	}
+
+	memcpy(entry->image.imageData,image->imageData,image->imageDataSize);
+
+	if(key->iconSize > 0)
+		memcpy(entry->elementData,key->iconData,key->iconSize);
+	if(key->maskSize > 0)
+		memcpy(entry->elementData + key->iconSize,key->maskData,key->maskSize);
+	entry->key.iconData = entry->elementData;
+	entry->key.maskData = entry->elementData + key->iconSize;
+
+	ICNS_IMAGE_CACHE_LOCK();
+
+	// Another thread may have decoded the same image in the meantime
+	for(existing = gImageCacheBuckets[bucket]; existing != NULL; existing = existing->hashNext)
+	{
+		if(icns_image_cache_keys_equal(&existing->key,key))
+			break;
+	}
+
+	if(existing != NULL || entry->entryBytes > gImageCacheStats.bytesLimit)
+	{
+		ICNS_IMAGE_CACHE_UNLOCK();
+		free(entry->image.imageData);
+		free(entry->elementData);
+		free(entry);
+		return;
+	}
+
+	entry->hashNext = gImageCacheBuckets[bucket];
+	gImageCacheBuckets[bucket] = entry;
+
+	entry->lruNext = gImageCacheNewest;
+	if(gImageCacheNewest)
+		gImageCacheNewest->lruPrev = entry;
+	gImageCacheNewest = entry;
+	if(gImageCacheOldest == NULL)
+		gImageCacheOldest = entry;
+
+	gImageCacheStats.bytesUsed += entry->entryBytes;
+	gImageCacheStats.entryCount++;
+
+	while(gImageCacheStats.bytesUsed > gImageCacheStats.bytesLimit && gImageCacheOldest != NULL)
+	{
+		icns_evict_image_cache_entry(gImageCacheOldest);
+		gImageCacheStats.evictions++;
+	}
+
+	ICNS_IMAGE_CACHE_UNLOCK();
+}
+
+//***************************** icns_set_image_cache_limit **************************//
+// Turns the decoded image cache on with room for maxBytes of images (entry
+// overhead included), or off with 0. Shrinking evicts right away.
+
+int icns_set_image_cache_limit(icns_uint64_t maxBytes)
+{
+	ICNS_IMAGE_CACHE_LOCK();
+
+	gImageCacheStats.bytesLimit = maxBytes;
+
+	while(gImageCacheStats.bytesUsed > gImageCacheStats.bytesLimit && gImageCacheOldest != NULL)
+	{
+		icns_evict_image_cache_entry(gImageCacheOldest);
+		gImageCacheStats.evictions++;
+	}
+
+	ICNS_IMAGE_CACHE_UNLOCK();
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** icns_clear_image_cache **************************//
+// Drops every cached image; the limit and the statistics are kept
+
+int icns_clear_image_cache(void)
+{
+	ICNS_IMAGE_CACHE_LOCK();
+
+	while(gImageCacheOldest != NULL)
+		icns_evict_image_cache_entry(gImageCacheOldest);
+
+	ICNS_IMAGE_CACHE_UNLOCK();
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** icns_get_image_cache_stats **************************//
+// Hit/miss counters and current usage of the decoded image cache. Lookups
+// are only counted while the cache is on.
+
+int icns_get_image_cache_stats(icns_image_cache_stats_t *statsOut)
+{
+	if(statsOut == NULL)
+	{
+		icns_print_err("icns_get_image_cache_stats: Statistics out is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	ICNS_IMAGE_CACHE_LOCK();
+	*statsOut = gImageCacheStats;
+	ICNS_IMAGE_CACHE_UNLOCK();
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** icns_reset_image_cache_stats **************************//
+// Zeroes the hit, miss and eviction counters
+
+int icns_reset_image_cache_stats(void)
+{
+	ICNS_IMAGE_CACHE_LOCK();
+	gImageCacheStats.hits = 0;
+	gImageCacheStats.misses = 0;
+	gImageCacheStats.evictions = 0;
+	ICNS_IMAGE_CACHE_UNLOCK();
+
+	return ICNS_STATUS_OK;
+}
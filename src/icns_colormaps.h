@@ -23,292 +23,357 @@ Boston, MA 02110-1301, USA.
 #ifndef _COLORMAPS_H_
 #define	_COLORMAPS_H_	1
 
-typedef struct icns_colormap_rgb_t
-{
-  icns_byte_t r;
-  icns_byte_t g;
-  icns_byte_t b;
-} icns_colormap_rgb_t;
+/*
+The colormaps are only listed once, as macros, and every table below is
+generated from them at compile time. ENTRY is called as ENTRY(r,g,b).
+*/
+
+// 4-bit colormap - one macro per index, so tables can paste them by index
+#define ICNS_COLORMAP_4_0   0xFF, 0xFF, 0xFF
+#define ICNS_COLORMAP_4_1   0xFC, 0xF3, 0x05
+#define ICNS_COLORMAP_4_2   0xFF, 0x64, 0x02
+#define ICNS_COLORMAP_4_3   0xDD, 0x08, 0x06
+#define ICNS_COLORMAP_4_4   0xF2, 0x08, 0x84
+#define ICNS_COLORMAP_4_5   0x46, 0x00, 0xA5
+#define ICNS_COLORMAP_4_6   0x00, 0x00, 0xD4
+#define ICNS_COLORMAP_4_7   0x02, 0xAB, 0xEA
+#define ICNS_COLORMAP_4_8   0x1F, 0xB7, 0x14
+#define ICNS_COLORMAP_4_9   0x00, 0x64, 0x11
+#define ICNS_COLORMAP_4_10  0x56, 0x2C, 0x05
+#define ICNS_COLORMAP_4_11  0x90, 0x71, 0x3A
+#define ICNS_COLORMAP_4_12  0xC0, 0xC0, 0xC0
+#define ICNS_COLORMAP_4_13  0x80, 0x80, 0x80
+#define ICNS_COLORMAP_4_14  0x40, 0x40, 0x40
+#define ICNS_COLORMAP_4_15  0x00, 0x00, 0x00
+
+#define ICNS_COLORMAP_APPLY(ENTRY,rgb)  ENTRY(rgb)
+
+#define ICNS_COLORMAP_4_ENTRIES(ENTRY) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_0) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_1) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_2) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_3) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_4) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_5) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_6) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_7) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_8) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_9) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_10) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_11) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_12) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_13) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_14) \
+   ICNS_COLORMAP_APPLY(ENTRY,ICNS_COLORMAP_4_15)
+
+// 8-bit colormap
+#define ICNS_COLORMAP_8_ENTRIES(ENTRY) \
+   ENTRY(0xFF, 0xFF, 0xFF) \
+   ENTRY(0xFF, 0xFF, 0xCC) \
+   ENTRY(0xFF, 0xFF, 0x99) \
+   ENTRY(0xFF, 0xFF, 0x66) \
+   ENTRY(0xFF, 0xFF, 0x33) \
+   ENTRY(0xFF, 0xFF, 0x00) \
+   ENTRY(0xFF, 0xCC, 0xFF) \
+   ENTRY(0xFF, 0xCC, 0xCC) \
+   ENTRY(0xFF, 0xCC, 0x99) \
+   ENTRY(0xFF, 0xCC, 0x66) \
+   ENTRY(0xFF, 0xCC, 0x33) \
+   ENTRY(0xFF, 0xCC, 0x00) \
+   ENTRY(0xFF, 0x99, 0xFF) \
+   ENTRY(0xFF, 0x99, 0xCC) \
+   ENTRY(0xFF, 0x99, 0x99) \
+   ENTRY(0xFF, 0x99, 0x66) \
+   ENTRY(0xFF, 0x99, 0x33) \
+   ENTRY(0xFF, 0x99, 0x00) \
+   ENTRY(0xFF, 0x66, 0xFF) \
+   ENTRY(0xFF, 0x66, 0xCC) \
+   ENTRY(0xFF, 0x66, 0x99) \
+   ENTRY(0xFF, 0x66, 0x66) \
+   ENTRY(0xFF, 0x66, 0x33) \
+   ENTRY(0xFF, 0x66, 0x00) \
+   ENTRY(0xFF, 0x33, 0xFF) \
+   ENTRY(0xFF, 0x33, 0xCC) \
+   ENTRY(0xFF, 0x33, 0x99) \
+   ENTRY(0xFF, 0x33, 0x66) \
+   ENTRY(0xFF, 0x33, 0x33) \
+   ENTRY(0xFF, 0x33, 0x00) \
+   ENTRY(0xFF, 0x00, 0xFF) \
+   ENTRY(0xFF, 0x00, 0xCC) \
+   ENTRY(0xFF, 0x00, 0x99) \
+   ENTRY(0xFF, 0x00, 0x66) \
+   ENTRY(0xFF, 0x00, 0x33) \
+   ENTRY(0xFF, 0x00, 0x00) \
+   ENTRY(0xCC, 0xFF, 0xFF) \
+   ENTRY(0xCC, 0xFF, 0xCC) \
+   ENTRY(0xCC, 0xFF, 0x99) \
+   ENTRY(0xCC, 0xFF, 0x66) \
+   ENTRY(0xCC, 0xFF, 0x33) \
+   ENTRY(0xCC, 0xFF, 0x00) \
+   ENTRY(0xCC, 0xCC, 0xFF) \
+   ENTRY(0xCC, 0xCC, 0xCC) \
+   ENTRY(0xCC, 0xCC, 0x99) \
+   ENTRY(0xCC, 0xCC, 0x66) \
+   ENTRY(0xCC, 0xCC, 0x33) \
+   ENTRY(0xCC, 0xCC, 0x00) \
+   ENTRY(0xCC, 0x99, 0xFF) \
+   ENTRY(0xCC, 0x99, 0xCC) \
+   ENTRY(0xCC, 0x99, 0x99) \
+   ENTRY(0xCC, 0x99, 0x66) \
+   ENTRY(0xCC, 0x99, 0x33) \
+   ENTRY(0xCC, 0x99, 0x00) \
+   ENTRY(0xCC, 0x66, 0xFF) \
+   ENTRY(0xCC, 0x66, 0xCC) \
+   ENTRY(0xCC, 0x66, 0x99) \
+   ENTRY(0xCC, 0x66, 0x66) \
+   ENTRY(0xCC, 0x66, 0x33) \
+   ENTRY(0xCC, 0x66, 0x00) \
+   ENTRY(0xCC, 0x33, 0xFF) \
+   ENTRY(0xCC, 0x33, 0xCC) \
+   ENTRY(0xCC, 0x33, 0x99) \
+   ENTRY(0xCC, 0x33, 0x66) \
+   ENTRY(0xCC, 0x33, 0x33) \
+   ENTRY(0xCC, 0x33, 0x00) \
+   ENTRY(0xCC, 0x00, 0xFF) \
+   ENTRY(0xCC, 0x00, 0xCC) \
+   ENTRY(0xCC, 0x00, 0x99) \
+   ENTRY(0xCC, 0x00, 0x66) \
+   ENTRY(0xCC, 0x00, 0x33) \
+   ENTRY(0xCC, 0x00, 0x00) \
+   ENTRY(0x99, 0xFF, 0xFF) \
+   ENTRY(0x99, 0xFF, 0xCC) \
+   ENTRY(0x99, 0xFF, 0x99) \
+   ENTRY(0x99, 0xFF, 0x66) \
+   ENTRY(0x99, 0xFF, 0x33) \
+   ENTRY(0x99, 0xFF, 0x00) \
+   ENTRY(0x99, 0xCC, 0xFF) \
+   ENTRY(0x99, 0xCC, 0xCC) \
+   ENTRY(0x99, 0xCC, 0x99) \
+   ENTRY(0x99, 0xCC, 0x66) \
+   ENTRY(0x99, 0xCC, 0x33) \
+   ENTRY(0x99, 0xCC, 0x00) \
+   ENTRY(0x99, 0x99, 0xFF) \
+   ENTRY(0x99, 0x99, 0xCC) \
+   ENTRY(0x99, 0x99, 0x99) \
+   ENTRY(0x99, 0x99, 0x66) \
+   ENTRY(0x99, 0x99, 0x33) \
+   ENTRY(0x99, 0x99, 0x00) \
+   ENTRY(0x99, 0x66, 0xFF) \
+   ENTRY(0x99, 0x66, 0xCC) \
+   ENTRY(0x99, 0x66, 0x99) \
+   ENTRY(0x99, 0x66, 0x66) \
+   ENTRY(0x99, 0x66, 0x33) \
+   ENTRY(0x99, 0x66, 0x00) \
+   ENTRY(0x99, 0x33, 0xFF) \
+   ENTRY(0x99, 0x33, 0xCC) \
+   ENTRY(0x99, 0x33, 0x99) \
+   ENTRY(0x99, 0x33, 0x66) \
+   ENTRY(0x99, 0x33, 0x33) \
+   ENTRY(0x99, 0x33, 0x00) \
+   ENTRY(0x99, 0x00, 0xFF) \
+   ENTRY(0x99, 0x00, 0xCC) \
+   ENTRY(0x99, 0x00, 0x99) \
+   ENTRY(0x99, 0x00, 0x66) \
+   ENTRY(0x99, 0x00, 0x33) \
+   ENTRY(0x99, 0x00, 0x00) \
+   ENTRY(0x66, 0xFF, 0xFF) \
+   ENTRY(0x66, 0xFF, 0xCC) \
+   ENTRY(0x66, 0xFF, 0x99) \
+   ENTRY(0x66, 0xFF, 0x66) \
+   ENTRY(0x66, 0xFF, 0x33) \
+   ENTRY(0x66, 0xFF, 0x00) \
+   ENTRY(0x66, 0xCC, 0xFF) \
+   ENTRY(0x66, 0xCC, 0xCC) \
+   ENTRY(0x66, 0xCC, 0x99) \
+   ENTRY(0x66, 0xCC, 0x66) \
+   ENTRY(0x66, 0xCC, 0x33) \
+   ENTRY(0x66, 0xCC, 0x00) \
+   ENTRY(0x66, 0x99, 0xFF) \
+   ENTRY(0x66, 0x99, 0xCC) \
+   ENTRY(0x66, 0x99, 0x99) \
+   ENTRY(0x66, 0x99, 0x66) \
+   ENTRY(0x66, 0x99, 0x33) \
+   ENTRY(0x66, 0x99, 0x00) \
+   ENTRY(0x66, 0x66, 0xFF) \
+   ENTRY(0x66, 0x66, 0xCC) \
+   ENTRY(0x66, 0x66, 0x99) \
+   ENTRY(0x66, 0x66, 0x66) \
+   ENTRY(0x66, 0x66, 0x33) \
+   ENTRY(0x66, 0x66, 0x00) \
+   ENTRY(0x66, 0x33, 0xFF) \
+   ENTRY(0x66, 0x33, 0xCC) \
+   ENTRY(0x66, 0x33, 0x99) \
+   ENTRY(0x66, 0x33, 0x66) \
+   ENTRY(0x66, 0x33, 0x33) \
+   ENTRY(0x66, 0x33, 0x00) \
+   ENTRY(0x66, 0x00, 0xFF) \
+   ENTRY(0x66, 0x00, 0xCC) \
+   ENTRY(0x66, 0x00, 0x99) \
+   ENTRY(0x66, 0x00, 0x66) \
+   ENTRY(0x66, 0x00, 0x33) \
+   ENTRY(0x66, 0x00, 0x00) \
+   ENTRY(0x33, 0xFF, 0xFF) \
+   ENTRY(0x33, 0xFF, 0xCC) \
+   ENTRY(0x33, 0xFF, 0x99) \
+   ENTRY(0x33, 0xFF, 0x66) \
+   ENTRY(0x33, 0xFF, 0x33) \
+   ENTRY(0x33, 0xFF, 0x00) \
+   ENTRY(0x33, 0xCC, 0xFF) \
+   ENTRY(0x33, 0xCC, 0xCC) \
+   ENTRY(0x33, 0xCC, 0x99) \
+   ENTRY(0x33, 0xCC, 0x66) \
+   ENTRY(0x33, 0xCC, 0x33) \
+   ENTRY(0x33, 0xCC, 0x00) \
+   ENTRY(0x33, 0x99, 0xFF) \
+   ENTRY(0x33, 0x99, 0xCC) \
+   ENTRY(0x33, 0x99, 0x99) \
+   ENTRY(0x33, 0x99, 0x66) \
+   ENTRY(0x33, 0x99, 0x33) \
+   ENTRY(0x33, 0x99, 0x00) \
+   ENTRY(0x33, 0x66, 0xFF) \
+   ENTRY(0x33, 0x66, 0xCC) \
+   ENTRY(0x33, 0x66, 0x99) \
+   ENTRY(0x33, 0x66, 0x66) \
+   ENTRY(0x33, 0x66, 0x33) \
+   ENTRY(0x33, 0x66, 0x00) \
+   ENTRY(0x33, 0x33, 0xFF) \
+   ENTRY(0x33, 0x33, 0xCC) \
+   ENTRY(0x33, 0x33, 0x99) \
+   ENTRY(0x33, 0x33, 0x66) \
+   ENTRY(0x33, 0x33, 0x33) \
+   ENTRY(0x33, 0x33, 0x00) \
+   ENTRY(0x33, 0x00, 0xFF) \
+   ENTRY(0x33, 0x00, 0xCC) \
+   ENTRY(0x33, 0x00, 0x99) \
+   ENTRY(0x33, 0x00, 0x66) \
+   ENTRY(0x33, 0x00, 0x33) \
+   ENTRY(0x33, 0x00, 0x00) \
+   ENTRY(0x00, 0xFF, 0xFF) \
+   ENTRY(0x00, 0xFF, 0xCC) \
+   ENTRY(0x00, 0xFF, 0x99) \
+   ENTRY(0x00, 0xFF, 0x66) \
+   ENTRY(0x00, 0xFF, 0x33) \
+   ENTRY(0x00, 0xFF, 0x00) \
+   ENTRY(0x00, 0xCC, 0xFF) \
+   ENTRY(0x00, 0xCC, 0xCC) \
+   ENTRY(0x00, 0xCC, 0x99) \
+   ENTRY(0x00, 0xCC, 0x66) \
+   ENTRY(0x00, 0xCC, 0x33) \
+   ENTRY(0x00, 0xCC, 0x00) \
+   ENTRY(0x00, 0x99, 0xFF) \
+   ENTRY(0x00, 0x99, 0xCC) \
+   ENTRY(0x00, 0x99, 0x99) \
+   ENTRY(0x00, 0x99, 0x66) \
+   ENTRY(0x00, 0x99, 0x33) \
+   ENTRY(0x00, 0x99, 0x00) \
+   ENTRY(0x00, 0x66, 0xFF) \
+   ENTRY(0x00, 0x66, 0xCC) \
+   ENTRY(0x00, 0x66, 0x99) \
+   ENTRY(0x00, 0x66, 0x66) \
+   ENTRY(0x00, 0x66, 0x33) \
+   ENTRY(0x00, 0x66, 0x00) \
+   ENTRY(0x00, 0x33, 0xFF) \
+   ENTRY(0x00, 0x33, 0xCC) \
+   ENTRY(0x00, 0x33, 0x99) \
+   ENTRY(0x00, 0x33, 0x66) \
+   ENTRY(0x00, 0x33, 0x33) \
+   ENTRY(0x00, 0x33, 0x00) \
+   ENTRY(0x00, 0x00, 0xFF) \
+   ENTRY(0x00, 0x00, 0xCC) \
+   ENTRY(0x00, 0x00, 0x99) \
+   ENTRY(0x00, 0x00, 0x66) \
+   ENTRY(0x00, 0x00, 0x33) \
+   ENTRY(0xEE, 0x00, 0x00) \
+   ENTRY(0xDD, 0x00, 0x00) \
+   ENTRY(0xBB, 0x00, 0x00) \
+   ENTRY(0xAA, 0x00, 0x00) \
+   ENTRY(0x88, 0x00, 0x00) \
+   ENTRY(0x77, 0x00, 0x00) \
+   ENTRY(0x55, 0x00, 0x00) \
+   ENTRY(0x44, 0x00, 0x00) \
+   ENTRY(0x22, 0x00, 0x00) \
+   ENTRY(0x11, 0x00, 0x00) \
+   ENTRY(0x00, 0xEE, 0x00) \
+   ENTRY(0x00, 0xDD, 0x00) \
+   ENTRY(0x00, 0xBB, 0x00) \
+   ENTRY(0x00, 0xAA, 0x00) \
+   ENTRY(0x00, 0x88, 0x00) \
+   ENTRY(0x00, 0x77, 0x00) \
+   ENTRY(0x00, 0x55, 0x00) \
+   ENTRY(0x00, 0x44, 0x00) \
+   ENTRY(0x00, 0x22, 0x00) \
+   ENTRY(0x00, 0x11, 0x00) \
+   ENTRY(0x00, 0x00, 0xEE) \
+   ENTRY(0x00, 0x00, 0xDD) \
+   ENTRY(0x00, 0x00, 0xBB) \
+   ENTRY(0x00, 0x00, 0xAA) \
+   ENTRY(0x00, 0x00, 0x88) \
+   ENTRY(0x00, 0x00, 0x77) \
+   ENTRY(0x00, 0x00, 0x55) \
+   ENTRY(0x00, 0x00, 0x44) \
+   ENTRY(0x00, 0x00, 0x22) \
+   ENTRY(0x00, 0x00, 0x11) \
+   ENTRY(0xEE, 0xEE, 0xEE) \
+   ENTRY(0xDD, 0xDD, 0xDD) \
+   ENTRY(0xBB, 0xBB, 0xBB) \
+   ENTRY(0xAA, 0xAA, 0xAA) \
+   ENTRY(0x88, 0x88, 0x88) \
+   ENTRY(0x77, 0x77, 0x77) \
+   ENTRY(0x55, 0x55, 0x55) \
+   ENTRY(0x44, 0x44, 0x44) \
+   ENTRY(0x22, 0x22, 0x22) \
+   ENTRY(0x11, 0x11, 0x11) \
+   ENTRY(0x00, 0x00, 0x00)
+
+// A colormap entry as one opaque 32-bit RGBA pixel, in memory byte order
+#ifdef WORDS_BIGENDIAN
+ #define ICNS_COLORMAP_RGBA(r,g,b)  ( ((icns_uint32_t)(r) << 24) | ((icns_uint32_t)(g) << 16) | ((icns_uint32_t)(b) << 8) | 0xFF )
+#else
+ #define ICNS_COLORMAP_RGBA(r,g,b)  ( 0xFF000000 | ((icns_uint32_t)(b) << 16) | ((icns_uint32_t)(g) << 8) | (icns_uint32_t)(r) )
+#endif
+
+#define ICNS_COLORMAP_RGBA_ENTRY(r,g,b)   ICNS_COLORMAP_RGBA(r,g,b),
+#define ICNS_COLORMAP_RED_ENTRY(r,g,b)    r,
+#define ICNS_COLORMAP_GREEN_ENTRY(r,g,b)  g,
+#define ICNS_COLORMAP_BLUE_ENTRY(r,g,b)   b,
+
+static const icns_uint32_t icns_colormap_4_rgba[16] = { ICNS_COLORMAP_4_ENTRIES(ICNS_COLORMAP_RGBA_ENTRY) };
+static const icns_uint32_t icns_colormap_8_rgba[256] = { ICNS_COLORMAP_8_ENTRIES(ICNS_COLORMAP_RGBA_ENTRY) };
+
+// The 4-bit colormap split by channel, for 16 entry byte shuffles
+static const icns_byte_t icns_colormap_4_red[16] = { ICNS_COLORMAP_4_ENTRIES(ICNS_COLORMAP_RED_ENTRY) };
+static const icns_byte_t icns_colormap_4_green[16] = { ICNS_COLORMAP_4_ENTRIES(ICNS_COLORMAP_GREEN_ENTRY) };
+static const icns_byte_t icns_colormap_4_blue[16] = { ICNS_COLORMAP_4_ENTRIES(ICNS_COLORMAP_BLUE_ENTRY) };
+
+/*
+Tables indexed by one packed source byte, giving every pixel it holds.
+ENTRY is called as ENTRY(h,l) for the high and low nibbles of the byte.
+*/
+
+#define ICNS_BYTE_TABLE_ROW(ENTRY,h) \
+   ENTRY(h,0) ENTRY(h,1) ENTRY(h,2) ENTRY(h,3) ENTRY(h,4) ENTRY(h,5) ENTRY(h,6) ENTRY(h,7) \
+   ENTRY(h,8) ENTRY(h,9) ENTRY(h,10) ENTRY(h,11) ENTRY(h,12) ENTRY(h,13) ENTRY(h,14) ENTRY(h,15)
+
+#define ICNS_BYTE_TABLE(ENTRY) \
+   ICNS_BYTE_TABLE_ROW(ENTRY,0) ICNS_BYTE_TABLE_ROW(ENTRY,1) ICNS_BYTE_TABLE_ROW(ENTRY,2) ICNS_BYTE_TABLE_ROW(ENTRY,3) \
+   ICNS_BYTE_TABLE_ROW(ENTRY,4) ICNS_BYTE_TABLE_ROW(ENTRY,5) ICNS_BYTE_TABLE_ROW(ENTRY,6) ICNS_BYTE_TABLE_ROW(ENTRY,7) \
+   ICNS_BYTE_TABLE_ROW(ENTRY,8) ICNS_BYTE_TABLE_ROW(ENTRY,9) ICNS_BYTE_TABLE_ROW(ENTRY,10) ICNS_BYTE_TABLE_ROW(ENTRY,11) \
+   ICNS_BYTE_TABLE_ROW(ENTRY,12) ICNS_BYTE_TABLE_ROW(ENTRY,13) ICNS_BYTE_TABLE_ROW(ENTRY,14) ICNS_BYTE_TABLE_ROW(ENTRY,15)
+
+// 4-bit: high nibble is the first pixel
+#define ICNS_COLORMAP_RGBA_OF(rgb)  ICNS_COLORMAP_RGBA(rgb)
+#define ICNS_EXPAND_4BIT_ENTRY(h,l) \
+   { ICNS_COLORMAP_RGBA_OF(ICNS_COLORMAP_4_##h), ICNS_COLORMAP_RGBA_OF(ICNS_COLORMAP_4_##l) },
 
+static const icns_uint32_t icns_expand_4bit_table[256][2] = { ICNS_BYTE_TABLE(ICNS_EXPAND_4BIT_ENTRY) };
 
-static const icns_colormap_rgb_t icns_colormap_4[] =
-{
-   {0xFF, 0xFF, 0xFF},
-   {0xFC, 0xF3, 0x05},
-   {0xFF, 0x64, 0x02},
-   {0xDD, 0x08, 0x06},
-   {0xF2, 0x08, 0x84},
-   {0x46, 0x00, 0xA5},
-   {0x00, 0x00, 0xD4},
-   {0x02, 0xAB, 0xEA},
-   {0x1F, 0xB7, 0x14},
-   {0x00, 0x64, 0x11},
-   {0x56, 0x2C, 0x05},
-   {0x90, 0x71, 0x3A},
-   {0xC0, 0xC0, 0xC0},
-   {0x80, 0x80, 0x80},
-   {0x40, 0x40, 0x40},
-   {0x00, 0x00, 0x00}
-};
+// 1-bit: high bit is the first pixel, set bits are black
+#define ICNS_EXPAND_1BIT_PIXEL(h,l,bit) \
+   ( ((((h) << 4) | (l)) & (bit)) ? ICNS_COLORMAP_RGBA(0x00,0x00,0x00) : ICNS_COLORMAP_RGBA(0xFF,0xFF,0xFF) )
+#define ICNS_EXPAND_1BIT_ENTRY(h,l) \
+   { ICNS_EXPAND_1BIT_PIXEL(h,l,0x80), ICNS_EXPAND_1BIT_PIXEL(h,l,0x40), ICNS_EXPAND_1BIT_PIXEL(h,l,0x20), ICNS_EXPAND_1BIT_PIXEL(h,l,0x10), \
+     ICNS_EXPAND_1BIT_PIXEL(h,l,0x08), ICNS_EXPAND_1BIT_PIXEL(h,l,0x04), ICNS_EXPAND_1BIT_PIXEL(h,l,0x02), ICNS_EXPAND_1BIT_PIXEL(h,l,0x01) },
 
-static const icns_colormap_rgb_t icns_colormap_8[] =
-{
-   {0xFF, 0xFF, 0xFF},
-   {0xFF, 0xFF, 0xCC},
-   {0xFF, 0xFF, 0x99},
-   {0xFF, 0xFF, 0x66},
-   {0xFF, 0xFF, 0x33},
-   {0xFF, 0xFF, 0x00},
-   {0xFF, 0xCC, 0xFF},
-   {0xFF, 0xCC, 0xCC},
-   {0xFF, 0xCC, 0x99},
-   {0xFF, 0xCC, 0x66},
-   {0xFF, 0xCC, 0x33},
-   {0xFF, 0xCC, 0x00},
-   {0xFF, 0x99, 0xFF},
-   {0xFF, 0x99, 0xCC},
-   {0xFF, 0x99, 0x99},
-   {0xFF, 0x99, 0x66},
-   {0xFF, 0x99, 0x33},
-   {0xFF, 0x99, 0x00},
-   {0xFF, 0x66, 0xFF},
-   {0xFF, 0x66, 0xCC},
-   {0xFF, 0x66, 0x99},
-   {0xFF, 0x66, 0x66},
-   {0xFF, 0x66, 0x33},
-   {0xFF, 0x66, 0x00},
-   {0xFF, 0x33, 0xFF},
-   {0xFF, 0x33, 0xCC},
-   {0xFF, 0x33, 0x99},
-   {0xFF, 0x33, 0x66},
-   {0xFF, 0x33, 0x33},
-   {0xFF, 0x33, 0x00},
-   {0xFF, 0x00, 0xFF},
-   {0xFF, 0x00, 0xCC},
-   {0xFF, 0x00, 0x99},
-   {0xFF, 0x00, 0x66},
-   {0xFF, 0x00, 0x33},
-   {0xFF, 0x00, 0x00},
-   {0xCC, 0xFF, 0xFF},
-   {0xCC, 0xFF, 0xCC},
-   {0xCC, 0xFF, 0x99},
-   {0xCC, 0xFF, 0x66},
-   {0xCC, 0xFF, 0x33},
-   {0xCC, 0xFF, 0x00},
-   {0xCC, 0xCC, 0xFF},
-   {0xCC, 0xCC, 0xCC},
-   {0xCC, 0xCC, 0x99},
-   {0xCC, 0xCC, 0x66},
-   {0xCC, 0xCC, 0x33},
-   {0xCC, 0xCC, 0x00},
-   {0xCC, 0x99, 0xFF},
-   {0xCC, 0x99, 0xCC},
-   {0xCC, 0x99, 0x99},
-   {0xCC, 0x99, 0x66},
-   {0xCC, 0x99, 0x33},
-   {0xCC, 0x99, 0x00},
-   {0xCC, 0x66, 0xFF},
-   {0xCC, 0x66, 0xCC},
-   {0xCC, 0x66, 0x99},
-   {0xCC, 0x66, 0x66},
-   {0xCC, 0x66, 0x33},
-   {0xCC, 0x66, 0x00},
-   {0xCC, 0x33, 0xFF},
-   {0xCC, 0x33, 0xCC},
-   {0xCC, 0x33, 0x99},
-   {0xCC, 0x33, 0x66},
-   {0xCC, 0x33, 0x33},
-   {0xCC, 0x33, 0x00},
-   {0xCC, 0x00, 0xFF},
-   {0xCC, 0x00, 0xCC},
-   {0xCC, 0x00, 0x99},
-   {0xCC, 0x00, 0x66},
-   {0xCC, 0x00, 0x33},
-   {0xCC, 0x00, 0x00},
-   {0x99, 0xFF, 0xFF},
-   {0x99, 0xFF, 0xCC},
-   {0x99, 0xFF, 0x99},
-   {0x99, 0xFF, 0x66},
-   {0x99, 0xFF, 0x33},
-   {0x99, 0xFF, 0x00},
-   {0x99, 0xCC, 0xFF},
-   {0x99, 0xCC, 0xCC},
-   {0x99, 0xCC, 0x99},
-   {0x99, 0xCC, 0x66},
-   {0x99, 0xCC, 0x33},
-   {0x99, 0xCC, 0x00},
-   {0x99, 0x99, 0xFF},
-   {0x99, 0x99, 0xCC},
-   {0x99, 0x99, 0x99},
-   {0x99, 0x99, 0x66},
-   {0x99, 0x99, 0x33},
-   {0x99, 0x99, 0x00},
-   {0x99, 0x66, 0xFF},
-   {0x99, 0x66, 0xCC},
-   {0x99, 0x66, 0x99},
-   {0x99, 0x66, 0x66},
-   {0x99, 0x66, 0x33},
-   {0x99, 0x66, 0x00},
-   {0x99, 0x33, 0xFF},
-   {0x99, 0x33, 0xCC},
-   {0x99, 0x33, 0x99},
-   {0x99, 0x33, 0x66},
-   {0x99, 0x33, 0x33},
-   {0x99, 0x33, 0x00},
-   {0x99, 0x00, 0xFF},
-   {0x99, 0x00, 0xCC},
-   {0x99, 0x00, 0x99},
-   {0x99, 0x00, 0x66},
-   {0x99, 0x00, 0x33},
-   {0x99, 0x00, 0x00},
-   {0x66, 0xFF, 0xFF},
-   {0x66, 0xFF, 0xCC},
-   {0x66, 0xFF, 0x99},
-   {0x66, 0xFF, 0x66},
-   {0x66, 0xFF, 0x33},
-   {0x66, 0xFF, 0x00},
-   {0x66, 0xCC, 0xFF},
-   {0x66, 0xCC, 0xCC},
-   {0x66, 0xCC, 0x99},
-   {0x66, 0xCC, 0x66},
-   {0x66, 0xCC, 0x33},
-   {0x66, 0xCC, 0x00},
-   {0x66, 0x99, 0xFF},
-   {0x66, 0x99, 0xCC},
-   {0x66, 0x99, 0x99},
-   {0x66, 0x99, 0x66},
-   {0x66, 0x99, 0x33},
-   {0x66, 0x99, 0x00},
-   {0x66, 0x66, 0xFF},
-   {0x66, 0x66, 0xCC},
-   {0x66, 0x66, 0x99},
-   {0x66, 0x66, 0x66},
-   {0x66, 0x66, 0x33},
-   {0x66, 0x66, 0x00},
-   {0x66, 0x33, 0xFF},
-   {0x66, 0x33, 0xCC},
-   {0x66, 0x33, 0x99},
-   {0x66, 0x33, 0x66},
-   {0x66, 0x33, 0x33},
-   {0x66, 0x33, 0x00},
-   {0x66, 0x00, 0xFF},
-   {0x66, 0x00, 0xCC},
-   {0x66, 0x00, 0x99},
-   {0x66, 0x00, 0x66},
-   {0x66, 0x00, 0x33},
-   {0x66, 0x00, 0x00},
-   {0x33, 0xFF, 0xFF},
-   {0x33, 0xFF, 0xCC},
-   {0x33, 0xFF, 0x99},
-   {0x33, 0xFF, 0x66},
-   {0x33, 0xFF, 0x33},
-   {0x33, 0xFF, 0x00},
-   {0x33, 0xCC, 0xFF},
-   {0x33, 0xCC, 0xCC},
-   {0x33, 0xCC, 0x99},
-   {0x33, 0xCC, 0x66},
-   {0x33, 0xCC, 0x33},
-   {0x33, 0xCC, 0x00},
-   {0x33, 0x99, 0xFF},
-   {0x33, 0x99, 0xCC},
-   {0x33, 0x99, 0x99},
-   {0x33, 0x99, 0x66},
-   {0x33, 0x99, 0x33},
-   {0x33, 0x99, 0x00},
-   {0x33, 0x66, 0xFF},
-   {0x33, 0x66, 0xCC},
-   {0x33, 0x66, 0x99},
-   {0x33, 0x66, 0x66},
-   {0x33, 0x66, 0x33},
-   {0x33, 0x66, 0x00},
-   {0x33, 0x33, 0xFF},
-   {0x33, 0x33, 0xCC},
-   {0x33, 0x33, 0x99},
-   {0x33, 0x33, 0x66},
-   {0x33, 0x33, 0x33},
-   {0x33, 0x33, 0x00},
-   {0x33, 0x00, 0xFF},
-   {0x33, 0x00, 0xCC},
-   {0x33, 0x00, 0x99},
-   {0x33, 0x00, 0x66},
-   {0x33, 0x00, 0x33},
-   {0x33, 0x00, 0x00},
-   {0x00, 0xFF, 0xFF},
-   {0x00, 0xFF, 0xCC},
-   {0x00, 0xFF, 0x99},
-   {0x00, 0xFF, 0x66},
-   {0x00, 0xFF, 0x33},
-   {0x00, 0xFF, 0x00},
-   {0x00, 0xCC, 0xFF},
-   {0x00, 0xCC, 0xCC},
-   {0x00, 0xCC, 0x99},
-   {0x00, 0xCC, 0x66},
-   {0x00, 0xCC, 0x33},
-   {0x00, 0xCC, 0x00},
-   {0x00, 0x99, 0xFF},
-   {0x00, 0x99, 0xCC},
-   {0x00, 0x99, 0x99},
-   {0x00, 0x99, 0x66},
-   {0x00, 0x99, 0x33},
-   {0x00, 0x99, 0x00},
-   {0x00, 0x66, 0xFF},
-   {0x00, 0x66, 0xCC},
-   {0x00, 0x66, 0x99},
-   {0x00, 0x66, 0x66},
-   {0x00, 0x66, 0x33},
-   {0x00, 0x66, 0x00},
-   {0x00, 0x33, 0xFF},
-   {0x00, 0x33, 0xCC},
-   {0x00, 0x33, 0x99},
-   {0x00, 0x33, 0x66},
-   {0x00, 0x33, 0x33},
-   {0x00, 0x33, 0x00},
-   {0x00, 0x00, 0xFF},
-   {0x00, 0x00, 0xCC},
-   {0x00, 0x00, 0x99},
-   {0x00, 0x00, 0x66},
-   {0x00, 0x00, 0x33},
-   {0xEE, 0x00, 0x00},
-   {0xDD, 0x00, 0x00},
-   {0xBB, 0x00, 0x00},
-   {0xAA, 0x00, 0x00},
-   {0x88, 0x00, 0x00},
-   {0x77, 0x00, 0x00},
-   {0x55, 0x00, 0x00},
-   {0x44, 0x00, 0x00},
-   {0x22, 0x00, 0x00},
-   {0x11, 0x00, 0x00},
-   {0x00, 0xEE, 0x00},
-   {0x00, 0xDD, 0x00},
-   {0x00, 0xBB, 0x00},
-   {0x00, 0xAA, 0x00},
-   {0x00, 0x88, 0x00},
-   {0x00, 0x77, 0x00},
-   {0x00, 0x55, 0x00},
-   {0x00, 0x44, 0x00},
-   {0x00, 0x22, 0x00},
-   {0x00, 0x11, 0x00},
-   {0x00, 0x00, 0xEE},
-   {0x00, 0x00, 0xDD},
-   {0x00, 0x00, 0xBB},
-   {0x00, 0x00, 0xAA},
-   {0x00, 0x00, 0x88},
-   {0x00, 0x00, 0x77},
-   {0x00, 0x00, 0x55},
-   {0x00, 0x00, 0x44},
-   {0x00, 0x00, 0x22},
-   {0x00, 0x00, 0x11},
-   {0xEE, 0xEE, 0xEE},
-   {0xDD, 0xDD, 0xDD},
-   {0xBB, 0xBB, 0xBB},
-   {0xAA, 0xAA, 0xAA},
-   {0x88, 0x88, 0x88},
-   {0x77, 0x77, 0x77},
-   {0x55, 0x55, 0x55},
-   {0x44, 0x44, 0x44},
-   {0x22, 0x22, 0x22},
-   {0x11, 0x11, 0x11},
-   {0x00, 0x00, 0x00}
-};
+static const icns_uint32_t icns_expand_1bit_table[256][8] = { ICNS_BYTE_TABLE(ICNS_EXPAND_1BIT_ENTRY) };
 
 #endif /*_COLORMAPS_H_ */
@@ -0,0 +1,404 @@
+/*
+File:       icns_context.c
+Copyright (C) 2001-2013 Mathew Eis <mathew@eisbox.net>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the
+Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+Boston, MA 02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "icns.h"
+#include "icns_internals.h"
+
+/*
+A context carries error reporting state for one caller (typically one
+thread) so that it doesn't have to share the process-wide
+icns_set_print_errors setting with everyone else. The *_with_context
+functions make the context current for the calling thread for the
+duration of the call; icns_print_err reports to whichever context is
+current.
+A context must not be used by two threads at the same time, but any
+number of threads may each use their own.
+*/
+
+/********* Context in effect for the calling thread, if any *********/
+ICNS_THREAD_LOCAL icns_context_t	*gCurrentContext = NULL;
+
+/***************************** icns_new_context **************************/
+
+int icns_new_context(icns_context_t **contextOut)
+{
+	icns_context_t	*context = NULL;
+
+	if(contextOut == NULL)
+	{
+		icns_print_err("icns_new_context: icns context ref is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	*contextOut = NULL;
+
+	context = (icns_context_t *)malloc(sizeof(icns_context_t));
+	if(context == NULL)
+	{
+		icns_print_err("icns_new_context: Unable to allocate memory block of size: %d!\n",(int)sizeof(icns_context_t));
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	memset(context,0,sizeof(icns_context_t));
+
+	#ifdef ICNS_DEBUG
+	context->printErrors = 1;
+	#endif
+
+	*contextOut = context;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_free_context **************************/
+// Also stops context being current for the calling thread. Other threads
+// are not tracked: the caller has to make sure no other thread still has
+// context current (through icns_set_current_context or a *_with_context
+// call in progress) before freeing it.
+
+int icns_free_context(icns_context_t *context)
+{
+	if(context == NULL)
+	{
+		icns_print_err("icns_free_context: icns context is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(gCurrentContext == context)
+		gCurrentContext = NULL;
+
+	free(context);
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_context_set_print_errors **************************/
+// Whether errors reported through this context go to stderr (off by default)
+
+int icns_context_set_print_errors(icns_context_t *context,icns_bool_t shouldPrint)
+{
+	if(context == NULL)
+	{
+		icns_print_err("icns_context_set_print_errors: icns context is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	context->printErrors = shouldPrint;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_context_set_error_callback **************************/
+// Called with every error message reported through this context, printed or not
+
+int icns_context_set_error_callback(icns_context_t *context,icns_error_callback_t errorCallback,void *userData)
+{
+	if(context == NULL)
+	{
+		icns_print_err("icns_context_set_error_callback: icns context is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	context->errorCallback = errorCallback;
+	context->errorUserData = userData;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_context_get_last_error **************************/
+// Status of the last *_with_context call, and the first error message it
+// reported (the most specific one) - an empty string if there was none.
+// The message belongs to the context and is overwritten by the next call.
+
+int icns_context_get_last_error(icns_context_t *context,int *errorOut,const char **messageOut)
+{
+	if(context == NULL)
+	{
+		icns_print_err("icns_context_get_last_error: icns context is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(errorOut != NULL)
+		*errorOut = context->lastError;
+
+	if(messageOut != NULL)
+		*messageOut = context->lastErrorMessage;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_context_set_png_options **************************/
+// Compression settings for png elements encoded while this context is current
+// (see icns_init_png_options). Pass NULL to go back to the defaults.
+
+int icns_context_set_png_options(icns_context_t *context,const icns_png_options_t *options)
+{
+	if(context == NULL)
+	{
+		icns_print_err("icns_context_set_png_options: icns context is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(options == NULL)
+	{
+		context->hasPngOptions = 0;
+		return ICNS_STATUS_OK;
+	}
+
+	if(options->compressionLevel < ICNS_PNG_COMPRESSION_DEFAULT || options->compressionLevel > 9)
+	{
+		icns_print_err("icns_context_set_png_options: Invalid compression level! (%d)\n",options->compressionLevel);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if((options->filterSet & ICNS_PNG_FILTER_ALL) == 0 || (options->filterSet & ~ICNS_PNG_FILTER_ALL) != 0)
+	{
+		icns_print_err("icns_context_set_png_options: Invalid filter set! (0x%02X)\n",options->filterSet);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(options->zlibStrategy < ICNS_PNG_STRATEGY_DEFAULT || options->zlibStrategy > ICNS_PNG_STRATEGY_FIXED)
+	{
+		icns_print_err("icns_context_set_png_options: Invalid zlib strategy! (%d)\n",options->zlibStrategy);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	context->pngOptions = *options;
+	context->hasPngOptions = 1;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_context_set_allocator **************************/
+// Memory for calls made while this context is current comes from allocator
+// (see icns_get_arena_allocator). Pass NULL to go back to the process-wide
+// allocator. Anything allocated has to be freed with the same context
+// current, so don't swap allocators while families or images are still live.
+
+int icns_context_set_allocator(icns_context_t *context,const icns_allocator_t *allocator)
+{
+	int	error = ICNS_STATUS_OK;
+
+	if(context == NULL)
+	{
+		icns_print_err("icns_context_set_allocator: icns context is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(allocator == NULL)
+	{
+		context->hasAllocator = 0;
+		return ICNS_STATUS_OK;
+	}
+
+	error = icns_check_allocator("icns_context_set_allocator",allocator);
+	if(error)
+		return error;
+
+	context->allocator = *allocator;
+	context->hasAllocator = 1;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_set_current_context **************************/
+// Makes context current for the calling thread until changed again, for
+// callers that would rather not use the *_with_context variants. Pass NULL
+// to go back to the process-wide icns_set_print_errors setting.
+// Returns the previously current context.
+
+icns_context_t *icns_set_current_context(icns_context_t *context)
+{
+	icns_context_t	*previousContext = gCurrentContext;
+
+	gCurrentContext = context;
+
+	return previousContext;
+}
+
+/***************************** icns_context_report_err **************************/
+// Hands a formatted message to the current context. Returns 1 if the context
+// took care of it, 0 if there is no current context.
+
+int icns_context_report_err(const char *message)
+{
+	icns_context_t	*context = gCurrentContext;
+
+	if(context == NULL)
+		return 0;
+
+	if(context->lastErrorMessage[0] == 0)
+	{
+		strncpy(context->lastErrorMessage,message,ICNS_ERROR_MESSAGE_SIZE-1);
+		context->lastErrorMessage[ICNS_ERROR_MESSAGE_SIZE-1] = 0;
+	}
+
+	if(context->errorCallback != NULL)
+		context->errorCallback(context,message,context->errorUserData);
+
+	if(context->printErrors)
+		fprintf(stderr,"libicns: %s",message);
+
+	return 1;
+}
+
+/***************************** icns_context_get_png_options **************************/
+// The png options of the current context, or NULL for the defaults
+
+const icns_png_options_t *icns_context_get_png_options(void)
+{
+	icns_context_t	*context = gCurrentContext;
+
+	if(context == NULL || !context->hasPngOptions)
+		return NULL;
+
+	return &context->pngOptions;
+}
+
+/***************************** icns_context_get_allocator **************************/
+// The allocator of the current context, or NULL if it has none
+
+const icns_allocator_t *icns_context_get_allocator(void)
+{
+	icns_context_t	*context = gCurrentContext;
+
+	if(context == NULL || !context->hasAllocator)
+		return NULL;
+
+	return &context->allocator;
+}
+
+/***************************** context call helpers **************************/
+
+static icns_context_t *icns_enter_context(icns_context_t *context)
+{
+	icns_context_t	*previousContext = gCurrentContext;
+
+	if(context != NULL)
+	{
+		context->lastError = ICNS_STATUS_OK;
+		context->lastErrorMessage[0] = 0;
+		gCurrentContext = context;
+	}
+
+	return previousContext;
+}
+
+static int icns_leave_context(icns_context_t *context,icns_context_t *previousContext,int error)
+{
+	if(context != NULL)
+		context->lastError = error;
+
+	gCurrentContext = previousContext;
+
+	return error;
+}
+
+/***************************** context variants **************************/
+// Same as the functions they are named after, reporting errors to context
+
+int icns_read_family_from_file_with_context(icns_context_t *context,FILE *dataFile,icns_family_t **iconFamilyOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_read_family_from_file(dataFile,iconFamilyOut));
+}
+
+int icns_write_family_to_file_with_context(icns_context_t *context,FILE *dataFile,icns_family_t *iconFamilyIn)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_write_family_to_file(dataFile,iconFamilyIn));
+}
+
+int icns_import_family_data_with_context(icns_context_t *context,icns_size_t dataSize,icns_byte_t *data,icns_family_t **iconFamilyOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_import_family_data(dataSize,data,iconFamilyOut));
+}
+
+int icns_export_family_data_with_context(icns_context_t *context,icns_family_t *iconFamily,icns_size_t *dataSizeOut,icns_byte_t **dataPtrOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_export_family_data(iconFamily,dataSizeOut,dataPtrOut));
+}
+
+int icns_read_element_from_fd_with_context(icns_context_t *context,int fd,icns_type_t iconType,icns_element_t **iconElementOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_read_element_from_fd(fd,iconType,iconElementOut));
+}
+
+int icns_get_element_from_family_with_context(icns_context_t *context,icns_family_t *iconFamily,icns_type_t iconType,icns_element_t **iconElementOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_get_element_from_family(iconFamily,iconType,iconElementOut));
+}
+
+int icns_peek_element_in_family_with_context(icns_context_t *context,icns_family_t *iconFamily,icns_type_t iconType,icns_element_view_t *elementViewOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_peek_element_in_family(iconFamily,iconType,elementViewOut));
+}
+
+int icns_set_element_in_family_with_context(icns_context_t *context,icns_family_t **iconFamilyRef,icns_element_t *newIconElement)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_set_element_in_family(iconFamilyRef,newIconElement));
+}
+
+int icns_remove_element_in_family_with_context(icns_context_t *context,icns_family_t **iconFamilyRef,icns_type_t iconType)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_remove_element_in_family(iconFamilyRef,iconType));
+}
+
+int icns_new_element_from_image_with_context(icns_context_t *context,icns_image_t *imageIn,icns_type_t iconType,icns_element_t **iconElementOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_new_element_from_image(imageIn,iconType,iconElementOut));
+}
+
+int icns_new_element_from_mask_with_context(icns_context_t *context,icns_image_t *imageIn,icns_type_t iconType,icns_element_t **iconElementOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_new_element_from_mask(imageIn,iconType,iconElementOut));
+}
+
+int icns_get_image32_with_mask_from_family_with_context(icns_context_t *context,icns_family_t *iconFamily,icns_type_t iconType,icns_image_t *imageOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_get_image32_with_mask_from_family(iconFamily,iconType,imageOut));
+}
+
+int icns_get_image_from_element_with_context(icns_context_t *context,icns_element_t *iconElement,icns_image_t *imageOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_get_image_from_element(iconElement,imageOut));
+}
+
+int icns_get_mask_from_element_with_context(icns_context_t *context,icns_element_t *iconElement,icns_image_t *imageOut)
+{
+	icns_context_t	*previousContext = icns_enter_context(context);
+	return icns_leave_context(context,previousContext,icns_get_mask_from_element(iconElement,imageOut));
+}
@@ -34,14 +34,16 @@ Boston, MA 02110-1301, USA.
 
 int icns_get_element_from_family(icns_family_t *iconFamily,icns_type_t iconType,icns_element_t **iconElementOut)
 {
-	int		error = ICNS_STATUS_OK;
-	int		foundData = 0;
-	icns_type_t	iconFamilyType = ICNS_NULL_TYPE;
-	icns_size_t	iconFamilySize = 0;
-	icns_element_t	*iconElement = NULL;
-	icns_type_t	elementType = ICNS_NULL_TYPE;
-	icns_size_t	elementSize = 0;
-	icns_uint32_t	dataOffset = 0;
+	return icns_get_element_from_indexed_family(iconFamily,NULL,iconType,iconElementOut);
+}
+
+//***************************** icns_get_element_from_indexed_family **************************//
+// Same as icns_get_element_from_family, using familyIndex (if not NULL) to find the element
+
+int icns_get_element_from_indexed_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_element_t **iconElementOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_element_entry_t	elementEntry;
 
 	if(iconFamily == NULL)
 	{
@@ -65,27 +67,229 @@ int icns_get_element_from_family(icns_family_t *iconFamily,icns_type_t iconType,
 		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	ICNS_READ_UNALIGNED(iconFamilyType, &(iconFamily->resourceType),sizeof( icns_type_t));
-	ICNS_READ_UNALIGNED(iconFamilySize, &(iconFamily->resourceSize),sizeof( icns_size_t));
-
 	#ifdef ICNS_DEBUG
 	{
 		char typeStr[5];
 		printf("Looking for icon element of type: '%s'\n",icns_type_str(iconType,typeStr));
-		printf("  icon family type check: '%s'\n",icns_type_str(iconFamilyType,typeStr));
-		printf("  icon family size check: %d\n",iconFamilySize);
 	}
 	#endif
 
+	error = icns_find_element_in_family(iconFamily,familyIndex,iconType,&elementEntry);
+
+	if(error == ICNS_STATUS_DATA_NOT_FOUND)
+	{
+		icns_print_err("icns_get_element_from_family: Unable to find requested icon data!\n");
+		return error;
+	}
+	else if(error != ICNS_STATUS_OK)
+	{
+		return error;
+	}
+
+	*iconElementOut = icns_malloc(elementEntry.elementSize);
+	if(*iconElementOut == NULL)
+	{
+		icns_print_err("icns_get_element_from_family: Unable to allocate memory block of size: %d!\n",elementEntry.elementSize);
+		return ICNS_STATUS_NO_MEMORY;
+	}
+	memcpy( *iconElementOut, ((icns_byte_t*)iconFamily)+elementEntry.elementOffset, elementEntry.elementSize);
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** icns_peek_element_in_family **************************//
+// Looks up an element without copying it - elementViewOut borrows from iconFamily.
+// The view is only valid until iconFamily is freed or modified in any way
+// (set/add/remove may move the whole family), so callers that need the data
+// any longer than that should use icns_get_element_from_family instead.
+
+int icns_peek_element_in_family(icns_family_t *iconFamily,icns_type_t iconType,icns_element_view_t *elementViewOut)
+{
+	return icns_peek_element_in_indexed_family(iconFamily,NULL,iconType,elementViewOut);
+}
+
+//***************************** icns_peek_element_in_indexed_family **************************//
+// Same as icns_peek_element_in_family, using familyIndex (if not NULL) to find the element
+
+int icns_peek_element_in_indexed_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_element_view_t *elementViewOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_element_entry_t	elementEntry;
+
+	if(iconFamily == NULL)
+	{
+		icns_print_err("icns_peek_element_in_family: icns family is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(elementViewOut == NULL)
+	{
+		icns_print_err("icns_peek_element_in_family: icns element view out is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+	else
+	{
+		memset(elementViewOut,0,sizeof(icns_element_view_t));
+	}
+
+	if(iconFamily->resourceType != ICNS_FAMILY_TYPE)
+	{
+		icns_print_err("icns_peek_element_in_family: Invalid icns family!\n");
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	error = icns_find_element_in_family(iconFamily,familyIndex,iconType,&elementEntry);
+
+	if(error == ICNS_STATUS_DATA_NOT_FOUND)
+	{
+		icns_print_err("icns_peek_element_in_family: Unable to find requested icon data!\n");
+		return error;
+	}
+	else if(error != ICNS_STATUS_OK)
+	{
+		return error;
+	}
+
+	icns_fill_view_from_element((icns_element_t *)(((icns_byte_t*)iconFamily)+elementEntry.elementOffset),elementViewOut);
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** icns_peek_png_data_in_family **************************//
+// Finds the png stream stored in a png/jp2 type element (ic08, ic09, ic10, ...)
+// so it can be written out without decoding it. Like icns_peek_element_in_family,
+// pngDataOut borrows from iconFamily. Meant to be tried before decoding, so it
+// doesn't print an error when there is nothing to peek at: it returns
+// ICNS_STATUS_DATA_NOT_FOUND when the family has no such element, and
+// ICNS_STATUS_UNSUPPORTED when the element does not hold png data.
+
+int icns_peek_png_data_in_family(icns_family_t *iconFamily,icns_type_t iconType,icns_size_t *pngSizeOut,const icns_byte_t **pngDataOut)
+{
+	return icns_peek_png_data_in_indexed_family(iconFamily,NULL,iconType,pngSizeOut,pngDataOut);
+}
+
+//***************************** icns_peek_png_data_in_indexed_family **************************//
+// Same as icns_peek_png_data_in_family, using familyIndex (if not NULL) to find the element
+
+int icns_peek_png_data_in_indexed_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_size_t *pngSizeOut,const icns_byte_t **pngDataOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_element_entry_t	elementEntry;
+	icns_element_view_t	elementView;
+	const icns_byte_t	magicPNG[8] = {0x89,0x50,0x4E,0x47,0x0D,0x0A,0x1A,0x0A};
+
+	if(pngSizeOut == NULL || pngDataOut == NULL)
+	{
+		icns_print_err("icns_peek_png_data_in_family: png data out is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	*pngSizeOut = 0;
+	*pngDataOut = NULL;
+
+	if(iconFamily == NULL)
+	{
+		icns_print_err("icns_peek_png_data_in_family: icns family is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(iconFamily->resourceType != ICNS_FAMILY_TYPE)
+	{
+		icns_print_err("icns_peek_png_data_in_family: Invalid icns family!\n");
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	switch(iconType)
+	{
+	case ICNS_512x512_2X_32BIT_ARGB_DATA:
+	case ICNS_256x256_2X_32BIT_ARGB_DATA:
+	case ICNS_128x128_2X_32BIT_ARGB_DATA:
+	case ICNS_32x32_2X_32BIT_ARGB_DATA:
+	case ICNS_16x16_2X_32BIT_ARGB_DATA:
+	//case ICNS_1024x1024_32BIT_ARGB_DATA:
+	case ICNS_256x256_32BIT_ARGB_DATA:
+	case ICNS_512x512_32BIT_ARGB_DATA:
+		break;
+	default:
+		return ICNS_STATUS_UNSUPPORTED;
+	}
+
+	// Not icns_peek_element_in_indexed_family - a missing element is no error here
+	error = icns_find_element_in_family(iconFamily,familyIndex,iconType,&elementEntry);
+	if(error)
+		return error;
+
+	icns_fill_view_from_element((icns_element_t *)(((icns_byte_t*)iconFamily)+elementEntry.elementOffset),&elementView);
+
+	// jp2 data, or too short to be png
+	if(elementView.dataSize < 8 || memcmp(elementView.elementData,magicPNG,8) != 0)
+		return ICNS_STATUS_UNSUPPORTED;
+
+	*pngSizeOut = elementView.dataSize;
+	*pngDataOut = elementView.elementData;
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** icns_find_element_in_family **************************//
+// Locates the first element of iconType in the family without copying anything.
+// Uses familyIndex when given (rebuilding it if the family has changed under it),
+// otherwise walks the element chain.
+
+int icns_find_element_in_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_element_entry_t *elementEntryOut)
+{
+	icns_size_t	iconFamilySize = 0;
+	icns_element_t	*iconElement = NULL;
+	icns_type_t	elementType = ICNS_NULL_TYPE;
+	icns_size_t	elementSize = 0;
+	icns_uint32_t	dataOffset = 0;
+
+	ICNS_READ_UNALIGNED(iconFamilySize, &(iconFamily->resourceSize),sizeof( icns_size_t));
+
+	if(familyIndex != NULL)
+	{
+		int			error = ICNS_STATUS_OK;
+		int			attempt = 0;
+		icns_element_entry_t	*indexEntry = NULL;
+
+		for(attempt = 0; attempt < 2; attempt++)
+		{
+			if( (attempt > 0) || (familyIndex->iconFamily != iconFamily) || (familyIndex->familySize != iconFamilySize) )
+			{
+				if((error = icns_update_family_index(familyIndex,iconFamily)) != ICNS_STATUS_OK)
+					return error;
+			}
+
+			indexEntry = icns_lookup_family_index(familyIndex,iconType);
+
+			if(indexEntry == NULL)
+				return ICNS_STATUS_DATA_NOT_FOUND;
+
+			// Make sure the family wasn't edited in place behind our back
+			iconElement = ((icns_element_t*)(((icns_byte_t*)iconFamily)+indexEntry->elementOffset));
+			ICNS_READ_UNALIGNED(elementType, &(iconElement->elementType),sizeof( icns_type_t));
+			ICNS_READ_UNALIGNED(elementSize, &(iconElement->elementSize),sizeof( icns_size_t));
+
+			if( (elementType == indexEntry->elementType) && (elementSize == indexEntry->elementSize) )
+			{
+				*elementEntryOut = *indexEntry;
+				return ICNS_STATUS_OK;
+			}
+		}
+
+		icns_print_err("icns_find_element_in_family: Corrupted icns family!\n");
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
 	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
 
-	while ( (foundData == 0) && (dataOffset < iconFamilySize) )
+	while ( dataOffset < (icns_uint32_t)iconFamilySize )
 	{
 		iconElement = ((icns_element_t*)(((icns_byte_t*)iconFamily)+dataOffset));
 
-		if( iconFamilySize < (dataOffset+sizeof(icns_type_t)+sizeof(icns_size_t)) )
+		if( (icns_uint32_t)iconFamilySize < (dataOffset+sizeof(icns_type_t)+sizeof(icns_size_t)) )
 		{
-			icns_print_err("icns_get_element_from_family: Corrupted icns family!\n");
+			icns_print_err("icns_find_element_in_family: Corrupted icns family!\n");
 			return ICNS_STATUS_INVALID_DATA;
 		}
 
@@ -101,35 +305,102 @@ int icns_get_element_from_family(icns_family_t *iconFamily,icns_type_t iconType,
 		}
 		#endif
 
-		if( (elementSize < 8) || ((dataOffset+elementSize) > iconFamilySize) )
+		if( (elementSize < 8) || ((dataOffset+elementSize) > (icns_uint32_t)iconFamilySize) )
 		{
-			icns_print_err("icns_get_element_from_family: Invalid element size! (%d)\n",elementSize);
+			icns_print_err("icns_find_element_in_family: Invalid element size! (%d)\n",elementSize);
 			return ICNS_STATUS_INVALID_DATA;
 		}
 
 		if(elementType == iconType)
-			foundData = 1;
-		else
-			dataOffset += elementSize;
+		{
+			elementEntryOut->elementType = elementType;
+			elementEntryOut->elementSize = elementSize;
+			elementEntryOut->elementOffset = dataOffset;
+			return ICNS_STATUS_OK;
+		}
+
+		dataOffset += elementSize;
 	}
 
-	if(foundData)
+	return ICNS_STATUS_DATA_NOT_FOUND;
+}
+
+//***************************** icns_fill_view_from_element **************************//
+// Describes an in-memory element (native endian header) as a read-only view
+
+void icns_fill_view_from_element(icns_element_t *iconElement,icns_element_view_t *elementViewOut)
+{
+	icns_type_t	elementType = ICNS_NULL_TYPE;
+	icns_size_t	elementSize = 0;
+
+	ICNS_READ_UNALIGNED(elementType, &(iconElement->elementType),sizeof( icns_type_t));
+	ICNS_READ_UNALIGNED(elementSize, &(iconElement->elementSize),sizeof( icns_size_t));
+
+	elementViewOut->elementType = elementType;
+	elementViewOut->elementSize = elementSize;
+	elementViewOut->dataSize = elementSize - sizeof(icns_type_t) - sizeof(icns_size_t);
+	elementViewOut->elementData = &(iconElement->elementData[0]);
+}
+
+//***************************** icns_splice_family **************************//
+// Replaces oldSize bytes at dataOffset with newSize bytes of newData (NULL to
+// just remove), growing or shrinking the family in place with realloc.
+// The caller must make sure newData does not point into the family itself.
+
+static int icns_splice_family(icns_family_t **iconFamilyRef,icns_uint32_t dataOffset,icns_size_t oldSize,const icns_byte_t *newData,icns_size_t newSize)
+{
+	icns_family_t	*iconFamily = *iconFamilyRef;
+	icns_size_t	iconFamilySize = 0;
+	icns_size_t	newIconFamilySize = 0;
+	icns_uint32_t	tailOffset = 0;
+	icns_uint32_t	tailSize = 0;
+
+	ICNS_READ_UNALIGNED(iconFamilySize, &(iconFamily->resourceSize),sizeof( icns_size_t));
+
+	newIconFamilySize = iconFamilySize - oldSize + newSize;
+	tailOffset = dataOffset + oldSize;
+	tailSize = iconFamilySize - tailOffset;
+
+	#ifdef ICNS_DEBUG
+	printf("  new family size: %d (0x%08X)\n",(int)newIconFamilySize,newIconFamilySize);
+	#endif
+
+	// Grow first, so the tail has somewhere to go
+	if(newSize > oldSize)
 	{
-		*iconElementOut = malloc(elementSize);
-		if(*iconElementOut == NULL)
+		icns_family_t	*newIconFamily = NULL;
+
+		newIconFamily = (icns_family_t *)icns_realloc(iconFamily,iconFamilySize,newIconFamilySize);
+		if(newIconFamily == NULL)
 		{
-			icns_print_err("icns_get_element_from_family: Unable to allocate memory block of size: %d!\n",elementSize);
+			icns_print_err("icns_splice_family: Unable to allocate memory block of size: %d!\n",newIconFamilySize);
 			return ICNS_STATUS_NO_MEMORY;
 		}
-		memcpy( *iconElementOut, iconElement, elementSize);
+		iconFamily = newIconFamily;
 	}
-	else
+
+	if(tailSize > 0 && newSize != oldSize)
+		memmove( ((icns_byte_t *)iconFamily)+dataOffset+newSize, ((icns_byte_t *)iconFamily)+tailOffset, tailSize);
+
+	if(newData != NULL)
+		memcpy( ((icns_byte_t *)iconFamily)+dataOffset, newData, newSize);
+
+	// ...and shrink last, once the tail has moved down
+	if(newSize < oldSize)
 	{
-		icns_print_err("icns_get_element_from_family: Unable to find requested icon data!\n");
-		error = ICNS_STATUS_DATA_NOT_FOUND;
+		icns_family_t	*newIconFamily = NULL;
+
+		newIconFamily = (icns_family_t *)icns_realloc(iconFamily,iconFamilySize,newIconFamilySize);
+		// A failed shrink just leaves some slack at the end
+		if(newIconFamily != NULL)
+			iconFamily = newIconFamily;
 	}
 
-	return error;
+	ICNS_WRITE_UNALIGNED(&(iconFamily->resourceSize), newIconFamilySize, sizeof(icns_size_t));
+
+	*iconFamilyRef = iconFamily;
+
+	return ICNS_STATUS_OK;
 }
 
 //***************************** icns_set_element_in_family **************************//
@@ -137,24 +408,25 @@ int icns_get_element_from_family(icns_family_t *iconFamily,icns_type_t iconType,
 
 int icns_set_element_in_family(icns_family_t **iconFamilyRef,icns_element_t *newIconElement)
 {
-	int		error = ICNS_STATUS_OK;
-	int		foundData = 0;
-	int		copiedData = 0;
-	icns_family_t	*iconFamily = NULL;
-	icns_type_t	iconFamilyType = ICNS_NULL_TYPE;
-	icns_size_t	iconFamilySize = 0;
-	icns_element_t	*iconElement = NULL;
-	icns_type_t	newElementType = ICNS_NULL_TYPE;
-	icns_size_t	newElementSize = 0;
-	icns_type_t	elementType = ICNS_NULL_TYPE;
-	icns_size_t	elementSize = 0;
-	icns_uint32_t	dataOffset = 0;
-	icns_size_t	newIconFamilySize = 0;
-	icns_family_t	*newIconFamily = NULL;
-	icns_uint32_t	newDataOffset = 0;
-	icns_uint32_t	elementOrder = 0;
-	icns_uint32_t   newElementOrder = 0;
+	return icns_set_element_in_indexed_family(iconFamilyRef,NULL,newIconElement);
+}
+
+//***************************** icns_set_element_in_indexed_family **************************//
+// Same as icns_set_element_in_family, keeping familyIndex (if not NULL) up to date
 
+int icns_set_element_in_indexed_family(icns_family_t **iconFamilyRef,icns_family_index_t *familyIndex,icns_element_t *newIconElement)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_family_t		*iconFamily = NULL;
+	icns_type_t		iconFamilyType = ICNS_NULL_TYPE;
+	icns_size_t		iconFamilySize = 0;
+	icns_type_t		newElementType = ICNS_NULL_TYPE;
+	icns_size_t		newElementSize = 0;
+	icns_element_entry_t	elementEntry;
+	icns_uint32_t		dataOffset = 0;
+	icns_size_t		oldElementSize = 0;
+	icns_byte_t		*newElementCopy = NULL;
+	ICNS_STATS_SCOPE(ICNS_STATS_SET_ELEMENT,newIconElement ? newIconElement->elementSize : 0);
 
 	if(iconFamilyRef == NULL)
 	{
@@ -174,15 +446,15 @@ int icns_set_element_in_family(icns_family_t **iconFamilyRef,icns_element_t *new
 	printf("Setting element in icon family...\n");
 	#endif
 
-	if(iconFamily->resourceType != ICNS_FAMILY_TYPE)
+	ICNS_READ_UNALIGNED(iconFamilyType, &(iconFamily->resourceType),sizeof( icns_type_t));
+	ICNS_READ_UNALIGNED(iconFamilySize, &(iconFamily->resourceSize),sizeof( icns_size_t));
+
+	if(iconFamilyType != ICNS_FAMILY_TYPE)
 	{
 		icns_print_err("icns_set_element_in_family: Invalid icns family!\n");
-		error = ICNS_STATUS_INVALID_DATA;
+		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	ICNS_READ_UNALIGNED(iconFamilyType, &(iconFamily->resourceType),sizeof( icns_type_t));
-	ICNS_READ_UNALIGNED(iconFamilySize, &(iconFamily->resourceSize),sizeof( icns_size_t));
-
 	#ifdef ICNS_DEBUG
 	{
 		char typeStr[5];
@@ -209,88 +481,69 @@ int icns_set_element_in_family(icns_family_t **iconFamilyRef,icns_element_t *new
 	}
 	#endif
 
-	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
-
-	while ( (foundData == 0) && (dataOffset < iconFamilySize) )
+	if(newElementSize < 8)
 	{
-		iconElement = ((icns_element_t*)(((char*)iconFamily)+dataOffset));
-		ICNS_READ_UNALIGNED(elementType, &(iconElement->elementType),sizeof( icns_type_t));
-		ICNS_READ_UNALIGNED(elementSize, &(iconElement->elementSize),sizeof( icns_size_t));
-
-		if(elementType == newElementType)
-			foundData = 1;
-		else
-			dataOffset += elementSize;
+		icns_print_err("icns_set_element_in_family: Invalid element size! (%d)\n",newElementSize);
+		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	if(foundData)
-		newIconFamilySize = iconFamilySize - elementSize + newElementSize;
-	else
-		newIconFamilySize = iconFamilySize + newElementSize;
-
-	#ifdef ICNS_DEBUG
-	printf("  new family type 'icns'\n");
-	printf("  new family size: %d (0x%08X)\n",(int)newIconFamilySize,newIconFamilySize);
-	#endif
-
-	newIconFamily = malloc(newIconFamilySize);
+	error = icns_find_element_in_family(iconFamily,familyIndex,newElementType,&elementEntry);
 
-	if(newIconFamily == NULL)
+	if(error == ICNS_STATUS_OK)
 	{
-		icns_print_err("icns_set_element_in_family: Unable to allocate memory block of size: %d!\n",newIconFamilySize);
-		return ICNS_STATUS_NO_MEMORY;
+		// Replace the existing element where it stands
+		dataOffset = elementEntry.elementOffset;
+		oldElementSize = elementEntry.elementSize;
 	}
+	else if(error == ICNS_STATUS_DATA_NOT_FOUND)
+	{
+		icns_uint32_t	newElementOrder = icns_get_element_order(newElementType);
 
-	newIconFamily->resourceType = ICNS_FAMILY_TYPE;
-	newIconFamily->resourceSize = newIconFamilySize;
-
-	newDataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
-	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
-
-	copiedData = 0;
+		// Insert ahead of the first element that sorts after the new one
+		dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
 
-	newElementOrder = icns_get_element_order(newElementType);
+		while ( dataOffset < (icns_uint32_t)iconFamilySize )
+		{
+			icns_element_t	*iconElement = ((icns_element_t*)(((icns_byte_t*)iconFamily)+dataOffset));
+			icns_type_t	elementType = ICNS_NULL_TYPE;
+			icns_size_t	elementSize = 0;
 
-	while ( dataOffset < iconFamilySize )
-	{
-		iconElement = ((icns_element_t*)(((char*)iconFamily)+dataOffset));
-		ICNS_READ_UNALIGNED(elementType, &(iconElement->elementType),sizeof( icns_type_t));
-		ICNS_READ_UNALIGNED(elementSize, &(iconElement->elementSize),sizeof( icns_size_t));
-		elementOrder = icns_get_element_order(elementType);
+			ICNS_READ_UNALIGNED(elementType, &(iconElement->elementType),sizeof( icns_type_t));
+			ICNS_READ_UNALIGNED(elementSize, &(iconElement->elementSize),sizeof( icns_size_t));
 
-		if(!copiedData && (elementType == newElementType))
-		{
-			memcpy( ((char *)(newIconFamily))+newDataOffset , (char *)newIconElement, newElementSize);
-			newDataOffset += newElementSize;
-			copiedData = 1;
-		}
-		else if(!copiedData && !foundData && newElementOrder < elementOrder)
-		{
-			memcpy( ((char *)(newIconFamily))+newDataOffset , (char *)newIconElement, newElementSize);
-			newDataOffset += newElementSize;
-			copiedData = 1;
+			if(newElementOrder < icns_get_element_order(elementType))
+				break;
 
-			memcpy( ((char *)(newIconFamily))+newDataOffset , ((char *)(iconFamily))+dataOffset, elementSize);
-			newDataOffset += elementSize;
-		}
-		else
-		{
-			memcpy( ((char *)(newIconFamily))+newDataOffset , ((char *)(iconFamily))+dataOffset, elementSize);
-			newDataOffset += elementSize;
+			dataOffset += elementSize;
 		}
 
-		dataOffset += elementSize;
+		oldElementSize = 0;
+		error = ICNS_STATUS_OK;
+	}
+	else
+	{
+		return error;
 	}
 
-	if(!copiedData)
+	// The new element may live inside the family we're about to move around
+	if( ((icns_byte_t *)newIconElement >= (icns_byte_t *)iconFamily) && ((icns_byte_t *)newIconElement < ((icns_byte_t *)iconFamily)+iconFamilySize) )
 	{
-		memcpy( ((char *)(newIconFamily))+newDataOffset , (char *)newIconElement, newElementSize);
-		newDataOffset += newElementSize;
+		newElementCopy = (icns_byte_t *)icns_malloc(newElementSize);
+		if(newElementCopy == NULL)
+		{
+			icns_print_err("icns_set_element_in_family: Unable to allocate memory block of size: %d!\n",newElementSize);
+			return ICNS_STATUS_NO_MEMORY;
+		}
+		memcpy(newElementCopy,newIconElement,newElementSize);
 	}
 
-	*iconFamilyRef = newIconFamily;
+	error = icns_splice_family(iconFamilyRef,dataOffset,oldElementSize,(newElementCopy != NULL) ? newElementCopy : (icns_byte_t *)newIconElement,newElementSize);
 
-	free(iconFamily);
+	if(newElementCopy != NULL)
+		icns_free(newElementCopy);
+
+	if( (error == ICNS_STATUS_OK) && (familyIndex != NULL) )
+		error = icns_update_family_index(familyIndex,*iconFamilyRef);
 
 	return error;
 }
@@ -321,15 +574,18 @@ int icns_add_element_in_family(icns_family_t **iconFamilyRef,icns_element_t *new
 
 int icns_remove_element_in_family(icns_family_t **iconFamilyRef,icns_type_t iconElementType)
 {
-	int		error = ICNS_STATUS_OK;
-	int		foundData = 0;
-	icns_family_t	*iconFamily = NULL;
-	icns_type_t	iconFamilyType = ICNS_NULL_TYPE;
-	icns_size_t	iconFamilySize = 0;
-	icns_element_t	*iconElement = NULL;
-	icns_type_t	elementType = ICNS_NULL_TYPE;
-	icns_size_t	elementSize = 0;
-	icns_uint32_t	dataOffset = 0;
+	return icns_remove_element_in_indexed_family(iconFamilyRef,NULL,iconElementType);
+}
+
+//***************************** icns_remove_element_in_indexed_family **************************//
+// Same as icns_remove_element_in_family, keeping familyIndex (if not NULL) up to date
+
+int icns_remove_element_in_indexed_family(icns_family_t **iconFamilyRef,icns_family_index_t *familyIndex,icns_type_t iconElementType)
+{
+	int			error = ICNS_STATUS_OK;
+	int			removedCount = 0;
+	icns_family_t		*iconFamily = NULL;
+	icns_element_entry_t	elementEntry;
 
 	if(iconFamilyRef == NULL)
 	{
@@ -348,75 +604,34 @@ int icns_remove_element_in_family(icns_family_t **iconFamilyRef,icns_type_t icon
 	if(iconFamily->resourceType != ICNS_FAMILY_TYPE)
 	{
 		icns_print_err("icns_remove_element_in_family: Invalid icon family!\n");
-		error = ICNS_STATUS_INVALID_DATA;
+		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	ICNS_READ_UNALIGNED(iconFamilyType, &(iconFamily->resourceType),sizeof( icns_type_t));
-	ICNS_READ_UNALIGNED(iconFamilySize, &(iconFamily->resourceSize),sizeof( icns_size_t));
-
-	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
-
-	while ( (foundData == 0) && (dataOffset < iconFamilySize) )
+	// Remove every element of the type, in case the family holds duplicates
+	while( (error = icns_find_element_in_family(*iconFamilyRef,familyIndex,iconElementType,&elementEntry)) == ICNS_STATUS_OK )
 	{
-		iconElement = ((icns_element_t*)(((char*)iconFamily)+dataOffset));
-		ICNS_READ_UNALIGNED(elementType, &(iconElement->elementType),sizeof( icns_type_t));
-		ICNS_READ_UNALIGNED(elementSize, &(iconElement->elementSize),sizeof( icns_size_t));
-
-		if(elementType == iconElementType)
-			foundData = 1;
-		else
-			dataOffset += elementSize;
+		error = icns_splice_family(iconFamilyRef,elementEntry.elementOffset,elementEntry.elementSize,NULL,0);
+		if(error != ICNS_STATUS_OK)
+			return error;
+		removedCount++;
 	}
 
-	if(!foundData)
+	if(error != ICNS_STATUS_DATA_NOT_FOUND)
+		return error;
+
+	if(removedCount == 0)
 	{
 		icns_print_err("icns_remove_element_in_family: Unable to find requested icon data for removal!\n");
 		return ICNS_STATUS_DATA_NOT_FOUND;
 	}
 
-	icns_size_t	newIconFamilySize = 0;
-	icns_family_t	*newIconFamily = NULL;
-	icns_uint32_t	newDataOffset = 0;
-
-	newIconFamilySize = iconFamilySize - elementSize;
-	newIconFamily = malloc(newIconFamilySize);
-
-	if(newIconFamily == NULL)
-	{
-		icns_print_err("icns_remove_element_in_family: Unable to allocate memory block of size: %d!\n",newIconFamilySize);
-		return ICNS_STATUS_NO_MEMORY;
-	}
-
-	newIconFamily->resourceType = ICNS_FAMILY_TYPE;
-	newIconFamily->resourceSize = newIconFamilySize;
-
-	newDataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
-	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
-
-	while ( dataOffset < iconFamilySize )
-	{
-		iconElement = ((icns_element_t*)(((char*)iconFamily)+dataOffset));
-		ICNS_READ_UNALIGNED(elementType, &(iconElement->elementType),sizeof( icns_type_t));
-		ICNS_READ_UNALIGNED(elementSize, &(iconElement->elementSize),sizeof( icns_size_t));
+	if(familyIndex != NULL)
+		return icns_update_family_index(familyIndex,*iconFamilyRef);
 
-		if(elementType != iconElementType)
-		{
-			memcpy( ((char *)(newIconFamily))+newDataOffset , ((char *)(iconFamily))+dataOffset, elementSize);
-			newDataOffset += elementSize;
-		}
-
-		dataOffset += elementSize;
-	}
-
-	*iconFamilyRef = newIconFamily;
-
-	free(iconFamily);
-
-	return error;
+	return ICNS_STATUS_OK;
 }
 
 
-
 //***************************** icns_new_element_from_image **************************//
 // Creates a new icon element from an image
 int icns_new_element_from_image(icns_image_t *imageIn,icns_type_t iconType,icns_element_t **iconElementOut)
@@ -432,6 +647,83 @@ int icns_new_element_from_mask(icns_image_t *imageIn,icns_type_t iconType,icns_e
 }
 
 
+//***************************** icns_new_element_from_png_data **************************//
+// Creates a new png/jp2 type icon element that holds the png data as is,
+// without decoding and re-encoding it. Only the IHDR is checked: the png
+// must be 8-bit RGBA at the size of iconType.
+int icns_new_element_from_png_data(icns_type_t iconType,icns_size_t dataSize,icns_byte_t *dataPtr,icns_element_t **iconElementOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_element_t		*newElement = NULL;
+	icns_size_t		newElementSize = 0;
+	icns_icon_info_t	iconInfo;
+	icns_uint32_t		pngWidth = 0;
+	icns_uint32_t		pngHeight = 0;
+	icns_uint8_t		pngBitDepth = 0;
+	icns_uint8_t		pngColorType = 0;
+
+	if(iconElementOut == NULL)
+	{
+		icns_print_err("icns_new_element_from_png_data: Icon element reference is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	*iconElementOut = NULL;
+
+	switch(iconType)
+	{
+	case ICNS_512x512_2X_32BIT_ARGB_DATA:
+	case ICNS_256x256_2X_32BIT_ARGB_DATA:
+	case ICNS_128x128_2X_32BIT_ARGB_DATA:
+	case ICNS_32x32_2X_32BIT_ARGB_DATA:
+	case ICNS_16x16_2X_32BIT_ARGB_DATA:
+	//case ICNS_1024x1024_32BIT_ARGB_DATA:
+	case ICNS_256x256_32BIT_ARGB_DATA:
+	case ICNS_512x512_32BIT_ARGB_DATA:
+		break;
+	default:
+		{
+			char typeStr[5];
+			icns_print_err("icns_new_element_from_png_data: Type '%s' can not hold png data!\n",icns_type_str(iconType,typeStr));
+		}
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	error = icns_get_png_info(dataSize,dataPtr,&pngWidth,&pngHeight,&pngBitDepth,&pngColorType);
+	if(error)
+		return error;
+
+	iconInfo = icns_get_image_info_for_type(iconType);
+
+	if(pngWidth != iconInfo.iconWidth || pngHeight != iconInfo.iconHeight)
+	{
+		icns_print_err("icns_new_element_from_png_data: png is %dx%d, expected %dx%d!\n",pngWidth,pngHeight,iconInfo.iconWidth,iconInfo.iconHeight);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(pngBitDepth != 8 || pngColorType != ICNS_PNG_COLOR_TYPE_RGBA)
+	{
+		icns_print_err("icns_new_element_from_png_data: png must be 8-bit RGBA! (bit depth %d, color type %d)\n",pngBitDepth,pngColorType);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	newElementSize = sizeof(icns_type_t) + sizeof(icns_size_t) + dataSize;
+	newElement = (icns_element_t *)icns_malloc(newElementSize);
+	if(newElement == NULL)
+	{
+		icns_print_err("icns_new_element_from_png_data: Unable to allocate memory block of size: %d!\n",(int)newElementSize);
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	newElement->elementType = iconType;
+	newElement->elementSize = newElementSize;
+	memcpy(newElement->elementData,dataPtr,dataSize);
+
+	*iconElementOut = newElement;
+
+	return ICNS_STATUS_OK;
+}
+
 //***************************** icns_new_element_from_image_or_mask **************************//
 // Creates a new icon element from an image
 int icns_new_element_from_image_or_mask(icns_image_t *imageIn,icns_type_t iconType,icns_bool_t isMask,icns_element_t **iconElementOut)
@@ -450,7 +742,7 @@ int icns_new_element_from_image_or_mask(icns_image_t *imageIn,icns_type_t iconTy
 	}
 
 	newElementSize = sizeof(icns_type_t) + sizeof(icns_size_t);
-	newElement = (icns_element_t *)malloc(newElementSize);
+	newElement = (icns_element_t *)icns_malloc(newElementSize);
 	if(newElement == NULL)
 	{
 		icns_print_err("icns_new_element_with_image_or_mask: Unable to allocate memory block of size: %d!\n",(int)newElementSize);
@@ -572,7 +864,7 @@ int icns_update_element_with_image_or_mask(icns_image_t *imageIn,icns_bool_t isM
 	//case ICNS_1024x1024_32BIT_ARGB_DATA:
 	case ICNS_256x256_32BIT_ARGB_DATA:
 	case ICNS_512x512_32BIT_ARGB_DATA:
-		error = icns_image_to_png(imageIn,&newDataSize,&newDataPtr);
+		error = icns_image_to_png(imageIn,icns_context_get_png_options(),&newDataSize,&newDataPtr);
 		//error = icns_image_to_jp2(imageIn,&newDataSize,&newDataPtr);
 		imageDataSize = newDataSize;
 		imageDataPtr = newDataPtr;
@@ -611,7 +903,7 @@ int icns_update_element_with_image_or_mask(icns_image_t *imageIn,icns_bool_t isM
 			}
 
 			newDataSize = iconInfo.iconRawDataSize * 2;
-			newDataPtr = (icns_byte_t *)malloc(newDataSize);
+			newDataPtr = (icns_byte_t *)icns_malloc(newDataSize);
 			if(newDataPtr == NULL)
 			{
 				icns_print_err("icns_update_element_with_image_or_mask: Unable to allocate memory block of size: %d!\n",newDataSize);
@@ -698,7 +990,7 @@ int icns_update_element_with_image_or_mask(icns_image_t *imageIn,icns_bool_t isM
 		newElementSize = newElementHeaderSize + imageDataSize;
 		newElementType = iconType;
 
-		newElement = (icns_element_t *)malloc(newElementSize);
+		newElement = (icns_element_t *)icns_malloc(newElementSize);
 
 		if(newElement == NULL)
 		{
@@ -725,7 +1017,7 @@ int icns_update_element_with_image_or_mask(icns_image_t *imageIn,icns_bool_t isM
 
 		// Free the old element...
 		if(*iconElement != NULL)
-			free(*iconElement);
+			icns_free(*iconElement);
 
 		// and move the pointer to the new element
 		*iconElement = newElement;
@@ -736,7 +1028,7 @@ exception:
 	// We might have allocated new memory earlier...
 	if(newDataPtr != NULL)
 	{
-		free(newDataPtr);
+		icns_free(newDataPtr);
 		newDataPtr = NULL;
 	}
 
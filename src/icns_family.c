@@ -47,7 +47,7 @@ int icns_create_family(icns_family_t **iconFamilyOut)
 	iconFamilyType = ICNS_FAMILY_TYPE;
 	iconFamilySize = sizeof(icns_type_t) + sizeof(icns_size_t);
 
-	newIconFamily = malloc(iconFamilySize);
+	newIconFamily = icns_malloc(iconFamilySize);
 
 	if(newIconFamily == NULL)
 	{
@@ -109,3 +109,473 @@ int icns_count_elements_in_family(icns_family_t *iconFamily, icns_sint32_t *elem
 }
 
 
+
+/***************************** icns_new_family_index **************************/
+// Builds a type -> element location table for an icon family, so repeated
+// lookups don't have to walk the element chain. The index remembers which
+// family (and family size) it was built from, and quietly rebuilds itself
+// when handed a family that has changed since.
+
+int icns_new_family_index(icns_family_t *iconFamily,icns_family_index_t **familyIndexOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_family_index_t	*familyIndex = NULL;
+
+	if(iconFamily == NULL)
+	{
+		icns_print_err("icns_new_family_index: icns family is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(familyIndexOut == NULL)
+	{
+		icns_print_err("icns_new_family_index: icns family index ref is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	*familyIndexOut = NULL;
+
+	familyIndex = (icns_family_index_t *)icns_malloc(sizeof(icns_family_index_t));
+	if(familyIndex == NULL)
+	{
+		icns_print_err("icns_new_family_index: Unable to allocate memory block of size: %d!\n",(int)sizeof(icns_family_index_t));
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	memset(familyIndex,0,sizeof(icns_family_index_t));
+
+	error = icns_update_family_index(familyIndex,iconFamily);
+	if(error)
+	{
+		icns_free_family_index(familyIndex);
+		return error;
+	}
+
+	*familyIndexOut = familyIndex;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_free_family_index **************************/
+
+int icns_free_family_index(icns_family_index_t *familyIndex)
+{
+	if(familyIndex == NULL)
+	{
+		icns_print_err("icns_free_family_index: icns family index is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(familyIndex->slots != NULL)
+		icns_free(familyIndex->slots);
+
+	icns_free(familyIndex);
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_family_index_slot **************************/
+// Open addressing on the element type - slotCount is always a power of two
+
+static inline icns_uint32_t icns_family_index_slot(icns_family_index_t *familyIndex,icns_type_t iconType)
+{
+	return ((iconType * 0x9E3779B1U) >> 16) & (familyIndex->slotCount - 1);
+}
+
+/***************************** icns_update_family_index **************************/
+// (Re)builds the index for iconFamily
+
+int icns_update_family_index(icns_family_index_t *familyIndex,icns_family_t *iconFamily)
+{
+	icns_type_t	iconFamilyType = ICNS_NULL_TYPE;
+	icns_size_t	iconFamilySize = 0;
+	icns_uint32_t	dataOffset = 0;
+	icns_uint32_t	elementCount = 0;
+	icns_uint32_t	slotCount = 0;
+
+	// Forget the old family first, so a failure below can't leave stale entries behind
+	familyIndex->iconFamily = NULL;
+	familyIndex->familySize = 0;
+	familyIndex->entryCount = 0;
+
+	ICNS_READ_UNALIGNED(iconFamilyType, &(iconFamily->resourceType),sizeof( icns_type_t));
+	ICNS_READ_UNALIGNED(iconFamilySize, &(iconFamily->resourceSize),sizeof( icns_size_t));
+
+	if(iconFamilyType != ICNS_FAMILY_TYPE)
+	{
+		icns_print_err("icns_update_family_index: Invalid icns family!\n");
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	// First pass validates the chain and counts the elements
+	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
+
+	while( dataOffset < (icns_uint32_t)iconFamilySize )
+	{
+		icns_element_t	*iconElement = NULL;
+		icns_size_t	elementSize = 0;
+
+		if( (icns_uint32_t)iconFamilySize < (dataOffset+sizeof(icns_type_t)+sizeof(icns_size_t)) )
+		{
+			icns_print_err("icns_update_family_index: Corrupted icns family!\n");
+			return ICNS_STATUS_INVALID_DATA;
+		}
+
+		iconElement = ((icns_element_t*)(((icns_byte_t*)iconFamily)+dataOffset));
+		ICNS_READ_UNALIGNED(elementSize, &(iconElement->elementSize),sizeof( icns_size_t));
+
+		if( (elementSize < 8) || ((dataOffset+elementSize) > (icns_uint32_t)iconFamilySize) )
+		{
+			icns_print_err("icns_update_family_index: Invalid element size! (%d)\n",elementSize);
+			return ICNS_STATUS_INVALID_DATA;
+		}
+
+		elementCount++;
+		dataOffset += elementSize;
+	}
+
+	// Keep the table at most half full
+	slotCount = 32;
+	while(slotCount < elementCount * 2)
+		slotCount *= 2;
+
+	if(slotCount != familyIndex->slotCount)
+	{
+		icns_element_entry_t	*newSlots = NULL;
+
+		newSlots = (icns_element_entry_t *)icns_realloc(familyIndex->slots,familyIndex->slotCount * sizeof(icns_element_entry_t),slotCount * sizeof(icns_element_entry_t));
+		if(newSlots == NULL)
+		{
+			icns_print_err("icns_update_family_index: Unable to allocate memory block of size: %d!\n",(int)(slotCount * sizeof(icns_element_entry_t)));
+			return ICNS_STATUS_NO_MEMORY;
+		}
+
+		familyIndex->slots = newSlots;
+		familyIndex->slotCount = slotCount;
+	}
+
+	memset(familyIndex->slots,0,familyIndex->slotCount * sizeof(icns_element_entry_t));
+
+	// Second pass fills in the slots - the first element of a type wins,
+	// matching what a linear walk of the family would find
+	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
+
+	while( dataOffset < (icns_uint32_t)iconFamilySize )
+	{
+		icns_element_t	*iconElement = NULL;
+		icns_type_t	elementType = ICNS_NULL_TYPE;
+		icns_size_t	elementSize = 0;
+		icns_uint32_t	slot = 0;
+
+		iconElement = ((icns_element_t*)(((icns_byte_t*)iconFamily)+dataOffset));
+		ICNS_READ_UNALIGNED(elementType, &(iconElement->elementType),sizeof( icns_type_t));
+		ICNS_READ_UNALIGNED(elementSize, &(iconElement->elementSize),sizeof( icns_size_t));
+
+		slot = icns_family_index_slot(familyIndex,elementType);
+
+		while( (familyIndex->slots[slot].elementSize != 0) && (familyIndex->slots[slot].elementType != elementType) )
+			slot = (slot + 1) & (familyIndex->slotCount - 1);
+
+		if(familyIndex->slots[slot].elementSize == 0)
+		{
+			familyIndex->slots[slot].elementType = elementType;
+			familyIndex->slots[slot].elementSize = elementSize;
+			familyIndex->slots[slot].elementOffset = dataOffset;
+			familyIndex->entryCount++;
+		}
+
+		dataOffset += elementSize;
+	}
+
+	familyIndex->iconFamily = iconFamily;
+	familyIndex->familySize = iconFamilySize;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_lookup_family_index **************************/
+// Returns the indexed location of iconType, or NULL if the family has none
+
+icns_element_entry_t *icns_lookup_family_index(icns_family_index_t *familyIndex,icns_type_t iconType)
+{
+	icns_uint32_t	slot = 0;
+
+	if(familyIndex->slots == NULL)
+		return NULL;
+
+	slot = icns_family_index_slot(familyIndex,iconType);
+
+	while(familyIndex->slots[slot].elementSize != 0)
+	{
+		if(familyIndex->slots[slot].elementType == iconType)
+			return &(familyIndex->slots[slot]);
+		slot = (slot + 1) & (familyIndex->slotCount - 1);
+	}
+
+	return NULL;
+}
+
+/***************************** icns_new_family_builder **************************/
+// A family builder collects elements and lays them all out in one go, instead
+// of growing (and copying) the family once per element like
+// icns_set_element_in_family does.
+
+int icns_new_family_builder(icns_family_builder_t **familyBuilderOut)
+{
+	icns_family_builder_t	*familyBuilder = NULL;
+
+	if(familyBuilderOut == NULL)
+	{
+		icns_print_err("icns_new_family_builder: icns family builder ref is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	*familyBuilderOut = NULL;
+
+	familyBuilder = (icns_family_builder_t *)icns_malloc(sizeof(icns_family_builder_t));
+	if(familyBuilder == NULL)
+	{
+		icns_print_err("icns_new_family_builder: Unable to allocate memory block of size: %d!\n",(int)sizeof(icns_family_builder_t));
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	memset(familyBuilder,0,sizeof(icns_family_builder_t));
+
+	*familyBuilderOut = familyBuilder;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_free_family_builder **************************/
+// Frees the builder along with any elements it still owns
+
+int icns_free_family_builder(icns_family_builder_t *familyBuilder)
+{
+	icns_uint32_t	entryID = 0;
+
+	if(familyBuilder == NULL)
+	{
+		icns_print_err("icns_free_family_builder: icns family builder is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	for(entryID = 0; entryID < familyBuilder->entryCount; entryID++)
+		icns_free(familyBuilder->entries[entryID].iconElement);
+
+	if(familyBuilder->entries != NULL)
+		icns_free(familyBuilder->entries);
+
+	icns_free(familyBuilder);
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_add_element_to_family_builder **************************/
+// Hands iconElement (allocated with malloc) over to the builder, which frees
+// it from then on - even when this call fails. An element of the same type
+// already in the builder is replaced, as with icns_set_element_in_family.
+
+int icns_add_element_to_family_builder(icns_family_builder_t *familyBuilder,icns_element_t *iconElement)
+{
+	icns_type_t	elementType = ICNS_NULL_TYPE;
+	icns_size_t	elementSize = 0;
+	icns_uint32_t	entryID = 0;
+
+	if(familyBuilder == NULL)
+	{
+		icns_print_err("icns_add_element_to_family_builder: icns family builder is NULL!\n");
+		if(iconElement != NULL)
+			icns_free(iconElement);
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(iconElement == NULL)
+	{
+		icns_print_err("icns_add_element_to_family_builder: icns element is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	ICNS_READ_UNALIGNED(elementType, &(iconElement->elementType),sizeof( icns_type_t));
+	ICNS_READ_UNALIGNED(elementSize, &(iconElement->elementSize),sizeof( icns_size_t));
+
+	if(elementSize < 8)
+	{
+		icns_print_err("icns_add_element_to_family_builder: Invalid element size! (%d)\n",elementSize);
+		icns_free(iconElement);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	for(entryID = 0; entryID < familyBuilder->entryCount; entryID++)
+	{
+		icns_builder_entry_t	*builderEntry = &familyBuilder->entries[entryID];
+
+		if(builderEntry->elementType == elementType)
+		{
+			// The element it replaces stays in place if the new one won't fit
+			if( ((icns_uint64_t)familyBuilder->familySize - builderEntry->elementSize + elementSize + 8) > 0x7FFFFFFF )
+			{
+				icns_print_err("icns_add_element_to_family_builder: Icon family would be too large!\n");
+				icns_free(iconElement);
+				return ICNS_STATUS_INVALID_DATA;
+			}
+
+			familyBuilder->familySize -= builderEntry->elementSize;
+			familyBuilder->familySize += elementSize;
+			icns_free(builderEntry->iconElement);
+			builderEntry->iconElement = iconElement;
+			builderEntry->elementSize = elementSize;
+			return ICNS_STATUS_OK;
+		}
+	}
+
+	if( ((icns_uint64_t)familyBuilder->familySize + elementSize + 8) > 0x7FFFFFFF )
+	{
+		icns_print_err("icns_add_element_to_family_builder: Icon family would be too large!\n");
+		icns_free(iconElement);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(familyBuilder->entryCount == familyBuilder->entryCapacity)
+	{
+		icns_uint32_t		newCapacity = familyBuilder->entryCapacity ? familyBuilder->entryCapacity * 2 : 16;
+		icns_builder_entry_t	*newEntries = NULL;
+
+		newEntries = (icns_builder_entry_t *)icns_realloc(familyBuilder->entries,familyBuilder->entryCapacity * sizeof(icns_builder_entry_t),newCapacity * sizeof(icns_builder_entry_t));
+		if(newEntries == NULL)
+		{
+			icns_print_err("icns_add_element_to_family_builder: Unable to allocate memory block of size: %d!\n",(int)(newCapacity * sizeof(icns_builder_entry_t)));
+			icns_free(iconElement);
+			return ICNS_STATUS_NO_MEMORY;
+		}
+
+		familyBuilder->entries = newEntries;
+		familyBuilder->entryCapacity = newCapacity;
+	}
+
+	familyBuilder->entries[familyBuilder->entryCount].iconElement = iconElement;
+	familyBuilder->entries[familyBuilder->entryCount].elementType = elementType;
+	familyBuilder->entries[familyBuilder->entryCount].elementSize = elementSize;
+	familyBuilder->entries[familyBuilder->entryCount].elementOrder = icns_get_element_order(elementType);
+	familyBuilder->entries[familyBuilder->entryCount].entryID = familyBuilder->entryCount;
+	familyBuilder->entryCount++;
+
+	familyBuilder->familySize += elementSize;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_peek_element_in_family_builder **************************/
+// Same as icns_peek_element_in_family, for elements not yet built into a family.
+// The view is valid until the element is replaced or the builder is built or freed.
+
+int icns_peek_element_in_family_builder(icns_family_builder_t *familyBuilder,icns_type_t iconType,icns_element_view_t *elementViewOut)
+{
+	icns_uint32_t	entryID = 0;
+
+	if(familyBuilder == NULL)
+	{
+		icns_print_err("icns_peek_element_in_family_builder: icns family builder is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(elementViewOut == NULL)
+	{
+		icns_print_err("icns_peek_element_in_family_builder: icns element view out is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	memset(elementViewOut,0,sizeof(icns_element_view_t));
+
+	for(entryID = 0; entryID < familyBuilder->entryCount; entryID++)
+	{
+		if(familyBuilder->entries[entryID].elementType == iconType)
+		{
+			icns_fill_view_from_element(familyBuilder->entries[entryID].iconElement,elementViewOut);
+			return ICNS_STATUS_OK;
+		}
+	}
+
+	icns_print_err("icns_peek_element_in_family_builder: Unable to find requested icon data!\n");
+
+	return ICNS_STATUS_DATA_NOT_FOUND;
+}
+
+/***************************** icns_compare_builder_entries **************************/
+// Element order first, then the order they were added in (qsort isn't stable)
+
+static int icns_compare_builder_entries(const void *entryA,const void *entryB)
+{
+	const icns_builder_entry_t	*builderEntryA = (const icns_builder_entry_t *)entryA;
+	const icns_builder_entry_t	*builderEntryB = (const icns_builder_entry_t *)entryB;
+
+	if(builderEntryA->elementOrder != builderEntryB->elementOrder)
+		return (builderEntryA->elementOrder < builderEntryB->elementOrder) ? -1 : 1;
+
+	if(builderEntryA->entryID != builderEntryB->entryID)
+		return (builderEntryA->entryID < builderEntryB->entryID) ? -1 : 1;
+
+	return 0;
+}
+
+/***************************** icns_build_family **************************/
+// Lays out every element collected so far into a new family, sorted the same
+// way icns_set_element_in_family would have sorted them. On success the
+// builder is emptied, ready to be reused or freed.
+
+int icns_build_family(icns_family_builder_t *familyBuilder,icns_family_t **iconFamilyOut)
+{
+	icns_family_t	*iconFamily = NULL;
+	icns_type_t	iconFamilyType = ICNS_FAMILY_TYPE;
+	icns_size_t	iconFamilySize = 0;
+	icns_uint32_t	dataOffset = 0;
+	icns_uint32_t	entryID = 0;
+
+	if(familyBuilder == NULL)
+	{
+		icns_print_err("icns_build_family: icns family builder is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(iconFamilyOut == NULL)
+	{
+		icns_print_err("icns_build_family: icon family reference is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	*iconFamilyOut = NULL;
+
+	iconFamilySize = sizeof(icns_type_t) + sizeof(icns_size_t) + familyBuilder->familySize;
+
+	iconFamily = (icns_family_t *)icns_malloc(iconFamilySize);
+	if(iconFamily == NULL)
+	{
+		icns_print_err("icns_build_family: Unable to allocate memory block of size: %d!\n",iconFamilySize);
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	ICNS_WRITE_UNALIGNED(&(iconFamily->resourceType), iconFamilyType, sizeof(icns_type_t));
+	ICNS_WRITE_UNALIGNED(&(iconFamily->resourceSize), iconFamilySize, sizeof(icns_size_t));
+
+	if(familyBuilder->entryCount > 1)
+		qsort(familyBuilder->entries,familyBuilder->entryCount,sizeof(icns_builder_entry_t),icns_compare_builder_entries);
+
+	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
+
+	for(entryID = 0; entryID < familyBuilder->entryCount; entryID++)
+	{
+		icns_builder_entry_t	*builderEntry = &familyBuilder->entries[entryID];
+
+		memcpy(((icns_byte_t *)iconFamily)+dataOffset,builderEntry->iconElement,builderEntry->elementSize);
+		dataOffset += builderEntry->elementSize;
+
+		icns_free(builderEntry->iconElement);
+		builderEntry->iconElement = NULL;
+	}
+
+	familyBuilder->entryCount = 0;
+	familyBuilder->familySize = 0;
+
+	*iconFamilyOut = iconFamily;
+
+	return ICNS_STATUS_OK;
+}
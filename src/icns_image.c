@@ -29,40 +29,98 @@ Boston, MA 02110-1301, USA.
 #include "icns_internals.h"
 #include "icns_colormaps.h"
 
+#ifdef ICNS_SIMD_X86
+ #include <immintrin.h>
+#endif
 
-int icns_get_image32_with_mask_from_family(icns_family_t *iconFamily,icns_type_t iconType,icns_image_t *imageOut)
+
+
+// Element types decoded by the png/jp2 processors
+static icns_bool_t icns_is_argb_type(icns_type_t iconType)
 {
-	int		error = ICNS_STATUS_OK;
-	icns_type_t	maskType = ICNS_NULL_TYPE;
-	icns_element_t	*iconElement = NULL;
-	icns_element_t	*maskElement = NULL;
-	icns_image_t	iconImage;
-	icns_image_t	maskImage;
-	unsigned long	dataCount = 0;
-	icns_byte_t	dataValue = 0;
-	unsigned long	pixelCount = 0;
-	unsigned long	pixelID = 0;
-	icns_byte_t	colorIndex = 0;
+	return (
+		(iconType == ICNS_256x256_32BIT_ARGB_DATA) ||
+		(iconType == ICNS_512x512_32BIT_ARGB_DATA) ||
+		(iconType == ICNS_1024x1024_32BIT_ARGB_DATA) ||
+		(iconType == ICNS_16x16_2X_32BIT_ARGB_DATA) ||
+		(iconType == ICNS_32x32_2X_32BIT_ARGB_DATA) ||
+		(iconType == ICNS_128x128_2X_32BIT_ARGB_DATA) ||
+		(iconType == ICNS_256x256_2X_32BIT_ARGB_DATA) ||
+		(iconType == ICNS_512x512_2X_32BIT_ARGB_DATA)
+	);
+}
 
-	memset ( &iconImage, 0, sizeof(icns_image_t) );
-	memset ( &maskImage, 0, sizeof(icns_image_t) );
+static int icns_allocate_image_for_type(icns_type_t iconType,icns_bool_t clearData,icns_image_t *imageOut);
+static int icns_allocate_image(icns_uint32_t iconWidth,icns_uint32_t iconHeight,icns_uint32_t iconChannels,icns_uint32_t iconPixelDepth,icns_bool_t clearData,icns_image_t *imageOut);
 
-	if(iconFamily == NULL)
+// Checks that a caller supplied buffer is iconWidth x iconHeight with room
+// for iconBitDepth bits per pixel on each row
+static int icns_check_pixel_buffer(const char *funcName,const icns_pixel_buffer_t *bufferOut,icns_uint32_t iconWidth,icns_uint32_t iconHeight,icns_uint32_t iconBitDepth)
+{
+	if(bufferOut->bufferData == NULL)
 	{
-		icns_print_err("icns_get_image32_with_mask_from_family: Icon family is NULL!\n");
+		icns_print_err("%s: Pixel buffer data is NULL!\n",funcName);
 		return ICNS_STATUS_NULL_PARAM;
 	}
 
-	if(imageOut == NULL)
+	if( (bufferOut->bufferWidth != iconWidth) || (bufferOut->bufferHeight != iconHeight) )
 	{
-		icns_print_err("icns_get_image32_with_mask_from_family: Icon image is NULL!\n");
-		return ICNS_STATUS_NULL_PARAM;
+		icns_print_err("%s: Pixel buffer is %dx%d, expected %dx%d!\n",funcName,bufferOut->bufferWidth,bufferOut->bufferHeight,iconWidth,iconHeight);
+		return ICNS_STATUS_INVALID_DATA;
 	}
-	else
+
+	if(bufferOut->bufferRowBytes < (icns_size_t)(iconWidth * iconBitDepth / ICNS_BYTE_BITS))
 	{
-		icns_free_image(imageOut);
+		icns_print_err("%s: Pixel buffer row bytes too small! (%d < %d)\n",funcName,(int)bufferOut->bufferRowBytes,(int)(iconWidth * iconBitDepth / ICNS_BYTE_BITS));
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(iconBitDepth == 32 && (unsigned int)bufferOut->bufferFormat > ICNS_PIXEL_FORMAT_ARGB_PREMULTIPLIED)
+	{
+		icns_print_err("%s: Unknown pixel format! (%d)\n",funcName,(int)bufferOut->bufferFormat);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	return ICNS_STATUS_OK;
+}
+
+// Copies height rows of rowSize bytes from a packed source into the buffer
+static void icns_copy_rows_to_buffer(const icns_byte_t *srcPtr,icns_size_t rowSize,icns_uint32_t height,icns_pixel_buffer_t *bufferOut)
+{
+	icns_uint32_t	rowID = 0;
+
+	if(bufferOut->bufferRowBytes == rowSize)
+	{
+		memcpy(bufferOut->bufferData,srcPtr,rowSize * height);
+		return;
 	}
 
+	for(rowID = 0; rowID < height; rowID++)
+		memcpy(bufferOut->bufferData + rowID * bufferOut->bufferRowBytes,srcPtr + rowID * rowSize,rowSize);
+}
+
+//***************************** icns_get_image32_with_mask_from_family **************************//
+// Builds a 32-bit RGBA image from an icon element and its matching mask element
+
+int icns_get_image32_with_mask_from_family(icns_family_t *iconFamily,icns_type_t iconType,icns_image_t *imageOut)
+{
+	return icns_get_image32_with_mask_from_indexed_family(iconFamily,NULL,iconType,imageOut);
+}
+
+//***************************** icns_get_image32_with_mask_from_family_into **************************//
+// Same as icns_get_image32_with_mask_from_family, but decodes into a caller owned buffer
+
+int icns_get_image32_with_mask_from_family_into(icns_family_t *iconFamily,icns_type_t iconType,icns_pixel_buffer_t *bufferOut)
+{
+	return icns_get_image32_with_mask_from_indexed_family_into(iconFamily,NULL,iconType,bufferOut);
+}
+
+// Finds the icon element, and its mask element for the types that have one
+static int icns_peek_image32_views(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_element_view_t *iconViewOut,icns_element_view_t *maskViewOut,icns_bool_t *hasMaskOut)
+{
+	int		error = ICNS_STATUS_OK;
+	icns_type_t	maskType = ICNS_NULL_TYPE;
+
 	#ifdef ICNS_DEBUG
 	{
 		char typeStr[5];
@@ -71,7 +129,6 @@ int icns_get_image32_with_mask_from_family(icns_family_t *iconFamily,icns_type_t
 	}
 	#endif
 
-
 	if((iconType == ICNS_128X128_8BIT_MASK) || \
 	(iconType == ICNS_48x48_8BIT_MASK) || \
 	(iconType == ICNS_32x32_8BIT_MASK) || \
@@ -81,270 +138,246 @@ int icns_get_image32_with_mask_from_family(icns_family_t *iconFamily,icns_type_t
 		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	// Preliminaries checked - carry on with the icon/mask merge
-
-	// Load icon element then image
-	error = icns_get_element_from_family(iconFamily,iconType,&iconElement);
+	// Find icon element - decoded in place, no need for a copy
+	error = icns_peek_element_in_indexed_family(iconFamily,familyIndex,iconType,iconViewOut);
 
 	if(error) {
 		icns_print_err("icns_get_image32_with_mask_from_family: Unable to load icon element from icon family!\n");
-		goto cleanup;
+		return error;
 	}
 
-	error = icns_get_image_from_element(iconElement,&iconImage);
+	// Load mask element, for the types that have one
+	maskType = icns_get_mask_type_for_icon_type(iconType);
+	*hasMaskOut = (maskType != ICNS_NULL_MASK);
 
-	if(error) {
-		icns_print_err("icns_get_image32_with_mask_from_family: Unable to load icon image data from icon element!\n");
-		goto cleanup;
-	}
+	if(maskType != ICNS_NULL_MASK)
+	{
+		error = icns_peek_element_in_indexed_family(iconFamily,familyIndex,maskType,maskViewOut);
 
-	// We used the jp2/png processor for these two, so we're done!
-	if(
-		(iconType == ICNS_256x256_32BIT_ARGB_DATA) ||
-		(iconType == ICNS_512x512_32BIT_ARGB_DATA) ||
-		(iconType == ICNS_1024x1024_32BIT_ARGB_DATA) ||
-		(iconType == ICNS_16x16_2X_32BIT_ARGB_DATA) ||
-		(iconType == ICNS_32x32_2X_32BIT_ARGB_DATA) ||
-		(iconType == ICNS_128x128_2X_32BIT_ARGB_DATA) ||
-		(iconType == ICNS_256x256_2X_32BIT_ARGB_DATA) ||
-		(iconType == ICNS_512x512_2X_32BIT_ARGB_DATA)
-	) {
-		memcpy(imageOut,&iconImage,sizeof(icns_image_t));
-		if(iconElement != NULL) {
-			free(iconElement);
-			iconElement = NULL;
+		if(error) {
+			icns_print_err("icns_get_image32_with_mask_from_family: Unable to load mask element from icon family!\n");
+			return error;
 		}
-		return error;
 	}
 
-	maskType = icns_get_mask_type_for_icon_type(iconType);
+	return ICNS_STATUS_OK;
+}
 
-	#ifdef ICNS_DEBUG
+// Does the work of icns_get_image32_with_mask_from_indexed_family and
+// icns_get_image32_with_mask_from_family_in_format
+static int icns_get_image32_in_format_from_indexed_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_pixel_format_t pixelFormat,icns_image_t *imageOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_bool_t		hasMask = 0;
+	icns_element_view_t	iconView;
+	icns_element_view_t	maskView;
+
+	if(iconFamily == NULL)
 	{
-		char typeStr[5];
-		printf("  using mask type '%s'\n",icns_type_str(maskType,typeStr));
+		icns_print_err("icns_get_image32_with_mask_from_family: Icon family is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
 	}
-	#endif
 
-	if( (maskType == ICNS_NULL_DATA) )
+	if(imageOut == NULL)
 	{
-		char typeStr[5];
-		icns_print_err("icns_get_image32_with_mask_from_family: Can't find mask for type '%s'\n",icns_type_str(iconType,typeStr));
-		return ICNS_STATUS_DATA_NOT_FOUND;
+		icns_print_err("icns_get_image32_with_mask_from_family: Icon image is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+	else
+	{
+		icns_free_image(imageOut);
 	}
 
-	// Load mask element then image...
-	error = icns_get_element_from_family(iconFamily,maskType,&maskElement);
+	error = icns_peek_image32_views(iconFamily,familyIndex,iconType,&iconView,&maskView,&hasMask);
 
-	// Note that we could arguably recover from not having a mask
-	// by creating a dummy blank mask. However, the icns data type
-	// should always have the corresponding mask present. This
-	// function was designed to retrieve a VALID image... There are
-	// other API functions better used if the goal is editing, data
-	// recovery, etc.
-	if(error) {
-		icns_print_err("icns_get_image32_with_mask_from_family: Unable to load mask element from icon family!\n");
-		goto cleanup;
-	}
+	if(error)
+		return error;
+
+	return icns_get_image32_with_mask_from_views(&iconView,hasMask ? &maskView : NULL,pixelFormat,imageOut);
+}
 
-	error = icns_get_mask_from_element(maskElement,&maskImage);
+//***************************** icns_get_image32_with_mask_from_indexed_family **************************//
+// Same as icns_get_image32_with_mask_from_family, using familyIndex (if not NULL) to find the elements
 
-	if(error) {
-		icns_print_err("icns_get_image32_with_mask_from_family: Unable to load mask image data from icon element!\n");
-		goto cleanup;
+int icns_get_image32_with_mask_from_indexed_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_image_t *imageOut)
+{
+	return icns_get_image32_in_format_from_indexed_family(iconFamily,familyIndex,iconType,ICNS_PIXEL_FORMAT_RGBA,imageOut);
+}
+
+//***************************** icns_get_image32_with_mask_from_family_in_format **************************//
+// Same as icns_get_image32_with_mask_from_family, with the pixels laid out in pixelFormat
+
+int icns_get_image32_with_mask_from_family_in_format(icns_family_t *iconFamily,icns_type_t iconType,icns_pixel_format_t pixelFormat,icns_image_t *imageOut)
+{
+	return icns_get_image32_in_format_from_indexed_family(iconFamily,NULL,iconType,pixelFormat,imageOut);
+}
+
+//***************************** icns_get_image32_with_mask_from_indexed_family_into **************************//
+// Same as icns_get_image32_with_mask_from_indexed_family, but decodes into a caller owned buffer
+
+int icns_get_image32_with_mask_from_indexed_family_into(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_pixel_buffer_t *bufferOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_bool_t		hasMask = 0;
+	icns_element_view_t	iconView;
+	icns_element_view_t	maskView;
+
+	if(iconFamily == NULL)
+	{
+		icns_print_err("icns_get_image32_with_mask_from_family_into: Icon family is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(bufferOut == NULL)
+	{
+		icns_print_err("icns_get_image32_with_mask_from_family_into: Pixel buffer is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
 	}
 
-	if(iconImage.imageWidth != maskImage.imageWidth) {
-		icns_print_err("icns_get_image32_with_mask_from_family: icon and mask widths do not match! (%d != %d)\n",iconImage.imageWidth,maskImage.imageHeight);
-		goto cleanup;
+	error = icns_peek_image32_views(iconFamily,familyIndex,iconType,&iconView,&maskView,&hasMask);
+
+	if(error)
+		return error;
+
+	return icns_get_image32_with_mask_from_views_into(&iconView,hasMask ? &maskView : NULL,bufferOut);
+}
+
+
+//***************************** icns_get_image32_with_mask_from_map **************************//
+// Same as icns_get_image32_with_mask_from_family, but decodes straight out of a mapped file
+
+int icns_get_image32_with_mask_from_map(icns_family_map_t *familyMap,icns_type_t iconType,icns_image_t *imageOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_type_t		maskType = ICNS_NULL_TYPE;
+	icns_element_view_t	iconView;
+	icns_element_view_t	maskView;
+
+	if(familyMap == NULL)
+	{
+		icns_print_err("icns_get_image32_with_mask_from_map: Icon family map is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
 	}
 
-	if(iconImage.imageHeight != maskImage.imageHeight) {
-		icns_print_err("icns_get_image32_with_mask_from_family: icon and mask heights do not match! (%d != %d)\n",iconImage.imageHeight,maskImage.imageHeight);
-		goto cleanup;
+	if(imageOut == NULL)
+	{
+		icns_print_err("icns_get_image32_with_mask_from_map: Icon image is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+	else
+	{
+		icns_free_image(imageOut);
 	}
 
-	// Unpack image pixels if depth is < 32
-	if((iconImage.imagePixelDepth * iconImage.imageChannels) < 32)
+	if((iconType == ICNS_128X128_8BIT_MASK) || \
+	(iconType == ICNS_48x48_8BIT_MASK) || \
+	(iconType == ICNS_32x32_8BIT_MASK) || \
+	(iconType == ICNS_16x16_8BIT_MASK) )
 	{
-		icns_byte_t	*oldData = NULL;
-		icns_byte_t	*newData = NULL;
-		icns_uint32_t	oldBitDepth = 0;
-		unsigned long	newBlockSize = 0;
-		unsigned long	newDataSize = 0;
-		icns_colormap_rgb_t	colorRGB;
+		icns_print_err("icns_get_image32_with_mask_from_map: Can't make an image with mask from a mask\n");
+		return ICNS_STATUS_INVALID_DATA;
+	}
 
-		oldBitDepth = (iconImage.imagePixelDepth * iconImage.imageChannels);
+	error = icns_get_element_view_from_map(familyMap,iconType,&iconView);
 
-		pixelCount = iconImage.imageWidth * iconImage.imageHeight;
+	if(error) {
+		icns_print_err("icns_get_image32_with_mask_from_map: Unable to find icon element in icon family map!\n");
+		return error;
+	}
 
-		newBlockSize = iconImage.imageWidth * 32;
-		newDataSize = newBlockSize * iconImage.imageHeight;
+	maskType = icns_get_mask_type_for_icon_type(iconType);
 
-		oldData = iconImage.imageData;
-		newData = (icns_byte_t *)malloc(newDataSize);
+	if(maskType == ICNS_NULL_MASK)
+		return icns_get_image32_with_mask_from_views(&iconView,NULL,ICNS_PIXEL_FORMAT_RGBA,imageOut);
 
-		if(newData == NULL)
-		{
-			icns_print_err("icns_get_image32_with_mask_from_family: Unable to allocate memory block of size: %d!\n",(int)newDataSize);
-			return ICNS_STATUS_NO_MEMORY;
-		}
+	error = icns_get_element_view_from_map(familyMap,maskType,&maskView);
 
-		dataCount = 0;
+	if(error) {
+		icns_print_err("icns_get_image32_with_mask_from_map: Unable to find mask element in icon family map!\n");
+		return error;
+	}
 
-		// 8-Bit Icon Image Data Types
-		if((iconType == ICNS_48x48_8BIT_DATA) || \
-		(iconType == ICNS_32x32_8BIT_DATA) || \
-		(iconType == ICNS_16x16_8BIT_DATA) || \
-		(iconType == ICNS_16x12_8BIT_DATA) )
-		{
-			if(oldBitDepth != 8)
-			{
-				icns_print_err("icns_get_image32_with_mask_from_family: Invalid bit depth - type mismatch!\n");
-				free(newData);
-				error = ICNS_STATUS_INVALID_DATA;
-				goto cleanup;
-			}
-			for(pixelID = 0; pixelID < pixelCount; pixelID++)
-			{
-				colorIndex = oldData[dataCount++];
-				colorRGB = icns_colormap_8[colorIndex];
-				newData[pixelID * 4 + 0] = colorRGB.r;
-				newData[pixelID * 4 + 1] = colorRGB.g;
-				newData[pixelID * 4 + 2] = colorRGB.b;
-				newData[pixelID * 4 + 3] = 0xff;
-			}
-		}
-		// 4-Bit Icon Image Data Types
-		else if((iconType == ICNS_48x48_4BIT_DATA) || \
-		(iconType == ICNS_32x32_4BIT_DATA) || \
-		(iconType == ICNS_16x16_4BIT_DATA) || \
-		(iconType == ICNS_16x12_4BIT_DATA) )
-		{
-			if(oldBitDepth != 4)
-			{
-				icns_print_err("icns_get_image32_with_mask_from_family: Invalid bit depth - type mismatch!\n");
-				free(newData);
-				error = ICNS_STATUS_INVALID_DATA;
-				goto cleanup;
-			}
-			for(pixelID = 0; pixelID < pixelCount; pixelID++)
-			{
-				if(pixelID % 2 == 0)
-					dataValue = oldData[dataCount++];
-				colorIndex = (dataValue & 0xF0) >> 4;
-				dataValue = dataValue << 4;
-				colorRGB = icns_colormap_4[colorIndex];
-				newData[pixelID * 4 + 0] = colorRGB.r;
-				newData[pixelID * 4 + 1] = colorRGB.g;
-				newData[pixelID * 4 + 2] = colorRGB.b;
-				newData[pixelID * 4 + 3] = 0xFF;
-			}
-		}
-		// 1-Bit Icon Image Data Types
-		else if((iconType == ICNS_48x48_1BIT_DATA) || \
-		(iconType == ICNS_32x32_1BIT_DATA) || \
-		(iconType == ICNS_16x16_1BIT_DATA) || \
-		(iconType == ICNS_16x12_1BIT_DATA) )
-		{
-			if(oldBitDepth != 1)
-			{
-				icns_print_err("icns_get_image32_with_mask_from_family: Invalid bit depth - type mismatch!\n");
-				free(newData);
-				error = ICNS_STATUS_INVALID_DATA;
-				goto cleanup;
-			}
-			for(pixelID = 0; pixelID < pixelCount; pixelID++)
-			{
-				if(pixelID % 8 == 0)
-					dataValue = oldData[dataCount++];
-				colorIndex = (dataValue & 0x80) ? 0x00 : 0xFF;
-				dataValue = dataValue << 1;
-				newData[pixelID * 4 + 0] = colorIndex;
-				newData[pixelID * 4 + 1] = colorIndex;
-				newData[pixelID * 4 + 2] = colorIndex;
-				newData[pixelID * 4 + 3] = 0xFF;
-			}
-		}
-		else
-		{
-			char typeStr[5];
-			icns_print_err("icns_get_image32_with_mask_from_family: Unpack error - unknown icon type! ('%s')\n",icns_type_str(iconType,typeStr));
-			free(newData);
-			error = ICNS_STATUS_INVALID_DATA;
-			goto cleanup;
-		}
+	return icns_get_image32_with_mask_from_views(&iconView,&maskView,ICNS_PIXEL_FORMAT_RGBA,imageOut);
+}
 
-		iconImage.imagePixelDepth = 8;
-		iconImage.imageChannels = 4;
-		iconImage.imageDataSize = newDataSize;
-		iconImage.imageData = newData;
 
-		free(oldData);
-	}
+// Decodes a png or jp2 element into an image it allocates, in pixelFormat
+static int icns_decode_argb_element_data(icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_pixel_format_t pixelFormat,icns_image_t *imageOut)
+{
+	int	error = ICNS_STATUS_OK;
+	uint8_t magicPNG[] = {0x89,0x50,0x4E,0x47,0x0D,0x0A,0x1A,0x0A};
+	uint8_t magicByt[] = {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
 
-	// 8-Bit Icon Mask Data Types
-	if((maskType == ICNS_128X128_8BIT_MASK) || \
-	(maskType == ICNS_48x48_8BIT_MASK) || \
-	(maskType == ICNS_32x32_8BIT_MASK) || \
-	(maskType == ICNS_16x16_8BIT_MASK) )
-	{
-		pixelCount = maskImage.imageWidth * maskImage.imageHeight;
-		dataCount = 0;
-		if((maskImage.imagePixelDepth * maskImage.imageChannels) != 8)
-		{
-			icns_print_err("icns_get_image32_with_mask_from_family: Invalid bit depth - mismatch!\n");
-			error = ICNS_STATUS_INVALID_DATA;
-			goto cleanup;
-		}
-		for(pixelID = 0; pixelID < pixelCount; pixelID++)
-		{
-			iconImage.imageData[pixelID * 4 + 3] = maskImage.imageData[dataCount++];
-		}
+	if(rawDataSize >= 8)
+		ICNS_READ_UNALIGNED(magicByt[0], rawDataPtr, 8);
+
+	// 256x256+ sizes may or may not be PNG dta as of 10.7 Lion, so check
+	if(memcmp(&magicByt[0], &magicPNG[0], 8) == 0) {
+		// We know to use the PNG processor, which converts as it reads rows
+		error = icns_png_to_image((int)rawDataSize, (icns_byte_t *)rawDataPtr, pixelFormat, imageOut);
+	} else {
+		// We assume use of the jp2 processor
+		error = icns_jp2_to_image((int)rawDataSize, (icns_byte_t *)rawDataPtr, imageOut);
+		if(error == ICNS_STATUS_OK && (imageOut->imagePixelDepth * imageOut->imageChannels) == 32)
+			icns_convert_rgba_rows(imageOut->imageData,imageOut->imageWidth * 4,imageOut->imageWidth,imageOut->imageHeight,pixelFormat);
 	}
-	// 1-Bit Icon Mask Data Types
-	else if((maskType == ICNS_48x48_1BIT_MASK) || \
-	(maskType == ICNS_32x32_1BIT_MASK) || \
-	(maskType == ICNS_16x16_1BIT_MASK) || \
-	(maskType == ICNS_16x12_1BIT_MASK) )
+
+	return error;
+}
+
+//***************************** icns_decode_image32_with_mask_from_views **************************//
+// Does the actual decode and icon/mask merge for icns_get_image32_with_mask_from_views
+
+static int icns_decode_image32_with_mask_from_views(const icns_element_view_t *iconView,const icns_element_view_t *maskView,icns_pixel_format_t pixelFormat,icns_image_t *imageOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_type_t		iconType = ICNS_NULL_TYPE;
+	icns_icon_info_t	iconInfo;
+	icns_image_t		iconImage;
+	icns_pixel_buffer_t	iconBuffer;
+
+	memset ( &iconImage, 0, sizeof(icns_image_t) );
+
+	iconType = iconView->elementType;
+
+	// We use the jp2/png processor for these, which allocates for us
+	if(icns_is_argb_type(iconType))
 	{
-		pixelCount = maskImage.imageWidth * maskImage.imageHeight;
-		dataCount = 0;
-		if((maskImage.imagePixelDepth * maskImage.imageChannels) != 1)
-		{
-			icns_print_err("icns_get_image32_with_mask_from_family: Invalid bit depth - mismatch!\n");
-			error = ICNS_STATUS_INVALID_DATA;
-			goto cleanup;
-		}
-		for(pixelID = 0; pixelID < pixelCount; pixelID++)
-		{
-			if(pixelID % 8 == 0)
-				dataValue = maskImage.imageData[dataCount++];
-			colorIndex = (dataValue & 0x80) ? 0xFF : 0x00;
-			dataValue = dataValue << 1;
-			iconImage.imageData[pixelID * 4 + 3] = colorIndex;
+		error = icns_decode_argb_element_data(iconView->dataSize,iconView->elementData,pixelFormat,&iconImage);
+
+		if(error) {
+			icns_print_err("icns_get_image32_with_mask_from_views: Unable to load icon image data from icon element!\n");
+			return error;
 		}
+
+		memcpy(imageOut,&iconImage,sizeof(icns_image_t));
+		return error;
 	}
-	else
+
+	iconInfo = icns_get_image_info_for_type(iconType);
+
+	if(iconType != iconInfo.iconType)
 	{
 		char typeStr[5];
-		icns_print_err("icns_get_image32_with_mask_from_family: Unpack error - unknown mask type! ('%s')\n",icns_type_str(maskType,typeStr));
-		error = ICNS_STATUS_INVALID_DATA;
-		goto cleanup;
+		icns_print_err("icns_get_image32_with_mask_from_views: Unpack error - unknown icon type! ('%s')\n",icns_type_str(iconType,typeStr));
+		return ICNS_STATUS_INVALID_DATA;
 	}
 
-cleanup:
+	// Every byte is written below, so there is no need to clear the block
+	error = icns_allocate_image(iconInfo.iconWidth,iconInfo.iconHeight,4,8,0,&iconImage);
 
-	if(maskElement != NULL) {
-		free(maskElement);
-		maskElement = NULL;
+	if(error) {
+		icns_free_image(&iconImage);
+		return error;
 	}
-	icns_free_image(&maskImage);
 
-	if(iconElement != NULL) {
-		free(iconElement);
-		iconElement = NULL;
-	}
+	iconBuffer.bufferWidth = iconImage.imageWidth;
+	iconBuffer.bufferHeight = iconImage.imageHeight;
+	iconBuffer.bufferRowBytes = iconImage.imageWidth * 4;
+	iconBuffer.bufferData = iconImage.imageData;
+	iconBuffer.bufferFormat = pixelFormat;
+
+	error = icns_get_image32_with_mask_from_views_into(iconView,maskView,&iconBuffer);
 
 	// We only free the icon image if there was an error. Otherwise, we
 	// pass the data onto the outgoing image
@@ -365,21 +398,861 @@ cleanup:
 	return error;
 }
 
-
+//***************************** icns_get_image32_with_mask_from_views **************************//
+// Shared entry point for the functions above. Goes through the decoded image
+// cache when it is on, keyed by the icon and mask data and the pixel format.
+// maskView may only be NULL for types that carry their own alpha (png/jp2).
+
+int icns_get_image32_with_mask_from_views(const icns_element_view_t *iconView,const icns_element_view_t *maskView,icns_pixel_format_t pixelFormat,icns_image_t *imageOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_image_cache_key_t	cacheKey;
+	icns_bool_t		useCache = 0;
+	ICNS_STATS_SCOPE(ICNS_STATS_DECODE_IMAGE,iconView ? iconView->dataSize : 0);
+
+	useCache = icns_image_cache_key_for(ICNS_IMAGE_CACHE_IMAGE32_WITH_MASK,iconView,maskView,pixelFormat,&cacheKey);
+	if(useCache && icns_image_cache_lookup(&cacheKey,imageOut) == ICNS_STATUS_OK)
+		return ICNS_STATUS_OK;
+
+	error = icns_decode_image32_with_mask_from_views(iconView,maskView,pixelFormat,imageOut);
+
+	if(useCache && error == ICNS_STATUS_OK)
+		icns_image_cache_insert(&cacheKey,imageOut);
+
+	return error;
+}
+
+//***************************** Palette expansion ****************************//
+// 8, 4 and 1-bit icons are expanded to RGBA through the tables generated in
+// icns_colormaps.h, a whole source byte at a time - with AVX2 gathers (8-bit)
+// and SSSE3 byte shuffles (4 and 1-bit) on x86 when the CPU has them.
+
+static void icns_expand_8bit_rows_c(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_byte_t	*srcRow = srcPtr + rowID * srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		for(pixelID = 0; pixelID < width; pixelID++)
+			memcpy(destRow + pixelID * 4,&icns_colormap_8_rgba[srcRow[pixelID]],4);
+	}
+}
+
+static void icns_expand_4bit_rows_c(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	byteID = 0;
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_byte_t	*srcRow = srcPtr + rowID * srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		for(byteID = 0; byteID < width / 2; byteID++)
+			memcpy(destRow + byteID * 8,icns_expand_4bit_table[srcRow[byteID]],8);
+		if(width % 2)
+			memcpy(destRow + byteID * 8,icns_expand_4bit_table[srcRow[byteID]],4);
+	}
+}
+
+static void icns_expand_1bit_rows_c(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	byteID = 0;
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_byte_t	*srcRow = srcPtr + rowID * srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		for(byteID = 0; byteID < width / 8; byteID++)
+			memcpy(destRow + byteID * 32,icns_expand_1bit_table[srcRow[byteID]],32);
+		if(width % 8)
+			memcpy(destRow + byteID * 32,icns_expand_1bit_table[srcRow[byteID]],(width % 8) * 4);
+	}
+}
+
+#ifdef ICNS_SIMD_X86
+__attribute__ ((target("avx2")))
+static void icns_expand_8bit_rows_avx2(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_byte_t	*srcRow = srcPtr + rowID * srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		// Widen 8 indices to 32 bits and gather their palette entries
+		for(pixelID = 0; pixelID + 8 <= width; pixelID += 8)
+		{
+			__m256i	colorIndex = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(srcRow + pixelID)));
+			_mm256_storeu_si256((__m256i *)(destRow + pixelID * 4),_mm256_i32gather_epi32((const int *)icns_colormap_8_rgba,colorIndex,4));
+		}
+
+		icns_expand_8bit_rows_c(srcRow + pixelID,0,width - pixelID,1,destRow + pixelID * 4,0);
+	}
+}
+
+__attribute__ ((target("ssse3")))
+static void icns_expand_4bit_rows_ssse3(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	const __m128i	red = _mm_loadu_si128((const __m128i *)icns_colormap_4_red);
+	const __m128i	green = _mm_loadu_si128((const __m128i *)icns_colormap_4_green);
+	const __m128i	blue = _mm_loadu_si128((const __m128i *)icns_colormap_4_blue);
+	const __m128i	alpha = _mm_set1_epi8((char)0xFF);
+	const __m128i	lowNibble = _mm_set1_epi8(0x0F);
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_byte_t	*srcRow = srcPtr + rowID * srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		// 8 source bytes give 16 indices, which look up each channel with one shuffle
+		for(pixelID = 0; pixelID + 16 <= width; pixelID += 16)
+		{
+			__m128i	packed = _mm_loadl_epi64((const __m128i *)(srcRow + pixelID / 2));
+			__m128i	colorIndex = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(packed,4),lowNibble),_mm_and_si128(packed,lowNibble));
+			__m128i	r = _mm_shuffle_epi8(red,colorIndex);
+			__m128i	g = _mm_shuffle_epi8(green,colorIndex);
+			__m128i	b = _mm_shuffle_epi8(blue,colorIndex);
+			__m128i	rgLo = _mm_unpacklo_epi8(r,g);
+			__m128i	rgHi = _mm_unpackhi_epi8(r,g);
+			__m128i	baLo = _mm_unpacklo_epi8(b,alpha);
+			__m128i	baHi = _mm_unpackhi_epi8(b,alpha);
+			__m128i	*dest = (__m128i *)(destRow + pixelID * 4);
+
+			_mm_storeu_si128(dest+0,_mm_unpacklo_epi16(rgLo,baLo));
+			_mm_storeu_si128(dest+1,_mm_unpackhi_epi16(rgLo,baLo));
+			_mm_storeu_si128(dest+2,_mm_unpacklo_epi16(rgHi,baHi));
+			_mm_storeu_si128(dest+3,_mm_unpackhi_epi16(rgHi,baHi));
+		}
+
+		icns_expand_4bit_rows_c(srcRow + pixelID / 2,0,width - pixelID,1,destRow + pixelID * 4,0);
+	}
+}
+
+__attribute__ ((target("ssse3")))
+static void icns_expand_1bit_rows_ssse3(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	const __m128i	black = _mm_set1_epi32((int)icns_expand_1bit_table[0xFF][0]);
+	const __m128i	white = _mm_set1_epi32((int)icns_expand_1bit_table[0x00][0]);
+	const __m128i	highBits = _mm_set_epi32(0x10,0x20,0x40,0x80);
+	const __m128i	lowBits = _mm_set_epi32(0x01,0x02,0x04,0x08);
+	const __m128i	zero = _mm_setzero_si128();
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_byte_t	*srcRow = srcPtr + rowID * srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		// 2 source bytes give 16 pixels: spread each byte over four lanes,
+		// and pick white where the lane's bit is clear
+		for(pixelID = 0; pixelID + 16 <= width; pixelID += 16)
+		{
+			__m128i	packed = _mm_cvtsi32_si128(srcRow[pixelID / 8] | (srcRow[pixelID / 8 + 1] << 8));
+			__m128i	first = _mm_shuffle_epi8(packed,zero);
+			__m128i	second = _mm_shuffle_epi8(packed,_mm_set1_epi8(1));
+			__m128i	*dest = (__m128i *)(destRow + pixelID * 4);
+			__m128i	isClear;
+
+			isClear = _mm_cmpeq_epi32(_mm_and_si128(first,highBits),zero);
+			_mm_storeu_si128(dest+0,_mm_or_si128(_mm_and_si128(isClear,white),_mm_andnot_si128(isClear,black)));
+			isClear = _mm_cmpeq_epi32(_mm_and_si128(first,lowBits),zero);
+			_mm_storeu_si128(dest+1,_mm_or_si128(_mm_and_si128(isClear,white),_mm_andnot_si128(isClear,black)));
+			isClear = _mm_cmpeq_epi32(_mm_and_si128(second,highBits),zero);
+			_mm_storeu_si128(dest+2,_mm_or_si128(_mm_and_si128(isClear,white),_mm_andnot_si128(isClear,black)));
+			isClear = _mm_cmpeq_epi32(_mm_and_si128(second,lowBits),zero);
+			_mm_storeu_si128(dest+3,_mm_or_si128(_mm_and_si128(isClear,white),_mm_andnot_si128(isClear,black)));
+		}
+
+		icns_expand_1bit_rows_c(srcRow + pixelID / 8,0,width - pixelID,1,destRow + pixelID * 4,0);
+	}
+}
+#endif
+
+static void icns_expand_8bit_rows(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	#ifdef ICNS_SIMD_X86
+	if(__builtin_cpu_supports("avx2"))
+	{
+		icns_expand_8bit_rows_avx2(srcPtr,srcRowBytes,width,height,destPtr,destRowBytes);
+		return;
+	}
+	#endif
+
+	icns_expand_8bit_rows_c(srcPtr,srcRowBytes,width,height,destPtr,destRowBytes);
+}
+
+static void icns_expand_4bit_rows(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	#ifdef ICNS_SIMD_X86
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		icns_expand_4bit_rows_ssse3(srcPtr,srcRowBytes,width,height,destPtr,destRowBytes);
+		return;
+	}
+	#endif
+
+	icns_expand_4bit_rows_c(srcPtr,srcRowBytes,width,height,destPtr,destRowBytes);
+}
+
+static void icns_expand_1bit_rows(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	#ifdef ICNS_SIMD_X86
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		icns_expand_1bit_rows_ssse3(srcPtr,srcRowBytes,width,height,destPtr,destRowBytes);
+		return;
+	}
+	#endif
+
+	icns_expand_1bit_rows_c(srcPtr,srcRowBytes,width,height,destPtr,destRowBytes);
+}
+
+//***************************** Channel swizzling ****************************//
+// Copies 32-bit pixels while reordering their bytes: destination byte i of
+// each pixel is source byte swizzleOrder[i]. Source and destination may be
+// the same rows. Uses pshufb/vpshufb on x86, and a 32-bit rotate for orders
+// that are a rotation (such as ARGB to RGBA) otherwise.
+
+const icns_byte_t icns_swizzle_argb_to_rgba[4] = { 1, 2, 3, 0 };
+
+static void icns_swizzle_rows_c(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,const icns_byte_t swizzleOrder[4],icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	icns_uint32_t	rotateBits = swizzleOrder[0] * 8;
+	icns_bool_t	isRotate = 1;
+	int		byteID = 0;
+
+	for(byteID = 0; byteID < 4; byteID++)
+	{
+		if(swizzleOrder[byteID] != ((swizzleOrder[0] + byteID) & 3))
+			isRotate = 0;
+	}
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_byte_t	*srcRow = srcPtr + rowID * srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		if(isRotate && rotateBits == 0)
+		{
+			memmove(destRow,srcRow,width * 4);
+		}
+		else if(isRotate)
+		{
+			for(pixelID = 0; pixelID < width; pixelID++)
+			{
+				icns_uint32_t	pixel;
+
+				memcpy(&pixel,srcRow + pixelID * 4,4);
+				#ifdef WORDS_BIGENDIAN
+				pixel = (pixel << rotateBits) | (pixel >> (32 - rotateBits));
+				#else
+				pixel = (pixel >> rotateBits) | (pixel << (32 - rotateBits));
+				#endif
+				memcpy(destRow + pixelID * 4,&pixel,4);
+			}
+		}
+		else
+		{
+			for(pixelID = 0; pixelID < width; pixelID++)
+			{
+				icns_byte_t	pixel[4];
+
+				memcpy(pixel,srcRow + pixelID * 4,4);
+				for(byteID = 0; byteID < 4; byteID++)
+					destRow[pixelID * 4 + byteID] = pixel[swizzleOrder[byteID]];
+			}
+		}
+	}
+}
+
+#ifdef ICNS_SIMD_X86
+__attribute__ ((target("ssse3")))
+static void icns_swizzle_rows_ssse3(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,const icns_byte_t swizzleOrder[4],icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_byte_t	shuffleBytes[16];
+	__m128i		shuffle;
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	int		byteID = 0;
+
+	for(byteID = 0; byteID < 16; byteID++)
+		shuffleBytes[byteID] = (byteID & ~3) + swizzleOrder[byteID & 3];
+	shuffle = _mm_loadu_si128((const __m128i *)shuffleBytes);
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_byte_t	*srcRow = srcPtr + rowID * srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		for(pixelID = 0; pixelID + 4 <= width; pixelID += 4)
+		{
+			__m128i	pixels = _mm_loadu_si128((const __m128i *)(srcRow + pixelID * 4));
+			_mm_storeu_si128((__m128i *)(destRow + pixelID * 4),_mm_shuffle_epi8(pixels,shuffle));
+		}
+
+		icns_swizzle_rows_c(srcRow + pixelID * 4,0,width - pixelID,1,swizzleOrder,destRow + pixelID * 4,0);
+	}
+}
+
+__attribute__ ((target("avx2")))
+static void icns_swizzle_rows_avx2(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,const icns_byte_t swizzleOrder[4],icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_byte_t	shuffleBytes[16];
+	__m256i		shuffle;
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	int		byteID = 0;
+
+	// vpshufb works within each 128-bit lane, so both lanes use the same mask
+	for(byteID = 0; byteID < 16; byteID++)
+		shuffleBytes[byteID] = (byteID & ~3) + swizzleOrder[byteID & 3];
+	shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shuffleBytes));
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_byte_t	*srcRow = srcPtr + rowID * srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		for(pixelID = 0; pixelID + 8 <= width; pixelID += 8)
+		{
+			__m256i	pixels = _mm256_loadu_si256((const __m256i *)(srcRow + pixelID * 4));
+			_mm256_storeu_si256((__m256i *)(destRow + pixelID * 4),_mm256_shuffle_epi8(pixels,shuffle));
+		}
+
+		icns_swizzle_rows_c(srcRow + pixelID * 4,0,width - pixelID,1,swizzleOrder,destRow + pixelID * 4,0);
+	}
+}
+#endif
+
+void icns_swizzle_rows(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,const icns_byte_t swizzleOrder[4],icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	#ifdef ICNS_SIMD_X86
+	if(__builtin_cpu_supports("avx2"))
+	{
+		icns_swizzle_rows_avx2(srcPtr,srcRowBytes,width,height,swizzleOrder,destPtr,destRowBytes);
+		return;
+	}
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		icns_swizzle_rows_ssse3(srcPtr,srcRowBytes,width,height,swizzleOrder,destPtr,destRowBytes);
+		return;
+	}
+	#endif
+
+	icns_swizzle_rows_c(srcPtr,srcRowBytes,width,height,swizzleOrder,destPtr,destRowBytes);
+}
+
+//***************************** Pixel formats ****************************//
+// Decoders produce straight RGBA rows, and icns_convert_rgba_rows turns them
+// into the requested format in place. It is run on each row as the decoder
+// finishes it, so the conversion rides along with the final write instead
+// of being a pass of its own.
+
+static const icns_byte_t icns_swizzle_rgba_to_rgba[4] = { 0, 1, 2, 3 };
+static const icns_byte_t icns_swizzle_rgba_to_bgra[4] = { 2, 1, 0, 3 };
+static const icns_byte_t icns_swizzle_rgba_to_argb[4] = { 3, 0, 1, 2 };
+
+// Rounded (value * alpha / 255), exact for all 8-bit inputs
+#define ICNS_PREMULTIPLY(value,alpha) ((((value) * (alpha) + 128) + (((value) * (alpha) + 128) >> 8)) >> 8)
+
+static const icns_byte_t *icns_get_format_swizzle(icns_pixel_format_t pixelFormat)
+{
+	switch(pixelFormat)
+	{
+		case ICNS_PIXEL_FORMAT_BGRA:
+		case ICNS_PIXEL_FORMAT_BGRA_PREMULTIPLIED:
+			return icns_swizzle_rgba_to_bgra;
+		case ICNS_PIXEL_FORMAT_ARGB:
+		case ICNS_PIXEL_FORMAT_ARGB_PREMULTIPLIED:
+			return icns_swizzle_rgba_to_argb;
+		default:
+			return icns_swizzle_rgba_to_rgba;
+	}
+}
+
+static void icns_premultiply_rows_c(icns_byte_t *rowsPtr,icns_size_t rowBytes,icns_uint32_t width,icns_uint32_t height,const icns_byte_t swizzleOrder[4])
+{
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	int		byteID = 0;
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		icns_byte_t	*pixelPtr = rowsPtr + rowID * rowBytes;
+
+		for(pixelID = 0; pixelID < width; pixelID++, pixelPtr += 4)
+		{
+			icns_byte_t	pixel[4];
+
+			pixel[3] = pixelPtr[3];
+			pixel[0] = ICNS_PREMULTIPLY(pixelPtr[0],pixel[3]);
+			pixel[1] = ICNS_PREMULTIPLY(pixelPtr[1],pixel[3]);
+			pixel[2] = ICNS_PREMULTIPLY(pixelPtr[2],pixel[3]);
+
+			for(byteID = 0; byteID < 4; byteID++)
+				pixelPtr[byteID] = pixel[swizzleOrder[byteID]];
+		}
+	}
+}
+
+#ifdef ICNS_SIMD_X86
+// Pixels are widened to 16 bits, multiplied by their alpha (with 255 in the
+// alpha lane so it passes through), rounded, narrowed and then reordered
+__attribute__ ((target("ssse3")))
+static void icns_premultiply_rows_ssse3(icns_byte_t *rowsPtr,icns_size_t rowBytes,icns_uint32_t width,icns_uint32_t height,const icns_byte_t swizzleOrder[4])
+{
+	icns_byte_t	shuffleBytes[16];
+	__m128i		shuffle;
+	const __m128i	zero = _mm_setzero_si128();
+	const __m128i	alphaLane = _mm_set_epi16(255,0,0,0,255,0,0,0);
+	const __m128i	round = _mm_set1_epi16(128);
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	int		byteID = 0;
+
+	for(byteID = 0; byteID < 16; byteID++)
+		shuffleBytes[byteID] = (byteID & ~3) + swizzleOrder[byteID & 3];
+	shuffle = _mm_loadu_si128((const __m128i *)shuffleBytes);
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		icns_byte_t	*rowPtr = rowsPtr + rowID * rowBytes;
+
+		for(pixelID = 0; pixelID + 4 <= width; pixelID += 4)
+		{
+			__m128i	pixels = _mm_loadu_si128((const __m128i *)(rowPtr + pixelID * 4));
+			__m128i	lo = _mm_unpacklo_epi8(pixels,zero);
+			__m128i	hi = _mm_unpackhi_epi8(pixels,zero);
+			__m128i	alphaLo = _mm_or_si128(_mm_shufflehi_epi16(_mm_shufflelo_epi16(lo,0xFF),0xFF),alphaLane);
+			__m128i	alphaHi = _mm_or_si128(_mm_shufflehi_epi16(_mm_shufflelo_epi16(hi,0xFF),0xFF),alphaLane);
+
+			lo = _mm_add_epi16(_mm_mullo_epi16(lo,alphaLo),round);
+			hi = _mm_add_epi16(_mm_mullo_epi16(hi,alphaHi),round);
+			lo = _mm_srli_epi16(_mm_add_epi16(lo,_mm_srli_epi16(lo,8)),8);
+			hi = _mm_srli_epi16(_mm_add_epi16(hi,_mm_srli_epi16(hi,8)),8);
+
+			_mm_storeu_si128((__m128i *)(rowPtr + pixelID * 4),_mm_shuffle_epi8(_mm_packus_epi16(lo,hi),shuffle));
+		}
+
+		icns_premultiply_rows_c(rowPtr + pixelID * 4,0,width - pixelID,1,swizzleOrder);
+	}
+}
+
+__attribute__ ((target("avx2")))
+static void icns_premultiply_rows_avx2(icns_byte_t *rowsPtr,icns_size_t rowBytes,icns_uint32_t width,icns_uint32_t height,const icns_byte_t swizzleOrder[4])
+{
+	icns_byte_t	shuffleBytes[16];
+	__m256i		shuffle;
+	const __m256i	zero = _mm256_setzero_si256();
+	const __m256i	alphaLane = _mm256_set_epi16(255,0,0,0,255,0,0,0,255,0,0,0,255,0,0,0);
+	const __m256i	round = _mm256_set1_epi16(128);
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	int		byteID = 0;
+
+	// The unpacks, packs and shuffles all stay within 128-bit lanes, so
+	// pixels come back out in the order they went in
+	for(byteID = 0; byteID < 16; byteID++)
+		shuffleBytes[byteID] = (byteID & ~3) + swizzleOrder[byteID & 3];
+	shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shuffleBytes));
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		icns_byte_t	*rowPtr = rowsPtr + rowID * rowBytes;
+
+		for(pixelID = 0; pixelID + 8 <= width; pixelID += 8)
+		{
+			__m256i	pixels = _mm256_loadu_si256((const __m256i *)(rowPtr + pixelID * 4));
+			__m256i	lo = _mm256_unpacklo_epi8(pixels,zero);
+			__m256i	hi = _mm256_unpackhi_epi8(pixels,zero);
+			__m256i	alphaLo = _mm256_or_si256(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo,0xFF),0xFF),alphaLane);
+			__m256i	alphaHi = _mm256_or_si256(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi,0xFF),0xFF),alphaLane);
+
+			lo = _mm256_add_epi16(_mm256_mullo_epi16(lo,alphaLo),round);
+			hi = _mm256_add_epi16(_mm256_mullo_epi16(hi,alphaHi),round);
+			lo = _mm256_srli_epi16(_mm256_add_epi16(lo,_mm256_srli_epi16(lo,8)),8);
+			hi = _mm256_srli_epi16(_mm256_add_epi16(hi,_mm256_srli_epi16(hi,8)),8);
+
+			_mm256_storeu_si256((__m256i *)(rowPtr + pixelID * 4),_mm256_shuffle_epi8(_mm256_packus_epi16(lo,hi),shuffle));
+		}
+
+		icns_premultiply_rows_c(rowPtr + pixelID * 4,0,width - pixelID,1,swizzleOrder);
+	}
+}
+#endif
+
+void icns_convert_rgba_rows(icns_byte_t *rowsPtr,icns_size_t rowBytes,icns_uint32_t width,icns_uint32_t height,icns_pixel_format_t pixelFormat)
+{
+	const icns_byte_t	*swizzleOrder = icns_get_format_swizzle(pixelFormat);
+
+	switch(pixelFormat)
+	{
+		case ICNS_PIXEL_FORMAT_BGRA:
+		case ICNS_PIXEL_FORMAT_ARGB:
+			icns_swizzle_rows(rowsPtr,rowBytes,width,height,swizzleOrder,rowsPtr,rowBytes);
+			return;
+		case ICNS_PIXEL_FORMAT_RGBA_PREMULTIPLIED:
+		case ICNS_PIXEL_FORMAT_BGRA_PREMULTIPLIED:
+		case ICNS_PIXEL_FORMAT_ARGB_PREMULTIPLIED:
+			break;
+		default:
+			return;
+	}
+
+	#ifdef ICNS_SIMD_X86
+	if(__builtin_cpu_supports("avx2"))
+	{
+		icns_premultiply_rows_avx2(rowsPtr,rowBytes,width,height,swizzleOrder);
+		return;
+	}
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		icns_premultiply_rows_ssse3(rowsPtr,rowBytes,width,height,swizzleOrder);
+		return;
+	}
+	#endif
+
+	icns_premultiply_rows_c(rowsPtr,rowBytes,width,height,swizzleOrder);
+}
+
+//***************************** Mask application ****************************//
+// Masks are read straight out of the element data and written into the
+// alpha bytes of an RGBA buffer, without decoding them to an image first.
+
+// Validates a mask element's data and points maskPtrOut at its bits - for
+// 1-bit masks these follow the icon bits, if the element carries both
+static int icns_get_mask_bits(icns_type_t maskType,icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,const icns_byte_t **maskPtrOut)
+{
+	icns_icon_info_t	maskInfo;
+
+	if(rawDataSize <= 0 || rawDataPtr == NULL)
+	{
+		icns_print_err("icns_get_mask_from_element_data: Invalid data size! (%d)\n",rawDataSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	#if ICNS_DEBUG
+	printf("  data size is: %d\n",(int)rawDataSize);
+	#endif
+
+	maskInfo = icns_get_image_info_for_type(maskType);
+
+	switch(maskType)
+	{
+		case ICNS_128X128_8BIT_MASK:
+		case ICNS_48x48_8BIT_MASK:
+		case ICNS_32x32_8BIT_MASK:
+		case ICNS_16x16_8BIT_MASK:
+		case ICNS_48x48_1BIT_MASK:
+		case ICNS_32x32_1BIT_MASK:
+		case ICNS_16x16_1BIT_MASK:
+		case ICNS_16x12_1BIT_MASK:
+			break;
+		default:
+			{
+				char typeStr[5];
+				icns_print_err("icns_get_mask_from_element: Unknown mask type! ('%s')\n",icns_type_str(maskType,typeStr));
+			}
+			return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(rawDataSize < maskInfo.iconRawDataSize)
+	{
+		icns_print_err("icns_get_mask_from_element: Not enough mask data! (%d < %d)\n",(int)rawDataSize,(int)maskInfo.iconRawDataSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(maskInfo.iconBitDepth == 1 && rawDataSize == (maskInfo.iconRawDataSize * 2))
+	{
+		#if ICNS_DEBUG
+		printf("  mask data in second memory block\n");
+		#endif
+		*maskPtrOut = rawDataPtr + maskInfo.iconRawDataSize;
+	}
+	else
+	{
+		#if ICNS_DEBUG
+		if(maskInfo.iconBitDepth == 1)
+			printf("  using icon data from first memory block\n");
+		#endif
+		*maskPtrOut = rawDataPtr;
+	}
+
+	return ICNS_STATUS_OK;
+}
+
+#ifdef ICNS_SIMD_X86
+// Sets the alpha bytes of whole 16 pixel runs from 1-bit mask bits, the same
+// way icns_expand_1bit_rows_ssse3 spreads icon bits. Returns the pixels done.
+__attribute__ ((target("ssse3")))
+static icns_uint32_t icns_apply_1bit_mask_ssse3(const icns_byte_t *maskPtr,icns_uint32_t width,icns_byte_t *destRow)
+{
+	const __m128i	alpha = _mm_set1_epi32((int)0xFF000000);
+	const __m128i	highBits = _mm_set_epi32(0x10,0x20,0x40,0x80);
+	const __m128i	lowBits = _mm_set_epi32(0x01,0x02,0x04,0x08);
+	const __m128i	zero = _mm_setzero_si128();
+	icns_uint32_t	pixelID = 0;
+
+	for(pixelID = 0; pixelID + 16 <= width; pixelID += 16)
+	{
+		__m128i	packed = _mm_cvtsi32_si128(maskPtr[pixelID / 8] | (maskPtr[pixelID / 8 + 1] << 8));
+		__m128i	first = _mm_shuffle_epi8(packed,zero);
+		__m128i	second = _mm_shuffle_epi8(packed,_mm_set1_epi8(1));
+		__m128i	*dest = (__m128i *)(destRow + pixelID * 4);
+		__m128i	isClear;
+
+		isClear = _mm_cmpeq_epi32(_mm_and_si128(first,highBits),zero);
+		_mm_storeu_si128(dest+0,_mm_or_si128(_mm_andnot_si128(alpha,_mm_loadu_si128(dest+0)),_mm_andnot_si128(isClear,alpha)));
+		isClear = _mm_cmpeq_epi32(_mm_and_si128(first,lowBits),zero);
+		_mm_storeu_si128(dest+1,_mm_or_si128(_mm_andnot_si128(alpha,_mm_loadu_si128(dest+1)),_mm_andnot_si128(isClear,alpha)));
+		isClear = _mm_cmpeq_epi32(_mm_and_si128(second,highBits),zero);
+		_mm_storeu_si128(dest+2,_mm_or_si128(_mm_andnot_si128(alpha,_mm_loadu_si128(dest+2)),_mm_andnot_si128(isClear,alpha)));
+		isClear = _mm_cmpeq_epi32(_mm_and_si128(second,lowBits),zero);
+		_mm_storeu_si128(dest+3,_mm_or_si128(_mm_andnot_si128(alpha,_mm_loadu_si128(dest+3)),_mm_andnot_si128(isClear,alpha)));
+	}
+
+	return pixelID;
+}
+#endif
+
+// Writes the alpha bytes of width x height RGBA pixels from 8 or 1-bit mask bits
+static void icns_apply_mask_rows(const icns_byte_t *maskPtr,icns_uint32_t maskBitDepth,icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	icns_byte_t	dataValue = 0;
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		icns_byte_t	*destRow = destPtr + rowID * destRowBytes;
+
+		if(maskBitDepth == 8)
+		{
+			for(pixelID = 0; pixelID < width; pixelID++)
+				destRow[pixelID * 4 + 3] = *(maskPtr++);
+		}
+		else
+		{
+			pixelID = 0;
+
+			#ifdef ICNS_SIMD_X86
+			if(__builtin_cpu_supports("ssse3"))
+			{
+				pixelID = icns_apply_1bit_mask_ssse3(maskPtr,width,destRow);
+				maskPtr += pixelID / 8;
+			}
+			#endif
+
+			for(; pixelID < width; pixelID++)
+			{
+				if(pixelID % 8 == 0)
+					dataValue = *(maskPtr++);
+				destRow[pixelID * 4 + 3] = (dataValue & 0x80) ? 0xFF : 0x00;
+				dataValue = dataValue << 1;
+			}
+		}
+	}
+}
+
+//***************************** icns_get_image32_with_mask_from_views_into **************************//
+// Same as icns_get_image32_with_mask_from_views, writing rows in bufferOut->bufferFormat into bufferOut
+
+int icns_get_image32_with_mask_from_views_into(const icns_element_view_t *iconView,const icns_element_view_t *maskView,icns_pixel_buffer_t *bufferOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_type_t		iconType = ICNS_NULL_TYPE;
+	icns_type_t		maskType = ICNS_NULL_TYPE;
+	icns_icon_info_t	iconInfo;
+	icns_icon_info_t	maskInfo;
+	const icns_byte_t	*maskPtr = NULL;
+	icns_size_t		srcRowSize = 0;
+	icns_size_t		maskRowSize = 0;
+	icns_uint32_t		rowID = 0;
+	icns_pixel_format_t	pixelFormat = bufferOut->bufferFormat;
+	void			(*expandRows)(const icns_byte_t *,icns_size_t,icns_uint32_t,icns_uint32_t,icns_byte_t *,icns_size_t) = NULL;
+
+	iconType = iconView->elementType;
+
+	// The jp2/png processors bring their own alpha
+	if(icns_is_argb_type(iconType))
+	{
+		error = icns_get_image_from_element_data_into(iconType,iconView->dataSize,iconView->elementData,bufferOut);
+
+		if(error)
+			icns_print_err("icns_get_image32_with_mask_from_views: Unable to load icon image data from icon element!\n");
+
+		return error;
+	}
+
+	if(maskView == NULL)
+	{
+		char typeStr[5];
+		icns_print_err("icns_get_image32_with_mask_from_views: Can't find mask for type '%s'\n",icns_type_str(iconType,typeStr));
+		return ICNS_STATUS_DATA_NOT_FOUND;
+	}
+
+	maskType = maskView->elementType;
+
+	#ifdef ICNS_DEBUG
+	{
+		char typeStr[5];
+		printf("  using mask type '%s'\n",icns_type_str(maskType,typeStr));
+	}
+	#endif
+
+	iconInfo = icns_get_image_info_for_type(iconType);
+	maskInfo = icns_get_image_info_for_type(maskType);
+
+	if( (iconType != iconInfo.iconType) || (maskType != maskInfo.iconType) )
+	{
+		char typeStr[5];
+		icns_print_err("icns_get_image32_with_mask_from_views: Unpack error - unknown icon type! ('%s')\n",icns_type_str(iconType,typeStr));
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(iconInfo.iconWidth != maskInfo.iconWidth) {
+		icns_print_err("icns_get_image32_with_mask_from_views: icon and mask widths do not match! (%d != %d)\n",iconInfo.iconWidth,maskInfo.iconWidth);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(iconInfo.iconHeight != maskInfo.iconHeight) {
+		icns_print_err("icns_get_image32_with_mask_from_views: icon and mask heights do not match! (%d != %d)\n",iconInfo.iconHeight,maskInfo.iconHeight);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	error = icns_check_pixel_buffer("icns_get_image32_with_mask_from_views",bufferOut,iconInfo.iconWidth,iconInfo.iconHeight,32);
+
+	if(error)
+		return error;
+
+	// Note that we could arguably recover from not having a mask
+	// by creating a dummy blank mask. However, the icns data type
+	// should always have the corresponding mask present. This
+	// function was designed to retrieve a VALID image... There are
+	// other API functions better used if the goal is editing, data
+	// recovery, etc.
+	error = icns_get_mask_bits(maskType,maskView->dataSize,maskView->elementData,&maskPtr);
+
+	if(error) {
+		icns_print_err("icns_get_image32_with_mask_from_views: Unable to load mask image data from icon element!\n");
+		return error;
+	}
+
+	maskRowSize = maskInfo.iconWidth * maskInfo.iconBitDepth / ICNS_BYTE_BITS;
+
+	// 32-Bit Icon Image Data Types - RLE data takes an 8-bit mask as alpha
+	// and is converted to the buffer format while the channels are interleaved
+	if((iconType == ICNS_128X128_32BIT_DATA) || \
+	(iconType == ICNS_48x48_32BIT_DATA) || \
+	(iconType == ICNS_32x32_32BIT_DATA) || \
+	(iconType == ICNS_16x16_32BIT_DATA) )
+	{
+		if(iconView->dataSize <= 0)
+		{
+			icns_print_err("icns_get_image32_with_mask_from_views: Invalid data size! (%d)\n",(int)iconView->dataSize);
+			return ICNS_STATUS_INVALID_DATA;
+		}
+
+		if(iconView->dataSize < iconInfo.iconRawDataSize)
+		{
+			if(maskInfo.iconBitDepth == 8)
+				error = icns_decode_rle24_rows(iconView->dataSize,iconView->elementData,iconInfo.iconWidth,iconInfo.iconHeight,maskPtr,pixelFormat,bufferOut->bufferRowBytes,bufferOut->bufferData);
+			else
+				error = icns_decode_rle24_rows(iconView->dataSize,iconView->elementData,iconInfo.iconWidth,iconInfo.iconHeight,NULL,ICNS_PIXEL_FORMAT_RGBA,bufferOut->bufferRowBytes,bufferOut->bufferData);
+
+			if(error)
+			{
+				icns_print_err("icns_get_image32_with_mask_from_views: Unable to load icon image data from icon element!\n");
+				return error;
+			}
+
+			if(maskInfo.iconBitDepth == 8)
+				return ICNS_STATUS_OK;
+		}
+		else
+		{
+			icns_swizzle_rows(iconView->elementData,iconInfo.iconWidth * 4,iconInfo.iconWidth,iconInfo.iconHeight,icns_swizzle_argb_to_rgba,bufferOut->bufferData,bufferOut->bufferRowBytes);
+		}
+
+		for(rowID = 0; rowID < iconInfo.iconHeight; rowID++)
+		{
+			icns_byte_t	*destRow = bufferOut->bufferData + rowID * bufferOut->bufferRowBytes;
+
+			icns_apply_mask_rows(maskPtr + rowID * maskRowSize,maskInfo.iconBitDepth,iconInfo.iconWidth,1,destRow,0);
+			icns_convert_rgba_rows(destRow,0,iconInfo.iconWidth,1,pixelFormat);
+		}
+
+		return ICNS_STATUS_OK;
+	}
+
+	// Unpack image pixels if depth is < 32
+	if(iconView->dataSize < iconInfo.iconRawDataSize)
+	{
+		icns_print_err("icns_get_image32_with_mask_from_views: Not enough image data! (%d < %d)\n",(int)iconView->dataSize,(int)iconInfo.iconRawDataSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	// 8-Bit Icon Image Data Types
+	if((iconType == ICNS_48x48_8BIT_DATA) || \
+	(iconType == ICNS_32x32_8BIT_DATA) || \
+	(iconType == ICNS_16x16_8BIT_DATA) || \
+	(iconType == ICNS_16x12_8BIT_DATA) )
+		expandRows = icns_expand_8bit_rows;
+	// 4-Bit Icon Image Data Types
+	else if((iconType == ICNS_48x48_4BIT_DATA) || \
+	(iconType == ICNS_32x32_4BIT_DATA) || \
+	(iconType == ICNS_16x16_4BIT_DATA) || \
+	(iconType == ICNS_16x12_4BIT_DATA) )
+		expandRows = icns_expand_4bit_rows;
+	// 1-Bit Icon Image Data Types
+	else if((iconType == ICNS_48x48_1BIT_DATA) || \
+	(iconType == ICNS_32x32_1BIT_DATA) || \
+	(iconType == ICNS_16x16_1BIT_DATA) || \
+	(iconType == ICNS_16x12_1BIT_DATA) )
+		expandRows = icns_expand_1bit_rows;
+	else
+	{
+		char typeStr[5];
+		icns_print_err("icns_get_image32_with_mask_from_views: Unpack error - unknown icon type! ('%s')\n",icns_type_str(iconType,typeStr));
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	// Each row is expanded, masked and converted while it is still in cache
+	srcRowSize = iconInfo.iconWidth * iconInfo.iconBitDepth / ICNS_BYTE_BITS;
+
+	for(rowID = 0; rowID < iconInfo.iconHeight; rowID++)
+	{
+		icns_byte_t	*destRow = bufferOut->bufferData + rowID * bufferOut->bufferRowBytes;
+
+		expandRows(iconView->elementData + rowID * srcRowSize,0,iconInfo.iconWidth,1,destRow,0);
+		icns_apply_mask_rows(maskPtr + rowID * maskRowSize,maskInfo.iconBitDepth,iconInfo.iconWidth,1,destRow,0);
+		icns_convert_rgba_rows(destRow,0,iconInfo.iconWidth,1,pixelFormat);
+	}
+
+	return error;
+}
+
 //***************************** icns_get_image_from_element **************************//
 // Actual conversion of the icon data into uncompressed raw pixels
 
 int icns_get_image_from_element(icns_element_t *iconElement,icns_image_t *imageOut)
 {
-	int		error = ICNS_STATUS_OK;
-	unsigned long	dataCount = 0;
 	icns_type_t	elementType = ICNS_NULL_TYPE;
 	icns_size_t	elementSize = 0;
-	icns_type_t	iconType = ICNS_NULL_TYPE;
-	unsigned long	rawDataSize = 0;
-	icns_byte_t	*rawDataPtr = NULL;
-	icns_uint32_t	iconBitDepth = 0;
-	unsigned long	iconDataRowSize = 0;
 
 	if(iconElement == NULL)
 	{
@@ -411,9 +1284,72 @@ int icns_get_image_from_element(icns_element_t *iconElement,icns_image_t *imageO
 		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	iconType = elementType;
-	rawDataSize = elementSize - sizeof(icns_type_t) - sizeof(icns_size_t);
-	rawDataPtr = (icns_byte_t*)&(iconElement->elementData[0]);
+	return icns_get_image_from_element_data(elementType,elementSize - sizeof(icns_type_t) - sizeof(icns_size_t),&(iconElement->elementData[0]),imageOut);
+}
+
+//***************************** icns_get_image_from_element_into **************************//
+// Same as icns_get_image_from_element, but decodes into a caller owned buffer
+
+int icns_get_image_from_element_into(icns_element_t *iconElement,icns_pixel_buffer_t *bufferOut)
+{
+	icns_size_t	elementSize = 0;
+
+	if(iconElement == NULL)
+	{
+		icns_print_err("icns_get_image_from_element_into: Icon element is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(bufferOut == NULL)
+	{
+		icns_print_err("icns_get_image_from_element_into: Pixel buffer is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	elementSize = iconElement->elementSize;
+
+	if(elementSize <= 8)
+	{
+		icns_print_err("icns_get_image_from_element_into: Invalid element size! (%d)\n",elementSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	return icns_get_image_from_element_data_into(iconElement->elementType,elementSize - sizeof(icns_type_t) - sizeof(icns_size_t),&(iconElement->elementData[0]),bufferOut);
+}
+
+//***************************** icns_get_image_from_element_view **************************//
+// Same as icns_get_image_from_element, for element data borrowed from a family or map
+
+int icns_get_image_from_element_view(const icns_element_view_t *elementView,icns_image_t *imageOut)
+{
+	if(elementView == NULL)
+	{
+		icns_print_err("icns_get_image_from_element_view: Icon element view is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(imageOut == NULL)
+	{
+		icns_print_err("icns_get_image_from_element_view: Icon image structure is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	return icns_get_image_from_element_data(elementView->elementType,elementView->dataSize,elementView->elementData,imageOut);
+}
+
+//***************************** icns_decode_element_data **************************//
+// Does the actual decode for icns_get_image_from_element_data
+
+static int icns_decode_element_data(icns_type_t iconType,icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_image_t *imageOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_pixel_buffer_t	imageBuffer;
+
+	if(rawDataSize <= 0 || rawDataPtr == NULL)
+	{
+		icns_print_err("icns_get_image_from_element_data: Invalid data size! (%d)\n",rawDataSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
 
 	#if ICNS_DEBUG
 	printf("  data size is: %d\n",(int)rawDataSize);
@@ -430,76 +1366,166 @@ int icns_get_image_from_element(icns_element_t *iconElement,icns_image_t *imageO
 		case ICNS_16x16_2X_32BIT_ARGB_DATA:
 		case ICNS_512x512_32BIT_ARGB_DATA:
 		case ICNS_256x256_32BIT_ARGB_DATA:
-			{
-				uint8_t magicPNG[] = {0x89,0x50,0x4E,0x47,0x0D,0x0A,0x1A,0x0A};
-				uint8_t magicByt[] = {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00};
-
-				ICNS_READ_UNALIGNED(magicByt[0], rawDataPtr, 8);
-
-				// 256x256+ sizes may or may not be PNG dta as of 10.7 Lion, so check
-				if(memcmp(&magicByt[0], &magicPNG[0], 8) == 0) {
-					// We know to use the PNG processor
-					error = icns_png_to_image((int)rawDataSize, (icns_byte_t *)rawDataPtr, imageOut);
-				} else {
-					// We assume use of the jp2 processor
-					error = icns_jp2_to_image((int)rawDataSize, (icns_byte_t *)rawDataPtr, imageOut);
-				}
-				return error;
-			}
+			return icns_decode_argb_element_data(rawDataSize,rawDataPtr,ICNS_PIXEL_FORMAT_RGBA,imageOut);
 		case ICNS_128X128_32BIT_DATA:
 		case ICNS_48x48_32BIT_DATA:
 		case ICNS_32x32_32BIT_DATA:
 		case ICNS_16x16_32BIT_DATA:
-
-			error = icns_init_image_for_type(iconType,imageOut);
-			if(error)
+		case ICNS_48x48_8BIT_DATA:
+		case ICNS_32x32_8BIT_DATA:
+		case ICNS_16x16_8BIT_DATA:
+		case ICNS_16x12_8BIT_DATA:
+		case ICNS_48x48_4BIT_DATA:
+		case ICNS_32x32_4BIT_DATA:
+		case ICNS_16x16_4BIT_DATA:
+		case ICNS_16x12_4BIT_DATA:
+		case ICNS_48x48_1BIT_DATA:
+		case ICNS_32x32_1BIT_DATA:
+		case ICNS_16x16_1BIT_DATA:
+		case ICNS_16x12_1BIT_DATA:
+			break;
+		default:
 			{
-				icns_print_err("icns_get_image_from_element: Error allocating new icns image!\n");
+				char typeStr[5];
+				icns_print_err("icns_get_image_from_element: Unknown icon type! ('%s')\n",icns_type_str(iconType,typeStr));
 				icns_free_image(imageOut);
-				return error;
 			}
+			return ICNS_STATUS_INVALID_DATA;
+	}
+
+	// The decoder writes every byte, so there is no need to clear the block
+	error = icns_allocate_image_for_type(iconType,0,imageOut);
+	if(error)
+	{
+		icns_print_err("icns_get_image_from_element: Error allocating new icns image!\n");
+		icns_free_image(imageOut);
+		return error;
+	}
+
+	imageBuffer.bufferWidth = imageOut->imageWidth;
+	imageBuffer.bufferHeight = imageOut->imageHeight;
+	imageBuffer.bufferRowBytes = imageOut->imageWidth * imageOut->imagePixelDepth * imageOut->imageChannels / ICNS_BYTE_BITS;
+	imageBuffer.bufferFormat = ICNS_PIXEL_FORMAT_RGBA;
+	imageBuffer.bufferData = imageOut->imageData;
+
+	error = icns_get_image_from_element_data_into(iconType,rawDataSize,rawDataPtr,&imageBuffer);
+	if(error)
+		icns_free_image(imageOut);
+
+	return error;
+}
+
+//***************************** icns_get_image_from_element_data **************************//
+// Decodes the data portion of an icon element - shared by the element and view
+// paths. Goes through the decoded image cache when it is on.
+
+int icns_get_image_from_element_data(icns_type_t iconType,icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_image_t *imageOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_element_view_t	elementView;
+	icns_image_cache_key_t	cacheKey;
+	icns_bool_t		useCache = 0;
+	ICNS_STATS_SCOPE(ICNS_STATS_DECODE_IMAGE,rawDataSize);
 
-			iconBitDepth = imageOut->imagePixelDepth * imageOut->imageChannels;
-			iconDataRowSize = imageOut->imageWidth * iconBitDepth / ICNS_BYTE_BITS;
+	if(rawDataSize > 0 && rawDataPtr != NULL)
+	{
+		elementView.elementType = iconType;
+		elementView.elementSize = sizeof(icns_type_t) + sizeof(icns_size_t) + rawDataSize;
+		elementView.dataSize = rawDataSize;
+		elementView.elementData = rawDataPtr;
+
+		useCache = icns_image_cache_key_for(ICNS_IMAGE_CACHE_ELEMENT,&elementView,NULL,ICNS_PIXEL_FORMAT_RGBA,&cacheKey);
+		if(useCache && icns_image_cache_lookup(&cacheKey,imageOut) == ICNS_STATUS_OK)
+			return ICNS_STATUS_OK;
+	}
+
+	error = icns_decode_element_data(iconType,rawDataSize,rawDataPtr,imageOut);
+
+	if(useCache && error == ICNS_STATUS_OK)
+		icns_image_cache_insert(&cacheKey,imageOut);
+
+	return error;
+}
+
+//***************************** icns_get_image_from_element_data_into **************************//
+// Decodes the data portion of an icon element into bufferOut, at the
+// depth of the element - or as RGBA for the png/jp2 and 32-bit types
+
+int icns_get_image_from_element_data_into(icns_type_t iconType,icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_pixel_buffer_t *bufferOut)
+{
+	int			error = ICNS_STATUS_OK;
+	unsigned long		iconDataRowSize = 0;
+	icns_uint32_t		rowID = 0;
+	icns_icon_info_t	iconInfo;
+
+	if(rawDataSize <= 0 || rawDataPtr == NULL)
+	{
+		icns_print_err("icns_get_image_from_element_data: Invalid data size! (%d)\n",rawDataSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(icns_is_argb_type(iconType))
+	{
+		icns_image_t	iconImage;
 
-			if(rawDataSize < imageOut->imageDataSize)
+		// The png/jp2 processors only decode into a block of their own
+		memset ( &iconImage, 0, sizeof(icns_image_t) );
+
+		error = icns_decode_argb_element_data(rawDataSize,rawDataPtr,bufferOut->bufferFormat,&iconImage);
+		if(error)
+			return error;
+
+		error = icns_check_pixel_buffer("icns_get_image_from_element_data",bufferOut,iconImage.imageWidth,iconImage.imageHeight,32);
+		if(error == ICNS_STATUS_OK)
+		{
+			if((iconImage.imagePixelDepth * iconImage.imageChannels) != 32)
+			{
+				icns_print_err("icns_get_image_from_element_data: Invalid bit depth - mismatch!\n");
+				error = ICNS_STATUS_INVALID_DATA;
+			}
+			else
 			{
-				icns_uint32_t	pixelCount = 0;
-				icns_size_t	decodedDataSize = imageOut->imageDataSize;
-				icns_byte_t	*decodedImageData = imageOut->imageData;
+				icns_copy_rows_to_buffer(iconImage.imageData,iconImage.imageWidth * 4,iconImage.imageHeight,bufferOut);
+			}
+		}
+
+		icns_free_image(&iconImage);
+		return error;
+	}
+
+	iconInfo = icns_get_image_info_for_type(iconType);
+
+	switch(iconType)
+	{
+		case ICNS_128X128_32BIT_DATA:
+		case ICNS_48x48_32BIT_DATA:
+		case ICNS_32x32_32BIT_DATA:
+		case ICNS_16x16_32BIT_DATA:
+
+			error = icns_check_pixel_buffer("icns_get_image_from_element_data",bufferOut,iconInfo.iconWidth,iconInfo.iconHeight,32);
+			if(error)
+				return error;
 
-				pixelCount = imageOut->imageWidth * imageOut->imageHeight;
-				error = icns_decode_rle24_data(rawDataSize,rawDataPtr,pixelCount,&decodedDataSize,&decodedImageData);
+			if(rawDataSize < iconInfo.iconRawDataSize)
+			{
+				error = icns_decode_rle24_rows(rawDataSize,rawDataPtr,iconInfo.iconWidth,iconInfo.iconHeight,NULL,bufferOut->bufferFormat,bufferOut->bufferRowBytes,bufferOut->bufferData);
 				if(error)
 				{
 					icns_print_err("icns_get_image_from_element: Error decoding RLE data!\n");
-					icns_free_image(imageOut);
 					return error;
 				}
-				else
-				{
-					imageOut->imageDataSize = decodedDataSize;
-					imageOut->imageData = decodedImageData;
-				}
 			}
 			else
 			{
-				unsigned long	pixelCount = 0;
-				icns_byte_t	*swapPtr = NULL;
-				icns_argb_t	*pixelPtr = NULL;
-
-				for(dataCount = 0; dataCount < imageOut->imageHeight; dataCount++)
-					memcpy(&(((char*)(imageOut->imageData))[dataCount*iconDataRowSize]),&(((char*)(rawDataPtr))[dataCount*iconDataRowSize]),iconDataRowSize);
-
-				pixelCount = imageOut->imageWidth * imageOut->imageHeight;
 				#ifdef ICNS_DEBUG
-					printf("Converting %d pixels from argb to rgba\n",(int)pixelCount);
+					printf("Converting %d pixels from argb to rgba\n",(int)(iconInfo.iconWidth * iconInfo.iconHeight));
 				#endif
-				swapPtr = imageOut->imageData;
-				for(dataCount = 0; dataCount < pixelCount; dataCount++)
+				for(rowID = 0; rowID < iconInfo.iconHeight; rowID++)
 				{
-					pixelPtr = (icns_argb_t *)(swapPtr + (dataCount * 4));
-					*((icns_rgba_t *)pixelPtr) = ICNS_ARGB_TO_RGBA( *((icns_argb_t *)pixelPtr) );
+					icns_byte_t	*destRow = bufferOut->bufferData + rowID * bufferOut->bufferRowBytes;
+
+					icns_swizzle_rows(rawDataPtr + rowID * iconInfo.iconWidth * 4,0,iconInfo.iconWidth,1,icns_swizzle_argb_to_rgba,destRow,0);
+					icns_convert_rgba_rows(destRow,0,iconInfo.iconWidth,1,bufferOut->bufferFormat);
 				}
 			}
 			break;
@@ -516,25 +1542,24 @@ int icns_get_image_from_element(icns_element_t *iconElement,icns_image_t *imageO
 		case ICNS_16x16_1BIT_DATA:
 		case ICNS_16x12_1BIT_DATA:
 
-			error = icns_init_image_for_type(iconType,imageOut);
+			error = icns_check_pixel_buffer("icns_get_image_from_element_data",bufferOut,iconInfo.iconWidth,iconInfo.iconHeight,iconInfo.iconBitDepth);
 			if(error)
-			{
-				icns_print_err("icns_get_image_from_element: Error allocating new icns image!\n");
-				icns_free_image(imageOut);
 				return error;
-			}
 
-			iconBitDepth = imageOut->imagePixelDepth * imageOut->imageChannels;
-			iconDataRowSize = imageOut->imageWidth * iconBitDepth / ICNS_BYTE_BITS;
+			iconDataRowSize = iconInfo.iconWidth * iconInfo.iconBitDepth / ICNS_BYTE_BITS;
+
+			if(rawDataSize < iconInfo.iconRawDataSize)
+			{
+				icns_print_err("icns_get_image_from_element: Not enough image data! (%d < %d)\n",(int)rawDataSize,(int)iconInfo.iconRawDataSize);
+				return ICNS_STATUS_INVALID_DATA;
+			}
 
-			for(dataCount = 0; dataCount < imageOut->imageHeight; dataCount++)
-				memcpy(&(((char*)(imageOut->imageData))[dataCount*iconDataRowSize]),&(((char*)(rawDataPtr))[dataCount*iconDataRowSize]),iconDataRowSize);
+			icns_copy_rows_to_buffer(rawDataPtr,iconDataRowSize,iconInfo.iconHeight,bufferOut);
 			break;
 		default:
 			{
 				char typeStr[5];
 				icns_print_err("icns_get_image_from_element: Unknown icon type! ('%s')\n",icns_type_str(iconType,typeStr));
-				icns_free_image(imageOut);
 			}
 			return ICNS_STATUS_INVALID_DATA;
 	}
@@ -547,16 +1572,8 @@ int icns_get_image_from_element(icns_element_t *iconElement,icns_image_t *imageO
 
 int icns_get_mask_from_element(icns_element_t *maskElement,icns_image_t *imageOut)
 {
-	int		error = ICNS_STATUS_OK;
-	unsigned long	dataCount = 0;
 	icns_type_t	elementType = ICNS_NULL_TYPE;
 	icns_size_t	elementSize = 0;
-	icns_type_t	maskType = ICNS_NULL_TYPE;
-	unsigned long	rawDataSize = 0;
-	icns_byte_t	*rawDataPtr = NULL;
-	icns_uint32_t	maskBitDepth = 0;
-	unsigned long	maskDataSize = 0;
-	unsigned long	maskDataRowSize = 0;
 
 	if(maskElement == NULL)
 	{
@@ -588,92 +1605,83 @@ int icns_get_mask_from_element(icns_element_t *maskElement,icns_image_t *imageOu
 		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	maskType = elementType;
-	rawDataSize = elementSize - sizeof(icns_type_t) - sizeof(icns_size_t);
-	rawDataPtr = (icns_byte_t*)&(maskElement->elementData[0]);
+	return icns_get_mask_from_element_data(elementType,elementSize - sizeof(icns_type_t) - sizeof(icns_size_t),&(maskElement->elementData[0]),imageOut);
+}
 
-	#if ICNS_DEBUG
-	printf("  data size is: %d\n",(int)rawDataSize);
-	#endif
+//***************************** icns_get_mask_from_element_into **************************//
+// Same as icns_get_mask_from_element, but decodes into a caller owned buffer
 
-	switch(maskType)
-	{
-		case ICNS_128X128_8BIT_MASK:
-		case ICNS_48x48_8BIT_MASK:
-		case ICNS_32x32_8BIT_MASK:
-		case ICNS_16x16_8BIT_MASK:
+int icns_get_mask_from_element_into(icns_element_t *maskElement,icns_pixel_buffer_t *bufferOut)
+{
+	icns_size_t	elementSize = 0;
 
-			error = icns_init_image_for_type(maskType,imageOut);
-			if(error)
-			{
-				icns_print_err("icns_get_mask_from_element: Error allocating new icns image!\n");
-				icns_free_image(imageOut);
-				return error;
-			}
+	if(maskElement == NULL)
+	{
+		icns_print_err("icns_get_mask_from_element_into: Mask element is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
 
-			maskBitDepth = imageOut->imagePixelDepth * imageOut->imageChannels;
+	if(bufferOut == NULL)
+	{
+		icns_print_err("icns_get_mask_from_element_into: Pixel buffer is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
 
-			if(maskBitDepth != 8) {
-				icns_print_err("icns_get_mask_from_element: Unknown bit depth!\n");
-				icns_free_image(imageOut);
-				return ICNS_STATUS_INVALID_DATA;
-			}
+	elementSize = maskElement->elementSize;
 
-			maskDataSize = imageOut->imageDataSize;
-			maskDataRowSize = imageOut->imageWidth * maskBitDepth / ICNS_BYTE_BITS;
+	if(elementSize <= 8)
+	{
+		icns_print_err("icns_get_mask_from_element_into: Invalid element size! (%d)\n",elementSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
 
-			for(dataCount = 0; dataCount < imageOut->imageHeight; dataCount++)
-				memcpy(&(((char*)(imageOut->imageData))[dataCount*maskDataRowSize]),&(((char*)(rawDataPtr))[dataCount*maskDataRowSize]),maskDataRowSize);
+	return icns_get_mask_from_element_data_into(maskElement->elementType,elementSize - sizeof(icns_type_t) - sizeof(icns_size_t),&(maskElement->elementData[0]),bufferOut);
+}
 
-			break;
-		case ICNS_48x48_1BIT_MASK:
-		case ICNS_32x32_1BIT_MASK:
-		case ICNS_16x16_1BIT_MASK:
-		case ICNS_16x12_1BIT_MASK:
+//***************************** icns_get_mask_from_element_view **************************//
+// Same as icns_get_mask_from_element, for element data borrowed from a family or map
 
-			error = icns_init_image_for_type(maskType,imageOut);
-			if(error)
-			{
-				icns_print_err("icns_get_mask_from_element: Error allocating new icns image!\n");
-				icns_free_image(imageOut);
-				return error;
-			}
+int icns_get_mask_from_element_view(const icns_element_view_t *elementView,icns_image_t *imageOut)
+{
+	if(elementView == NULL)
+	{
+		icns_print_err("icns_get_mask_from_element_view: Mask element view is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
 
-			maskBitDepth = imageOut->imagePixelDepth * imageOut->imageChannels;
+	if(imageOut == NULL)
+	{
+		icns_print_err("icns_get_mask_from_element_view: Mask image structure is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
 
-			if(maskBitDepth != 1) {
-				icns_print_err("icns_get_mask_from_element: Unknown bit depth!\n");
-				icns_free_image(imageOut);
-				return ICNS_STATUS_INVALID_DATA;
-			}
+	return icns_get_mask_from_element_data(elementView->elementType,elementView->dataSize,elementView->elementData,imageOut);
+}
 
-			maskDataSize = imageOut->imageDataSize;
-			maskDataRowSize = imageOut->imageWidth * maskBitDepth / ICNS_BYTE_BITS;
+//***************************** icns_get_mask_from_element_data **************************//
+// Decodes the data portion of a mask element - shared by the element and view paths
 
-			#if ICNS_DEBUG
-			printf("  raw mask data size is: %d\n",(int)rawDataSize);
-			printf("  image mask data size is: %d\n",(int)maskDataSize);
-			#endif
+int icns_get_mask_from_element_data(icns_type_t maskType,icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_image_t *imageOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_pixel_buffer_t	maskBuffer;
 
-			if(rawDataSize == (maskDataSize * 2) )
-			{
-				#if ICNS_DEBUG
-				printf("  mask data in second memory block\n");
-				#endif
-				// Mask data found - Copy the second block of memory
-				for(dataCount = 0; dataCount < imageOut->imageHeight; dataCount++)
-					memcpy(&(((char*)(imageOut->imageData))[dataCount*maskDataRowSize]),&(((char*)(rawDataPtr))[dataCount*maskDataRowSize+maskDataSize]),maskDataRowSize);
-			}
-			else
-			{
-				#if ICNS_DEBUG
-				printf("  using icon data from first memory block\n");
-				#endif
-				// Hmm, no mask - copy the first block of memory
-				for(dataCount = 0; dataCount < imageOut->imageHeight; dataCount++)
-					memcpy(&(((char*)(imageOut->imageData))[dataCount*maskDataRowSize]),&(((char*)(rawDataPtr))[dataCount*maskDataRowSize]),maskDataRowSize);
-			}
+	if(rawDataSize <= 0 || rawDataPtr == NULL)
+	{
+		icns_print_err("icns_get_mask_from_element_data: Invalid data size! (%d)\n",rawDataSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
 
+	switch(maskType)
+	{
+		case ICNS_128X128_8BIT_MASK:
+		case ICNS_48x48_8BIT_MASK:
+		case ICNS_32x32_8BIT_MASK:
+		case ICNS_16x16_8BIT_MASK:
+		case ICNS_48x48_1BIT_MASK:
+		case ICNS_32x32_1BIT_MASK:
+		case ICNS_16x16_1BIT_MASK:
+		case ICNS_16x12_1BIT_MASK:
 			break;
 		default:
 			{
@@ -684,6 +1692,49 @@ int icns_get_mask_from_element(icns_element_t *maskElement,icns_image_t *imageOu
 			return ICNS_STATUS_INVALID_DATA;
 	}
 
+	// The decoder writes every byte, so there is no need to clear the block
+	error = icns_allocate_image_for_type(maskType,0,imageOut);
+	if(error)
+	{
+		icns_print_err("icns_get_mask_from_element: Error allocating new icns image!\n");
+		icns_free_image(imageOut);
+		return error;
+	}
+
+	maskBuffer.bufferWidth = imageOut->imageWidth;
+	maskBuffer.bufferHeight = imageOut->imageHeight;
+	maskBuffer.bufferRowBytes = imageOut->imageWidth * imageOut->imagePixelDepth * imageOut->imageChannels / ICNS_BYTE_BITS;
+	maskBuffer.bufferFormat = ICNS_PIXEL_FORMAT_RGBA;
+	maskBuffer.bufferData = imageOut->imageData;
+
+	error = icns_get_mask_from_element_data_into(maskType,rawDataSize,rawDataPtr,&maskBuffer);
+	if(error)
+		icns_free_image(imageOut);
+
+	return error;
+}
+
+//***************************** icns_get_mask_from_element_data_into **************************//
+// Decodes the data portion of a mask element into bufferOut, at the depth of the mask
+
+int icns_get_mask_from_element_data_into(icns_type_t maskType,icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_pixel_buffer_t *bufferOut)
+{
+	int			error = ICNS_STATUS_OK;
+	const icns_byte_t	*maskPtr = NULL;
+	icns_icon_info_t	maskInfo;
+
+	error = icns_get_mask_bits(maskType,rawDataSize,rawDataPtr,&maskPtr);
+	if(error)
+		return error;
+
+	maskInfo = icns_get_image_info_for_type(maskType);
+
+	error = icns_check_pixel_buffer("icns_get_mask_from_element_data",bufferOut,maskInfo.iconWidth,maskInfo.iconHeight,maskInfo.iconBitDepth);
+	if(error)
+		return error;
+
+	icns_copy_rows_to_buffer(maskPtr,maskInfo.iconWidth * maskInfo.iconBitDepth / ICNS_BYTE_BITS,maskInfo.iconHeight,bufferOut);
+
 	return error;
 }
 
@@ -694,6 +1745,12 @@ int icns_get_mask_from_element(icns_element_t *maskElement,icns_image_t *imageOu
 // using the information for the specified type
 
 int icns_init_image_for_type(icns_type_t iconType,icns_image_t *imageOut)
+{
+	return icns_allocate_image_for_type(iconType,1,imageOut);
+}
+
+// Same as icns_init_image_for_type - clearData can be 0 if every byte is going to be written
+static int icns_allocate_image_for_type(icns_type_t iconType,icns_bool_t clearData,icns_image_t *imageOut)
 {
 	icns_icon_info_t iconInfo;
 
@@ -714,7 +1771,7 @@ int icns_init_image_for_type(icns_type_t iconType,icns_image_t *imageOut)
 		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	return icns_init_image(iconInfo.iconWidth,iconInfo.iconHeight,iconInfo.iconChannels,iconInfo.iconPixelDepth,imageOut);
+	return icns_allocate_image(iconInfo.iconWidth,iconInfo.iconHeight,iconInfo.iconChannels,iconInfo.iconPixelDepth,clearData,imageOut);
 
 }
 
@@ -722,6 +1779,12 @@ int icns_init_image_for_type(icns_type_t iconType,icns_image_t *imageOut)
 // Initialize a new image structure for holding the data
 
 int icns_init_image(icns_uint32_t iconWidth,icns_uint32_t iconHeight,icns_uint32_t iconChannels,icns_uint32_t iconPixelDepth,icns_image_t *imageOut)
+{
+	return icns_allocate_image(iconWidth,iconHeight,iconChannels,iconPixelDepth,1,imageOut);
+}
+
+// Same as icns_init_image - clearData can be 0 if every byte is going to be written
+static int icns_allocate_image(icns_uint32_t iconWidth,icns_uint32_t iconHeight,icns_uint32_t iconChannels,icns_uint32_t iconPixelDepth,icns_bool_t clearData,icns_image_t *imageOut)
 {
 	icns_uint32_t	iconBitDepth = 0;
 	unsigned long	iconDataSize = 0;
@@ -775,13 +1838,14 @@ int icns_init_image(icns_uint32_t iconWidth,icns_uint32_t iconHeight,icns_uint32
 	imageOut->imageChannels = iconChannels;
 	imageOut->imagePixelDepth = (iconBitDepth / iconChannels);
 	imageOut->imageDataSize = iconDataSize;
-	imageOut->imageData = (icns_byte_t *)malloc(iconDataSize);
+	imageOut->imageData = (icns_byte_t *)icns_malloc(iconDataSize);
 	if(!imageOut->imageData)
 	{
 		icns_print_err("icns_init_image: Unable to allocate memory block of size: %d ($s:%m)!\n",(int)iconDataSize);
 		return ICNS_STATUS_NO_MEMORY;
 	}
-	memset(imageOut->imageData,0,iconDataSize);
+	if(clearData)
+		memset(imageOut->imageData,0,iconDataSize);
 
 	return ICNS_STATUS_OK;
 }
@@ -799,7 +1863,7 @@ int icns_free_image(icns_image_t *imageIn)
 
 	if(imageIn->imageData != NULL)
 	{
-		free(imageIn->imageData);
+		icns_free(imageIn->imageData);
 		imageIn->imageData = NULL;
 	}
 
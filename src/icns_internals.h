@@ -61,6 +61,36 @@ Boston, MA 02110-1301, USA.
 // We do not want to expose any of the internal stuff
 #pragma GCC visibility push(hidden)
 
+/* Thread-local storage, for the per-thread current context - configure requires it */
+#ifdef HAVE_THREAD_LOCAL
+ #define ICNS_THREAD_LOCAL	HAVE_THREAD_LOCAL
+#else
+ #error "libicns needs thread-local storage (HAVE_THREAD_LOCAL) - see DEVNOTES"
+#endif
+
+/* Stage statistics - see icns_stats.c */
+/* ICNS_STATS_SCOPE times everything up to the end of the enclosing block */
+#ifdef ICNS_STATS
+typedef struct icns_stats_scope_t
+{
+	int		stage;
+	int		parentStage;
+	icns_uint64_t	bytesProcessed;
+	icns_uint64_t	startTime;
+} icns_stats_scope_t;
+
+ #define ICNS_STATS_SCOPE(stage,bytes)	icns_stats_scope_t icnsStatsScope __attribute__((cleanup(icns_stats_end_scope))) = icns_stats_begin_scope((stage),(bytes))
+ #define ICNS_STATS_ALLOC(bytes)	icns_stats_add_alloc(bytes)
+#else
+ #define ICNS_STATS_SCOPE(stage,bytes)
+ #define ICNS_STATS_ALLOC(bytes)
+#endif
+
+/* x86 SIMD kernels - which one runs is picked with __builtin_cpu_supports */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(ICNS_NO_SIMD)
+ #define ICNS_SIMD_X86	1
+#endif
+
 /* icns structures */
 
 typedef struct icns_rgba_t
@@ -86,6 +116,91 @@ typedef struct icns_rgb_t
 	icns_byte_t	 b;
 } icns_rgb_t;
 
+/* location of one element header inside a family */
+typedef struct icns_element_entry_t
+{
+	icns_type_t	 elementType;
+	icns_size_t	 elementSize;
+	icns_uint32_t	 elementOffset;	// offset of the element header from the family start
+} icns_element_entry_t;
+
+/* icns_family_map_t - element headers are parsed lazily, in file order */
+struct icns_family_map_t
+{
+	const icns_byte_t	*mapData;	// start of the 'icns' header, big endian as on disk
+	icns_size_t		mapSize;	// resource size from the 'icns' header
+	icns_bool_t		isMapped;	// 1 if mapData came from mmap, 0 if from malloc
+	icns_bool_t		parseDone;	// 1 once parsing has stopped, see parseStatus
+	int			parseStatus;	// DATA_NOT_FOUND at the end, or the error that stopped it
+	icns_uint32_t		parseOffset;	// offset of the next unparsed element header
+	icns_uint32_t		entryCount;
+	icns_uint32_t		entryCapacity;
+	icns_element_entry_t	*entries;
+};
+
+/* icns_family_index_t - hash of element type to the element's location */
+struct icns_family_index_t
+{
+	icns_family_t		*iconFamily;	// family the slots describe, NULL if not built
+	icns_size_t		familySize;	// size of that family when indexed
+	icns_uint32_t		slotCount;	// always a power of two
+	icns_uint32_t		entryCount;
+	icns_element_entry_t	*slots;		// elementSize of 0 marks an empty slot
+};
+
+/* one element waiting in an icns_family_builder_t */
+typedef struct icns_builder_entry_t
+{
+	icns_element_t		*iconElement;	// owned by the builder
+	icns_type_t		elementType;
+	icns_size_t		elementSize;
+	icns_uint32_t		elementOrder;	// from icns_get_element_order
+	icns_uint32_t		entryID;	// order added, to keep the sort stable
+} icns_builder_entry_t;
+
+/* icns_family_builder_t - elements are only laid out by icns_build_family */
+struct icns_family_builder_t
+{
+	icns_uint32_t		entryCount;
+	icns_uint32_t		entryCapacity;
+	icns_size_t		familySize;	// sum of all element sizes, without the family header
+	icns_builder_entry_t	*entries;
+};
+
+/* key of one entry in the decoded image cache - see icns_cache.c */
+#define	ICNS_IMAGE_CACHE_IMAGE32_WITH_MASK	1	// icns_get_image32_with_mask_from_views
+#define	ICNS_IMAGE_CACHE_ELEMENT		2	// icns_get_image_from_element_data
+
+typedef struct icns_image_cache_key_t
+{
+	icns_uint32_t		kind;		// which decoder produced the image
+	icns_type_t		iconType;
+	icns_size_t		iconSize;
+	icns_uint64_t		iconHash;	// hash of the icon element data
+	const icns_byte_t	*iconData;	// the data itself - a hit has to match it byte for byte
+	icns_type_t		maskType;	// ICNS_NULL_TYPE without a mask
+	icns_size_t		maskSize;
+	icns_uint64_t		maskHash;
+	const icns_byte_t	*maskData;
+	icns_pixel_format_t	pixelFormat;
+} icns_image_cache_key_t;
+
+/* icns_context_t - error reporting state for one caller */
+#define	ICNS_ERROR_MESSAGE_SIZE	256
+
+struct icns_context_t
+{
+	icns_bool_t		printErrors;
+	int			lastError;
+	char			lastErrorMessage[ICNS_ERROR_MESSAGE_SIZE];
+	icns_error_callback_t	errorCallback;
+	void			*errorUserData;
+	icns_bool_t		hasPngOptions;
+	icns_png_options_t	pngOptions;
+	icns_bool_t		hasAllocator;
+	icns_allocator_t	allocator;
+};
+
 /* icns constants */
 
 
@@ -156,9 +271,15 @@ memory alignment. So, we try to work around this here.
 
 /* global variables */
 extern icns_bool_t gShouldPrintErrors;
+extern ICNS_THREAD_LOCAL icns_context_t *gCurrentContext;
 
 /* icns function prototypes */
 
+// icns_context.c
+int icns_context_report_err(const char *message);
+const icns_png_options_t *icns_context_get_png_options(void);
+const icns_allocator_t *icns_context_get_allocator(void);
+
 // icns_debug.c
 void bin_print_byte(int x);
 void bin_print_int(int x);
@@ -166,6 +287,12 @@ void bin_print_int(int x);
 // icns_element.c
 int icns_new_element_from_image_or_mask(icns_image_t *imageIn,icns_type_t iconType,icns_bool_t isMask,icns_element_t **iconElementOut);
 int icns_update_element_with_image_or_mask(icns_image_t *imageIn,icns_bool_t isMask,icns_element_t **iconElement);
+void icns_fill_view_from_element(icns_element_t *iconElement,icns_element_view_t *elementViewOut);
+int icns_find_element_in_family(icns_family_t *iconFamily,icns_family_index_t *familyIndex,icns_type_t iconType,icns_element_entry_t *elementEntryOut);
+
+// icns_family.c
+int icns_update_family_index(icns_family_index_t *familyIndex,icns_family_t *iconFamily);
+icns_element_entry_t *icns_lookup_family_index(icns_family_index_t *familyIndex,icns_type_t iconType);
 
 // icns_io.c
 int icns_parse_family_data(icns_size_t dataSize,icns_byte_t *data,icns_family_t **iconFamilyOut);
@@ -177,18 +304,52 @@ icns_bool_t icns_rsrc_header_check(icns_size_t dataSize,icns_byte_t *dataPtr,icn
 icns_bool_t icns_macbinary_header_check(icns_size_t dataSize,icns_byte_t *dataPtr);
 icns_bool_t icns_apple_encoded_header_check(icns_size_t dataSize,icns_byte_t *dataPtr);
 
+// icns_image.c
+int icns_get_image_from_element_data(icns_type_t iconType,icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_image_t *imageOut);
+int icns_get_mask_from_element_data(icns_type_t maskType,icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_image_t *imageOut);
+int icns_get_image_from_element_data_into(icns_type_t iconType,icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_pixel_buffer_t *bufferOut);
+int icns_get_mask_from_element_data_into(icns_type_t maskType,icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_pixel_buffer_t *bufferOut);
+int icns_get_image32_with_mask_from_views(const icns_element_view_t *iconView,const icns_element_view_t *maskView,icns_pixel_format_t pixelFormat,icns_image_t *imageOut);
+int icns_get_image32_with_mask_from_views_into(const icns_element_view_t *iconView,const icns_element_view_t *maskView,icns_pixel_buffer_t *bufferOut);
+void icns_swizzle_rows(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t width,icns_uint32_t height,const icns_byte_t swizzleOrder[4],icns_byte_t *destPtr,icns_size_t destRowBytes);
+extern const icns_byte_t icns_swizzle_argb_to_rgba[4];
+void icns_convert_rgba_rows(icns_byte_t *rowsPtr,icns_size_t rowBytes,icns_uint32_t width,icns_uint32_t height,icns_pixel_format_t pixelFormat);
+
+// icns_alloc.c
+void *icns_malloc(size_t dataSize);
+void *icns_realloc(void *dataPtr,size_t oldSize,size_t newSize);
+void icns_free(void *dataPtr);
+int icns_check_allocator(const char *funcName,const icns_allocator_t *allocator);
+
+// icns_cache.c
+icns_bool_t icns_image_cache_key_for(icns_uint32_t keyKind,const icns_element_view_t *iconView,const icns_element_view_t *maskView,icns_pixel_format_t pixelFormat,icns_image_cache_key_t *keyOut);
+int icns_image_cache_lookup(const icns_image_cache_key_t *key,icns_image_t *imageOut);
+void icns_image_cache_insert(const icns_image_cache_key_t *key,const icns_image_t *image);
+
+// icns_stats.c
+#ifdef ICNS_STATS
+icns_stats_scope_t icns_stats_begin_scope(int stage,icns_uint64_t bytesProcessed);
+void icns_stats_end_scope(icns_stats_scope_t *scope);
+void icns_stats_add_alloc(icns_uint64_t allocBytes);
+#endif
+
 // icns_png.c
-int icns_image_to_png(icns_image_t *image, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut);
-int icns_png_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *imageOut);
+int icns_image_to_png(icns_image_t *image, const icns_png_options_t *options, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut);
+int icns_png_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_pixel_format_t pixelFormat, icns_image_t *imageOut);
+
+// icns_rle24.c
+int icns_decode_rle24_rows(icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_uint32_t imageWidth,icns_uint32_t imageHeight,const icns_byte_t *alphaPtr,icns_pixel_format_t pixelFormat,icns_size_t rowBytes,icns_byte_t *destPtr);
 
 // icns_jp2.c
+int icns_get_jp2_reduce_levels(icns_size_t dataSize, const icns_byte_t *dataPtr, icns_uint32_t targetSize);
+void icns_interleave_planar32_rows(const icns_sint32_t *const planes[4],icns_size_t planeStride,const icns_sint32_t bias[4],const int shift[4],icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes);
 #ifdef ICNS_JASPER
-int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *imageOut);
+int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, int reduceLevels, icns_image_t *imageOut);
 int icns_jas_image_to_jp2(icns_image_t *image, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut);
 #endif
 #ifdef ICNS_OPENJPEG
-int icns_opj_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *imageOut);
-int icns_opj_jp2_dec(icns_size_t dataSize, icns_byte_t *dataPtr, opj_image_t **imageOut);
+int icns_opj_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, int reduceLevels, icns_image_t *imageOut);
+int icns_opj_jp2_dec(icns_size_t dataSize, icns_byte_t *dataPtr, int reduceLevels, opj_image_t **imageOut);
 int icns_opj_to_image(opj_image_t *image, icns_image_t *outIcon);
 int icns_opj_image_to_jp2(icns_image_t *image, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut);
 void icns_opj_error_callback(const char *msg, void *client_data);
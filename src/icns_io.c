@@ -28,6 +28,22 @@ Boston, MA 02110-1301, USA.
 #include "icns.h"
 #include "icns_internals.h"
 
+#ifdef HAVE_UNISTD_H
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
 /***************************** ICNS_MEMCPY **************************/
 #if HAVE_UNALIGNED_MEMCPY == 0
 __attribute__ ((noinline)) void *icns_memcpy( void *dst, const void *src, size_t num ) {
@@ -198,17 +214,79 @@ static inline void icns_write_be(void *outp, void *inp, int size)
 	memcpy(outp, &b, size);
 }
 
+/***************************** icns_check_family_header **************************/
+// Validates the (native endian) family header before writing it out
+
+static int icns_check_family_header(icns_family_t *iconFamily,icns_size_t *dataSizeOut)
+{
+	icns_type_t	dataType = ICNS_NULL_TYPE;
+	icns_size_t	dataSize = 0;
+
+	ICNS_READ_UNALIGNED(dataType, &(iconFamily->resourceType),sizeof( icns_type_t));
+	ICNS_READ_UNALIGNED(dataSize, &(iconFamily->resourceSize),sizeof( icns_size_t));
+
+	if(dataType != ICNS_FAMILY_TYPE)
+	{
+		char typeStr[5];
+		icns_print_err("icns_check_family_header: Invalid type in header! ('%s')\n",icns_type_str(dataType,typeStr));
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(dataSize < 8)
+	{
+		icns_print_err("icns_check_family_header: Invalid size in header! (%d)\n",dataSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	*dataSizeOut = dataSize;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_next_element_header **************************/
+// Fills headerData with the big endian header of the element at dataOffset
+
+static int icns_next_element_header(icns_family_t *iconFamily,icns_size_t dataSize,icns_uint32_t dataOffset,icns_byte_t *headerData,icns_size_t *elementSizeOut)
+{
+	icns_type_t	elementType = ICNS_NULL_TYPE;
+	icns_size_t	elementSize = 0;
+
+	ICNS_READ_UNALIGNED(elementType, ((icns_byte_t *)iconFamily)+dataOffset,sizeof(icns_type_t));
+	ICNS_READ_UNALIGNED(elementSize, ((icns_byte_t *)iconFamily)+dataOffset+4,sizeof(icns_size_t));
+
+	#ifdef ICNS_DEBUG
+	{
+		char typeStr[5];
+		printf("  writing element type '%s', size %d\n",icns_type_str(elementType,typeStr),elementSize);
+	}
+	#endif
+
+	if( (elementSize < 8) || (dataOffset+elementSize > (icns_uint32_t)dataSize) )
+	{
+		icns_print_err("icns_next_element_header: Invalid element size! (%d)\n",elementSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	ICNS_WRITE_UNALIGNED_BE(headerData, elementType, sizeof(icns_type_t));
+	ICNS_WRITE_UNALIGNED_BE(headerData + 4, elementSize, sizeof(icns_size_t));
+
+	*elementSizeOut = elementSize;
+
+	return ICNS_STATUS_OK;
+}
+
 /***************************** icns_write_family_to_file **************************/
+// Only the 8 byte headers need swapping on the way out, so those go through
+// a small buffer and the element data is written straight from the family.
 
 int icns_write_family_to_file(FILE *dataFile,icns_family_t *iconFamilyIn)
 {
 	int		error = ICNS_STATUS_OK;
-	icns_size_t	blockSize = 0;
-	icns_size_t	blockCount = 0;
-	icns_size_t	blocksWritten = 0;
-	icns_size_t	dataWritten = 0;
 	icns_size_t	dataSize = 0;
-	icns_byte_t	*dataPtr = NULL;
+	icns_uint32_t	dataOffset = 0;
+	icns_byte_t	headerData[8];
+	icns_type_t	dataType = ICNS_FAMILY_TYPE;
+	ICNS_STATS_SCOPE(ICNS_STATS_WRITE_FAMILY,iconFamilyIn ? iconFamilyIn->resourceSize : 0);
 
 	if( dataFile == NULL )
 	{
@@ -222,9 +300,7 @@ int icns_write_family_to_file(FILE *dataFile,icns_family_t *iconFamilyIn)
 		return ICNS_STATUS_NULL_PARAM;
 	}
 
-	error = icns_export_family_data(iconFamilyIn,&dataSize,&dataPtr);
-
-	if(error != ICNS_STATUS_OK)
+	if((error = icns_check_family_header(iconFamilyIn,&dataSize)) != ICNS_STATUS_OK)
 		return error;
 
 	#ifdef ICNS_DEBUG
@@ -232,30 +308,212 @@ int icns_write_family_to_file(FILE *dataFile,icns_family_t *iconFamilyIn)
 	printf("  total data size: %d (0x%08X)\n",(int)dataSize,dataSize);
 	#endif
 
-	blockSize = 1024;
-	blockCount = dataSize / blockSize;
+	ICNS_WRITE_UNALIGNED_BE(headerData, dataType, sizeof(icns_type_t));
+	ICNS_WRITE_UNALIGNED_BE(headerData + 4, dataSize, sizeof(icns_size_t));
+
+	if(fwrite(headerData,8,1,dataFile) != 1)
+	{
+		icns_print_err("icns_write_family_to_file: Error writing icns to file!\n");
+		return ICNS_STATUS_IO_WRITE_ERR;
+	}
 
-	blocksWritten = fwrite ( dataPtr , blockSize , blockCount , dataFile );
+	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
 
-	if(blocksWritten < blockCount)
+	while( dataOffset+8 <= (icns_uint32_t)dataSize )
 	{
+		icns_size_t	elementSize = 0;
+
+		if((error = icns_next_element_header(iconFamilyIn,dataSize,dataOffset,headerData,&elementSize)) != ICNS_STATUS_OK)
+			return error;
+
+		if(fwrite(headerData,8,1,dataFile) != 1)
+		{
 			icns_print_err("icns_write_family_to_file: Error writing icns to file!\n");
 			return ICNS_STATUS_IO_WRITE_ERR;
-	}
+		}
+
+		if( (elementSize > 8) && (fwrite(((icns_byte_t *)iconFamilyIn)+dataOffset+8,elementSize-8,1,dataFile) != 1) )
+		{
+			icns_print_err("icns_write_family_to_file: Error writing icns to file!\n");
+			return ICNS_STATUS_IO_WRITE_ERR;
+		}
 
-	dataWritten = (blockCount * blockSize);
-	blockSize = dataSize - (blockCount * blockSize);
-	blocksWritten = fwrite ( dataPtr + dataWritten , blockSize , 1 , dataFile );
+		dataOffset += elementSize;
+	}
 
-	if(blocksWritten != 1)
+	// Pass along any trailing bytes too short to be an element
+	if( (dataOffset < (icns_uint32_t)dataSize) && (fwrite(((icns_byte_t *)iconFamilyIn)+dataOffset,dataSize-dataOffset,1,dataFile) != 1) )
 	{
 		icns_print_err("icns_write_family_to_file: Error writing icns to file!\n");
 		return ICNS_STATUS_IO_WRITE_ERR;
 	}
 
-	free(dataPtr);
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_write_family_to_fd **************************/
+// Same as icns_write_family_to_file, for a file descriptor. Elements are
+// gathered into batches and written with writev where available.
+
+#define ICNS_WRITE_BATCH_SIZE	32
+
+#ifdef HAVE_UNISTD_H
+static int icns_write_all(int fd,const icns_byte_t *dataPtr,icns_uint32_t dataSize)
+{
+	while(dataSize > 0)
+	{
+		ssize_t	writeSize = write(fd,dataPtr,dataSize);
+
+		if(writeSize < 0 && errno == EINTR)
+			continue;
+
+		if(writeSize <= 0)
+			return ICNS_STATUS_IO_WRITE_ERR;
+
+		dataPtr += writeSize;
+		dataSize -= writeSize;
+	}
+
+	return ICNS_STATUS_OK;
+}
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+static int icns_writev_all(int fd,struct iovec *iov,int iovCount)
+{
+	while(iovCount > 0)
+	{
+		ssize_t	writeSize = writev(fd,iov,iovCount);
+
+		if(writeSize < 0 && errno == EINTR)
+			continue;
+
+		if(writeSize <= 0)
+			return ICNS_STATUS_IO_WRITE_ERR;
+
+		// Skip whatever made it out, possibly stopping part way into a vector
+		while(iovCount > 0 && (size_t)writeSize >= iov->iov_len)
+		{
+			writeSize -= iov->iov_len;
+			iov++;
+			iovCount--;
+		}
+
+		if(iovCount > 0)
+		{
+			iov->iov_base = ((char *)iov->iov_base) + writeSize;
+			iov->iov_len -= writeSize;
+		}
+	}
+
+	return ICNS_STATUS_OK;
+}
+#endif
+
+int icns_write_family_to_fd(int fd,icns_family_t *iconFamilyIn)
+{
+	#ifdef HAVE_UNISTD_H
+	int		error = ICNS_STATUS_OK;
+	icns_size_t	dataSize = 0;
+	icns_uint32_t	dataOffset = 0;
+	icns_byte_t	headerData[ICNS_WRITE_BATCH_SIZE+1][8];
+	icns_type_t	dataType = ICNS_FAMILY_TYPE;
+	int		headerCount = 0;
+	#ifdef HAVE_SYS_UIO_H
+	struct iovec	iov[(ICNS_WRITE_BATCH_SIZE+1)*2];
+	int		iovCount = 0;
+	#endif
+	ICNS_STATS_SCOPE(ICNS_STATS_WRITE_FAMILY,iconFamilyIn ? iconFamilyIn->resourceSize : 0);
+
+	if( fd < 0 )
+	{
+		icns_print_err("icns_write_family_to_fd: Invalid file descriptor!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if( iconFamilyIn == NULL )
+	{
+		icns_print_err("icns_write_family_to_fd: NULL icns family!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if((error = icns_check_family_header(iconFamilyIn,&dataSize)) != ICNS_STATUS_OK)
+		return error;
+
+	ICNS_WRITE_UNALIGNED_BE(headerData[0], dataType, sizeof(icns_type_t));
+	ICNS_WRITE_UNALIGNED_BE(headerData[0] + 4, dataSize, sizeof(icns_size_t));
+	headerCount = 1;
+
+	#ifdef HAVE_SYS_UIO_H
+	iov[0].iov_base = headerData[0];
+	iov[0].iov_len = 8;
+	iovCount = 1;
+	#else
+	if(icns_write_all(fd,headerData[0],8) != ICNS_STATUS_OK)
+		goto write_error;
+	#endif
+
+	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
+
+	while( dataOffset+8 <= (icns_uint32_t)dataSize )
+	{
+		icns_size_t	elementSize = 0;
+		icns_byte_t	*elementHeader = headerData[headerCount];
+
+		if((error = icns_next_element_header(iconFamilyIn,dataSize,dataOffset,elementHeader,&elementSize)) != ICNS_STATUS_OK)
+			return error;
+
+		#ifdef HAVE_SYS_UIO_H
+		iov[iovCount].iov_base = elementHeader;
+		iov[iovCount].iov_len = 8;
+		iovCount++;
+
+		if(elementSize > 8)
+		{
+			iov[iovCount].iov_base = ((icns_byte_t *)iconFamilyIn)+dataOffset+8;
+			iov[iovCount].iov_len = elementSize-8;
+			iovCount++;
+		}
+
+		headerCount++;
+
+		if(headerCount == ICNS_WRITE_BATCH_SIZE+1)
+		{
+			if(icns_writev_all(fd,iov,iovCount) != ICNS_STATUS_OK)
+				goto write_error;
+			headerCount = 0;
+			iovCount = 0;
+		}
+		#else
+		if(icns_write_all(fd,elementHeader,8) != ICNS_STATUS_OK)
+			goto write_error;
+
+		if( (elementSize > 8) && (icns_write_all(fd,((icns_byte_t *)iconFamilyIn)+dataOffset+8,elementSize-8) != ICNS_STATUS_OK) )
+			goto write_error;
+		#endif
+
+		dataOffset += elementSize;
+	}
+
+	#ifdef HAVE_SYS_UIO_H
+	if( (iovCount > 0) && (icns_writev_all(fd,iov,iovCount) != ICNS_STATUS_OK) )
+		goto write_error;
+	#endif
+
+	// Pass along any trailing bytes too short to be an element
+	if( (dataOffset < (icns_uint32_t)dataSize) && (icns_write_all(fd,((icns_byte_t *)iconFamilyIn)+dataOffset,dataSize-dataOffset) != ICNS_STATUS_OK) )
+		goto write_error;
 
 	return ICNS_STATUS_OK;
+
+write_error:
+
+	icns_print_err("icns_write_family_to_fd: Error writing icns to file!\n");
+	return ICNS_STATUS_IO_WRITE_ERR;
+	#else
+	icns_print_err("icns_write_family_to_fd: Not supported on this platform!\n");
+	return ICNS_STATUS_UNSUPPORTED;
+	#endif
 }
 
 
@@ -284,13 +542,13 @@ int icns_read_family_from_file(FILE *dataFile,icns_family_t **iconFamilyOut)
 		dataSize = ftell(dataFile);
 		rewind(dataFile);
 
-		dataPtr = (void *)malloc(dataSize);
+		dataPtr = (void *)icns_malloc(dataSize);
 
 		if( (error == 0) && (dataPtr != NULL) )
 		{
 			if(fread( dataPtr, sizeof(char), dataSize, dataFile) != dataSize)
 			{
-				free( dataPtr );
+				icns_free( dataPtr );
 				dataPtr = NULL;
 				dataSize = 0;
 				error = ICNS_STATUS_IO_READ_ERR;
@@ -382,7 +640,7 @@ int icns_read_family_from_file(FILE *dataFile,icns_family_t **iconFamilyOut)
 
 			if(resourceData != NULL)
 			{
-				free(resourceData);
+				icns_free(resourceData);
 				resourceData = NULL;
 			}
 		}
@@ -411,7 +669,7 @@ int icns_read_family_from_file(FILE *dataFile,icns_family_t **iconFamilyOut)
 
 			if(resourceData != NULL)
 			{
-				free(resourceData);
+				icns_free(resourceData);
 				resourceData = NULL;
 			}
 		}
@@ -429,7 +687,7 @@ exception:
 
 	if(dataPtr != NULL)
 	{
-		free(dataPtr);
+		icns_free(dataPtr);
 		dataPtr = NULL;
 	}
 
@@ -461,13 +719,13 @@ int icns_read_family_from_rsrc(FILE *dataFile,icns_family_t **iconFamilyOut)
 		dataSize = ftell(dataFile);
 		rewind(dataFile);
 
-		dataPtr = (void *)malloc(dataSize);
+		dataPtr = (void *)icns_malloc(dataSize);
 
 		if( (error == 0) && (dataPtr != NULL) )
 		{
 			if(fread( dataPtr, sizeof(char), dataSize, dataFile) != dataSize)
 			{
-				free( dataPtr );
+				icns_free( dataPtr );
 				dataPtr = NULL;
 				dataSize = 0;
 				error = ICNS_STATUS_IO_READ_ERR;
@@ -529,7 +787,7 @@ exception:
 
 	if(dataPtr != NULL)
 	{
-		free(dataPtr);
+		icns_free(dataPtr);
 		dataPtr = NULL;
 	}
 
@@ -545,6 +803,7 @@ int icns_export_family_data(icns_family_t *iconFamily,icns_size_t *dataSizeOut,i
 	icns_type_t	dataType = ICNS_NULL_TYPE;
 	icns_size_t	dataSize = 0;
 	icns_byte_t	*dataPtr = NULL;
+	ICNS_STATS_SCOPE(ICNS_STATS_EXPORT_FAMILY,iconFamily ? iconFamily->resourceSize : 0);
 
 	if(iconFamily == NULL)
 	{
@@ -595,7 +854,7 @@ int icns_export_family_data(icns_family_t *iconFamily,icns_size_t *dataSizeOut,i
 	#endif
 
 	// Allocate a new block of memory for the outgoing data
-	dataPtr = (icns_byte_t *)malloc(dataSize);
+	dataPtr = (icns_byte_t *)icns_malloc(dataSize);
 
 	if(dataPtr == NULL)
 	{
@@ -656,7 +915,7 @@ exception:
 	{
 		*dataSizeOut = 0;
 		*dataPtrOut = NULL;
-		free(dataPtr);
+		icns_free(dataPtr);
 		dataPtr = NULL;
 	}
 	else
@@ -694,7 +953,7 @@ int icns_import_family_data(icns_size_t dataSize,icns_byte_t *dataPtr,icns_famil
 	}
 
 	// icns_parse_family_data is destructive, so we allocate a new block of memory
-	iconFamilyData = malloc(dataSize);
+	iconFamilyData = icns_malloc(dataSize);
 
 	if(iconFamilyData != NULL)
 	{
@@ -722,6 +981,7 @@ int icns_parse_family_data(icns_size_t dataSize,icns_byte_t *dataPtr,icns_family
 	int		error = ICNS_STATUS_OK;
 	icns_type_t	resourceType = ICNS_NULL_TYPE;
 	icns_size_t	resourceSize = 0;
+	ICNS_STATS_SCOPE(ICNS_STATS_PARSE_FAMILY,dataSize);
 
 	if(dataSize < 8)
 	{
@@ -824,6 +1084,749 @@ exception:
 	return error;
 }
 
+/***************************** icns_map_family_from_path **************************/
+// Maps an 'icns' file read-only. Nothing is copied and the big endian headers
+// are left untouched - element headers are only parsed as lookups reach them.
+// NOTE: a family map is not safe to share between threads without locking,
+// since lookups append to the parsed header list.
+
+static void icns_release_map_data(const icns_byte_t *dataPtr,icns_size_t dataSize,icns_bool_t isMapped)
+{
+	if(dataPtr == NULL)
+		return;
+
+	#ifdef HAVE_SYS_MMAN_H
+	if(isMapped)
+	{
+		munmap((void *)dataPtr,dataSize);
+		return;
+	}
+	#endif
+
+	icns_free((void *)dataPtr);
+}
+
+int icns_map_family_from_path(const char *path,icns_family_map_t **familyMapOut)
+{
+	icns_family_map_t	*familyMap = NULL;
+	icns_byte_t		*dataPtr = NULL;
+	icns_size_t		dataSize = 0;
+	icns_bool_t		isMapped = 0;
+	icns_type_t		resourceType = ICNS_NULL_TYPE;
+	icns_size_t		resourceSize = 0;
+
+	if(path == NULL)
+	{
+		icns_print_err("icns_map_family_from_path: NULL path!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(familyMapOut == NULL)
+	{
+		icns_print_err("icns_map_family_from_path: NULL icns family map ref!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	*familyMapOut = NULL;
+
+	#ifdef HAVE_SYS_MMAN_H
+	{
+		int		fd = -1;
+		struct stat	fileInfo;
+		void		*mapPtr = NULL;
+
+		fd = open(path,O_RDONLY);
+		if(fd < 0)
+		{
+			icns_print_err("icns_map_family_from_path: Unable to open file '%s'!\n",path);
+			return ICNS_STATUS_IO_READ_ERR;
+		}
+
+		if(fstat(fd,&fileInfo) != 0)
+		{
+			icns_print_err("icns_map_family_from_path: Unable to determine size of file '%s'!\n",path);
+			close(fd);
+			return ICNS_STATUS_IO_READ_ERR;
+		}
+
+		if( (fileInfo.st_size < 8) || (fileInfo.st_size > 0x7FFFFFFF) )
+		{
+			icns_print_err("icns_map_family_from_path: file size is %ld - not an icns file!\n",(long)fileInfo.st_size);
+			close(fd);
+			return ICNS_STATUS_INVALID_DATA;
+		}
+
+		dataSize = (icns_size_t)fileInfo.st_size;
+		mapPtr = mmap(NULL,dataSize,PROT_READ,MAP_PRIVATE,fd,0);
+
+		// The mapping keeps its own reference to the file
+		close(fd);
+
+		if(mapPtr == MAP_FAILED)
+		{
+			icns_print_err("icns_map_family_from_path: Unable to map %d bytes of file '%s'!\n",(int)dataSize,path);
+			return ICNS_STATUS_IO_READ_ERR;
+		}
+
+		dataPtr = (icns_byte_t *)mapPtr;
+		isMapped = 1;
+	}
+	#else
+	{
+		FILE	*dataFile = NULL;
+		long	fileSize = 0;
+
+		dataFile = fopen(path,"rb");
+		if(dataFile == NULL)
+		{
+			icns_print_err("icns_map_family_from_path: Unable to open file '%s'!\n",path);
+			return ICNS_STATUS_IO_READ_ERR;
+		}
+
+		if( (fseek(dataFile,0,SEEK_END) != 0) || ((fileSize = ftell(dataFile)) < 0) )
+		{
+			icns_print_err("icns_map_family_from_path: Error occurred seeking to end of file!\n");
+			fclose(dataFile);
+			return ICNS_STATUS_IO_READ_ERR;
+		}
+
+		if( (fileSize < 8) || (fileSize > 0x7FFFFFFF) )
+		{
+			icns_print_err("icns_map_family_from_path: file size is %ld - not an icns file!\n",fileSize);
+			fclose(dataFile);
+			return ICNS_STATUS_INVALID_DATA;
+		}
+
+		dataSize = (icns_size_t)fileSize;
+		rewind(dataFile);
+
+		dataPtr = (icns_byte_t *)icns_malloc(dataSize);
+		if(dataPtr == NULL)
+		{
+			icns_print_err("icns_map_family_from_path: Unable to allocate memory block of size: %d!\n",(int)dataSize);
+			fclose(dataFile);
+			return ICNS_STATUS_NO_MEMORY;
+		}
+
+		if(fread(dataPtr,1,dataSize,dataFile) != (size_t)dataSize)
+		{
+			icns_print_err("icns_map_family_from_path: Error occurred reading file!\n");
+			icns_free(dataPtr);
+			fclose(dataFile);
+			return ICNS_STATUS_IO_READ_ERR;
+		}
+
+		fclose(dataFile);
+		isMapped = 0;
+	}
+	#endif
+
+	ICNS_READ_UNALIGNED_BE(resourceType, dataPtr,sizeof(icns_type_t));
+	ICNS_READ_UNALIGNED_BE(resourceSize, dataPtr + 4,sizeof(icns_size_t));
+
+	if(resourceType != ICNS_FAMILY_TYPE)
+	{
+		char typeStr[5];
+		icns_print_err("icns_map_family_from_path: Invalid icon family resource type! ('%s')\n",icns_type_str(resourceType,typeStr));
+		icns_release_map_data(dataPtr,dataSize,isMapped);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(resourceSize != dataSize)
+	{
+		icns_print_err("icns_map_family_from_path: Invalid icon family resource size! (%d)\n",resourceSize);
+		icns_release_map_data(dataPtr,dataSize,isMapped);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	familyMap = (icns_family_map_t *)icns_malloc(sizeof(icns_family_map_t));
+	if(familyMap == NULL)
+	{
+		icns_print_err("icns_map_family_from_path: Unable to allocate memory block of size: %d!\n",(int)sizeof(icns_family_map_t));
+		icns_release_map_data(dataPtr,dataSize,isMapped);
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	memset(familyMap,0,sizeof(icns_family_map_t));
+	familyMap->mapData = dataPtr;
+	familyMap->mapSize = resourceSize;
+	familyMap->isMapped = isMapped;
+	familyMap->parseOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
+
+	*familyMapOut = familyMap;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_unmap_family **************************/
+
+int icns_unmap_family(icns_family_map_t *familyMap)
+{
+	if(familyMap == NULL)
+	{
+		icns_print_err("icns_unmap_family: icns family map is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	icns_release_map_data(familyMap->mapData,familyMap->mapSize,familyMap->isMapped);
+
+	if(familyMap->entries != NULL)
+		icns_free(familyMap->entries);
+
+	icns_free(familyMap);
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_map_parse_next_element **************************/
+// Reads the next big endian element header in the map and records it
+
+static int icns_map_parse_next_element(icns_family_map_t *familyMap)
+{
+	icns_uint32_t	dataOffset = familyMap->parseOffset;
+	icns_type_t	elementType = ICNS_NULL_TYPE;
+	icns_size_t	elementSize = 0;
+
+	// Report a corrupt header on every lookup that gets that far, not just the first
+	if(familyMap->parseDone)
+		return familyMap->parseStatus;
+
+	if( (dataOffset+8) > (icns_uint32_t)familyMap->mapSize )
+	{
+		familyMap->parseDone = 1;
+		familyMap->parseStatus = ICNS_STATUS_DATA_NOT_FOUND;
+		return ICNS_STATUS_DATA_NOT_FOUND;
+	}
+
+	ICNS_READ_UNALIGNED_BE(elementType, (void *)(familyMap->mapData+dataOffset),sizeof(icns_type_t));
+	ICNS_READ_UNALIGNED_BE(elementSize, (void *)(familyMap->mapData+dataOffset+4),sizeof(icns_size_t));
+
+	#ifdef ICNS_DEBUG
+	{
+		char typeStr[5];
+		printf("  mapped element type is '%s'\n",icns_type_str(elementType,typeStr));
+		printf("  mapped element size is %d\n",elementSize);
+	}
+	#endif
+
+	if( (elementSize < 8) || (dataOffset+elementSize > (icns_uint32_t)familyMap->mapSize) )
+	{
+		icns_print_err("icns_map_parse_next_element: Invalid element size! (%d)\n",elementSize);
+		familyMap->parseDone = 1;
+		familyMap->parseStatus = ICNS_STATUS_INVALID_DATA;
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(familyMap->entryCount == familyMap->entryCapacity)
+	{
+		icns_uint32_t		newCapacity = familyMap->entryCapacity ? familyMap->entryCapacity * 2 : 16;
+		icns_element_entry_t	*newEntries = NULL;
+
+		newEntries = (icns_element_entry_t *)icns_realloc(familyMap->entries,familyMap->entryCapacity * sizeof(icns_element_entry_t),newCapacity * sizeof(icns_element_entry_t));
+		if(newEntries == NULL)
+		{
+			icns_print_err("icns_map_parse_next_element: Unable to allocate memory block of size: %d!\n",(int)(newCapacity * sizeof(icns_element_entry_t)));
+			return ICNS_STATUS_NO_MEMORY;
+		}
+
+		familyMap->entries = newEntries;
+		familyMap->entryCapacity = newCapacity;
+	}
+
+	familyMap->entries[familyMap->entryCount].elementType = elementType;
+	familyMap->entries[familyMap->entryCount].elementSize = elementSize;
+	familyMap->entries[familyMap->entryCount].elementOffset = dataOffset;
+	familyMap->entryCount++;
+
+	familyMap->parseOffset = dataOffset + elementSize;
+
+	return ICNS_STATUS_OK;
+}
+
+static void icns_map_fill_view(icns_family_map_t *familyMap,icns_element_entry_t *entry,icns_element_view_t *elementViewOut)
+{
+	elementViewOut->elementType = entry->elementType;
+	elementViewOut->elementSize = entry->elementSize;
+	elementViewOut->dataSize = entry->elementSize - sizeof(icns_type_t) - sizeof(icns_size_t);
+	elementViewOut->elementData = familyMap->mapData + entry->elementOffset + sizeof(icns_type_t) + sizeof(icns_size_t);
+}
+
+/***************************** icns_count_elements_in_map **************************/
+
+int icns_count_elements_in_map(icns_family_map_t *familyMap,icns_sint32_t *elementTotal)
+{
+	int	error = ICNS_STATUS_OK;
+
+	if(familyMap == NULL)
+	{
+		icns_print_err("icns_count_elements_in_map: icns family map is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(elementTotal == NULL)
+	{
+		icns_print_err("icns_count_elements_in_map: element count ref is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	while( (error = icns_map_parse_next_element(familyMap)) == ICNS_STATUS_OK )
+		;
+
+	if(error != ICNS_STATUS_DATA_NOT_FOUND)
+		return error;
+
+	*elementTotal = familyMap->entryCount;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_get_element_view_from_map **************************/
+// Finds an element in the map without copying it. The view stays valid
+// until icns_unmap_family is called.
+
+int icns_get_element_view_from_map(icns_family_map_t *familyMap,icns_type_t iconType,icns_element_view_t *elementViewOut)
+{
+	int		error = ICNS_STATUS_OK;
+	icns_uint32_t	entryID = 0;
+
+	if(familyMap == NULL)
+	{
+		icns_print_err("icns_get_element_view_from_map: icns family map is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(elementViewOut == NULL)
+	{
+		icns_print_err("icns_get_element_view_from_map: icns element view is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	memset(elementViewOut,0,sizeof(icns_element_view_t));
+
+	// Check what has already been parsed, then keep reading headers
+	for(entryID = 0; ; entryID++)
+	{
+		if(entryID == familyMap->entryCount)
+		{
+			error = icns_map_parse_next_element(familyMap);
+			if(error == ICNS_STATUS_DATA_NOT_FOUND)
+				break;
+			if(error != ICNS_STATUS_OK)
+				return error;
+		}
+
+		if(familyMap->entries[entryID].elementType == iconType)
+		{
+			icns_map_fill_view(familyMap,&familyMap->entries[entryID],elementViewOut);
+			return ICNS_STATUS_OK;
+		}
+	}
+
+	icns_print_err("icns_get_element_view_from_map: Unable to find requested icon data!\n");
+
+	return ICNS_STATUS_DATA_NOT_FOUND;
+}
+
+/***************************** icns_get_nth_element_view_from_map **************************/
+// Retrieves elements in file order, for walking every element in the map
+
+int icns_get_nth_element_view_from_map(icns_family_map_t *familyMap,icns_uint32_t elementIndex,icns_element_view_t *elementViewOut)
+{
+	int	error = ICNS_STATUS_OK;
+
+	if(familyMap == NULL)
+	{
+		icns_print_err("icns_get_nth_element_view_from_map: icns family map is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(elementViewOut == NULL)
+	{
+		icns_print_err("icns_get_nth_element_view_from_map: icns element view is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	memset(elementViewOut,0,sizeof(icns_element_view_t));
+
+	while(elementIndex >= familyMap->entryCount)
+	{
+		// Running off the end is not an error worth printing
+		if((error = icns_map_parse_next_element(familyMap)) != ICNS_STATUS_OK)
+			return error;
+	}
+
+	icns_map_fill_view(familyMap,&familyMap->entries[elementIndex],elementViewOut);
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_stream_t **************************/
+// Either a stdio stream or a raw descriptor - the streaming readers below
+// only ever read at absolute offsets, so they work the same on both.
+
+typedef struct icns_stream_t
+{
+	FILE		*dataFile;
+	int		fd;
+} icns_stream_t;
+
+static int icns_stream_read_at(icns_stream_t *stream,icns_uint32_t dataOffset,void *dataPtr,icns_uint32_t dataSize)
+{
+	if(stream->dataFile != NULL)
+	{
+		if(fseek(stream->dataFile,dataOffset,SEEK_SET) != 0)
+			return ICNS_STATUS_IO_READ_ERR;
+
+		if(fread(dataPtr,1,dataSize,stream->dataFile) != (size_t)dataSize)
+			return ICNS_STATUS_IO_READ_ERR;
+
+		return ICNS_STATUS_OK;
+	}
+
+	#if defined(HAVE_UNISTD_H)
+	while(dataSize > 0)
+	{
+		ssize_t	readSize = 0;
+
+		#ifdef HAVE_PREAD
+		readSize = pread(stream->fd,dataPtr,dataSize,(off_t)dataOffset);
+		#else
+		if(lseek(stream->fd,(off_t)dataOffset,SEEK_SET) == (off_t)-1)
+			return ICNS_STATUS_IO_READ_ERR;
+		readSize = read(stream->fd,dataPtr,dataSize);
+		#endif
+
+		if(readSize <= 0)
+			return ICNS_STATUS_IO_READ_ERR;
+
+		dataPtr = ((icns_byte_t *)dataPtr) + readSize;
+		dataOffset += readSize;
+		dataSize -= readSize;
+	}
+
+	return ICNS_STATUS_OK;
+	#else
+	return ICNS_STATUS_UNSUPPORTED;
+	#endif
+}
+
+/***************************** icns_stream_locate_element **************************/
+// Finds where an element lives in an 'icns' file without reading any element
+// data. The 'TOC ' element, when there is one, gives every element size up
+// front; otherwise (or if the TOC doesn't match the file) we hop from one
+// element header to the next.
+
+static int icns_stream_locate_element(icns_stream_t *stream,icns_type_t iconType,icns_element_entry_t *elementEntryOut)
+{
+	int		error = ICNS_STATUS_OK;
+	icns_byte_t	headerData[8];
+	icns_type_t	resourceType = ICNS_NULL_TYPE;
+	icns_size_t	resourceSize = 0;
+	icns_type_t	elementType = ICNS_NULL_TYPE;
+	icns_size_t	elementSize = 0;
+	icns_uint32_t	dataOffset = 0;
+
+	if((error = icns_stream_read_at(stream,0,headerData,8)) != ICNS_STATUS_OK)
+	{
+		icns_print_err("icns_stream_locate_element: Error occurred reading icns header!\n");
+		return error;
+	}
+
+	ICNS_READ_UNALIGNED_BE(resourceType, headerData,sizeof(icns_type_t));
+	ICNS_READ_UNALIGNED_BE(resourceSize, headerData + 4,sizeof(icns_size_t));
+
+	if(resourceType != ICNS_FAMILY_TYPE)
+	{
+		char typeStr[5];
+		icns_print_err("icns_stream_locate_element: Invalid icon family resource type! ('%s')\n",icns_type_str(resourceType,typeStr));
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(resourceSize < 8)
+	{
+		icns_print_err("icns_stream_locate_element: Invalid icon family resource size! (%d)\n",resourceSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	dataOffset = sizeof(icns_type_t) + sizeof(icns_size_t);
+
+	// Try the table of contents first
+	if( (iconType != ICNS_TABLE_OF_CONTENTS) && (dataOffset+8 <= (icns_uint32_t)resourceSize) )
+	{
+		if((error = icns_stream_read_at(stream,dataOffset,headerData,8)) != ICNS_STATUS_OK)
+		{
+			icns_print_err("icns_stream_locate_element: Error occurred reading element header!\n");
+			return error;
+		}
+
+		ICNS_READ_UNALIGNED_BE(elementType, headerData,sizeof(icns_type_t));
+		ICNS_READ_UNALIGNED_BE(elementSize, headerData + 4,sizeof(icns_size_t));
+
+		if( (elementType == ICNS_TABLE_OF_CONTENTS) && (elementSize >= 8) && (dataOffset+elementSize <= (icns_uint32_t)resourceSize) )
+		{
+			icns_uint32_t	tocDataSize = elementSize - 8;
+			icns_byte_t	*tocData = NULL;
+			icns_uint32_t	tocOffset = 0;
+			icns_uint32_t	entryOffset = dataOffset + elementSize;
+
+			tocData = (icns_byte_t *)icns_malloc(tocDataSize ? tocDataSize : 1);
+			if(tocData == NULL)
+			{
+				icns_print_err("icns_stream_locate_element: Unable to allocate memory block of size: %d!\n",(int)tocDataSize);
+				return ICNS_STATUS_NO_MEMORY;
+			}
+
+			if((error = icns_stream_read_at(stream,dataOffset+8,tocData,tocDataSize)) != ICNS_STATUS_OK)
+			{
+				icns_print_err("icns_stream_locate_element: Error occurred reading table of contents!\n");
+				icns_free(tocData);
+				return error;
+			}
+
+			#ifdef ICNS_DEBUG
+			printf("  using table of contents with %d entries\n",(int)(tocDataSize / 8));
+			#endif
+
+			for(tocOffset = 0; tocOffset+8 <= tocDataSize; tocOffset += 8)
+			{
+				icns_type_t	tocType = ICNS_NULL_TYPE;
+				icns_size_t	tocSize = 0;
+
+				ICNS_READ_UNALIGNED_BE(tocType, tocData+tocOffset,sizeof(icns_type_t));
+				ICNS_READ_UNALIGNED_BE(tocSize, tocData+tocOffset+4,sizeof(icns_size_t));
+
+				if( (tocSize < 8) || (entryOffset+tocSize > (icns_uint32_t)resourceSize) )
+					break;
+
+				if(tocType == iconType)
+				{
+					// Trust, but verify
+					if( (icns_stream_read_at(stream,entryOffset,headerData,8) == ICNS_STATUS_OK) )
+					{
+						ICNS_READ_UNALIGNED_BE(elementType, headerData,sizeof(icns_type_t));
+						ICNS_READ_UNALIGNED_BE(elementSize, headerData + 4,sizeof(icns_size_t));
+
+						if( (elementType == tocType) && (elementSize == tocSize) )
+						{
+							elementEntryOut->elementType = elementType;
+							elementEntryOut->elementSize = elementSize;
+							elementEntryOut->elementOffset = entryOffset;
+							icns_free(tocData);
+							return ICNS_STATUS_OK;
+						}
+					}
+					break;
+				}
+
+				entryOffset += tocSize;
+			}
+
+			icns_free(tocData);
+
+			#ifdef ICNS_DEBUG
+			printf("  element not in table of contents - scanning headers\n");
+			#endif
+		}
+	}
+
+	// No (usable) TOC - walk the element headers
+	while( dataOffset+8 <= (icns_uint32_t)resourceSize )
+	{
+		if((error = icns_stream_read_at(stream,dataOffset,headerData,8)) != ICNS_STATUS_OK)
+		{
+			icns_print_err("icns_stream_locate_element: Error occurred reading element header!\n");
+			return error;
+		}
+
+		ICNS_READ_UNALIGNED_BE(elementType, headerData,sizeof(icns_type_t));
+		ICNS_READ_UNALIGNED_BE(elementSize, headerData + 4,sizeof(icns_size_t));
+
+		if( (elementSize < 8) || (dataOffset+elementSize > (icns_uint32_t)resourceSize) )
+		{
+			icns_print_err("icns_stream_locate_element: Invalid element size! (%d)\n",elementSize);
+			return ICNS_STATUS_INVALID_DATA;
+		}
+
+		if(elementType == iconType)
+		{
+			elementEntryOut->elementType = elementType;
+			elementEntryOut->elementSize = elementSize;
+			elementEntryOut->elementOffset = dataOffset;
+			return ICNS_STATUS_OK;
+		}
+
+		dataOffset += elementSize;
+	}
+
+	return ICNS_STATUS_DATA_NOT_FOUND;
+}
+
+/***************************** icns_stream_read_element **************************/
+
+static int icns_stream_read_element(icns_stream_t *stream,icns_type_t iconType,icns_element_t **iconElementOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_element_entry_t	elementEntry;
+	icns_byte_t		*elementData = NULL;
+
+	*iconElementOut = NULL;
+
+	error = icns_stream_locate_element(stream,iconType,&elementEntry);
+
+	if(error == ICNS_STATUS_DATA_NOT_FOUND)
+	{
+		icns_print_err("icns_stream_read_element: Unable to find requested icon data!\n");
+		return error;
+	}
+	else if(error != ICNS_STATUS_OK)
+	{
+		return error;
+	}
+
+	elementData = (icns_byte_t *)icns_malloc(elementEntry.elementSize);
+	if(elementData == NULL)
+	{
+		icns_print_err("icns_stream_read_element: Unable to allocate memory block of size: %d!\n",elementEntry.elementSize);
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	if((error = icns_stream_read_at(stream,elementEntry.elementOffset,elementData,elementEntry.elementSize)) != ICNS_STATUS_OK)
+	{
+		icns_print_err("icns_stream_read_element: Error occurred reading element data!\n");
+		icns_free(elementData);
+		return error;
+	}
+
+	// Same layout as elements inside a parsed family - native endian header
+	ICNS_WRITE_UNALIGNED(elementData, elementEntry.elementType, sizeof(icns_type_t));
+	ICNS_WRITE_UNALIGNED(elementData + 4, elementEntry.elementSize, sizeof(icns_size_t));
+
+	*iconElementOut = (icns_element_t *)elementData;
+
+	return ICNS_STATUS_OK;
+}
+
+/***************************** icns_read_element_from_file **************************/
+// Reads a single element out of an 'icns' file, leaving the rest of the file
+// alone. The stream must be seekable; the family is expected at offset 0.
+
+int icns_read_element_from_file(FILE *dataFile,icns_type_t iconType,icns_element_t **iconElementOut)
+{
+	icns_stream_t	stream;
+
+	if( dataFile == NULL )
+	{
+		icns_print_err("icns_read_element_from_file: NULL file pointer!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if( iconElementOut == NULL )
+	{
+		icns_print_err("icns_read_element_from_file: NULL icns element ref!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	stream.dataFile = dataFile;
+	stream.fd = -1;
+
+	return icns_stream_read_element(&stream,iconType,iconElementOut);
+}
+
+/***************************** icns_read_element_from_fd **************************/
+// Same as icns_read_element_from_file, for a file descriptor. Uses pread where
+// available, so the descriptor's file offset is left alone and several threads
+// can read from the same descriptor.
+
+int icns_read_element_from_fd(int fd,icns_type_t iconType,icns_element_t **iconElementOut)
+{
+	icns_stream_t	stream;
+
+	if( fd < 0 )
+	{
+		icns_print_err("icns_read_element_from_fd: Invalid file descriptor!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if( iconElementOut == NULL )
+	{
+		icns_print_err("icns_read_element_from_fd: NULL icns element ref!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	stream.dataFile = NULL;
+	stream.fd = fd;
+
+	return icns_stream_read_element(&stream,iconType,iconElementOut);
+}
+
+/***************************** icns_get_element_size_from_file **************************/
+// Reports the size of an element in an 'icns' file (including the 8 byte
+// header) without reading its data - sets 0 if the file has no such element.
+
+int icns_get_element_size_from_file(FILE *dataFile,icns_type_t iconType,icns_size_t *elementSizeOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_stream_t		stream;
+	icns_element_entry_t	elementEntry;
+
+	if( dataFile == NULL )
+	{
+		icns_print_err("icns_get_element_size_from_file: NULL file pointer!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if( elementSizeOut == NULL )
+	{
+		icns_print_err("icns_get_element_size_from_file: NULL element size ref!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	*elementSizeOut = 0;
+
+	stream.dataFile = dataFile;
+	stream.fd = -1;
+
+	error = icns_stream_locate_element(&stream,iconType,&elementEntry);
+
+	if(error == ICNS_STATUS_OK)
+		*elementSizeOut = elementEntry.elementSize;
+
+	return error;
+}
+
+/***************************** icns_get_element_size_from_fd **************************/
+
+int icns_get_element_size_from_fd(int fd,icns_type_t iconType,icns_size_t *elementSizeOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_stream_t		stream;
+	icns_element_entry_t	elementEntry;
+
+	if( fd < 0 )
+	{
+		icns_print_err("icns_get_element_size_from_fd: Invalid file descriptor!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if( elementSizeOut == NULL )
+	{
+		icns_print_err("icns_get_element_size_from_fd: NULL element size ref!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	*elementSizeOut = 0;
+
+	stream.dataFile = NULL;
+	stream.fd = fd;
+
+	error = icns_stream_locate_element(&stream,iconType,&elementEntry);
+
+	if(error == ICNS_STATUS_OK)
+		*elementSizeOut = elementEntry.elementSize;
+
+	return error;
+}
+
 /***************************** icns_find_family_in_mac_resource **************************/
 
 int icns_find_family_in_mac_resource(icns_size_t resDataSize, icns_byte_t *resData, icns_rsrc_endian_t fileEndian, icns_family_t **dataOut)
@@ -1023,7 +2026,7 @@ int icns_find_family_in_mac_resource(icns_size_t resDataSize, icns_byte_t *resDa
 				goto exception;
 			}
 
-			resItemData = (icns_byte_t*)malloc(resItemDataSize);
+			resItemData = (icns_byte_t*)icns_malloc(resItemDataSize);
 
 			if(resItemData != NULL)
 			{
@@ -1200,7 +2203,7 @@ int icns_read_macbinary_resource_fork(icns_size_t dataSize,icns_byte_t *dataPtr,
 		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	resourceDataPtr = (icns_byte_t *)malloc(resourceDataSize);
+	resourceDataPtr = (icns_byte_t *)icns_malloc(resourceDataSize);
 
 	if(resourceDataPtr == NULL)
 	{
@@ -1349,7 +2352,7 @@ int icns_read_apple_encoded_resource_fork(icns_size_t dataSize,icns_byte_t *data
 		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	resourceDataPtr = (icns_byte_t *)malloc(resourceDataSize);
+	resourceDataPtr = (icns_byte_t *)icns_malloc(resourceDataSize);
 
 	if(resourceDataPtr == NULL)
 	{
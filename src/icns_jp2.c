@@ -36,15 +36,216 @@ Boston, MA 02110-1301, USA.
 #include <openjpeg.h>
 #endif
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef ICNS_SIMD_X86
+ #include <immintrin.h>
+#endif
+
 
 #if defined(ICNS_JASPER) && defined(ICNS_OPENJPEG)
 	#error "Should use either Jasper or OpenJPEG, but not both!"
 #endif
 
 
+//***************************** icns_get_jp2_reduce_levels **************************//
+// Reads the image size and the number of wavelet decomposition levels from
+// the codestream main header (SIZ and COD markers), and works out how many
+// resolution levels can be dropped while staying at or above targetSize.
+// Anything it can not parse gets 0, i.e. a full decode.
+
+static icns_uint32_t icns_jp2_read_uint32(const icns_byte_t *bytes)
+{
+	return ((icns_uint32_t)bytes[0] << 24) | ((icns_uint32_t)bytes[1] << 16) | ((icns_uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+int icns_get_jp2_reduce_levels(icns_size_t dataSize, const icns_byte_t *dataPtr, icns_uint32_t targetSize)
+{
+	icns_size_t	offset = 0;
+	icns_size_t	codeStart = 0;
+	icns_size_t	codeEnd = dataSize;
+	icns_uint32_t	imageWidth = 0;
+	icns_uint32_t	imageHeight = 0;
+	int		levels = -1;
+	int		reduceLevels = 0;
+
+	if(dataPtr == NULL || dataSize < 4)
+		return 0;
+
+	// Raw codestreams start with SOC+SIZ, jp2 files are boxes around one
+	if(!(dataPtr[0] == 0xFF && dataPtr[1] == 0x4F && dataPtr[2] == 0xFF && dataPtr[3] == 0x51))
+	{
+		codeStart = 0;
+		codeEnd = 0;
+
+		while(offset + 8 <= dataSize)
+		{
+			icns_uint64_t	boxSize = icns_jp2_read_uint32(dataPtr + offset);
+			icns_uint32_t	boxType = icns_jp2_read_uint32(dataPtr + offset + 4);
+			icns_size_t	headerSize = 8;
+
+			if(boxSize == 1)
+			{
+				if(offset + 16 > dataSize)
+					return 0;
+				boxSize = ((icns_uint64_t)icns_jp2_read_uint32(dataPtr + offset + 8) << 32) | icns_jp2_read_uint32(dataPtr + offset + 12);
+				headerSize = 16;
+			}
+			else if(boxSize == 0)
+			{
+				boxSize = dataSize - offset;
+			}
+
+			if(boxSize < headerSize || boxSize > dataSize - offset)
+				return 0;
+
+			// 'jp2c' - contiguous codestream box
+			if(boxType == 0x6A703263)
+			{
+				codeStart = offset + headerSize;
+				codeEnd = offset + boxSize;
+				break;
+			}
+
+			offset += boxSize;
+		}
+
+		if(codeEnd == 0)
+			return 0;
+	}
+
+	// SOC, then SIZ: Lsiz Rsiz Xsiz Ysiz XOsiz YOsiz ...
+	offset = codeStart;
+	if(offset + 24 > codeEnd || dataPtr[offset] != 0xFF || dataPtr[offset+1] != 0x4F || dataPtr[offset+2] != 0xFF || dataPtr[offset+3] != 0x51)
+		return 0;
+
+	imageWidth = icns_jp2_read_uint32(dataPtr + offset + 8) - icns_jp2_read_uint32(dataPtr + offset + 16);
+	imageHeight = icns_jp2_read_uint32(dataPtr + offset + 12) - icns_jp2_read_uint32(dataPtr + offset + 20);
+
+	// Walk the main header marker segments up to the first tile
+	offset += 2;
+	while(offset + 4 <= codeEnd && dataPtr[offset] == 0xFF)
+	{
+		icns_byte_t	marker = dataPtr[offset+1];
+		icns_size_t	segmentSize = (dataPtr[offset+2] << 8) | dataPtr[offset+3];
+
+		// SOT - end of the main header
+		if(marker == 0x90)
+			break;
+
+		// COD: Lcod Scod SGcod(4) then the decomposition level count
+		if(marker == 0x52)
+		{
+			if(segmentSize >= 8 && offset + 2 + 8 <= codeEnd)
+				levels = dataPtr[offset + 2 + 7];
+			break;
+		}
+
+		offset += 2 + segmentSize;
+	}
+
+	if(levels <= 0)
+		return 0;
+
+	while(reduceLevels < levels && (imageWidth >> (reduceLevels + 1)) >= targetSize && (imageHeight >> (reduceLevels + 1)) >= targetSize)
+		reduceLevels++;
+
+	return reduceLevels;
+}
+
+//***************************** icns_jp2_codec_init **************************//
+// JasPer keeps its codec table in process-wide state, and used to be set up
+// and torn down around every single jp2 image. A session keeps it set up:
+// each icns_jp2_codec_init() holds it until the matching
+// icns_jp2_codec_cleanup(). Sessions nest and may be opened or closed from
+// any thread. Without an open session each conversion opens its own, which
+// is the old per-image behaviour.
+
+static int	gJP2CodecSessions = 0;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	gJP2CodecLock = PTHREAD_MUTEX_INITIALIZER;
+ #define ICNS_JP2_CODEC_LOCK()		pthread_mutex_lock(&gJP2CodecLock)
+ #define ICNS_JP2_CODEC_UNLOCK()	pthread_mutex_unlock(&gJP2CodecLock)
+#else
+ #define ICNS_JP2_CODEC_LOCK()
+ #define ICNS_JP2_CODEC_UNLOCK()
+#endif
+
+int icns_jp2_codec_init(void)
+{
+	int error = ICNS_STATUS_OK;
+
+	ICNS_JP2_CODEC_LOCK();
+
+	if(gJP2CodecSessions == 0)
+	{
+		#ifdef ICNS_JASPER
+		if(jas_init() != 0)
+		{
+			icns_print_err("icns_jp2_codec_init: Unable to initialize jasper!\n");
+			error = ICNS_STATUS_UNSUPPORTED;
+		}
+		#endif
+		// OpenJPEG has no global state to set up
+	}
+
+	if(error == ICNS_STATUS_OK)
+		gJP2CodecSessions++;
+
+	ICNS_JP2_CODEC_UNLOCK();
+
+	return error;
+}
+
+//***************************** icns_jp2_codec_cleanup **************************//
+// Closes a session opened with icns_jp2_codec_init; the last one out
+// releases the codec
+
+int icns_jp2_codec_cleanup(void)
+{
+	int error = ICNS_STATUS_OK;
+
+	ICNS_JP2_CODEC_LOCK();
+
+	if(gJP2CodecSessions == 0)
+	{
+		icns_print_err("icns_jp2_codec_cleanup: No jp2 codec session is open!\n");
+		error = ICNS_STATUS_INVALID_DATA;
+	}
+	else if(--gJP2CodecSessions == 0)
+	{
+		#ifdef ICNS_JASPER
+		jas_image_clearfmts();
+		jas_cleanup();
+		#endif
+	}
+
+	ICNS_JP2_CODEC_UNLOCK();
+
+	return error;
+}
+
+
 int icns_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *imageOut)
+{
+	return icns_jp2_to_image_at_size(dataSize, dataPtr, 0, imageOut);
+}
+
+//***************************** icns_jp2_to_image_at_size **************************//
+// Decodes jp2 data for display at targetSize pixels (0 means full size).
+// JPEG 2000 stores each image as a chain of half-size resolution levels, so
+// only the levels needed for an image at least targetSize on each side are
+// decoded - a 512x512 element asked for at 64 comes back 64x64, at 100 it
+// comes back 128x128 and the caller scales the rest of the way.
+
+int icns_jp2_to_image_at_size(icns_size_t dataSize, icns_byte_t *dataPtr, icns_uint32_t targetSize, icns_image_t *imageOut)
 {
 	int error = ICNS_STATUS_OK;
+	int reduceLevels = 0;
+	ICNS_STATS_SCOPE(ICNS_STATS_DECODE_JP2,dataSize);
 
 	if(dataPtr == NULL)
 	{
@@ -64,16 +265,20 @@ int icns_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *
 		return ICNS_STATUS_INVALID_DATA;
 	}
 
+	if(targetSize > 0)
+		reduceLevels = icns_get_jp2_reduce_levels(dataSize, dataPtr, targetSize);
+
 	#ifdef ICNS_DEBUG
-	printf("Decoding JP2 image...\n");
+	printf("Decoding JP2 image... (discarding %d resolution levels)\n",reduceLevels);
 	#endif
 
 	#ifdef ICNS_JASPER
-		error = icns_jas_jp2_to_image(dataSize, dataPtr, imageOut);
+		error = icns_jas_jp2_to_image(dataSize, dataPtr, reduceLevels, imageOut);
 	#else
 	#ifdef ICNS_OPENJPEG
-		error = icns_opj_jp2_to_image(dataSize, dataPtr, imageOut);
+		error = icns_opj_jp2_to_image(dataSize, dataPtr, reduceLevels, imageOut);
 	#else
+		(void)reduceLevels;
 		icns_print_err("icns_jp2_to_image: libicns requires jasper or openjpeg to convert jp2 data!\n");
 		icns_free_image(imageOut);
 		error = ICNS_STATUS_UNSUPPORTED;
@@ -100,6 +305,7 @@ int icns_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *
 int icns_image_to_jp2(icns_image_t *image, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut)
 {
 	int error = ICNS_STATUS_OK;
+	ICNS_STATS_SCOPE(ICNS_STATS_ENCODE_JP2,image ? image->imageDataSize : 0);
 
 	if(image == NULL)
 	{
@@ -144,7 +350,7 @@ int icns_image_to_jp2(icns_image_t *image, icns_size_t *dataSizeOut, icns_byte_t
 
 #ifdef ICNS_JASPER
 
-int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *imageOut)
+int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, int reduceLevels, icns_image_t *imageOut)
 {
 	int           error = ICNS_STATUS_OK;
 	jas_stream_t  *imagestream = NULL;
@@ -152,12 +358,15 @@ int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 	jas_image_t   *image = NULL;
 	jas_matrix_t  *bufs[4] = {NULL,NULL,NULL,NULL};
 	icns_sint32_t imageChannels = 0;
+	icns_sint32_t sourceWidth = 0;
+	icns_sint32_t sourceHeight = 0;
 	icns_sint32_t imageWidth = 0;
 	icns_sint32_t imageHeight = 0;
 	icns_sint32_t imagePixelDepth = 0;
 	icns_sint32_t imageDataSize = 0;
 	icns_byte_t   *imageData = NULL;
 	icns_sint8_t    adjust[4] = {0,0,0,0};
+	int scale = 1;
 	int x, y, c;
 
 	if(dataPtr == NULL)
@@ -178,7 +387,10 @@ int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	jas_init();
+	// Cheap when the caller holds a session already
+	error = icns_jp2_codec_init();
+	if(error != ICNS_STATUS_OK)
+		return error;
 
 	// Connect a jasper stream to the memory
 	imagestream = jas_stream_memopen((char*)dataPtr, dataSize);
@@ -186,7 +398,8 @@ int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 	if(imagestream == NULL)
 	{
 		icns_print_err("icns_jas_jp2_to_image: Unable to connect to buffer for decoding!\n");
-		return ICNS_STATUS_INVALID_DATA;
+		error = ICNS_STATUS_INVALID_DATA;
+		goto exception;
 	}
 
 	// Determine the image format
@@ -196,7 +409,8 @@ int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 	{
 		icns_print_err("icns_jas_jp2_to_image: Unable to determine jp2 data format! (%d)\n",datafmt);
 		jas_stream_close(imagestream);
-		return ICNS_STATUS_INVALID_DATA;
+		error = ICNS_STATUS_INVALID_DATA;
+		goto exception;
 	}
 
 	//.Decode the image data
@@ -205,12 +419,15 @@ int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 	// that fails if there are not 3 channels or components (RGB). The
 	// data in icns files is usually RGBA - 4 channels. Thus, the
 	// assert will cause the program to crash.
-	if(!(image = jas_image_decode(imagestream, datafmt, 0)))
+	image = jas_image_decode(imagestream, datafmt, 0);
+	jas_stream_close(imagestream);
+
+	if(image == NULL)
 	{
 		icns_print_err("icns_jas_jp2_to_image: Error while decoding jp2 data stream!\n");
-		return ICNS_STATUS_INVALID_DATA;
+		error = ICNS_STATUS_INVALID_DATA;
+		goto exception;
 	}
-	jas_stream_close(imagestream);
 
 	// JP2 components, i.e. channels in icns case
 	imageChannels = jas_image_numcmpts(image);
@@ -223,15 +440,25 @@ int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 	if( imageChannels != 4)
 	{
 		icns_print_err("icns_jas_jp2_to_image: Number of jp2 components (%d) is invalid!\n",imageChannels);
-		return ICNS_STATUS_INVALID_DATA;
+		error = ICNS_STATUS_INVALID_DATA;
+		goto exception;
 	}
 
 	// Assume that we can retrieve all the relevant image
 	// information from componenent number zero.
-	imageWidth = jas_image_cmptwidth(image, 0);
-	imageHeight = jas_image_cmptheight(image, 0);
+	sourceWidth = jas_image_cmptwidth(image, 0);
+	sourceHeight = jas_image_cmptheight(image, 0);
 	imagePixelDepth = jas_image_cmptprec(image, 0);
 
+	// JasPer always decodes every resolution level, so dropped levels are
+	// folded in here by averaging scale x scale blocks of the full image
+	while(reduceLevels > 0 && ((sourceWidth >> reduceLevels) == 0 || (sourceHeight >> reduceLevels) == 0))
+		reduceLevels--;
+
+	scale = 1 << reduceLevels;
+	imageWidth = sourceWidth >> reduceLevels;
+	imageHeight = sourceHeight >> reduceLevels;
+
 	#ifdef ICNS_DEBUG
 	for(c = 0; c < 4; c++)
 	{
@@ -245,7 +472,7 @@ int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 	imageOut->imageChannels = imageChannels;
 	imageOut->imagePixelDepth = imagePixelDepth;
 	imageOut->imageDataSize = imageDataSize;
-	imageData = (icns_byte_t *)malloc(imageDataSize);
+	imageData = (icns_byte_t *)icns_malloc(imageDataSize);
 	if(!imageData) {
 		icns_print_err("icns_jas_jp2_to_image: Unable to allocate memory block of size: %d!\n",imageDataSize);
 		error = ICNS_STATUS_NO_MEMORY;
@@ -270,7 +497,7 @@ int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 
 	for (c = 0; c < 4; c++)
 	{
-		if((bufs[c] = jas_matrix_create(1, imageWidth)) == NULL)
+		if((bufs[c] = jas_matrix_create(scale, sourceWidth)) == NULL)
 		{
 			icns_print_err("icns_jas_jp2_to_image: Unable to create image matix! (No memory)\n");
 			error = ICNS_STATUS_NO_MEMORY;
@@ -285,7 +512,7 @@ int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 
 		for(c = 0; c < 4; c++)
 		{
-			if(jas_image_readcmpt(image, c, 0, y, imageWidth, 1, bufs[c]))
+			if(jas_image_readcmpt(image, c, 0, y * scale, sourceWidth, scale, bufs[c]))
 			{
 				icns_print_err("icns_jas_jp2_to_image: Unable to read data for component #%d!\n",c);
 				error = ICNS_STATUS_INVALID_DATA;
@@ -295,10 +522,18 @@ int icns_jas_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 
 		for (x=0; x<imageWidth; x++)
 		{
-			r = (jas_matrix_getv(bufs[0], x));
-			g = (jas_matrix_getv(bufs[1], x));
-			b = (jas_matrix_getv(bufs[2], x));
-			a = (jas_matrix_getv(bufs[3], x));
+			int sum[4] = {0,0,0,0};
+			int bx, by;
+
+			for(c = 0; c < 4; c++)
+				for(by = 0; by < scale; by++)
+					for(bx = 0; bx < scale; bx++)
+						sum[c] += jas_matrix_get(bufs[c], by, x * scale + bx);
+
+			r = (sum[0] + (scale * scale / 2)) >> (2 * reduceLevels);
+			g = (sum[1] + (scale * scale / 2)) >> (2 * reduceLevels);
+			b = (sum[2] + (scale * scale / 2)) >> (2 * reduceLevels);
+			a = (sum[3] + (scale * scale / 2)) >> (2 * reduceLevels);
 
 			dst_pixel = (icns_rgba_t *)&(imageData[y*imageWidth*imageChannels+x*imageChannels]);
 
@@ -317,9 +552,10 @@ exception:
 			jas_matrix_destroy(bufs[c]);
 	}
 
-	jas_image_destroy(image);
-	jas_image_clearfmts();
-	jas_cleanup();
+	if(image != NULL)
+		jas_image_destroy(image);
+
+	icns_jp2_codec_cleanup();
 
 	return error;
 }
@@ -398,14 +634,17 @@ int icns_jas_image_to_jp2(icns_image_t *image, icns_size_t *dataSizeOut, icns_by
 		cmptparms[c].sgnd = false;
 	}
 
-	// Initialize Jasper
-	jas_init();
+	// Initialize Jasper - cheap when the caller holds a session already
+	error = icns_jp2_codec_init();
+	if(error != ICNS_STATUS_OK)
+		return error;
 
 	// Allocate a new japser image
 	if(!(jasimage = jas_image_create(4, cmptparms, JAS_CLRSPC_UNKNOWN)))
 	{
 		icns_print_err("icns_jas_image_to_jp2: could not allocate new jasper image! (Likely out of memory)\n");
-		return ICNS_STATUS_NO_MEMORY;
+		error = ICNS_STATUS_NO_MEMORY;
+		goto exception;
 	}
 
 	// Set up the image components
@@ -463,6 +702,7 @@ int icns_jas_image_to_jp2(icns_image_t *image, icns_size_t *dataSizeOut, icns_by
 
 	if(jas_image_encode(jasimage, imagestream, jas_image_strtofmt("jp2"),NULL)) {
 		icns_print_err("icns_jas_image_to_jp2: Unable to encode jp2 data!\n");
+		jas_stream_close(imagestream);
 		error = ICNS_STATUS_INVALID_DATA;
 		goto exception;
 	}
@@ -477,11 +717,14 @@ int icns_jas_image_to_jp2(icns_image_t *image, icns_size_t *dataSizeOut, icns_by
 	#endif
 
 	// Offload the stream to our memory buffers
-	*dataPtrOut = (icns_byte_t *)malloc(*dataSizeOut);
+	*dataPtrOut = (icns_byte_t *)icns_malloc(*dataSizeOut);
 	if(!(*dataPtrOut))
 	{
 		icns_print_err("icns_jas_image_to_jp2: Unable to allocate memory block of size: %d ($s:%m)!\n",(int)*dataSizeOut);
-		return ICNS_STATUS_NO_MEMORY;
+		jas_stream_close(imagestream);
+		*dataSizeOut = 0;
+		error = ICNS_STATUS_NO_MEMORY;
+		goto exception;
 	}
 
 	jas_stream_rewind(imagestream);
@@ -498,9 +741,10 @@ exception:
 			jas_matrix_destroy(bufs[c]);
 	}
 
-	jas_image_destroy(jasimage);
-	jas_image_clearfmts();
-	jas_cleanup();
+	if(jasimage != NULL)
+		jas_image_destroy(jasimage);
+
+	icns_jp2_codec_cleanup();
 
 	return error;
 }
@@ -512,7 +756,7 @@ exception:
 // Only compile the openjpeg routines if we have support for it
 #ifdef ICNS_OPENJPEG
 
-int icns_opj_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *imageOut)
+int icns_opj_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, int reduceLevels, icns_image_t *imageOut)
 {
 	int         error = ICNS_STATUS_OK;
 	opj_image_t *image = NULL;
@@ -535,7 +779,11 @@ int icns_opj_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 		return ICNS_STATUS_INVALID_DATA;
 	}
 
-	error = icns_opj_jp2_dec(dataSize, dataPtr, &image);
+	error = icns_opj_jp2_dec(dataSize, dataPtr, reduceLevels, &image);
+
+	// A tile may use fewer levels than the main header says - fall back to a full decode
+	if(!image && reduceLevels > 0)
+		error = icns_opj_jp2_dec(dataSize, dataPtr, 0, &image);
 
 	if(!image)
 		return ICNS_STATUS_INVALID_DATA;
@@ -548,7 +796,7 @@ int icns_opj_jp2_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image
 }
 
 // Decode jp2 data using OpenJPEG
-int icns_opj_jp2_dec(icns_size_t dataSize, icns_byte_t *dataPtr, opj_image_t **imageOut)
+int icns_opj_jp2_dec(icns_size_t dataSize, icns_byte_t *dataPtr, int reduceLevels, opj_image_t **imageOut)
 {
 	opj_event_mgr_t    event_mgr;
 	opj_dparameters_t  parameters;
@@ -563,6 +811,9 @@ int icns_opj_jp2_dec(icns_size_t dataSize, icns_byte_t *dataPtr, opj_image_t **i
 
 	opj_set_default_decoder_parameters(&parameters);
 
+	// Discard the highest resolution levels - the image comes out 1/2^n size
+	parameters.cp_reduce = reduceLevels;
+
 	dinfo = opj_create_decompress(CODEC_JP2);
 	opj_set_event_mgr((opj_common_ptr)dinfo, &event_mgr, stderr);
 	opj_setup_decoder(dinfo, &parameters);
@@ -588,12 +839,10 @@ int icns_opj_jp2_dec(icns_size_t dataSize, icns_byte_t *dataPtr, opj_image_t **i
 // Convert from opj_image_t to icns_image_t
 int icns_opj_to_image(opj_image_t *opjImg, icns_image_t *iconImg)
 {
-	int		error = ICNS_STATUS_OK;
-	icns_sint8_t    adjust[4] = {0,0,0,0};
-	icns_byte_t	*dataPtr = NULL;
-	int             c = 0;
-	int             i, j;
-	int             rowOffset, colOffset;
+	const icns_sint32_t	*planes[4] = {NULL,NULL,NULL,NULL};
+	icns_sint32_t		bias[4] = {0,0,0,0};
+	int			shift[4] = {0,0,0,0};
+	int			c = 0;
 
 	if(opjImg == NULL)
 	{
@@ -607,61 +856,53 @@ int icns_opj_to_image(opj_image_t *opjImg, icns_image_t *iconImg)
 		return ICNS_STATUS_NULL_PARAM;
 	}
 
-	iconImg->imageWidth = opjImg->comps[0].w;
-	iconImg->imageHeight = opjImg->comps[0].h;
-	iconImg->imageChannels = opjImg->numcomps;
-	iconImg->imagePixelDepth = opjImg->comps[0].prec;
-
-	iconImg->imageDataSize = iconImg->imageHeight * iconImg->imageWidth * iconImg->imagePixelDepth; // * iconChannels ?
-	iconImg->imageData = (icns_byte_t *)malloc(iconImg->imageDataSize);
-	if(!iconImg->imageData) {
-		icns_print_err("icns_create_family: Unable to allocate memory block of size: %d!\n",iconImg->imageDataSize);
-		return ICNS_STATUS_NO_MEMORY;
+	if(opjImg->numcomps != 4)
+	{
+		icns_print_err("icns_opj_to_image: Number of jp2 components (%d) is invalid!\n",opjImg->numcomps);
+		return ICNS_STATUS_INVALID_DATA;
 	}
-	memset(iconImg->imageData,0,iconImg->imageDataSize);
-
-	dataPtr = iconImg->imageData;
 
 	for(c = 0; c < 4; c++)
 	{
 		int depth = opjImg->comps[c].prec;
+
+		// The interleave reads every component as a full size plane
+		if(opjImg->comps[c].w != opjImg->comps[0].w || opjImg->comps[c].h != opjImg->comps[0].h)
+		{
+			icns_print_err("icns_opj_to_image: Subsampled jp2 components are not supported!\n");
+			return ICNS_STATUS_UNSUPPORTED;
+		}
+
+		planes[c] = (const icns_sint32_t *)opjImg->comps[c].data;
+
+		// Signed samples are centered on zero
+		bias[c] = (opjImg->comps[c].sgnd ? 1 << (depth - 1) : 0);
+
+		// Round to the nearest 8-bit value
 		if(depth > 8) {
-			adjust[c] = depth - 8;
+			shift[c] = depth - 8;
+			bias[c] += 1 << (shift[c] - 1);
 			#ifdef ICNS_DEBUG
-			printf("BMP CONVERSION: Will be trucating component %d (%d bits) by %d bits to 8 bits.\n",c,depth,adjust[c]);
+			printf("BMP CONVERSION: Will be trucating component %d (%d bits) by %d bits to 8 bits.\n",c,depth,shift[c]);
 			#endif
-		} else {
-			adjust[c] = 0;
 		}
 	}
 
-	for (i = 0; i < iconImg->imageHeight; i++) {
-		rowOffset = i * iconImg->imageChannels * iconImg->imageWidth;
-		for(j = 0; j < iconImg->imageWidth; j++) {
-			icns_rgba_t *dst_pixel;
-			int r, g, b, a;
-
-			colOffset = j * iconImg->imageChannels;
-
-			r = opjImg->comps[0].data[i*iconImg->imageWidth+j];
-			r += (opjImg->comps[0].sgnd ? 1 << (opjImg->comps[0].prec - 1) : 0);
-			g = opjImg->comps[1].data[i*iconImg->imageWidth+j];
-			g += (opjImg->comps[1].sgnd ? 1 << (opjImg->comps[1].prec - 1) : 0);
-			b = opjImg->comps[2].data[i*iconImg->imageWidth+j];
-			b += (opjImg->comps[2].sgnd ? 1 << (opjImg->comps[2].prec - 1) : 0);
-			a = opjImg->comps[3].data[i*iconImg->imageWidth+j];
-			a += (opjImg->comps[3].sgnd ? 1 << (opjImg->comps[3].prec - 1) : 0);
-
-			dst_pixel = (icns_rgba_t *)&(dataPtr[rowOffset + colOffset]);
+	iconImg->imageWidth = opjImg->comps[0].w;
+	iconImg->imageHeight = opjImg->comps[0].h;
+	iconImg->imageChannels = 4;
+	iconImg->imagePixelDepth = 8;
 
-			dst_pixel->r = (icns_byte_t) ((r >> adjust[0])+((r >> (adjust[0]-1))%2));
-			dst_pixel->g = (icns_byte_t) ((g >> adjust[1])+((g >> (adjust[1]-1))%2));
-			dst_pixel->b = (icns_byte_t) ((b >> adjust[2])+((b >> (adjust[2]-1))%2));
-			dst_pixel->a = (icns_byte_t) ((a >> adjust[3])+((a >> (adjust[3]-1))%2));
-		}
+	iconImg->imageDataSize = iconImg->imageHeight * iconImg->imageWidth * 4;
+	iconImg->imageData = (icns_byte_t *)icns_malloc(iconImg->imageDataSize);
+	if(!iconImg->imageData) {
+		icns_print_err("icns_opj_to_image: Unable to allocate memory block of size: %d!\n",(int)iconImg->imageDataSize);
+		return ICNS_STATUS_NO_MEMORY;
 	}
 
-	return error;
+	icns_interleave_planar32_rows(planes,iconImg->imageWidth,bias,shift,iconImg->imageWidth,iconImg->imageHeight,iconImg->imageData,iconImg->imageWidth * 4);
+
+	return ICNS_STATUS_OK;
 }
 
 int icns_opj_image_to_jp2(icns_image_t *iconImg, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut)
@@ -782,7 +1023,7 @@ int icns_opj_image_to_jp2(icns_image_t *iconImg, icns_size_t *dataSizeOut, icns_
 	}
 
 	*dataSizeOut = cio_tell(cio) + 34;
-	*dataPtrOut = (icns_byte_t *)malloc(*dataSizeOut);
+	*dataPtrOut = (icns_byte_t *)icns_malloc(*dataSizeOut);
 
 	if(!(*dataPtrOut))
 	{
@@ -824,6 +1065,149 @@ void icns_opj_info_callback(const char *msg, void *client_data) {
 #endif /* ifdef ICNS_OPENJPEG */
 
 
+//***************************** Component interleaving ****************************//
+// Packs four planar 32-bit component rows into 8-bit RGBA pixels. Each
+// component gets its sign offset and precision shift folded into one
+// bias/shift pair up front: out = clamp((in + bias) >> shift, 0, 255).
+// On x86 the add and shift run on whole vectors, saturating packs do the
+// clamp and pshufb turns the RRRRGGGGBBBBAAAA result into RGBA pixels.
+
+static void icns_interleave_planar32_rows_c(const icns_sint32_t *const planes[4],icns_size_t planeStride,const icns_sint32_t bias[4],const int shift[4],icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	int		c = 0;
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		icns_byte_t	*destRow = destPtr + rowID * destRowBytes;
+
+		for(pixelID = 0; pixelID < width; pixelID++)
+		{
+			for(c = 0; c < 4; c++)
+			{
+				icns_sint32_t	value = (planes[c][rowID * planeStride + pixelID] + bias[c]) >> shift[c];
+
+				destRow[pixelID * 4 + c] = (icns_byte_t)(value < 0 ? 0 : (value > 255 ? 255 : value));
+			}
+		}
+	}
+}
+
+#ifdef ICNS_SIMD_X86
+// RRRRGGGGBBBBAAAA -> RGBARGBARGBARGBA
+static const icns_byte_t icns_interleave_shuffle[16] = { 0,4,8,12, 1,5,9,13, 2,6,10,14, 3,7,11,15 };
+
+__attribute__ ((target("ssse3")))
+static void icns_interleave_planar32_rows_ssse3(const icns_sint32_t *const planes[4],icns_size_t planeStride,const icns_sint32_t bias[4],const int shift[4],icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	__m128i		shuffle = _mm_loadu_si128((const __m128i *)icns_interleave_shuffle);
+	__m128i		biasVec[4];
+	__m128i		shiftVec[4];
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	int		c = 0;
+
+	for(c = 0; c < 4; c++)
+	{
+		biasVec[c] = _mm_set1_epi32(bias[c]);
+		shiftVec[c] = _mm_cvtsi32_si128(shift[c]);
+	}
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_sint32_t	*rowPlanes[4];
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		for(c = 0; c < 4; c++)
+			rowPlanes[c] = planes[c] + rowID * planeStride;
+
+		for(pixelID = 0; pixelID + 4 <= width; pixelID += 4)
+		{
+			__m128i	r = _mm_sra_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i *)(rowPlanes[0] + pixelID)),biasVec[0]),shiftVec[0]);
+			__m128i	g = _mm_sra_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i *)(rowPlanes[1] + pixelID)),biasVec[1]),shiftVec[1]);
+			__m128i	b = _mm_sra_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i *)(rowPlanes[2] + pixelID)),biasVec[2]),shiftVec[2]);
+			__m128i	a = _mm_sra_epi32(_mm_add_epi32(_mm_loadu_si128((const __m128i *)(rowPlanes[3] + pixelID)),biasVec[3]),shiftVec[3]);
+			__m128i	rgba = _mm_packus_epi16(_mm_packs_epi32(r,g),_mm_packs_epi32(b,a));
+
+			_mm_storeu_si128((__m128i *)(destRow + pixelID * 4),_mm_shuffle_epi8(rgba,shuffle));
+		}
+
+		if(pixelID < width)
+		{
+			for(c = 0; c < 4; c++)
+				rowPlanes[c] += pixelID;
+			icns_interleave_planar32_rows_c(rowPlanes,0,bias,shift,width - pixelID,1,destRow + pixelID * 4,0);
+		}
+	}
+}
+
+__attribute__ ((target("avx2")))
+static void icns_interleave_planar32_rows_avx2(const icns_sint32_t *const planes[4],icns_size_t planeStride,const icns_sint32_t bias[4],const int shift[4],icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	__m256i		shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)icns_interleave_shuffle));
+	__m256i		biasVec[4];
+	__m128i		shiftVec[4];
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	int		c = 0;
+
+	for(c = 0; c < 4; c++)
+	{
+		biasVec[c] = _mm256_set1_epi32(bias[c]);
+		shiftVec[c] = _mm_cvtsi32_si128(shift[c]);
+	}
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		const icns_sint32_t	*rowPlanes[4];
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		for(c = 0; c < 4; c++)
+			rowPlanes[c] = planes[c] + rowID * planeStride;
+
+		// The packs work within 128-bit lanes, so the low lane ends up
+		// holding pixels 0-3 and the high lane pixels 4-7, already in order
+		for(pixelID = 0; pixelID + 8 <= width; pixelID += 8)
+		{
+			__m256i	r = _mm256_sra_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(rowPlanes[0] + pixelID)),biasVec[0]),shiftVec[0]);
+			__m256i	g = _mm256_sra_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(rowPlanes[1] + pixelID)),biasVec[1]),shiftVec[1]);
+			__m256i	b = _mm256_sra_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(rowPlanes[2] + pixelID)),biasVec[2]),shiftVec[2]);
+			__m256i	a = _mm256_sra_epi32(_mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(rowPlanes[3] + pixelID)),biasVec[3]),shiftVec[3]);
+			__m256i	rgba = _mm256_packus_epi16(_mm256_packs_epi32(r,g),_mm256_packs_epi32(b,a));
+
+			_mm256_storeu_si256((__m256i *)(destRow + pixelID * 4),_mm256_shuffle_epi8(rgba,shuffle));
+		}
+
+		if(pixelID < width)
+		{
+			for(c = 0; c < 4; c++)
+				rowPlanes[c] += pixelID;
+			icns_interleave_planar32_rows_c(rowPlanes,0,bias,shift,width - pixelID,1,destRow + pixelID * 4,0);
+		}
+	}
+}
+#endif
+
+void icns_interleave_planar32_rows(const icns_sint32_t *const planes[4],icns_size_t planeStride,const icns_sint32_t bias[4],const int shift[4],icns_uint32_t width,icns_uint32_t height,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	#ifdef ICNS_SIMD_X86
+	if(__builtin_cpu_supports("avx2"))
+	{
+		icns_interleave_planar32_rows_avx2(planes,planeStride,bias,shift,width,height,destPtr,destRowBytes);
+		return;
+	}
+	if(__builtin_cpu_supports("ssse3"))
+	{
+		icns_interleave_planar32_rows_ssse3(planes,planeStride,bias,shift,width,height,destPtr,destRowBytes);
+		return;
+	}
+	#endif
+
+	icns_interleave_planar32_rows_c(planes,planeStride,bias,shift,width,height,destPtr,destRowBytes);
+}
+
+
 // Add cdef block - requires that dataPtr has 34 extra bytes!
 void icns_place_jp2_cdef(icns_byte_t *dataPtr, icns_size_t dataSize)
 {
@@ -36,29 +36,55 @@ typedef struct icns_png_io_ref {
 
 static void icns_png_read_memory(png_structp png_ptr, png_bytep data, png_size_t length) {
 	icns_png_io_ref* _ref = (icns_png_io_ref*) png_get_io_ptr( png_ptr );
+	if(length > _ref->size - _ref->offset)
+		png_error(png_ptr, "Read past end of png data!");
 	memcpy( data, (char*)_ref->data + _ref->offset, length );
 	_ref->offset += length;
 }
 
+// Output starts at a size guess and doubles from there, so a large image
+// costs a handful of reallocs instead of one per libpng write
+#define ICNS_PNG_MIN_CAPACITY	4096
+
+typedef struct icns_png_write_ref {
+	icns_byte_t	*data;
+	size_t		capacity;
+	size_t		offset;
+	icns_bool_t	outOfMemory;	// tells a failed realloc apart from other libpng errors
+} icns_png_write_ref;
+
 static void icns_png_write_memory(png_structp png_ptr, png_bytep data, png_size_t length) {
-	icns_png_io_ref* _ref = (icns_png_io_ref*) png_get_io_ptr( png_ptr );
-	size_t nsize = _ref->offset + length;
+	icns_png_write_ref* _ref = (icns_png_write_ref*) png_get_io_ptr( png_ptr );
 
-	/* allocate or grow buffer */
-	if(_ref->data)
-		_ref->data = realloc(_ref->data, nsize);
-	else
-		_ref->data = malloc(nsize);
+	if(_ref->offset + length > _ref->capacity)
+	{
+		size_t		newCapacity = (_ref->capacity < ICNS_PNG_MIN_CAPACITY) ? ICNS_PNG_MIN_CAPACITY : _ref->capacity;
+		icns_byte_t	*newData = NULL;
 
-	if(_ref->data == NULL)
-		png_error(png_ptr, "Unable to allocate memory!");
+		while(newCapacity < _ref->offset + length)
+			newCapacity *= 2;
+
+		newData = (icns_byte_t *)icns_realloc(_ref->data, _ref->capacity, newCapacity);
+		if(newData == NULL)
+		{
+			_ref->outOfMemory = 1;
+			png_error(png_ptr, "Unable to allocate memory!");
+		}
+
+		_ref->data = newData;
+		_ref->capacity = newCapacity;
+	}
 
 	/* copy new bytes to end of buffer */
 	memcpy(_ref->data + _ref->offset, data, length);
 	_ref->offset += length;
 }
 
-int icns_png_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *imageOut)
+static void icns_png_flush_memory(png_structp png_ptr) {
+	(void)png_ptr;
+}
+
+int icns_png_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_pixel_format_t pixelFormat, icns_image_t *imageOut)
 {
 	int error = ICNS_STATUS_OK;
 	png_structp png_ptr = NULL;
@@ -70,6 +96,8 @@ int icns_png_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *
 	int32_t color_type;
 	int row;
 	int rowsize;
+	int passes;
+	ICNS_STATS_SCOPE(ICNS_STATS_DECODE_PNG,dataSize);
 
 
 	if(dataPtr == NULL)
@@ -120,53 +148,73 @@ int icns_png_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *
 	png_read_info(png_ptr, info_ptr);
 	png_get_IHDR(png_ptr, info_ptr, &w, &h, &bit_depth, &color_type, NULL, NULL, NULL);
 
-	switch (color_type)
-	{
-		case PNG_COLOR_TYPE_RGB:
-			if (bit_depth == 16) {
-				png_set_strip_16(png_ptr);
-				bit_depth = 8;
-			}
-
-			png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
-			break;
-
-		case PNG_COLOR_TYPE_RGB_ALPHA:
-			if (bit_depth == 16) {
-				png_set_strip_16(png_ptr);
-				bit_depth = 8;
-			}
-
-			break;
-	}
-
+	// Whatever the png holds, have libpng hand over 8-bit RGBA rows: palette
+	// and low bit depth gray are expanded (tRNS becomes alpha), gray becomes
+	// RGB, 16-bit channels are stripped and opaque alpha is added if missing
+	png_set_expand(png_ptr);
+	if (bit_depth == 16)
+		png_set_strip_16(png_ptr);
+	if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+		png_set_gray_to_rgb(png_ptr);
+	png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
+
+	passes = png_set_interlace_handling(png_ptr);
 	png_read_update_info(png_ptr, info_ptr);
 
 	rowsize = png_get_rowbytes(png_ptr, info_ptr);
-	rows = malloc (sizeof(png_bytep) * h);
+	if(rowsize != w * 4)
+	{
+		icns_print_err("icns_png_to_image: Unable to convert png data to RGBA! (row size %d for width %d)\n",rowsize,(int)w);
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	rows = icns_malloc (sizeof(png_bytep) * h);
 
 	imageOut->imageWidth = w;
 	imageOut->imageHeight = h;
 	imageOut->imageChannels = 4;
 	imageOut->imagePixelDepth = 8;
 	imageOut->imageDataSize = w * h * 4;
-	imageOut->imageData = malloc( rowsize * h + 8 );
+	imageOut->imageData = icns_malloc( rowsize * h + 8 );
 
-	if(imageOut->imageData == NULL) {
-		png_destroy_read_struct(&png_ptr, NULL, NULL);
-		free(rows);
+	if(rows == NULL || imageOut->imageData == NULL) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		icns_free(rows);
+		icns_free(imageOut->imageData);
+		imageOut->imageData = NULL;
 		return ICNS_STATUS_NO_MEMORY;
 	}
 
+	// Errors from here on have the row buffers to clean up as well
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		icns_free(rows);
+		icns_free(imageOut->imageData);
+		imageOut->imageData = NULL;
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
 	rows[0] = imageOut->imageData;
 	for (row = 1; row < h; row++) {
 		rows[row] = rows[row-1] + rowsize;
 	}
 
-	png_read_image(png_ptr, rows);
+	if(passes == 1) {
+		// Convert each row to pixelFormat as soon as libpng hands it over
+		for (row = 0; row < h; row++) {
+			png_read_row(png_ptr, rows[row], NULL);
+			icns_convert_rgba_rows(rows[row], rowsize, w, 1, pixelFormat);
+		}
+	} else {
+		// Interlaced rows are only complete after the last pass
+		png_read_image(png_ptr, rows);
+		icns_convert_rgba_rows(imageOut->imageData, rowsize, w, h, pixelFormat);
+	}
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
-	free(rows);
+	icns_free(rows);
 
 	#ifdef ICNS_DEBUG
 	if(error == ICNS_STATUS_OK) {
@@ -186,17 +234,100 @@ int icns_png_to_image(icns_size_t dataSize, icns_byte_t *dataPtr, icns_image_t *
 
 static gnum = 0;
 
-int icns_image_to_png(icns_image_t *image, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut)
+//***************************** icns_get_png_info **************************//
+// Reads the size and pixel layout of png data from its IHDR chunk, without
+// decoding anything
+
+int icns_get_png_info(icns_size_t dataSize,icns_byte_t *dataPtr,icns_uint32_t *widthOut,icns_uint32_t *heightOut,icns_uint8_t *bitDepthOut,icns_uint8_t *colorTypeOut)
 {
-	int 			width = 0;
-	int 			height = 0;
-	int 			image_channels = 0;
-	int			  image_pixel_depth = 0;
-	int 			mask_channels = 0;
-	png_structp 		png_ptr;
-	png_infop 		info_ptr;
-	png_bytep 		*row_pointers;
-	int			i, j;
+	const icns_byte_t	magicPNG[8] = {0x89,0x50,0x4E,0x47,0x0D,0x0A,0x1A,0x0A};
+	const icns_byte_t	*ihdrPtr = NULL;
+	icns_uint32_t		chunkSize = 0;
+	icns_uint32_t		width = 0;
+	icns_uint32_t		height = 0;
+
+	if(dataPtr == NULL)
+	{
+		icns_print_err("icns_get_png_info: PNG data is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	// Signature, IHDR length and type, and the 13 bytes of IHDR data
+	if(dataSize < 8 + 8 + 13)
+	{
+		icns_print_err("icns_get_png_info: Invalid data size! (%d)\n",dataSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(memcmp(dataPtr,magicPNG,8) != 0)
+	{
+		icns_print_err("icns_get_png_info: Data is not a PNG!\n");
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	ihdrPtr = dataPtr + 8;
+	chunkSize = ((icns_uint32_t)ihdrPtr[0] << 24) | ((icns_uint32_t)ihdrPtr[1] << 16) | ((icns_uint32_t)ihdrPtr[2] << 8) | ihdrPtr[3];
+
+	if(chunkSize != 13 || memcmp(ihdrPtr + 4,"IHDR",4) != 0)
+	{
+		icns_print_err("icns_get_png_info: PNG does not start with a valid IHDR chunk!\n");
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	ihdrPtr += 8;
+	width = ((icns_uint32_t)ihdrPtr[0] << 24) | ((icns_uint32_t)ihdrPtr[1] << 16) | ((icns_uint32_t)ihdrPtr[2] << 8) | ihdrPtr[3];
+	height = ((icns_uint32_t)ihdrPtr[4] << 24) | ((icns_uint32_t)ihdrPtr[5] << 16) | ((icns_uint32_t)ihdrPtr[6] << 8) | ihdrPtr[7];
+
+	if(width == 0 || height == 0)
+	{
+		icns_print_err("icns_get_png_info: Invalid PNG dimensions! (%dx%d)\n",width,height);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(widthOut != NULL)
+		*widthOut = width;
+	if(heightOut != NULL)
+		*heightOut = height;
+	if(bitDepthOut != NULL)
+		*bitDepthOut = ihdrPtr[8];
+	if(colorTypeOut != NULL)
+		*colorTypeOut = ihdrPtr[9];
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** icns_init_png_options **************************//
+// Fills options with the settings libicns encodes png elements with by default
+
+int icns_init_png_options(icns_png_options_t *optionsOut)
+{
+	if(optionsOut == NULL)
+	{
+		icns_print_err("icns_init_png_options: Options are NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	optionsOut->compressionLevel = ICNS_PNG_COMPRESSION_DEFAULT;
+	optionsOut->filterSet = ICNS_PNG_FILTER_ALL;
+	optionsOut->zlibStrategy = ICNS_PNG_STRATEGY_DEFAULT;
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** icns_image_to_png **************************//
+// Encodes a 32-bit RGBA image as png, with options (or the defaults, if NULL).
+// libpng reads the rows straight out of the image.
+
+int icns_image_to_png(icns_image_t *image, const icns_png_options_t *options, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut)
+{
+	icns_png_options_t	pngOptions;
+	png_structp 		png_ptr = NULL;
+	png_infop 		info_ptr = NULL;
+	png_bytep 		*row_pointers = NULL;
+	icns_png_write_ref	io_data = { NULL, 0, 0, 0 };
+	size_t			rowBytes = 0;
+	icns_uint32_t		row = 0;
+	ICNS_STATS_SCOPE(ICNS_STATS_ENCODE_PNG,image ? image->imageDataSize : 0);
 
 	if(image == NULL)
 	{
@@ -216,20 +347,47 @@ int icns_image_to_png(icns_image_t *image, icns_size_t *dataSizeOut, icns_byte_t
 		return ICNS_STATUS_NULL_PARAM;
 	}
 
+	if(image->imageData == NULL || image->imageChannels != 4 || image->imagePixelDepth != 8)
+	{
+		icns_print_err("icns_image_to_png: Image must be 32-bit RGBA! (%d channels, %d bits)\n",image->imageChannels,image->imagePixelDepth);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	// A copy, so options itself is never assigned - see the setjmp below
+	if(options == NULL)
+		icns_init_png_options(&pngOptions);
+	else
+		pngOptions = *options;
+
 	#ifdef ICNS_DEBUG
 	printf("Encoding PNG image...\n");
 	#endif
 
-	width = image->imageWidth;
-	height = image->imageHeight;
-	image_channels = image->imageChannels;
-	image_pixel_depth = image->imagePixelDepth;
+	rowBytes = (size_t)image->imageWidth * 4;
+
+	row_pointers = (png_bytep *)icns_malloc(sizeof(png_bytep) * image->imageHeight);
+	if(row_pointers == NULL)
+	{
+		icns_print_err("icns_image_to_png: Unable to allocate row pointers!\n");
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	for(row = 0; row < image->imageHeight; row++)
+		row_pointers[row] = image->imageData + row * rowBytes;
+
+	// Compressed output is rarely more than half the raw size
+	io_data.capacity = (rowBytes + 1) * image->imageHeight / 2 + ICNS_PNG_MIN_CAPACITY;
+	io_data.data = (icns_byte_t *)icns_malloc(io_data.capacity);
+	if(io_data.data == NULL)
+		io_data.capacity = 0;
 
 	png_ptr = png_create_write_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 
 	if (png_ptr == NULL)
 	{
-		fprintf (stderr, "PNG error: cannot allocate libpng main struct\n");
+		icns_print_err("icns_image_to_png: Unable to allocate libpng main struct!\n");
+		icns_free(io_data.data);
+		icns_free(row_pointers);
 		return ICNS_STATUS_NO_MEMORY;
 	}
 
@@ -237,64 +395,45 @@ int icns_image_to_png(icns_image_t *image, icns_size_t *dataSizeOut, icns_byte_t
 
 	if (info_ptr == NULL)
 	{
-		fprintf (stderr, "PNG error: cannot allocate libpng info struct\n");
+		icns_print_err("icns_image_to_png: Unable to allocate libpng info struct!\n");
 		png_destroy_write_struct (&png_ptr, (png_infopp) NULL);
+		icns_free(io_data.data);
+		icns_free(row_pointers);
 		return ICNS_STATUS_NO_MEMORY;
 	}
 
-	icns_png_io_ref io_data = { NULL, 0, 0 };
-	png_set_write_fn(png_ptr, (void *)&io_data, &icns_png_write_memory, NULL);
+	// Nothing local is assigned past this point, so every variable the
+	// handler reads holds its value across the longjmp - io_data is only
+	// changed by icns_png_write_memory, through the pointer libpng is given
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		icns_print_err("icns_image_to_png: Error encoding png data!\n");
+		png_destroy_write_struct (&png_ptr, &info_ptr);
+		icns_free(row_pointers);
+		icns_free(io_data.data);
+		return io_data.outOfMemory ? ICNS_STATUS_NO_MEMORY : ICNS_STATUS_INVALID_DATA;
+	}
 
-	png_set_filter(png_ptr, 0, PNG_FILTER_NONE);
+	png_set_write_fn(png_ptr, (void *)&io_data, &icns_png_write_memory, &icns_png_flush_memory);
 
-	png_set_IHDR (png_ptr, info_ptr, width, height, image_pixel_depth, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_filter(png_ptr, 0, pngOptions.filterSet);
+	png_set_compression_level(png_ptr, pngOptions.compressionLevel);
+	png_set_compression_strategy(png_ptr, pngOptions.zlibStrategy);
 
-	png_write_info (png_ptr, info_ptr);
+	png_set_IHDR (png_ptr, info_ptr, image->imageWidth, image->imageHeight, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
-	if(image_pixel_depth < 8)
-		png_set_packing (png_ptr);
+	png_write_info (png_ptr, info_ptr);
 
-	row_pointers = (png_bytep*)malloc(sizeof(png_bytep)*height);
+	png_write_image (png_ptr, row_pointers);
 
-	if (row_pointers == NULL)
-	{
-		fprintf (stderr, "PNG error: unable to allocate row_pointers\n");
-	}
-	else
-	{
-		for (i = 0; i < height; i++)
-		{
-			if ((row_pointers[i] = (png_bytep)malloc(width*image_channels)) == NULL)
-			{
-				fprintf (stderr, "PNG error: unable to allocate rows\n");
-				for (j = 0; j < i; j++)
-					free(row_pointers[j]);
-				free(row_pointers);
-				return ICNS_STATUS_NO_MEMORY;
-			}
-
-			for(j = 0; j < width; j++)
-			{
-				icns_uint32_t *src_pixel = (icns_uint32_t*)&(image->imageData[i*width*image_channels+j*image_channels]);
-				icns_uint32_t *dst_pixel = (icns_uint32_t*)&(row_pointers[i][j*image_channels]);
-				*dst_pixel = *src_pixel;
-			}
-		}
-	}
+	png_write_end (png_ptr, info_ptr);
 
-	png_write_image (png_ptr,row_pointers);
+	png_destroy_write_struct (&png_ptr, &info_ptr);
 
-	png_write_end (png_ptr, info_ptr);
+	icns_free(row_pointers);
 
 	*dataSizeOut = io_data.offset;
 	*dataPtrOut = io_data.data;
 
-	png_destroy_write_struct (&png_ptr, &info_ptr);
-
-	for (j = 0; j < height; j++)
-		free(row_pointers[j]);
-	free(row_pointers);
-
 	return ICNS_STATUS_OK;
 }
-
@@ -0,0 +1,643 @@
+/*
+File:       icns_resample.c
+Copyright (C) 2001-2013 Mathew Eis <mathew@eisbox.net>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the
+Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+Boston, MA 02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "icns.h"
+#include "icns_internals.h"
+
+#ifdef ICNS_SIMD_X86
+ #include <immintrin.h>
+#endif
+
+//***************************** Element choice ****************************//
+// Every 32-bit image type, and the 8/4/1-bit types as a last resort. The
+// relative decode cost per pixel is a rough measure: raw/RLE24 is a byte
+// copy plus a small loop, png is an inflate plus unfiltering, and jp2 is a
+// full wavelet decode.
+
+#define ICNS_COST_RLE24		1
+#define ICNS_COST_PNG		4
+#define ICNS_COST_JP2		16
+#define ICNS_COST_INDEXED	2
+
+static const icns_type_t icns_sized_image_types[] = {
+	ICNS_16x16_32BIT_DATA,
+	ICNS_32x32_32BIT_DATA,
+	ICNS_48x48_32BIT_DATA,
+	ICNS_128X128_32BIT_DATA,
+	ICNS_16x16_2X_32BIT_ARGB_DATA,
+	ICNS_32x32_2X_32BIT_ARGB_DATA,
+	ICNS_256x256_32BIT_ARGB_DATA,
+	ICNS_128x128_2X_32BIT_ARGB_DATA,
+	ICNS_512x512_32BIT_ARGB_DATA,
+	ICNS_256x256_2X_32BIT_ARGB_DATA,
+	ICNS_512x512_2X_32BIT_ARGB_DATA,
+	ICNS_NULL_TYPE
+};
+
+static const icns_type_t icns_sized_indexed_types[] = {
+	ICNS_48x48_8BIT_DATA,
+	ICNS_32x32_8BIT_DATA,
+	ICNS_16x16_8BIT_DATA,
+	ICNS_48x48_4BIT_DATA,
+	ICNS_32x32_4BIT_DATA,
+	ICNS_16x16_4BIT_DATA,
+	ICNS_48x48_1BIT_DATA,
+	ICNS_32x32_1BIT_DATA,
+	ICNS_16x16_1BIT_DATA,
+	ICNS_NULL_TYPE
+};
+
+typedef struct icns_size_candidate_t
+{
+	icns_type_t	iconType;
+	icns_uint32_t	iconSize;	// pixels on the longer side
+	icns_uint32_t	decodeSize;	// what a decode will produce (jp2 may drop levels)
+	icns_bool_t	isJP2;
+	icns_uint64_t	decodeCost;
+} icns_size_candidate_t;
+
+// Is candidate a a better pick than b for targetSize pixels?
+static icns_bool_t icns_better_size_candidate(const icns_size_candidate_t *a,const icns_size_candidate_t *b,icns_uint32_t targetSize,icns_bool_t wantHiDPI)
+{
+	icns_bool_t	aCovers = (a->iconSize >= targetSize);
+	icns_bool_t	bCovers = (b->iconSize >= targetSize);
+
+	if(b->iconType == ICNS_NULL_TYPE)
+		return 1;
+
+	// Anything that avoids upscaling wins, then the biggest of the rest
+	if(aCovers != bCovers)
+		return aCovers;
+	if(!aCovers && a->iconSize != b->iconSize)
+		return (a->iconSize > b->iconSize);
+
+	if(a->decodeCost != b->decodeCost)
+		return (a->decodeCost < b->decodeCost);
+
+	// Same pixels at the same cost, e.g. ic08 and ic13 - prefer the variant
+	// that was drawn for the requested scale
+	if(icns_get_is_hidpi(a->iconType) != icns_get_is_hidpi(b->iconType))
+		return (icns_get_is_hidpi(a->iconType) == wantHiDPI);
+
+	return (a->iconSize < b->iconSize);
+}
+
+static void icns_find_size_candidate(icns_family_t *iconFamily,icns_family_index_t *familyIndex,const icns_type_t *iconTypes,icns_uint32_t costPerPixel,icns_uint32_t targetSize,icns_bool_t wantHiDPI,icns_size_candidate_t *bestOut)
+{
+	const icns_byte_t	magicPNG[8] = {0x89,0x50,0x4E,0x47,0x0D,0x0A,0x1A,0x0A};
+	int			typeID = 0;
+
+	for(typeID = 0; iconTypes[typeID] != ICNS_NULL_TYPE; typeID++)
+	{
+		icns_element_entry_t	elementEntry;
+		icns_element_view_t	elementView;
+		icns_icon_info_t	iconInfo;
+		icns_size_candidate_t	candidate;
+
+		if(icns_find_element_in_family(iconFamily,familyIndex,iconTypes[typeID],&elementEntry) != ICNS_STATUS_OK)
+			continue;
+
+		icns_fill_view_from_element((icns_element_t *)(((icns_byte_t*)iconFamily)+elementEntry.elementOffset),&elementView);
+
+		iconInfo = icns_get_image_info_for_type(iconTypes[typeID]);
+
+		memset(&candidate,0,sizeof(icns_size_candidate_t));
+		candidate.iconType = iconTypes[typeID];
+		candidate.iconSize = (iconInfo.iconWidth > iconInfo.iconHeight ? iconInfo.iconWidth : iconInfo.iconHeight);
+		candidate.decodeSize = candidate.iconSize;
+
+		if(icns_get_mask_type_for_icon_type(candidate.iconType) != ICNS_NULL_MASK)
+		{
+			candidate.decodeCost = (icns_uint64_t)candidate.iconSize * candidate.iconSize * costPerPixel;
+		}
+		else if(elementView.dataSize >= 8 && memcmp(elementView.elementData,magicPNG,8) == 0)
+		{
+			candidate.decodeCost = (icns_uint64_t)candidate.iconSize * candidate.iconSize * ICNS_COST_PNG;
+		}
+		else
+		{
+			// Only the resolution levels needed for targetSize get decoded
+			candidate.isJP2 = 1;
+			candidate.decodeSize = candidate.iconSize >> icns_get_jp2_reduce_levels(elementView.dataSize,elementView.elementData,targetSize);
+			candidate.decodeCost = (icns_uint64_t)candidate.decodeSize * candidate.decodeSize * ICNS_COST_JP2;
+		}
+
+		if(icns_better_size_candidate(&candidate,bestOut,targetSize,wantHiDPI))
+			*bestOut = candidate;
+	}
+}
+
+//***************************** icns_get_image_for_size **************************//
+// Returns a straight RGBA image of width x height (twice that with
+// ICNS_SIZE_HIDPI, where width and height are in points) made from the
+// cheapest element in the family that is at least that big, or from the
+// biggest element if none is. Raw/RLE24 elements are picked over png, and
+// png over jp2, unless the cheaper one would have to be upscaled.
+// With ICNS_SIZE_NATIVE the chosen element is returned at its own size.
+
+int icns_get_image_for_size(icns_family_t *iconFamily,icns_uint32_t width,icns_uint32_t height,icns_uint32_t flags,icns_image_t *imageOut)
+{
+	int			error = ICNS_STATUS_OK;
+	icns_family_index_t	*familyIndex = NULL;
+	icns_size_candidate_t	bestCandidate;
+	icns_image_t		decodedImage;
+	icns_uint32_t		targetWidth = width;
+	icns_uint32_t		targetHeight = height;
+	icns_uint32_t		targetSize = 0;
+	icns_bool_t		wantHiDPI = ((flags & ICNS_SIZE_HIDPI) != 0);
+
+	if(iconFamily == NULL)
+	{
+		icns_print_err("icns_get_image_for_size: icns family is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(imageOut == NULL)
+	{
+		icns_print_err("icns_get_image_for_size: Icon image structure is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	memset(imageOut,0,sizeof(icns_image_t));
+
+	if(width == 0 || height == 0 || width > 16384 || height > 16384)
+	{
+		icns_print_err("icns_get_image_for_size: Invalid size! (%dx%d)\n",width,height);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(wantHiDPI)
+	{
+		targetWidth *= 2;
+		targetHeight *= 2;
+	}
+
+	targetSize = (targetWidth > targetHeight ? targetWidth : targetHeight);
+
+	error = icns_new_family_index(iconFamily,&familyIndex);
+	if(error)
+		return error;
+
+	memset(&bestCandidate,0,sizeof(icns_size_candidate_t));
+	bestCandidate.iconType = ICNS_NULL_TYPE;
+
+	icns_find_size_candidate(iconFamily,familyIndex,icns_sized_image_types,ICNS_COST_RLE24,targetSize,wantHiDPI,&bestCandidate);
+
+	if(bestCandidate.iconType == ICNS_NULL_TYPE)
+		icns_find_size_candidate(iconFamily,familyIndex,icns_sized_indexed_types,ICNS_COST_INDEXED,targetSize,wantHiDPI,&bestCandidate);
+
+	if(bestCandidate.iconType == ICNS_NULL_TYPE)
+	{
+		icns_free_family_index(familyIndex);
+		icns_print_err("icns_get_image_for_size: No icon image found in icns family!\n");
+		return ICNS_STATUS_DATA_NOT_FOUND;
+	}
+
+	#ifdef ICNS_DEBUG
+	{
+		char typeStr[5];
+		printf("Using '%s' (%d pixels, decoded at %d) for %dx%d\n",icns_type_str(bestCandidate.iconType,typeStr),bestCandidate.iconSize,bestCandidate.decodeSize,targetWidth,targetHeight);
+	}
+	#endif
+
+	memset(&decodedImage,0,sizeof(icns_image_t));
+
+	if(bestCandidate.isJP2)
+	{
+		icns_element_view_t	elementView;
+
+		error = icns_peek_element_in_indexed_family(iconFamily,familyIndex,bestCandidate.iconType,&elementView);
+		if(error == ICNS_STATUS_OK)
+			error = icns_jp2_to_image_at_size(elementView.dataSize,(icns_byte_t *)elementView.elementData,targetSize,&decodedImage);
+	}
+	else
+	{
+		error = icns_get_image32_with_mask_from_indexed_family(iconFamily,familyIndex,bestCandidate.iconType,&decodedImage);
+	}
+
+	icns_free_family_index(familyIndex);
+
+	if(error)
+	{
+		icns_free_image(&decodedImage);
+		return error;
+	}
+
+	if((flags & ICNS_SIZE_NATIVE) || (decodedImage.imageWidth == targetWidth && decodedImage.imageHeight == targetHeight))
+	{
+		*imageOut = decodedImage;
+		return ICNS_STATUS_OK;
+	}
+
+	error = icns_resample_image(&decodedImage,targetWidth,targetHeight,imageOut);
+
+	icns_free_image(&decodedImage);
+
+	return error;
+}
+
+//***************************** Box halving ****************************//
+// Halves premultiplied RGBA rows in both directions by averaging 2x2 blocks.
+// Done while the image is at least twice the target size, it is an exact
+// area filter that touches each source pixel once.
+
+static void icns_halve_rows_c(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t destWidth,icns_uint32_t destHeight,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	int		c = 0;
+
+	for(rowID = 0; rowID < destHeight; rowID++)
+	{
+		const icns_byte_t	*srcRow0 = srcPtr + (rowID * 2) * srcRowBytes;
+		const icns_byte_t	*srcRow1 = srcRow0 + srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		for(pixelID = 0; pixelID < destWidth; pixelID++)
+		{
+			for(c = 0; c < 4; c++)
+			{
+				icns_uint32_t	sum = srcRow0[pixelID * 8 + c] + srcRow0[pixelID * 8 + 4 + c] + srcRow1[pixelID * 8 + c] + srcRow1[pixelID * 8 + 4 + c];
+
+				destRow[pixelID * 4 + c] = (icns_byte_t)((sum + 2) >> 2);
+			}
+		}
+	}
+}
+
+#ifdef ICNS_SIMD_X86
+// Widen to 16 bits, add the two rows, then add each pixel to its neighbour
+// (the other half of the same 64 bits), round and narrow back
+__attribute__ ((target("sse2")))
+static void icns_halve_rows_sse2(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t destWidth,icns_uint32_t destHeight,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	const __m128i	zero = _mm_setzero_si128();
+	const __m128i	two = _mm_set1_epi16(2);
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+
+	for(rowID = 0; rowID < destHeight; rowID++)
+	{
+		const icns_byte_t	*srcRow0 = srcPtr + (rowID * 2) * srcRowBytes;
+		const icns_byte_t	*srcRow1 = srcRow0 + srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		for(pixelID = 0; pixelID + 2 <= destWidth; pixelID += 2)
+		{
+			__m128i	row0 = _mm_loadu_si128((const __m128i *)(srcRow0 + pixelID * 8));
+			__m128i	row1 = _mm_loadu_si128((const __m128i *)(srcRow1 + pixelID * 8));
+			__m128i	lo = _mm_add_epi16(_mm_unpacklo_epi8(row0,zero),_mm_unpacklo_epi8(row1,zero));
+			__m128i	hi = _mm_add_epi16(_mm_unpackhi_epi8(row0,zero),_mm_unpackhi_epi8(row1,zero));
+			__m128i	sums;
+
+			lo = _mm_add_epi16(lo,_mm_srli_si128(lo,8));
+			hi = _mm_add_epi16(hi,_mm_srli_si128(hi,8));
+			sums = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo,hi),two),2);
+
+			_mm_storel_epi64((__m128i *)(destRow + pixelID * 4),_mm_packus_epi16(sums,sums));
+		}
+
+		if(pixelID < destWidth)
+			icns_halve_rows_c(srcRow0 + pixelID * 8,srcRowBytes,destWidth - pixelID,1,destRow + pixelID * 4,0);
+	}
+}
+
+__attribute__ ((target("avx2")))
+static void icns_halve_rows_avx2(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t destWidth,icns_uint32_t destHeight,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	const __m256i	zero = _mm256_setzero_si256();
+	const __m256i	two = _mm256_set1_epi16(2);
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+
+	for(rowID = 0; rowID < destHeight; rowID++)
+	{
+		const icns_byte_t	*srcRow0 = srcPtr + (rowID * 2) * srcRowBytes;
+		const icns_byte_t	*srcRow1 = srcRow0 + srcRowBytes;
+		icns_byte_t		*destRow = destPtr + rowID * destRowBytes;
+
+		// Same steps as the SSE2 version in each 128-bit lane; the packed
+		// results sit in 64-bit words 0 and 2 and are joined at the end
+		for(pixelID = 0; pixelID + 4 <= destWidth; pixelID += 4)
+		{
+			__m256i	row0 = _mm256_loadu_si256((const __m256i *)(srcRow0 + pixelID * 8));
+			__m256i	row1 = _mm256_loadu_si256((const __m256i *)(srcRow1 + pixelID * 8));
+			__m256i	lo = _mm256_add_epi16(_mm256_unpacklo_epi8(row0,zero),_mm256_unpacklo_epi8(row1,zero));
+			__m256i	hi = _mm256_add_epi16(_mm256_unpackhi_epi8(row0,zero),_mm256_unpackhi_epi8(row1,zero));
+			__m256i	sums;
+
+			lo = _mm256_add_epi16(lo,_mm256_srli_si256(lo,8));
+			hi = _mm256_add_epi16(hi,_mm256_srli_si256(hi,8));
+			sums = _mm256_srli_epi16(_mm256_add_epi16(_mm256_unpacklo_epi64(lo,hi),two),2);
+			sums = _mm256_permute4x64_epi64(_mm256_packus_epi16(sums,sums),0x08);
+
+			_mm_storeu_si128((__m128i *)(destRow + pixelID * 4),_mm256_castsi256_si128(sums));
+		}
+
+		if(pixelID < destWidth)
+			icns_halve_rows_c(srcRow0 + pixelID * 8,srcRowBytes,destWidth - pixelID,1,destRow + pixelID * 4,0);
+	}
+}
+#endif
+
+static void icns_halve_rows(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t destWidth,icns_uint32_t destHeight,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	#ifdef ICNS_SIMD_X86
+	if(__builtin_cpu_supports("avx2"))
+	{
+		icns_halve_rows_avx2(srcPtr,srcRowBytes,destWidth,destHeight,destPtr,destRowBytes);
+		return;
+	}
+	if(__builtin_cpu_supports("sse2"))
+	{
+		icns_halve_rows_sse2(srcPtr,srcRowBytes,destWidth,destHeight,destPtr,destRowBytes);
+		return;
+	}
+	#endif
+
+	icns_halve_rows_c(srcPtr,srcRowBytes,destWidth,destHeight,destPtr,destRowBytes);
+}
+
+//***************************** Area resampling ****************************//
+// Resamples premultiplied RGBA rows to any size: each destination pixel is
+// the average of the source area it covers, with partially covered source
+// pixels weighted by their coverage. Runs separably, horizontally into a
+// float buffer and then vertically.
+
+typedef struct icns_area_weights_t
+{
+	icns_uint32_t	first;		// first source pixel covered
+	icns_uint32_t	count;		// number of source pixels covered
+	float		*weights;	// count weights, summing to 1
+} icns_area_weights_t;
+
+static icns_area_weights_t *icns_new_area_weights(icns_uint32_t srcSize,icns_uint32_t destSize,float **weightBufferOut)
+{
+	icns_area_weights_t	*spans = NULL;
+	float			*weightBuffer = NULL;
+	float			scale = (float)srcSize / (float)destSize;
+	icns_uint32_t		maxCount = (icns_uint32_t)scale + 2;
+	icns_uint32_t		destID = 0;
+
+	spans = (icns_area_weights_t *)icns_malloc(destSize * sizeof(icns_area_weights_t));
+	weightBuffer = (float *)icns_malloc((size_t)destSize * maxCount * sizeof(float));
+
+	if(spans == NULL || weightBuffer == NULL)
+	{
+		icns_free(spans);
+		icns_free(weightBuffer);
+		return NULL;
+	}
+
+	for(destID = 0; destID < destSize; destID++)
+	{
+		float		start = destID * scale;
+		float		end = start + scale;
+		float		total = 0.0f;
+		icns_uint32_t	srcID = 0;
+
+		// When upscaling a destination pixel can sit inside one source pixel
+		if(end > srcSize)
+			end = srcSize;
+
+		spans[destID].first = (icns_uint32_t)start;
+		spans[destID].count = 0;
+		spans[destID].weights = weightBuffer + destID * maxCount;
+
+		for(srcID = spans[destID].first; srcID < srcSize && (float)srcID < end && spans[destID].count < maxCount; srcID++)
+		{
+			float	lo = ((float)srcID > start ? (float)srcID : start);
+			float	hi = ((float)(srcID + 1) < end ? (float)(srcID + 1) : end);
+
+			if(hi <= lo)
+				break;
+
+			spans[destID].weights[spans[destID].count++] = hi - lo;
+			total += hi - lo;
+		}
+
+		if(spans[destID].count == 0)
+		{
+			spans[destID].first = (srcSize - 1 < spans[destID].first ? srcSize - 1 : spans[destID].first);
+			spans[destID].weights[0] = 1.0f;
+			spans[destID].count = 1;
+			total = 1.0f;
+		}
+
+		for(srcID = 0; srcID < spans[destID].count; srcID++)
+			spans[destID].weights[srcID] /= total;
+	}
+
+	*weightBufferOut = weightBuffer;
+
+	return spans;
+}
+
+static int icns_area_resample_rows(const icns_byte_t *srcPtr,icns_size_t srcRowBytes,icns_uint32_t srcWidth,icns_uint32_t srcHeight,icns_uint32_t destWidth,icns_uint32_t destHeight,icns_byte_t *destPtr,icns_size_t destRowBytes)
+{
+	icns_area_weights_t	*columnSpans = NULL;
+	icns_area_weights_t	*rowSpans = NULL;
+	float			*columnWeights = NULL;
+	float			*rowWeights = NULL;
+	float			*rowsBuffer = NULL;
+	icns_uint32_t		rowID = 0;
+	icns_uint32_t		pixelID = 0;
+	icns_uint32_t		spanID = 0;
+	int			c = 0;
+
+	columnSpans = icns_new_area_weights(srcWidth,destWidth,&columnWeights);
+	rowSpans = icns_new_area_weights(srcHeight,destHeight,&rowWeights);
+	rowsBuffer = (float *)icns_malloc((size_t)destWidth * srcHeight * 4 * sizeof(float));
+
+	if(columnSpans == NULL || rowSpans == NULL || rowsBuffer == NULL)
+	{
+		icns_print_err("icns_area_resample_rows: Unable to allocate resampling buffers!\n");
+		if(columnSpans) { icns_free(columnSpans); icns_free(columnWeights); }
+		if(rowSpans) { icns_free(rowSpans); icns_free(rowWeights); }
+		icns_free(rowsBuffer);
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	// Horizontal pass: srcHeight rows of destWidth float pixels
+	for(rowID = 0; rowID < srcHeight; rowID++)
+	{
+		const icns_byte_t	*srcRow = srcPtr + rowID * srcRowBytes;
+		float			*bufferRow = rowsBuffer + (size_t)rowID * destWidth * 4;
+
+		for(pixelID = 0; pixelID < destWidth; pixelID++)
+		{
+			const icns_area_weights_t	*span = &columnSpans[pixelID];
+			const icns_byte_t		*srcPixel = srcRow + span->first * 4;
+			float				sum[4] = {0.0f,0.0f,0.0f,0.0f};
+
+			for(spanID = 0; spanID < span->count; spanID++, srcPixel += 4)
+				for(c = 0; c < 4; c++)
+					sum[c] += srcPixel[c] * span->weights[spanID];
+
+			for(c = 0; c < 4; c++)
+				bufferRow[pixelID * 4 + c] = sum[c];
+		}
+	}
+
+	// Vertical pass into the destination bytes
+	for(rowID = 0; rowID < destHeight; rowID++)
+	{
+		const icns_area_weights_t	*span = &rowSpans[rowID];
+		icns_byte_t			*destRow = destPtr + rowID * destRowBytes;
+
+		for(pixelID = 0; pixelID < destWidth * 4; pixelID++)
+		{
+			const float	*bufferColumn = rowsBuffer + (size_t)span->first * destWidth * 4 + pixelID;
+			float		sum = 0.0f;
+
+			for(spanID = 0; spanID < span->count; spanID++, bufferColumn += destWidth * 4)
+				sum += *bufferColumn * span->weights[spanID];
+
+			sum += 0.5f;
+			destRow[pixelID] = (icns_byte_t)(sum < 0.0f ? 0 : (sum > 255.0f ? 255 : sum));
+		}
+	}
+
+	icns_free(columnSpans);
+	icns_free(columnWeights);
+	icns_free(rowSpans);
+	icns_free(rowWeights);
+	icns_free(rowsBuffer);
+
+	return ICNS_STATUS_OK;
+}
+
+// Back from premultiplied to straight alpha, through a reciprocal table
+static void icns_unpremultiply_rows(icns_byte_t *rowsPtr,icns_size_t rowBytes,icns_uint32_t width,icns_uint32_t height)
+{
+	icns_uint32_t	reciprocal[256];
+	icns_uint32_t	rowID = 0;
+	icns_uint32_t	pixelID = 0;
+	int		c = 0;
+
+	reciprocal[0] = 0;
+	for(c = 1; c < 256; c++)
+		reciprocal[c] = (255 * 65536 + c / 2) / c;
+
+	for(rowID = 0; rowID < height; rowID++)
+	{
+		icns_byte_t	*pixelPtr = rowsPtr + rowID * rowBytes;
+
+		for(pixelID = 0; pixelID < width; pixelID++, pixelPtr += 4)
+		{
+			icns_uint32_t	alpha = pixelPtr[3];
+
+			if(alpha == 255)
+				continue;
+
+			for(c = 0; c < 3; c++)
+			{
+				icns_uint32_t	value = (pixelPtr[c] * reciprocal[alpha] + 32768) >> 16;
+
+				pixelPtr[c] = (icns_byte_t)(value > 255 ? 255 : value);
+			}
+		}
+	}
+}
+
+//***************************** icns_resample_image **************************//
+// Scales a 32-bit RGBA image to width x height into a new image. Colors are
+// averaged with premultiplied alpha, so transparent pixels do not bleed
+// their (meaningless) color into the edges of the icon. Power of two steps
+// use a vectorized 2x2 box filter, and the rest an area filter.
+
+int icns_resample_image(icns_image_t *imageIn,icns_uint32_t width,icns_uint32_t height,icns_image_t *imageOut)
+{
+	int		error = ICNS_STATUS_OK;
+	icns_byte_t	*workData = NULL;
+	icns_uint32_t	workWidth = 0;
+	icns_uint32_t	workHeight = 0;
+
+	if(imageIn == NULL || imageOut == NULL)
+	{
+		icns_print_err("icns_resample_image: Image is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(imageIn->imageData == NULL || imageIn->imageChannels != 4 || imageIn->imagePixelDepth != 8)
+	{
+		icns_print_err("icns_resample_image: Input must be an 8-bit RGBA image!\n");
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(imageIn->imageWidth == 0 || imageIn->imageHeight == 0 || width == 0 || height == 0 || width > 16384 || height > 16384)
+	{
+		icns_print_err("icns_resample_image: Invalid size! (%dx%d to %dx%d)\n",imageIn->imageWidth,imageIn->imageHeight,width,height);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	if(imageIn->imageDataSize < (icns_uint64_t)imageIn->imageWidth * imageIn->imageHeight * 4)
+	{
+		icns_print_err("icns_resample_image: Image data size too small for its dimensions! (%d for %dx%d)\n",(int)imageIn->imageDataSize,imageIn->imageWidth,imageIn->imageHeight);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
+	error = icns_init_image(width,height,4,8,imageOut);
+	if(error)
+		return error;
+
+	workWidth = imageIn->imageWidth;
+	workHeight = imageIn->imageHeight;
+	workData = (icns_byte_t *)icns_malloc((size_t)workWidth * workHeight * 4);
+	if(workData == NULL)
+	{
+		icns_print_err("icns_resample_image: Unable to allocate memory block of size: %d!\n",(int)(workWidth * workHeight * 4));
+		icns_free_image(imageOut);
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	memcpy(workData,imageIn->imageData,(size_t)workWidth * workHeight * 4);
+	icns_convert_rgba_rows(workData,workWidth * 4,workWidth,workHeight,ICNS_PIXEL_FORMAT_RGBA_PREMULTIPLIED);
+
+	// Halve in place while both sides stay at or above twice the target
+	while(workWidth >= width * 2 && workHeight >= height * 2)
+	{
+		icns_halve_rows(workData,workWidth * 4,workWidth / 2,workHeight / 2,workData,(workWidth / 2) * 4);
+		workWidth /= 2;
+		workHeight /= 2;
+	}
+
+	if(workWidth == width && workHeight == height)
+		memcpy(imageOut->imageData,workData,(size_t)width * height * 4);
+	else
+		error = icns_area_resample_rows(workData,workWidth * 4,workWidth,workHeight,width,height,imageOut->imageData,width * 4);
+
+	icns_free(workData);
+
+	if(error)
+	{
+		icns_free_image(imageOut);
+		return error;
+	}
+
+	icns_unpremultiply_rows(imageOut->imageData,width * 4,width,height);
+
+	return ICNS_STATUS_OK;
+}
@@ -27,19 +27,209 @@ Boston, MA 02110-1301, USA.
 
 #include "icns.h"
 #include "icns_internals.h"
+
+//***************************** RLE24 planar decoding ****************************//
+// The rle24 stream stores each channel as its own run, so each channel is
+// expanded into a planar scratch row with memcpy/memset per run, and the
+// three planes are then interleaved into RGBA in one pass - with SSE2/AVX2
+// on x86 when the CPU has it (picked at run time), plain C everywhere else.
+
+#ifdef ICNS_SIMD_X86
+ #include <immintrin.h>
+#endif
+
+// Each plane may be overrun by up to this many bytes while decoding
+#define ICNS_RLE24_PLANE_SLACK	16
+
+// Expands one channel; returns how many pixels it produced and advances *dataOffset
+// Planes are decoded in order, so overrunning into the next one is harmless
+static icns_uint32_t icns_decode_rle24_plane(icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_uint32_t *dataOffsetRef,icns_uint32_t expectedPixelCount,icns_byte_t *planePtr)
+{
+	icns_uint32_t	dataOffset = *dataOffsetRef;
+	icns_uint32_t	pixelOffset = 0;
+	icns_uint32_t	runLength = 0;
+
+	while((pixelOffset < expectedPixelCount) && (dataOffset < (icns_uint32_t)rawDataSize))
+	{
+		if( (rawDataPtr[dataOffset] & 0x80) == 0)
+		{
+			// Top bit is clear - run of various values to follow
+			runLength = (0xFF & rawDataPtr[dataOffset++]) + 1; // 1 <= len <= 128
+			if(runLength > expectedPixelCount - pixelOffset)
+				runLength = expectedPixelCount - pixelOffset;
+			if(runLength > (icns_uint32_t)rawDataSize - dataOffset)
+				runLength = (icns_uint32_t)rawDataSize - dataOffset;
+			// Runs are mostly short, so copy a fixed 16 bytes when we can -
+			// the plane has ICNS_RLE24_PLANE_SLACK spare bytes at the end
+			if( (runLength <= 16) && (dataOffset + 16 <= (icns_uint32_t)rawDataSize) )
+				memcpy(&planePtr[pixelOffset],&rawDataPtr[dataOffset],16);
+			else
+				memcpy(&planePtr[pixelOffset],&rawDataPtr[dataOffset],runLength);
+			dataOffset += runLength;
+		}
+		else
+		{
+			// Top bit is set - run of one value to follow
+			runLength = (0xFF & rawDataPtr[dataOffset++]) - 125; // 3 <= len <= 130
+			if(dataOffset >= (icns_uint32_t)rawDataSize)
+				break;
+			if(runLength > expectedPixelCount - pixelOffset)
+				runLength = expectedPixelCount - pixelOffset;
+			memset(&planePtr[pixelOffset],rawDataPtr[dataOffset],16);
+			if(runLength > 16)
+				memset(&planePtr[pixelOffset+16],rawDataPtr[dataOffset],runLength-16);
+			dataOffset++;
+		}
+		pixelOffset += runLength;
+	}
+
+	*dataOffsetRef = dataOffset;
+
+	return pixelOffset;
+}
+
+// Writes R, G and B of pixelCount pixels, and alpha from alphaPtr - or
+// leaves the alpha bytes untouched if alphaPtr is NULL
+static void icns_interleave_rgb_c(const icns_byte_t *redPtr,const icns_byte_t *greenPtr,const icns_byte_t *bluePtr,const icns_byte_t *alphaPtr,icns_uint32_t pixelCount,icns_byte_t *destPtr)
+{
+	icns_uint32_t	pixelID = 0;
+
+	for(pixelID = 0; pixelID < pixelCount; pixelID++)
+	{
+		destPtr[pixelID*4+0] = redPtr[pixelID];
+		destPtr[pixelID*4+1] = greenPtr[pixelID];
+		destPtr[pixelID*4+2] = bluePtr[pixelID];
+		if(alphaPtr != NULL)
+			destPtr[pixelID*4+3] = alphaPtr[pixelID];
+	}
+}
+
+#ifdef ICNS_SIMD_X86
+__attribute__ ((target("sse2")))
+static void icns_interleave_rgb_sse2(const icns_byte_t *redPtr,const icns_byte_t *greenPtr,const icns_byte_t *bluePtr,const icns_byte_t *alphaPtr,icns_uint32_t pixelCount,icns_byte_t *destPtr)
+{
+	const __m128i	zero = _mm_setzero_si128();
+	const __m128i	alphaMask = _mm_set1_epi32((int)0xFF000000);
+	icns_uint32_t	pixelID = 0;
+
+	for(pixelID = 0; pixelID + 16 <= pixelCount; pixelID += 16)
+	{
+		__m128i	red = _mm_loadu_si128((const __m128i *)(redPtr+pixelID));
+		__m128i	green = _mm_loadu_si128((const __m128i *)(greenPtr+pixelID));
+		__m128i	blue = _mm_loadu_si128((const __m128i *)(bluePtr+pixelID));
+		__m128i	rgLo = _mm_unpacklo_epi8(red,green);
+		__m128i	rgHi = _mm_unpackhi_epi8(red,green);
+		__m128i	*dest = (__m128i *)(destPtr+pixelID*4);
+
+		if(alphaPtr != NULL)
+		{
+			__m128i	alpha = _mm_loadu_si128((const __m128i *)(alphaPtr+pixelID));
+			__m128i	baLo = _mm_unpacklo_epi8(blue,alpha);
+			__m128i	baHi = _mm_unpackhi_epi8(blue,alpha);
+
+			_mm_storeu_si128(dest+0,_mm_unpacklo_epi16(rgLo,baLo));
+			_mm_storeu_si128(dest+1,_mm_unpackhi_epi16(rgLo,baLo));
+			_mm_storeu_si128(dest+2,_mm_unpacklo_epi16(rgHi,baHi));
+			_mm_storeu_si128(dest+3,_mm_unpackhi_epi16(rgHi,baHi));
+		}
+		else
+		{
+			__m128i	b0Lo = _mm_unpacklo_epi8(blue,zero);
+			__m128i	b0Hi = _mm_unpackhi_epi8(blue,zero);
+
+			_mm_storeu_si128(dest+0,_mm_or_si128(_mm_and_si128(_mm_loadu_si128(dest+0),alphaMask),_mm_unpacklo_epi16(rgLo,b0Lo)));
+			_mm_storeu_si128(dest+1,_mm_or_si128(_mm_and_si128(_mm_loadu_si128(dest+1),alphaMask),_mm_unpackhi_epi16(rgLo,b0Lo)));
+			_mm_storeu_si128(dest+2,_mm_or_si128(_mm_and_si128(_mm_loadu_si128(dest+2),alphaMask),_mm_unpacklo_epi16(rgHi,b0Hi)));
+			_mm_storeu_si128(dest+3,_mm_or_si128(_mm_and_si128(_mm_loadu_si128(dest+3),alphaMask),_mm_unpackhi_epi16(rgHi,b0Hi)));
+		}
+	}
+
+	icns_interleave_rgb_c(redPtr+pixelID,greenPtr+pixelID,bluePtr+pixelID,(alphaPtr != NULL) ? alphaPtr+pixelID : NULL,pixelCount-pixelID,destPtr+pixelID*4);
+}
+
+__attribute__ ((target("avx2")))
+static void icns_interleave_rgb_avx2(const icns_byte_t *redPtr,const icns_byte_t *greenPtr,const icns_byte_t *bluePtr,const icns_byte_t *alphaPtr,icns_uint32_t pixelCount,icns_byte_t *destPtr)
+{
+	const __m256i	alphaMask = _mm256_set1_epi32((int)0xFF000000);
+	icns_uint32_t	pixelID = 0;
+
+	// Widen each channel byte to its own 32 bit pixel, then shift into place
+	for(pixelID = 0; pixelID + 8 <= pixelCount; pixelID += 8)
+	{
+		__m256i	red = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(redPtr+pixelID)));
+		__m256i	green = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(greenPtr+pixelID)));
+		__m256i	blue = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(bluePtr+pixelID)));
+		__m256i	rgb = _mm256_or_si256(red,_mm256_or_si256(_mm256_slli_epi32(green,8),_mm256_slli_epi32(blue,16)));
+		__m256i	*dest = (__m256i *)(destPtr+pixelID*4);
+
+		if(alphaPtr != NULL)
+		{
+			__m256i	alpha = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(alphaPtr+pixelID)));
+			_mm256_storeu_si256(dest,_mm256_or_si256(_mm256_slli_epi32(alpha,24),rgb));
+		}
+		else
+		{
+			_mm256_storeu_si256(dest,_mm256_or_si256(_mm256_and_si256(_mm256_loadu_si256(dest),alphaMask),rgb));
+		}
+	}
+
+	icns_interleave_rgb_c(redPtr+pixelID,greenPtr+pixelID,bluePtr+pixelID,(alphaPtr != NULL) ? alphaPtr+pixelID : NULL,pixelCount-pixelID,destPtr+pixelID*4);
+}
+#endif
+
+static void icns_interleave_rgb(const icns_byte_t *redPtr,const icns_byte_t *greenPtr,const icns_byte_t *bluePtr,const icns_byte_t *alphaPtr,icns_uint32_t pixelCount,icns_byte_t *destPtr)
+{
+	#ifdef ICNS_SIMD_X86
+	if(__builtin_cpu_supports("avx2"))
+	{
+		icns_interleave_rgb_avx2(redPtr,greenPtr,bluePtr,alphaPtr,pixelCount,destPtr);
+		return;
+	}
+	if(__builtin_cpu_supports("sse2"))
+	{
+		icns_interleave_rgb_sse2(redPtr,greenPtr,bluePtr,alphaPtr,pixelCount,destPtr);
+		return;
+	}
+	#endif
+
+	icns_interleave_rgb_c(redPtr,greenPtr,bluePtr,alphaPtr,pixelCount,destPtr);
+}
+
+// Returns where the first channel starts
+static icns_uint32_t icns_get_rle24_data_offset(icns_size_t rawDataSize,const icns_byte_t *rawDataPtr)
+{
+	icns_uint32_t	paddingBytes = 0;
+
+	// What's this??? In the 128x128 icons, we need to start 4 bytes
+	// ahead. There is often a NULL padding here for some reason. If
+	// we don't, the red channel will be off by 2 pixels, or worse
+	if(rawDataSize >= 4)
+		ICNS_READ_UNALIGNED(paddingBytes, rawDataPtr, sizeof(icns_uint32_t));
+
+	if( (rawDataSize >= 4) && (paddingBytes == 0x00000000) )
+	{
+		#ifdef ICNS_DEBUG
+		printf("4 byte null padding found in rle data!\n");
+		#endif
+		return 4;
+	}
+
+	return 0;
+}
+
 //***************************** icns_decode_rle24_data ****************************//
 // Decode a rgb 24 bit rle encoded data stream into 32 bit argb (alpha is ignored)
 
 int icns_decode_rle24_data(icns_size_t rawDataSize, icns_byte_t *rawDataPtr,icns_size_t expectedPixelCount, icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut)
 {
 	icns_uint8_t	colorOffset = 0;
-	icns_byte_t	colorValue = 0;
-	icns_uint8_t	runLength = 0;
 	icns_uint32_t	dataOffset = 0;
-	icns_uint32_t	pixelOffset = 0;
-	icns_uint32_t	i = 0;
+	icns_uint32_t	pixelCount[3] = {0,0,0};
+	icns_uint32_t	commonCount = 0;
+	icns_byte_t	*planeData = NULL;	// Decompressed channels, one after another
 	icns_byte_t	*destIconData = NULL;	// Decompressed Raw Icon Data
 	icns_uint32_t	destIconDataSize = 0;
+	ICNS_STATS_SCOPE(ICNS_STATS_DECODE_RLE24,rawDataSize);
 
 	if(rawDataPtr == NULL)
 	{
@@ -67,16 +257,25 @@ int icns_decode_rle24_data(icns_size_t rawDataSize, icns_byte_t *rawDataPtr,icns
 		printf("Decompressed will be %d bytes (%d pixels)\n",(int)destIconDataSize,(int)expectedPixelCount);
 	#endif
 
+	// Scratch planes come first, so a failure here leaves *dataPtrOut alone
+	planeData = (icns_byte_t *)icns_malloc(expectedPixelCount * 3 + ICNS_RLE24_PLANE_SLACK);
+	if(!planeData)
+	{
+		icns_print_err("icns_decode_rle24_data: Unable to allocate memory block of size: %d!\n",(int)(expectedPixelCount * 3));
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
 	if( (*dataSizeOut != destIconDataSize) || (*dataPtrOut == NULL) )
 	{
 		if(*dataPtrOut != NULL)
-			free(*dataPtrOut);
+			icns_free(*dataPtrOut);
 
 		// Allocate the block for the decoded memory and set to 0
-		destIconData = (icns_byte_t *)malloc(destIconDataSize);
+		destIconData = (icns_byte_t *)icns_malloc(destIconDataSize);
 		if(!destIconData)
 		{
 			icns_print_err("icns_decode_rle24_data: Unable to allocate memory block of size: %d ($s:%m)!\n",(int)destIconDataSize);
+			icns_free(planeData);
 			return ICNS_STATUS_NO_MEMORY;
 		}
 		memset(destIconData,0,destIconDataSize);
@@ -90,97 +289,389 @@ int icns_decode_rle24_data(icns_size_t rawDataSize, icns_byte_t *rawDataPtr,icns
 		printf("Decoding RLE data into RGB pixels...\n");
 	#endif
 
-	// What's this??? In the 128x128 icons, we need to start 4 bytes
-	// ahead. There is often a NULL padding here for some reason. If
-	// we don't, the red channel will be off by 2 pixels, or worse
-	if( *((icns_uint32_t*)rawDataPtr) == 0x00000000 )
-	{
-		#ifdef ICNS_DEBUG
-		printf("4 byte null padding found in rle data!\n");
-		#endif
-		dataOffset = 4;
-	}
-	else
-	{
-		dataOffset = 0;
-	}
+	dataOffset = icns_get_rle24_data_offset(rawDataSize,rawDataPtr);
 
 	// Data is stored in red run, green run,blue run
-	// So we decompress to pixel format RGBA
+	// So we decompress each into its own plane first...
+	for(colorOffset = 0; colorOffset < 3; colorOffset++)
+		pixelCount[colorOffset] = icns_decode_rle24_plane(rawDataSize,rawDataPtr,&dataOffset,expectedPixelCount,planeData + colorOffset * expectedPixelCount);
+
+	// ...then interleave to pixel format RGBA
 	// RED:   byte[0], byte[4], byte[8]  ...
 	// GREEN: byte[1], byte[5], byte[9]  ...
 	// BLUE:  byte[2], byte[6], byte[10] ...
 	// ALPHA: byte[3], byte[7], byte[11] do nothing with these bytes
+	commonCount = pixelCount[0];
+	if(pixelCount[1] < commonCount)
+		commonCount = pixelCount[1];
+	if(pixelCount[2] < commonCount)
+		commonCount = pixelCount[2];
+
+	icns_interleave_rgb(planeData,planeData + expectedPixelCount,planeData + 2 * expectedPixelCount,NULL,commonCount,destIconData);
+
+	// Short (truncated) channels leave the rest of their bytes alone
 	for(colorOffset = 0; colorOffset < 3; colorOffset++)
 	{
-		pixelOffset = 0;
-		while((pixelOffset < expectedPixelCount) && (dataOffset < rawDataSize))
-		{
-			if( (rawDataPtr[dataOffset] & 0x80) == 0)
-			{
-				// Top bit is clear - run of various values to follow
-				runLength = (0xFF & rawDataPtr[dataOffset++]) + 1; // 1 <= len <= 128
-				for(i = 0; (i < runLength) && (pixelOffset < expectedPixelCount) && (dataOffset < rawDataSize); i++) {
-					destIconData[(pixelOffset * 4) + colorOffset] = rawDataPtr[dataOffset++];
-					pixelOffset++;
-				}
-			}
-			else
-			{
-				// Top bit is set - run of one value to follow
-				runLength = (0xFF & rawDataPtr[dataOffset++]) - 125; // 3 <= len <= 130
-				// Set the value to the color shifted to the correct bit offset
-				colorValue = rawDataPtr[dataOffset++];
-
-				for(i = 0; (i < runLength) && (pixelOffset < expectedPixelCount); i++) {
-					destIconData[(pixelOffset * 4) + colorOffset] = colorValue;
-					pixelOffset++;
-				}
-			}
-		}
+		icns_uint32_t	pixelOffset = 0;
+
+		for(pixelOffset = commonCount; pixelOffset < pixelCount[colorOffset]; pixelOffset++)
+			destIconData[(pixelOffset * 4) + colorOffset] = planeData[colorOffset * expectedPixelCount + pixelOffset];
 	}
 
+	icns_free(planeData);
+
 	*dataSizeOut = destIconDataSize;
 	*dataPtrOut = destIconData;
 
 	return ICNS_STATUS_OK;
 }
 
-//***************************** icns_encode_rle24_data *******************************************//
-// Encode an 32 bit argb data stream into a 24 bit rgb rle encoded data stream (alpha is ignored)
 
-int icns_encode_rle24_data(icns_size_t dataSizeIn, icns_byte_t *dataPtrIn,icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut)
+//***************************** icns_decode_rle24_rows ****************************//
+// Decode rgb 24 bit rle data straight into width x height rows that are
+// rowBytes apart, each converted to pixelFormat as it is interleaved. Alpha
+// comes from the width x height plane at alphaPtr, or is set to 0 if alphaPtr
+// is NULL. Short (truncated) channels decode as 0.
+
+int icns_decode_rle24_rows(icns_size_t rawDataSize,const icns_byte_t *rawDataPtr,icns_uint32_t imageWidth,icns_uint32_t imageHeight,const icns_byte_t *alphaPtr,icns_pixel_format_t pixelFormat,icns_size_t rowBytes,icns_byte_t *destPtr)
 {
-	unsigned long	dataInCount = 0;
-	unsigned long 	dataInChanSize = 0;
-	icns_byte_t	*rgbaDataPtr = NULL;
-	icns_sint8_t	*dataTemp = NULL;
-	unsigned long	dataTempCount = 0;
+	icns_uint32_t	pixelCount = imageWidth * imageHeight;
+	icns_uint32_t	dataOffset = 0;
+	icns_uint32_t	decodedCount = 0;
+	icns_uint32_t	rowID = 0;
 	icns_uint8_t	colorOffset = 0;
-	icns_uint8_t	dataByte = 0;
-	icns_uint8_t	*dataRun = NULL;
-	icns_bool_t	runType = 0;
-	icns_uint8_t	runLength = 0; // Runs will never go over 130, one byte is ok
-	int		runCount = 0;
+	icns_byte_t	*planeData = NULL;	// Decompressed channels, then a row of zero alpha
+	ICNS_STATS_SCOPE(ICNS_STATS_DECODE_RLE24,rawDataSize);
+
+	if(rawDataPtr == NULL || destPtr == NULL)
+	{
+		icns_print_err("icns_decode_rle24_rows: rle decoder data ptr is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	planeData = (icns_byte_t *)icns_malloc(pixelCount * 3 + imageWidth + ICNS_RLE24_PLANE_SLACK);
+	if(!planeData)
+	{
+		icns_print_err("icns_decode_rle24_rows: Unable to allocate memory block of size: %d!\n",(int)(pixelCount * 3 + imageWidth));
+		return ICNS_STATUS_NO_MEMORY;
+	}
+
+	dataOffset = icns_get_rle24_data_offset(rawDataSize,rawDataPtr);
+
+	for(colorOffset = 0; colorOffset < 3; colorOffset++)
+	{
+		icns_byte_t	*planePtr = planeData + colorOffset * pixelCount;
+
+		decodedCount = icns_decode_rle24_plane(rawDataSize,rawDataPtr,&dataOffset,pixelCount,planePtr);
+		if(decodedCount < pixelCount)
+			memset(planePtr + decodedCount,0,pixelCount - decodedCount);
+	}
+
+	if(alphaPtr == NULL)
+		memset(planeData + pixelCount * 3,0,imageWidth);
+
+	for(rowID = 0; rowID < imageHeight; rowID++)
+	{
+		icns_uint32_t	rowOffset = rowID * imageWidth;
+
+		icns_interleave_rgb(
+			planeData + rowOffset,
+			planeData + pixelCount + rowOffset,
+			planeData + 2 * pixelCount + rowOffset,
+			(alphaPtr != NULL) ? alphaPtr + rowOffset : planeData + pixelCount * 3,
+			imageWidth,
+			destPtr + rowID * rowBytes);
+
+		icns_convert_rgba_rows(destPtr + rowID * rowBytes,0,imageWidth,1,pixelFormat);
+	}
+
+	icns_free(planeData);
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** RLE24 planar encoding ****************************//
+// Each channel is split out into its own plane, and a bitmask is built per
+// plane marking every pixel that repeats the two pixels before it. Run
+// boundaries then fall out of a bit scan over the mask instead of a byte by
+// byte state machine, and literal runs are copied straight out of the plane.
+
+// Bytes kept in front of each plane, so the mask can look two pixels back
+#define ICNS_RLE24_PLANE_GUARD	32
+
+// Splits pixelCount RGBA pixels into three planes
+static void icns_split_rgb_c(const icns_byte_t *srcPtr,icns_uint32_t pixelCount,icns_byte_t *redPtr,icns_byte_t *greenPtr,icns_byte_t *bluePtr)
+{
+	icns_uint32_t	pixelID = 0;
+
+	for(pixelID = 0; pixelID < pixelCount; pixelID++)
+	{
+		redPtr[pixelID] = srcPtr[pixelID*4+0];
+		greenPtr[pixelID] = srcPtr[pixelID*4+1];
+		bluePtr[pixelID] = srcPtr[pixelID*4+2];
+	}
+}
+
+// Sets bit i of repeatBits when plane[i] == plane[i-1] == plane[i-2]
+// The plane must be readable from plane[-2] up to the next multiple of 32
+static void icns_find_repeats_c(const icns_byte_t *planePtr,icns_uint32_t pixelCount,icns_uint32_t *repeatBits)
+{
+	icns_uint32_t	wordCount = (pixelCount + 31) / 32;
+	icns_uint32_t	wordID = 0;
+
+	for(wordID = 0; wordID < wordCount; wordID++)
+	{
+		const icns_byte_t	*bytePtr = planePtr + wordID * 32;
+		icns_uint32_t		word = 0;
+		icns_uint32_t		bitID = 0;
+
+		for(bitID = 0; bitID < 32; bitID++)
+		{
+			const icns_byte_t	*pixelPtr = bytePtr + bitID;
+
+			if( (pixelPtr[0] == pixelPtr[-1]) && (pixelPtr[0] == pixelPtr[-2]) )
+				word |= ((icns_uint32_t)1 << bitID);
+		}
+
+		repeatBits[wordID] = word;
+	}
+}
+
+#ifdef ICNS_SIMD_X86
+__attribute__ ((target("sse2")))
+static void icns_split_rgb_sse2(const icns_byte_t *srcPtr,icns_uint32_t pixelCount,icns_byte_t *redPtr,icns_byte_t *greenPtr,icns_byte_t *bluePtr)
+{
+	const __m128i	lowByte = _mm_set1_epi32(0xFF);
+	icns_uint32_t	pixelID = 0;
+
+	// Mask each channel down to the low byte of its pixel, then pack 16 of them
+	for(pixelID = 0; pixelID + 16 <= pixelCount; pixelID += 16)
+	{
+		const __m128i	*src = (const __m128i *)(srcPtr+pixelID*4);
+		__m128i	px0 = _mm_loadu_si128(src+0);
+		__m128i	px1 = _mm_loadu_si128(src+1);
+		__m128i	px2 = _mm_loadu_si128(src+2);
+		__m128i	px3 = _mm_loadu_si128(src+3);
+		__m128i	red = _mm_packus_epi16(
+			_mm_packs_epi32(_mm_and_si128(px0,lowByte),_mm_and_si128(px1,lowByte)),
+			_mm_packs_epi32(_mm_and_si128(px2,lowByte),_mm_and_si128(px3,lowByte)));
+		__m128i	green = _mm_packus_epi16(
+			_mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(px0,8),lowByte),_mm_and_si128(_mm_srli_epi32(px1,8),lowByte)),
+			_mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(px2,8),lowByte),_mm_and_si128(_mm_srli_epi32(px3,8),lowByte)));
+		__m128i	blue = _mm_packus_epi16(
+			_mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(px0,16),lowByte),_mm_and_si128(_mm_srli_epi32(px1,16),lowByte)),
+			_mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(px2,16),lowByte),_mm_and_si128(_mm_srli_epi32(px3,16),lowByte)));
+
+		_mm_storeu_si128((__m128i *)(redPtr+pixelID),red);
+		_mm_storeu_si128((__m128i *)(greenPtr+pixelID),green);
+		_mm_storeu_si128((__m128i *)(bluePtr+pixelID),blue);
+	}
+
+	icns_split_rgb_c(srcPtr+pixelID*4,pixelCount-pixelID,redPtr+pixelID,greenPtr+pixelID,bluePtr+pixelID);
+}
+
+__attribute__ ((target("sse2")))
+static void icns_find_repeats_sse2(const icns_byte_t *planePtr,icns_uint32_t pixelCount,icns_uint32_t *repeatBits)
+{
+	icns_uint32_t	wordCount = (pixelCount + 31) / 32;
+	icns_uint32_t	wordID = 0;
+
+	for(wordID = 0; wordID < wordCount; wordID++)
+	{
+		const icns_byte_t	*bytePtr = planePtr + wordID * 32;
+		__m128i	cur0 = _mm_loadu_si128((const __m128i *)(bytePtr));
+		__m128i	cur1 = _mm_loadu_si128((const __m128i *)(bytePtr+16));
+		__m128i	rep0 = _mm_and_si128(
+			_mm_cmpeq_epi8(cur0,_mm_loadu_si128((const __m128i *)(bytePtr-1))),
+			_mm_cmpeq_epi8(cur0,_mm_loadu_si128((const __m128i *)(bytePtr-2))));
+		__m128i	rep1 = _mm_and_si128(
+			_mm_cmpeq_epi8(cur1,_mm_loadu_si128((const __m128i *)(bytePtr+15))),
+			_mm_cmpeq_epi8(cur1,_mm_loadu_si128((const __m128i *)(bytePtr+14))));
+
+		repeatBits[wordID] = (icns_uint32_t)_mm_movemask_epi8(rep0) | ((icns_uint32_t)_mm_movemask_epi8(rep1) << 16);
+	}
+}
+
+__attribute__ ((target("avx2")))
+static void icns_find_repeats_avx2(const icns_byte_t *planePtr,icns_uint32_t pixelCount,icns_uint32_t *repeatBits)
+{
+	icns_uint32_t	wordCount = (pixelCount + 31) / 32;
+	icns_uint32_t	wordID = 0;
+
+	for(wordID = 0; wordID < wordCount; wordID++)
+	{
+		const icns_byte_t	*bytePtr = planePtr + wordID * 32;
+		__m256i	cur = _mm256_loadu_si256((const __m256i *)(bytePtr));
+		__m256i	rep = _mm256_and_si256(
+			_mm256_cmpeq_epi8(cur,_mm256_loadu_si256((const __m256i *)(bytePtr-1))),
+			_mm256_cmpeq_epi8(cur,_mm256_loadu_si256((const __m256i *)(bytePtr-2))));
+
+		repeatBits[wordID] = (icns_uint32_t)_mm256_movemask_epi8(rep);
+	}
+}
+#endif
+
+static void icns_split_rgb(const icns_byte_t *srcPtr,icns_uint32_t pixelCount,icns_byte_t *redPtr,icns_byte_t *greenPtr,icns_byte_t *bluePtr)
+{
+	#ifdef ICNS_SIMD_X86
+	if(__builtin_cpu_supports("sse2"))
+	{
+		icns_split_rgb_sse2(srcPtr,pixelCount,redPtr,greenPtr,bluePtr);
+		return;
+	}
+	#endif
+
+	icns_split_rgb_c(srcPtr,pixelCount,redPtr,greenPtr,bluePtr);
+}
+
+static void icns_find_repeats(const icns_byte_t *planePtr,icns_uint32_t pixelCount,icns_uint32_t *repeatBits)
+{
+	#ifdef ICNS_SIMD_X86
+	if(__builtin_cpu_supports("avx2"))
+	{
+		icns_find_repeats_avx2(planePtr,pixelCount,repeatBits);
+		return;
+	}
+	if(__builtin_cpu_supports("sse2"))
+	{
+		icns_find_repeats_sse2(planePtr,pixelCount,repeatBits);
+		return;
+	}
+	#endif
+
+	icns_find_repeats_c(planePtr,pixelCount,repeatBits);
+}
+
+// Returns the first pixel in [fromPixel,toPixel) whose repeat bit equals
+// wantSet, or toPixel if there is none
+static icns_uint32_t icns_find_repeat_bit(const icns_uint32_t *repeatBits,icns_uint32_t fromPixel,icns_uint32_t toPixel,icns_bool_t wantSet)
+{
+	icns_uint32_t	flipBits = wantSet ? 0 : 0xFFFFFFFF;
+	icns_uint32_t	wordID = fromPixel >> 5;
+	icns_uint32_t	word = (repeatBits[wordID] ^ flipBits) & (0xFFFFFFFF << (fromPixel & 31));
+
+	while(word == 0)
+	{
+		wordID++;
+		if((wordID << 5) >= toPixel)
+			return toPixel;
+		word = repeatBits[wordID] ^ flipBits;
+	}
+
+	#ifdef __GNUC__
+	fromPixel = (wordID << 5) + __builtin_ctz(word);
+	#else
+	fromPixel = (wordID << 5);
+	while((word & 1) == 0)
+	{
+		word >>= 1;
+		fromPixel++;
+	}
+	#endif
+
+	return (fromPixel < toPixel) ? fromPixel : toPixel;
+}
+
+// Encodes one plane, returns the number of bytes written to destPtr
+static icns_size_t icns_encode_rle24_plane(const icns_byte_t *planePtr,const icns_uint32_t *repeatBits,icns_uint32_t pixelCount,icns_byte_t *destPtr)
+{
+	icns_size_t	destOffset = 0;
+	icns_uint32_t	runStart = 0;
+
+	while(runStart < pixelCount)
+	{
+		// Differing values run until three in a row match, or for 128 values
+		icns_uint32_t	runLimit = (pixelCount - runStart > 128) ? runStart + 128 : pixelCount;
+		icns_uint32_t	repeatAt = runLimit;
+		icns_uint32_t	runLength = 0;
+
+		if(runStart + 2 < runLimit)
+			repeatAt = icns_find_repeat_bit(repeatBits,runStart + 2,runLimit,1);
+
+		if(repeatAt == runLimit)
+		{
+			runLength = runLimit - runStart;
+			destPtr[destOffset++] = runLength - 1;
+			memcpy(&destPtr[destOffset],&planePtr[runStart],runLength);
+			destOffset += runLength;
+			runStart = runLimit;
+			continue;
+		}
+
+		// The same values run starts with the two values before the match
+		runLength = (repeatAt - 2) - runStart;
+		if(runLength > 0)
+		{
+			destPtr[destOffset++] = runLength - 1;
+			memcpy(&destPtr[destOffset],&planePtr[runStart],runLength);
+			destOffset += runLength;
+		}
+		runStart = repeatAt - 2;
+
+		// Same values run until one differs, or for 130 values
+		runLimit = (pixelCount - runStart > 130) ? runStart + 130 : pixelCount;
+		repeatAt = runLimit;
+		if(runStart + 3 < runLimit)
+			repeatAt = icns_find_repeat_bit(repeatBits,runStart + 3,runLimit,0);
+
+		destPtr[destOffset++] = (repeatAt - runStart) + 125;
+		destPtr[destOffset++] = planePtr[runStart];
+		runStart = repeatAt;
+	}
+
+	return destOffset;
+}
+
+//***************************** icns_get_rle24_max_encoded_size ****************************//
+// Largest possible output of icns_encode_rle24_data for dataSizeIn bytes of argb
+
+icns_size_t icns_get_rle24_max_encoded_size(icns_size_t dataSizeIn)
+{
+	icns_size_t	pixelCount = dataSizeIn / 4;
+
+	// Padding, then per channel one header byte for every 128 values at worst
+	return 4 + 3 * (pixelCount + (pixelCount + 127) / 128);
+}
+
+//***************************** icns_encode_rle24_data_into *******************************************//
+// Encode an 32 bit argb data stream into a caller supplied buffer of at
+// least icns_get_rle24_max_encoded_size(dataSizeIn) bytes
+
+int icns_encode_rle24_data_into(icns_size_t dataSizeIn, icns_byte_t *dataPtrIn,icns_size_t bufferSize, icns_byte_t *bufferPtr,icns_size_t *dataSizeOut)
+{
+	icns_uint32_t	pixelCount = 0;
+	icns_uint32_t	planeStride = 0;
+	icns_uint32_t	wordCount = 0;
+	icns_byte_t	*planeData = NULL;
+	icns_uint32_t	*repeatData = NULL;
+	icns_size_t	dataOutCount = 0;
+	icns_uint8_t	colorOffset = 0;
+	ICNS_STATS_SCOPE(ICNS_STATS_ENCODE_RLE24,dataSizeIn);
 
 	if(dataPtrIn == NULL)
 	{
-		icns_print_err("icns_encode_rle24_data: rle encoder data in ptr is NULL!\n");
+		icns_print_err("icns_encode_rle24_data_into: rle encoder data in ptr is NULL!\n");
 		return ICNS_STATUS_NULL_PARAM;
 	}
 
-	if(dataSizeOut == NULL)
+	if(bufferPtr == NULL)
 	{
-		icns_print_err("icns_encode_rle24_data: rle encoder data out size ref is NULL!\n");
+		icns_print_err("icns_encode_rle24_data_into: rle encoder buffer ptr is NULL!\n");
 		return ICNS_STATUS_NULL_PARAM;
 	}
 
-	if(dataPtrOut == NULL)
+	if(dataSizeOut == NULL)
 	{
-		icns_print_err("icns_encode_rle24_data: rle encoder data out ptr ref is NULL!\n");
+		icns_print_err("icns_encode_rle24_data_into: rle encoder data out size ref is NULL!\n");
 		return ICNS_STATUS_NULL_PARAM;
 	}
 
+	if(bufferSize < icns_get_rle24_max_encoded_size(dataSizeIn))
+	{
+		icns_print_err("icns_encode_rle24_data_into: Buffer size %d is too small!\n",(int)bufferSize);
+		return ICNS_STATUS_INVALID_DATA;
+	}
+
 	// Assumptions of what icns rle data is all about:
 	// A) Each channel is encoded indepenent of the next.
 	// B) An encoded channel looks like this:
@@ -198,214 +689,134 @@ int icns_encode_rle24_data(icns_size_t dataSizeIn, icns_byte_t *dataPtrIn,icns_s
 	// F) 0xCV byte are set accordingly
 	//    1) for differing values, run of all differing values
 	//    2) for same values, only one byte of that values
-	// Estimations put the absolute worst case scenario as the
-	// final compressed data being slightly LARGER. So we need to be
-	// careful about allocating memory. (Did I miss something?)
-	// tests seem to indicate it will never be larger than the original
+	// A differing values run only grows by one header byte per 128 values,
+	// which is where icns_get_rle24_max_encoded_size comes from.
 
-	// This block is for the new RLE encoded data - make it 25% larger
-	dataTemp = (icns_sint8_t *)malloc(dataSizeIn + (dataSizeIn / 4));
-	if(dataTemp == NULL)
+	// There's always going to be 4 channels in this
+	// so we want our counter to increment through
+	// channels, not bytes....
+	pixelCount = dataSizeIn / 4;
+
+	// Move forward 4 bytes for 128 size - who knows why this should be
+	if(dataSizeIn >= 65536)
 	{
-		icns_print_err("icns_encode_rle24_data: Unable to allocate memory block of size: %d!\n",(int)dataSizeIn);
-		return ICNS_STATUS_NO_MEMORY;
+		memset(bufferPtr,0,4);
+		dataOutCount = 4;
 	}
-	memset(dataTemp,0,dataSizeIn);
 
-	// This block is for a run of RLE encoded data
-	dataRun = (icns_uint8_t *)malloc(140);
-	if(dataRun == NULL)
+	if(pixelCount == 0)
 	{
-		icns_print_err("icns_encode_rle24_data: Unable to allocate memory block of size: %d!\n",140);
-		free(dataTemp);
-		return ICNS_STATUS_NO_MEMORY;
+		*dataSizeOut = dataOutCount;
+		return ICNS_STATUS_OK;
 	}
-	memset(dataRun,0,140);
 
-	// Set the data ptr
-	rgbaDataPtr = (icns_byte_t *)dataPtrIn;
+	// Each plane has a guard in front and is padded out to whole mask words
+	wordCount = (pixelCount + 31) / 32;
+	planeStride = ICNS_RLE24_PLANE_GUARD + wordCount * 32;
 
-	// There's always going to be 4 channels in this
-	// so we want our counter to increment through
-	// channels, not bytes....
-	dataInChanSize = dataSizeIn / 4;
-
-	// Move forward 4 bytes for 128 size - who knows why this should be
-	if(dataSizeIn >= 65536)
-		dataTempCount = 4;
+	planeData = (icns_byte_t *)icns_malloc(3 * planeStride + 3 * wordCount * sizeof(icns_uint32_t));
+	if(planeData == NULL)
+	{
+		icns_print_err("icns_encode_rle24_data_into: Unable to allocate memory block of size: %d!\n",(int)(3 * planeStride + 3 * wordCount * sizeof(icns_uint32_t)));
+		return ICNS_STATUS_NO_MEMORY;
+	}
+	repeatData = (icns_uint32_t *)(planeData + 3 * planeStride);
 
 	// Data is stored in red run, green run,blue run
-	// So we compress from pixel format RGBA
+	// So we split from pixel format RGBA
 	// RED:   byte[0], byte[4], byte[8]  ...
 	// GREEN: byte[1], byte[5], byte[9]  ...
 	// BLUE:  byte[2], byte[6], byte[10] ...
 	// ALPHA: byte[3], byte[7], byte[11] do nothing with these bytes
 	for(colorOffset = 0; colorOffset < 3; colorOffset++)
 	{
-		runCount = 0;
+		icns_byte_t	*planePtr = planeData + colorOffset * planeStride + ICNS_RLE24_PLANE_GUARD;
 
-		// Set the first byte of the run...
-		dataRun[0] = *(rgbaDataPtr+colorOffset);
+		memset(planePtr - ICNS_RLE24_PLANE_GUARD,0,ICNS_RLE24_PLANE_GUARD);
+		memset(planePtr + pixelCount,0,wordCount * 32 - pixelCount);
+	}
 
-		// Start with a runlength of 1 for the first byte
-		runLength = 1;
+	icns_split_rgb(dataPtrIn,pixelCount,
+		planeData + ICNS_RLE24_PLANE_GUARD,
+		planeData + planeStride + ICNS_RLE24_PLANE_GUARD,
+		planeData + 2 * planeStride + ICNS_RLE24_PLANE_GUARD);
 
-		// Assume that the run will be different for now... We can change this later
-		runType = 0; // 0 for low bit (different), 1 for high bit (same)
+	// The channels only depend on their own plane, but the green run can't
+	// start until the size of the red run is known, so encode them in order
+	for(colorOffset = 0; colorOffset < 3; colorOffset++)
+	{
+		icns_byte_t	*planePtr = planeData + colorOffset * planeStride + ICNS_RLE24_PLANE_GUARD;
+		icns_uint32_t	*repeatBits = repeatData + colorOffset * wordCount;
 
-		// Start one byte ahead
-		for(dataInCount = 1; dataInCount < dataInChanSize; dataInCount++)
-		{
-			dataByte = *(rgbaDataPtr+colorOffset+(dataInCount*4));
-
-			if(runLength < 2)
-			{
-				// Simply append to the current run
-				dataRun[runLength++] = dataByte;
-			}
-			else if(runLength == 2)
-			{
-				// Decide here if the run should be same values or different values
-
-				// If the last three values were the same, we can change to a same-type run
-				if( (dataByte == dataRun[runLength-1]) && (dataByte == dataRun[runLength-2]) )
-					runType = 1;
-				else
-					runType = 0;
-
-				dataRun[runLength++] = dataByte;
-			}
-			else // Greater than or equal to 2
-			{
-				if(runType == 0 && runLength < 128) // Different type run
-				{
-					// If the new value matches both of the last two values, we have a new
-					// same-type run starting with the previous two bytes
-					if( (dataByte == dataRun[runLength-1]) && (dataByte == dataRun[runLength-2]) )
-					{
-						// Set the RL byte
-						*(dataTemp+dataTempCount) = runLength - 3;
-						dataTempCount++;
-
-						// Copy 0 to runLength-2 bytes to the RLE data here
-						memcpy( dataTemp+dataTempCount , dataRun , runLength - 2 );
-						dataTempCount = dataTempCount + (runLength - 2);
-						runCount++;
-
-						// Set up the new same-type run
-						dataRun[0] = dataRun[runLength-2];
-						dataRun[1] = dataRun[runLength-1];
-						dataRun[2] = dataByte;
-						runLength = 3;
-						runType = 1;
-					}
-					else // They don't match, so we can proceed
-					{
-						dataRun[runLength++] = dataByte;
-					}
-				}
-				else if(runType == 1 && runLength < 130) // Same type run
-				{
-					// If the new value matches both of the last two values, we
-					// can safely continue
-					if( (dataByte == dataRun[runLength-1]) && (dataByte == dataRun[runLength-2]) )
-					{
-						dataRun[runLength++] = dataByte;
-					}
-					else // They don't match, so we need to start a new run
-					{
-						// Set the RL byte
-						*(dataTemp+dataTempCount) = runLength + 125;
-						dataTempCount++;
-
-						// Only copy the first byte, since all the remaining values are identical
-						*(dataTemp+dataTempCount) = dataRun[0];
-						dataTempCount++;
-						runCount++;
-
-						// Copy 0 to runLength bytes to the RLE data here
-						dataRun[0] = dataByte;
-						runLength = 1;
-						runType = 0;
-					}
-				}
-				else // Exceeded run limit, need to start a new one
-				{
-					if(runType == 0)
-					{
-						// Set the RL byte low
-						*(dataTemp+dataTempCount) = runLength - 1;
-						dataTempCount++;
-
-						// Copy 0 to runLength bytes to the RLE data here
-						memcpy( dataTemp+dataTempCount , dataRun , runLength );
-						dataTempCount = dataTempCount + runLength;
-					}
-					else if(runType == 1)
-					{
-						// Set the RL byte high
-						*(dataTemp+dataTempCount) = runLength + 125;
-						dataTempCount++;
-
-						// Only copy the first byte, since all the remaining values are identical
-						*(dataTemp+dataTempCount) = dataRun[0];
-						dataTempCount++;
-					}
-
-					runCount++;
-
-					// Copy 0 to runLength bytes to the RLE data here
-					dataRun[0] = dataByte;
-					runLength = 1;
-					runType = 0;
-				}
-			}
-		}
+		icns_find_repeats(planePtr,pixelCount,repeatBits);
 
-		// Copy the end of the last run
-		if(runLength > 0)
-		{
-			if(runType == 0)
-			{
-				// Set the RL byte low
-				*(dataTemp+dataTempCount) = runLength - 1;
-				dataTempCount++;
-
-				// Copy 0 to runLength bytes to the RLE data here
-				memcpy( dataTemp+dataTempCount , dataRun , runLength );
-				dataTempCount = dataTempCount + runLength;
-			}
-			else if(runType == 1)
-			{
-				// Set the RL byte high
-				*(dataTemp+dataTempCount) = runLength + 125;
-				dataTempCount++;
-
-				// Only copy the first byte, since all the remaining values are identical
-				*(dataTemp+dataTempCount) = dataRun[0];
-				dataTempCount++;
-			}
-
-			runCount++;
-		}
+		// The first two pixels looked back into the guard bytes
+		repeatBits[0] &= ~(icns_uint32_t)3;
+		dataOutCount += icns_encode_rle24_plane(planePtr,repeatBits,pixelCount,bufferPtr + dataOutCount);
 	}
 
-	free(dataRun);
+	icns_free(planeData);
+
+	*dataSizeOut = dataOutCount;
+
+	return ICNS_STATUS_OK;
+}
+
+//***************************** icns_encode_rle24_data *******************************************//
+// Encode an 32 bit argb data stream into a 24 bit rgb rle encoded data stream (alpha is ignored)
+
+int icns_encode_rle24_data(icns_size_t dataSizeIn, icns_byte_t *dataPtrIn,icns_size_t *dataSizeOut, icns_byte_t **dataPtrOut)
+{
+	icns_size_t	bufferSize = 0;
+	icns_byte_t	*bufferPtr = NULL;
+	icns_byte_t	*shrunkPtr = NULL;
+	icns_size_t	dataOutSize = 0;
+	int		error = ICNS_STATUS_OK;
 
-	// This block is for the final encoded data
-	(*dataPtrOut) = (icns_uint8_t *)malloc(dataTempCount);
-	if((*dataPtrOut) == NULL)
+	if(dataPtrIn == NULL)
+	{
+		icns_print_err("icns_encode_rle24_data: rle encoder data in ptr is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(dataSizeOut == NULL)
 	{
-		icns_print_err("icns_encode_rle24_data: Unable to allocate memory block of size: %d!\n",dataTempCount);
-		free(dataTemp);
+		icns_print_err("icns_encode_rle24_data: rle encoder data out size ref is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	if(dataPtrOut == NULL)
+	{
+		icns_print_err("icns_encode_rle24_data: rle encoder data out ptr ref is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	// Encode straight into a worst case sized block, then trim it down
+	bufferSize = icns_get_rle24_max_encoded_size(dataSizeIn);
+	bufferPtr = (icns_byte_t *)icns_malloc(bufferSize);
+	if(bufferPtr == NULL)
+	{
+		icns_print_err("icns_encode_rle24_data: Unable to allocate memory block of size: %d!\n",(int)bufferSize);
 		return ICNS_STATUS_NO_MEMORY;
 	}
 
-	*dataSizeOut = dataTempCount;
-	memcpy( (*dataPtrOut), dataTemp, dataTempCount);
+	error = icns_encode_rle24_data_into(dataSizeIn,dataPtrIn,bufferSize,bufferPtr,&dataOutSize);
+	if(error != ICNS_STATUS_OK)
+	{
+		icns_free(bufferPtr);
+		return error;
+	}
+
+	// A failed shrink still leaves the larger block intact
+	if(dataOutSize > 0)
+	{
+		shrunkPtr = (icns_byte_t *)icns_realloc(bufferPtr,bufferSize,dataOutSize);
+		if(shrunkPtr != NULL)
+			bufferPtr = shrunkPtr;
+	}
 
-	free(dataTemp);
+	*dataSizeOut = dataOutSize;
+	*dataPtrOut = bufferPtr;
 
 	return ICNS_STATUS_OK;
 }
-
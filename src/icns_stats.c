@@ -0,0 +1,388 @@
+/*
+File:       icns_stats.c
+Copyright (C) 2001-2013 Mathew Eis <mathew@eisbox.net>
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the
+Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+Boston, MA 02110-1301, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "icns.h"
+#include "icns_internals.h"
+
+#if defined(ICNS_STATS) && defined(HAVE_PTHREAD_H)
+#include <pthread.h>
+#endif
+
+//***************************** Stage statistics ****************************//
+// Built only with --enable-stats (ICNS_STATS). Each thread counts into a
+// block of its own, so the hot paths never take a lock; the blocks are
+// chained together for icns_get_stats(), and a thread's counts are folded
+// into gRetiredStats when it exits.
+//
+// Resetting doesn't touch the counters - it stores them as a baseline that
+// is subtracted on the way out, so a reset can't race with a thread that
+// is busy counting.
+//
+// Setting ICNS_STATS in the environment prints the totals to stderr at exit.
+
+#ifdef ICNS_STATS
+
+static const char *gStageNames[ICNS_STATS_STAGE_COUNT] = {
+	"parse family",
+	"export family",
+	"write family",
+	"set element",
+	"decode image",
+	"decode rle24",
+	"encode rle24",
+	"decode png",
+	"encode png",
+	"decode jp2",
+	"encode jp2"
+};
+
+typedef struct icns_thread_stats_t
+{
+	icns_stats_t			stats;		// only ever written by the owning thread
+	icns_stats_t			baseline;	// stats at the last reset, under the lock
+	struct icns_thread_stats_t	*next;
+} icns_thread_stats_t;
+
+// Must really be per thread: another thread's block may be retired and freed
+// at any time, which is why configure refuses --enable-stats without TLS
+static ICNS_THREAD_LOCAL icns_thread_stats_t	*gThreadStats = NULL;
+static ICNS_THREAD_LOCAL int			gCurrentStage = -1;
+
+static icns_thread_stats_t	*gThreadStatsList = NULL;
+static icns_stats_t		gRetiredStats;
+
+// Counters are read by other threads while their owner updates them, so
+// every access is a relaxed atomic - a plain load or store on most targets
+#define ICNS_STATS_LOAD(field)		__atomic_load_n(&(field),__ATOMIC_RELAXED)
+#define ICNS_STATS_ADD(field,value)	__atomic_store_n(&(field),ICNS_STATS_LOAD(field) + (value),__ATOMIC_RELAXED)
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	gStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	gStatsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t	gStatsKey;
+ #define ICNS_STATS_LOCK()	pthread_mutex_lock(&gStatsLock)
+ #define ICNS_STATS_UNLOCK()	pthread_mutex_unlock(&gStatsLock)
+#else
+static int		gStatsOnce = 0;
+ #define ICNS_STATS_LOCK()
+ #define ICNS_STATS_UNLOCK()
+#endif
+
+static void icns_stats_accumulate(icns_stats_t *total,const icns_stats_t *stats,const icns_stats_t *baseline)
+{
+	int	stage = 0;
+	int	bucket = 0;
+
+	for(stage = 0; stage < ICNS_STATS_STAGE_COUNT; stage++)
+	{
+		icns_stage_stats_t		*totalStage = &total->stages[stage];
+		const icns_stage_stats_t	*stageStats = &stats->stages[stage];
+		const icns_stage_stats_t	*baseStage = baseline ? &baseline->stages[stage] : NULL;
+
+		totalStage->calls += ICNS_STATS_LOAD(stageStats->calls) - (baseStage ? baseStage->calls : 0);
+		totalStage->bytesProcessed += ICNS_STATS_LOAD(stageStats->bytesProcessed) - (baseStage ? baseStage->bytesProcessed : 0);
+		totalStage->allocBytes += ICNS_STATS_LOAD(stageStats->allocBytes) - (baseStage ? baseStage->allocBytes : 0);
+		totalStage->totalNanoseconds += ICNS_STATS_LOAD(stageStats->totalNanoseconds) - (baseStage ? baseStage->totalNanoseconds : 0);
+
+		for(bucket = 0; bucket < ICNS_STATS_HISTOGRAM_BUCKETS; bucket++)
+			totalStage->latencyHistogram[bucket] += ICNS_STATS_LOAD(stageStats->latencyHistogram[bucket]) - (baseStage ? baseStage->latencyHistogram[bucket] : 0);
+	}
+}
+
+static void icns_stats_snapshot(icns_stats_t *statsOut,const icns_stats_t *stats)
+{
+	memset(statsOut,0,sizeof(icns_stats_t));
+	icns_stats_accumulate(statsOut,stats,NULL);
+}
+
+static void icns_print_stats(FILE *outFile,const icns_stats_t *stats)
+{
+	int	stage = 0;
+	int	bucket = 0;
+
+	fprintf(outFile,"libicns stats:\n");
+	fprintf(outFile,"  %-14s %10s %14s %14s %12s %10s\n","stage","calls","bytes","alloc bytes","total ms","avg us");
+
+	for(stage = 0; stage < ICNS_STATS_STAGE_COUNT; stage++)
+	{
+		const icns_stage_stats_t	*stageStats = &stats->stages[stage];
+
+		if(stageStats->calls == 0)
+			continue;
+
+		fprintf(outFile,"  %-14s %10llu %14llu %14llu %12.3f %10.1f\n",gStageNames[stage],
+			(unsigned long long)stageStats->calls,(unsigned long long)stageStats->bytesProcessed,
+			(unsigned long long)stageStats->allocBytes,(double)stageStats->totalNanoseconds / 1e6,
+			(double)stageStats->totalNanoseconds / 1e3 / (double)stageStats->calls);
+
+		fprintf(outFile,"  %-14s","");
+		for(bucket = 0; bucket < ICNS_STATS_HISTOGRAM_BUCKETS; bucket++)
+		{
+			if(stageStats->latencyHistogram[bucket] == 0)
+				continue;
+			if(bucket == ICNS_STATS_HISTOGRAM_BUCKETS - 1)
+				fprintf(outFile," >=%lluus:%llu",1ULL << (bucket - 1),(unsigned long long)stageStats->latencyHistogram[bucket]);
+			else
+				fprintf(outFile," <%lluus:%llu",1ULL << bucket,(unsigned long long)stageStats->latencyHistogram[bucket]);
+		}
+		fprintf(outFile,"\n");
+	}
+}
+
+static void icns_dump_stats_at_exit(void)
+{
+	icns_stats_t	stats;
+
+	if(icns_get_stats(&stats) == ICNS_STATUS_OK)
+		icns_print_stats(stderr,&stats);
+}
+
+#ifdef HAVE_PTHREAD_H
+// Folds an exiting thread's counts into gRetiredStats
+static void icns_retire_thread_stats(void *threadStatsPtr)
+{
+	icns_thread_stats_t	*threadStats = (icns_thread_stats_t *)threadStatsPtr;
+	icns_thread_stats_t	**link = &gThreadStatsList;
+
+	ICNS_STATS_LOCK();
+
+	while(*link != NULL && *link != threadStats)
+		link = &(*link)->next;
+	if(*link != NULL)
+		*link = threadStats->next;
+
+	icns_stats_accumulate(&gRetiredStats,&threadStats->stats,&threadStats->baseline);
+
+	ICNS_STATS_UNLOCK();
+
+	free(threadStats);
+}
+#endif
+
+static void icns_init_stats(void)
+{
+	const char	*dumpSetting = getenv("ICNS_STATS");
+
+	#ifdef HAVE_PTHREAD_H
+	pthread_key_create(&gStatsKey,icns_retire_thread_stats);
+	#endif
+
+	if(dumpSetting != NULL && dumpSetting[0] != '\0' && strcmp(dumpSetting,"0") != 0)
+		atexit(icns_dump_stats_at_exit);
+}
+
+static icns_thread_stats_t *icns_get_thread_stats_block(void)
+{
+	icns_thread_stats_t	*threadStats = gThreadStats;
+
+	if(threadStats != NULL)
+		return threadStats;
+
+	#ifdef HAVE_PTHREAD_H
+	pthread_once(&gStatsOnce,icns_init_stats);
+	#else
+	if(!gStatsOnce)
+	{
+		gStatsOnce = 1;
+		icns_init_stats();
+	}
+	#endif
+
+	threadStats = (icns_thread_stats_t *)calloc(1,sizeof(icns_thread_stats_t));
+	if(threadStats == NULL)
+		return NULL;
+
+	ICNS_STATS_LOCK();
+	threadStats->next = gThreadStatsList;
+	gThreadStatsList = threadStats;
+	ICNS_STATS_UNLOCK();
+
+	#ifdef HAVE_PTHREAD_H
+	pthread_setspecific(gStatsKey,threadStats);
+	#endif
+
+	gThreadStats = threadStats;
+
+	return threadStats;
+}
+
+static icns_uint64_t icns_stats_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+
+	return (icns_uint64_t)ts.tv_sec * 1000000000ULL + (icns_uint64_t)ts.tv_nsec;
+}
+
+//***************************** icns_stats_begin_scope **************************//
+// Used through ICNS_STATS_SCOPE - starts timing a stage in the calling thread
+
+icns_stats_scope_t icns_stats_begin_scope(int stage,icns_uint64_t bytesProcessed)
+{
+	icns_stats_scope_t	scope;
+
+	scope.stage = stage;
+	scope.parentStage = gCurrentStage;
+	scope.bytesProcessed = bytesProcessed;
+	scope.startTime = icns_stats_now();
+
+	gCurrentStage = stage;
+
+	return scope;
+}
+
+//***************************** icns_stats_end_scope **************************//
+// Run by the compiler as an ICNS_STATS_SCOPE variable goes out of scope
+
+void icns_stats_end_scope(icns_stats_scope_t *scope)
+{
+	icns_thread_stats_t	*threadStats = NULL;
+	icns_stage_stats_t	*stageStats = NULL;
+	icns_uint64_t		elapsed = icns_stats_now() - scope->startTime;
+	icns_uint64_t		micros = elapsed / 1000;
+	int			bucket = 0;
+
+	gCurrentStage = scope->parentStage;
+
+	threadStats = icns_get_thread_stats_block();
+	if(threadStats == NULL)
+		return;
+
+	// Bucket 0 is under 1us, bucket n under 2^n us
+	while(micros != 0 && bucket < ICNS_STATS_HISTOGRAM_BUCKETS - 1)
+	{
+		micros >>= 1;
+		bucket++;
+	}
+
+	stageStats = &threadStats->stats.stages[scope->stage];
+	ICNS_STATS_ADD(stageStats->calls,1);
+	ICNS_STATS_ADD(stageStats->bytesProcessed,scope->bytesProcessed);
+	ICNS_STATS_ADD(stageStats->totalNanoseconds,elapsed);
+	ICNS_STATS_ADD(stageStats->latencyHistogram[bucket],1);
+}
+
+//***************************** icns_stats_add_alloc **************************//
+// Charges an allocation to the innermost stage running in this thread
+
+void icns_stats_add_alloc(icns_uint64_t allocBytes)
+{
+	icns_thread_stats_t	*threadStats = NULL;
+
+	if(gCurrentStage < 0)
+		return;
+
+	threadStats = icns_get_thread_stats_block();
+	if(threadStats == NULL)
+		return;
+
+	ICNS_STATS_ADD(threadStats->stats.stages[gCurrentStage].allocBytes,allocBytes);
+}
+
+#endif
+
+//***************************** icns_get_stats **************************//
+// Per-stage counters summed over every thread since the last reset.
+// Returns ICNS_STATUS_UNSUPPORTED unless built with --enable-stats.
+
+int icns_get_stats(icns_stats_t *statsOut)
+{
+	if(statsOut == NULL)
+	{
+		icns_print_err("icns_get_stats: Statistics out is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	memset(statsOut,0,sizeof(icns_stats_t));
+
+	#ifdef ICNS_STATS
+	{
+		icns_thread_stats_t	*threadStats = NULL;
+
+		ICNS_STATS_LOCK();
+
+		icns_stats_accumulate(statsOut,&gRetiredStats,NULL);
+		for(threadStats = gThreadStatsList; threadStats != NULL; threadStats = threadStats->next)
+			icns_stats_accumulate(statsOut,&threadStats->stats,&threadStats->baseline);
+
+		ICNS_STATS_UNLOCK();
+
+		return ICNS_STATUS_OK;
+	}
+	#else
+	return ICNS_STATUS_UNSUPPORTED;
+	#endif
+}
+
+//***************************** icns_get_thread_stats **************************//
+// Same as icns_get_stats, for the calling thread alone
+
+int icns_get_thread_stats(icns_stats_t *statsOut)
+{
+	if(statsOut == NULL)
+	{
+		icns_print_err("icns_get_thread_stats: Statistics out is NULL!\n");
+		return ICNS_STATUS_NULL_PARAM;
+	}
+
+	memset(statsOut,0,sizeof(icns_stats_t));
+
+	#ifdef ICNS_STATS
+	if(gThreadStats != NULL)
+	{
+		ICNS_STATS_LOCK();
+		icns_stats_accumulate(statsOut,&gThreadStats->stats,&gThreadStats->baseline);
+		ICNS_STATS_UNLOCK();
+	}
+
+	return ICNS_STATUS_OK;
+	#else
+	return ICNS_STATUS_UNSUPPORTED;
+	#endif
+}
+
+//***************************** icns_reset_stats **************************//
+// Starts every thread's counters over from zero
+
+int icns_reset_stats(void)
+{
+	#ifdef ICNS_STATS
+	icns_thread_stats_t	*threadStats = NULL;
+
+	ICNS_STATS_LOCK();
+
+	memset(&gRetiredStats,0,sizeof(icns_stats_t));
+	for(threadStats = gThreadStatsList; threadStats != NULL; threadStats = threadStats->next)
+		icns_stats_snapshot(&threadStats->baseline,&threadStats->stats);
+
+	ICNS_STATS_UNLOCK();
+
+	return ICNS_STATUS_OK;
+	#else
+	return ICNS_STATUS_UNSUPPORTED;
+	#endif
+}
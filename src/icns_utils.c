@@ -826,6 +826,9 @@ const char * icns_type_str(icns_type_t type, char *strbuf)
 	return NULL;
 }
 
+// Process-wide default for every thread. A thread can override it by making
+// an icns_context_t current - see icns_context.c
+
 void icns_set_print_errors(icns_bool_t shouldPrint)
 {
 	#ifdef ICNS_DEBUG
@@ -846,7 +849,31 @@ void icns_print_err(const char *template, ...)
 	va_start (ap, template);
 	vprintf (template, ap);
 	va_end (ap);
-	#else
+	#endif
+
+	if(gCurrentContext != NULL)
+	{
+		char	message[ICNS_ERROR_MESSAGE_SIZE];
+
+		va_start (ap, template);
+		vsnprintf (message, sizeof(message), template, ap);
+		va_end (ap);
+
+		#ifndef ICNS_DEBUG
+		icns_context_report_err(message);
+		#else
+		// Already printed above, so keep the context from printing it again
+		{
+			icns_bool_t printErrors = gCurrentContext->printErrors;
+			gCurrentContext->printErrors = 0;
+			icns_context_report_err(message);
+			gCurrentContext->printErrors = printErrors;
+		}
+		#endif
+		return;
+	}
+
+	#ifndef ICNS_DEBUG
 	if(gShouldPrintErrors)
 	{
 		fprintf (stderr, "libicns: ");
@@ -856,4 +883,3 @@ void icns_print_err(const char *template, ...)
 	}
 	#endif
 }
-